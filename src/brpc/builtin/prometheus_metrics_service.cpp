@@ -24,7 +24,9 @@
 #include "brpc/closure_guard.h"             // ClosureGuard
 #include "brpc/builtin/prometheus_metrics_service.h"
 #include "brpc/builtin/common.h"
+#include "butil/base64.h"
 #include "bvar/bvar.h"
+#include "bvar/detail/quantile_sketch.h"
 
 namespace bvar {
 DECLARE_int32(bvar_latency_p1);
@@ -44,6 +46,11 @@ extern const char* const g_server_info_prefix;
 // more counter is just another gauge.
 // 2) Histogram and summary is equivalent except that histogram
 // calculates quantiles in the server side.
+// The exception is LatencyRecorder counting latencies in sketches
+// (-bvar_latency_use_sketch), whose buckets are output in the layout of a
+// histogram so that percentiles can be aggregated across instances. The
+// counts are of the recent window rather than monotonic, so the series are
+// typed as gauges.
 class PrometheusMetricsDumper : public bvar::Dumper {
 public:
     explicit PrometheusMetricsDumper(butil::IOBufBuilder* os,
@@ -57,6 +64,11 @@ public:
 private:
     DISALLOW_COPY_AND_ASSIGN(PrometheusMetricsDumper);
 
+    // Output <prefix>_latency_sketch of LatencyRecorder as gauges of
+    // cumulative bucket counts.
+    void DumpLatencySketch(const butil::StringPiece& name,
+                           const butil::StringPiece& desc);
+
     // Return true iff name ends with suffix output by LatencyRecorder.
     bool DumpLatencyRecorderSuffix(const butil::StringPiece& name,
                                    const butil::StringPiece& desc);
@@ -84,7 +96,10 @@ private:
 bool PrometheusMetricsDumper::dump(const std::string& name,
                                    const butil::StringPiece& desc) {
     if (!desc.empty() && desc[0] == '"') {
-        // there is no necessary to monitor string in prometheus
+        if (butil::StringPiece(name).ends_with("_latency_sketch")) {
+            DumpLatencySketch(name, desc);
+        }
+        // there is no necessary to monitor other strings in prometheus
         return true;
     }
     if (DumpLatencyRecorderSuffix(name, desc)) {
@@ -98,6 +113,74 @@ bool PrometheusMetricsDumper::dump(const std::string& name,
     return true;
 }
 
+// `le' of buckets output for latency sketches: 1 and then 2^e*1.5-1 and
+// 2^(e+1)-1 for e in [1, 31], namely two buckets for each power of 2. They
+// are upper bounds of buckets in QuantileSketch as well.
+static const uint32_t kSketchBucketBounds[] = {
+    1u, 2u, 3u, 5u, 7u, 11u, 15u, 23u, 31u, 47u, 63u, 95u, 127u, 191u, 255u,
+    383u, 511u, 767u, 1023u, 1535u, 2047u, 3071u, 4095u, 6143u, 8191u,
+    12287u, 16383u, 24575u, 32767u, 49151u, 65535u, 98303u, 131071u,
+    196607u, 262143u, 393215u, 524287u, 786431u, 1048575u, 1572863u,
+    2097151u, 3145727u, 4194303u, 6291455u, 8388607u, 12582911u, 16777215u,
+    25165823u, 33554431u, 50331647u, 67108863u, 100663295u, 134217727u,
+    201326591u, 268435455u, 402653183u, 536870911u, 805306367u, 1073741823u,
+    1610612735u, 2147483647u, 3221225471u, 4294967295u
+};
+
+void PrometheusMetricsDumper::DumpLatencySketch(
+    const butil::StringPiece& name, const butil::StringPiece& desc) {
+    butil::StringPiece encoded = desc;
+    encoded.remove_prefix(1);
+    if (encoded.ends_with("\"")) {
+        encoded.remove_suffix(1);
+    }
+    std::string data;
+    bvar::detail::CombinedQuantileSketch sketch;
+    if (!butil::Base64Decode(encoded, &data) || !sketch.parse(data)) {
+        LOG(WARNING) << "Fail to parse " << name;
+        return;
+    }
+    // Every instance outputs all buckets in kSketchBucketBounds even if
+    // they're empty, so that series with the same `le' can be summed up.
+    butil::StringPiece metric_name(name);
+    metric_name.remove_suffix(7/*_sketch*/);
+    *_os << "# HELP " << metric_name << "_histogram_bucket\n"
+         << "# TYPE " << metric_name << "_histogram_bucket gauge\n";
+    uint64_t cumulative = 0;
+    uint64_t sum = 0;
+    size_t next_bound = 0;
+    for (uint32_t i = 0; i < sketch.NUM_BUCKETS; ++i) {
+        const uint64_t n = sketch.bucket_count(i);
+        if (n == 0) {
+            continue;
+        }
+        // Bounds are aligned with buckets of the sketch, a bucket is either
+        // entirely below or entirely above a bound.
+        while (next_bound < arraysize(kSketchBucketBounds) &&
+               sketch.bucket_upper_bound(i) > kSketchBucketBounds[next_bound]) {
+            *_os << metric_name << "_histogram_bucket{le=\""
+                 << kSketchBucketBounds[next_bound] << "\"} "
+                 << cumulative << '\n';
+            ++next_bound;
+        }
+        cumulative += n;
+        sum += n * sketch.bucket_value(i);
+    }
+    for (; next_bound < arraysize(kSketchBucketBounds); ++next_bound) {
+        *_os << metric_name << "_histogram_bucket{le=\""
+             << kSketchBucketBounds[next_bound] << "\"} "
+             << cumulative << '\n';
+    }
+    *_os << metric_name << "_histogram_bucket{le=\"+Inf\"} "
+         << sketch.count() << '\n'
+         << "# HELP " << metric_name << "_histogram_sum\n"
+         << "# TYPE " << metric_name << "_histogram_sum gauge\n"
+         << metric_name << "_histogram_sum " << sum << '\n'
+         << "# HELP " << metric_name << "_histogram_count\n"
+         << "# TYPE " << metric_name << "_histogram_count gauge\n"
+         << metric_name << "_histogram_count " << sketch.count() << '\n';
+}
+
 const PrometheusMetricsDumper::SummaryItems*
 PrometheusMetricsDumper::ProcessLatencyRecorderSuffix(const butil::StringPiece& name,
                                                       const butil::StringPiece& desc) {
@@ -407,13 +407,21 @@ void VarsService::default_method(::google::protobuf::RpcController* cntl_base,
             " onkeyup='onQueryChanged()'></p>"
             "<div id=\"layer1\">\n";
     }    
-    VarsDumper dumper(os, use_html);
     bvar::DumpOptions options;
     options.question_mark = '$';
     options.display_filter = 
         (use_html ? bvar::DISPLAY_ON_HTML : bvar::DISPLAY_ON_PLAIN_TEXT);
     options.white_wildcards = cntl->http_request().unresolved_path();
-    const int ndump = bvar::Variable::dump_exposed(&dumper, &options);
+    int ndump = 0;
+    butil::IOBuf plain_vars;
+    if (use_html) {
+        VarsDumper dumper(os, use_html);
+        ndump = bvar::Variable::dump_exposed(&dumper, &options);
+    } else {
+        // Plain text is exactly what dump_exposed() appends into IOBuf,
+        // which skips formatting variables one by one.
+        ndump = bvar::Variable::dump_exposed(&plain_vars, &options);
+    }
     if (ndump < 0) {
         cntl->SetFailed("Fail to dump vars");
         return;
@@ -426,6 +434,7 @@ void VarsService::default_method(::google::protobuf::RpcController* cntl_base,
         os << "</div></body></html>";
     }
     os.move_to(cntl->response_attachment());
+    cntl->response_attachment().append(plain_vars);
     cntl->set_response_compress_type(COMPRESS_TYPE_GZIP);
 }
 
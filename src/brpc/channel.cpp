@@ -43,6 +43,8 @@ ChannelOptions::ChannelOptions()
     : connect_timeout_ms(200)
     , timeout_ms(500)
     , backup_request_ms(-1)
+    , backup_request_percentile(0)
+    , max_backup_requests(1)
     , max_retry(3)
     , enable_circuit_breaker(false)
     , protocol(PROTOCOL_BAIDU_STD)
@@ -367,11 +369,6 @@ static void HandleTimeout(void* arg) {
     bthread_id_error(correlation_id, ERPCTIMEDOUT);
 }
 
-static void HandleBackupRequest(void* arg) {
-    bthread_id_t correlation_id = { (uint64_t)arg };
-    bthread_id_error(correlation_id, EBACKUPREQUEST);
-}
-
 void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
                          google::protobuf::RpcController* controller_base,
                          const google::protobuf::Message* request,
@@ -515,11 +512,10 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
         } else {
             cntl->_deadline_us = cntl->timeout_ms() * 1000L + start_send_real_us;
         }
-        const int rc = bthread_timer_add(
-            &cntl->_timeout_id,
-            butil::microseconds_to_timespec(
-                cntl->backup_request_ms() * 1000L + start_send_real_us),
-            HandleBackupRequest, (void*)correlation_id.value);
+        cntl->_backup_request_percentile = _options.backup_request_percentile;
+        cntl->_max_backup_requests = _options.max_backup_requests;
+        const int rc = cntl->AddBackupTimer(
+            cntl->backup_request_ms() * 1000L + start_send_real_us);
         if (BAIDU_UNLIKELY(rc != 0)) {
             cntl->SetFailed(rc, "Fail to add timer for backup request");
             return cntl->HandleSendFailed();
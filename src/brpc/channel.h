@@ -64,6 +64,22 @@ struct ChannelOptions {
     // Maximum: 0x7fffffff (roughly 30 days)
     int32_t backup_request_ms;
 
+    // When it's in (0, 1], backup request is sent after this percentile of
+    // recent latencies to the selected server(e.g. 0.95 for p95) instead of
+    // backup_request_ms, which is still used when the server has too few
+    // latencies recently. Only effective when backup_request_ms >= 0.
+    // Process-wide ratio of backup requests can be capped by
+    // -backup_request_max_ratio.
+    // Default: 0 (disabled)
+    double backup_request_percentile;
+
+    // Max number of backup requests in one RPC. The next backup request is
+    // sent if none of the sent requests responds within another
+    // backup_request_ms (or the latency percentile). Each backup request also
+    // counts as a retry, thus limited by max_retry as well.
+    // Default: 1
+    int max_backup_requests;
+
     // Retry limit for RPC over this Channel. <=0 means no retry.
     // Overridable by Controller.set_max_retry().
     // Default: 3
@@ -39,6 +39,7 @@
 #include "brpc/server.h"   // Server::_session_local_data_pool
 #include "brpc/simple_data_pool.h"
 #include "brpc/retry_policy.h"
+#include "brpc/reloadable_flags.h"
 #include "brpc/stream_impl.h"
 #include "brpc/policy/streaming_rpc_protocol.h" // FIXME
 #include "brpc/rpc_dump.h"
@@ -84,6 +85,12 @@ namespace brpc {
 DEFINE_bool(graceful_quit_on_sigterm, false,
             "Register SIGTERM handle func to quit graceful");
 
+DEFINE_double(backup_request_max_ratio, 0,
+              "Max ratio of backup requests to RPCs with backup requests "
+              "enabled in this process, backup requests beyond the ratio are "
+              "not sent. <= 0 means unlimited");
+BRPC_VALIDATE_GFLAG(backup_request_max_ratio, PassValidate);
+
 const IdlNames idl_single_req_single_res = { "req", "res" };
 const IdlNames idl_single_req_multi_res = { "req", "" };
 const IdlNames idl_multi_req_single_res = { "", "res" };
@@ -106,6 +113,40 @@ static bvar::PassiveStatus<std::string> s_rpc_revision(
 
 static const int RETRY_AVOIDANCE = 8;
 
+// Budget of backup requests shared by all RPCs in this process, in units
+// of 1/BACKUP_BUDGET_SCALE backup request. Each RPC with backup requests
+// enabled deposits -backup_request_max_ratio backup request and each backup
+// request withdraws one. The budget is capped so that backup requests do not
+// burst after a long period without backup requests.
+static const int64_t BACKUP_BUDGET_SCALE = 1000;
+static const int64_t MAX_BACKUP_BUDGET = 100 * BACKUP_BUDGET_SCALE;
+static butil::static_atomic<int64_t> s_backup_budget = BUTIL_STATIC_ATOMIC_INIT(0);
+
+static void DepositBackupBudget() {
+    const double ratio = FLAGS_backup_request_max_ratio;
+    if (ratio <= 0 ||
+        s_backup_budget.load(butil::memory_order_relaxed) >= MAX_BACKUP_BUDGET) {
+        return;
+    }
+    s_backup_budget.fetch_add((int64_t)(ratio * BACKUP_BUDGET_SCALE),
+                              butil::memory_order_relaxed);
+}
+
+static bool WithdrawBackupBudget() {
+    if (FLAGS_backup_request_max_ratio <= 0) {
+        return true;
+    }
+    int64_t budget = s_backup_budget.load(butil::memory_order_relaxed);
+    do {
+        if (budget < BACKUP_BUDGET_SCALE) {
+            return false;
+        }
+    } while (!s_backup_budget.compare_exchange_weak(
+                 budget, budget - BACKUP_BUDGET_SCALE,
+                 butil::memory_order_relaxed));
+    return true;
+}
+
 // Defined in parallel_channel.cpp
 void DestroyParallelChannelDone(google::protobuf::Closure* c);
 const Controller* GetSubControllerOfParallelChannel(
@@ -242,6 +283,9 @@ void Controller::ResetPods() {
     _connection_type = CONNECTION_TYPE_UNKNOWN;
     _timeout_ms = UNSET_MAGIC_NUM;
     _backup_request_ms = UNSET_MAGIC_NUM;
+    _max_backup_requests = 1;
+    _backup_request_percentile = 0;
+    _nbackup_request = 0;
     _connect_timeout_ms = UNSET_MAGIC_NUM;
     _deadline_us = -1;
     _timeout_id = 0;
@@ -282,7 +326,8 @@ Controller::Call::Call(Controller::Call* rhs)
     , peer_id(rhs->peer_id)
     , begin_time_us(rhs->begin_time_us)
     , sending_sock(rhs->sending_sock.release())
-    , stream_user_data(rhs->stream_user_data) {
+    , stream_user_data(rhs->stream_user_data)
+    , next(NULL) {
     // NOTE: fields in rhs should be reset because RPC could fail before
     // setting all the fields to next call and _current_call.OnComplete
     // will behave incorrectly.
@@ -303,6 +348,7 @@ void Controller::Call::Reset() {
     begin_time_us = 0;
     sending_sock.reset(NULL);
     stream_user_data = NULL;
+    next = NULL;
 }
 
 void Controller::set_timeout_ms(int64_t timeout_ms) {
@@ -558,20 +604,63 @@ static void HandleTimeout(void* arg) {
     bthread_id_error(correlation_id, ERPCTIMEDOUT);
 }
 
+static void HandleBackupRequest(void* arg) {
+    bthread_id_t correlation_id = { (uint64_t)arg };
+    bthread_id_error(correlation_id, EBACKUPREQUEST);
+}
+
+Controller::Call** Controller::FindUnfinishedCall(CallId id) {
+    for (Call** p = &_unfinished_call; *p != NULL; p = &(*p)->next) {
+        if (get_id((*p)->nretry) == id) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+int Controller::AddBackupTimer(int64_t backup_us) {
+    if (_deadline_us >= 0 && backup_us >= _deadline_us) {
+        return bthread_timer_add(
+            &_timeout_id, butil::microseconds_to_timespec(_deadline_us),
+            HandleTimeout, (void*)_correlation_id.value);
+    }
+    add_flag(FLAGS_BACKUP_TIMER);
+    return bthread_timer_add(
+        &_timeout_id, butil::microseconds_to_timespec(backup_us),
+        HandleBackupRequest, (void*)_correlation_id.value);
+}
+
+int Controller::ResetBackupTimer(Socket* server, int64_t start_realtime_us) {
+    const int64_t latency_us =
+        server->GetRecentLatencyPercentile(_backup_request_percentile);
+    if (latency_us < 0) {
+        // Too few latencies, keep the timer of backup_request_ms.
+        return 0;
+    }
+    if (bthread_timer_del(_timeout_id) != 0) {
+        // The timer is running or has run, EBACKUPREQUEST will come.
+        return 0;
+    }
+    clear_flag(FLAGS_BACKUP_TIMER);
+    return AddBackupTimer(start_realtime_us + latency_us);
+}
+
 void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
                                         bool new_bthread, int saved_error) {
     // TODO(gejun): Simplify call-ending code.
     // Intercept previous calls
     while (info.id != _correlation_id && info.id != current_id()) {
-        if (_unfinished_call && get_id(_unfinished_call->nretry) == info.id) {
+        Call** unfinished = FindUnfinishedCall(info.id);
+        if (unfinished != NULL) {
             if (!FailedInline()) {
                 // Continue with successful backup request.
                 break;
             }
             // Complete failed backup request.
-            _unfinished_call->OnComplete(this, _error_code, info.responded, false);
-            delete _unfinished_call;
-            _unfinished_call = NULL;
+            Call* call = *unfinished;
+            *unfinished = call->next;
+            call->OnComplete(this, _error_code, info.responded, false);
+            delete call;
         }
         // Ignore all non-backup requests and failed backup requests.
         _error_code = saved_error;
@@ -585,9 +674,18 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
         goto END_OF_RPC;
     }
     if (_error_code == EBACKUPREQUEST) {
+        clear_flag(FLAGS_BACKUP_TIMER);
+        const int64_t now_us = butil::gettimeofday_us();
+        const bool allowed = WithdrawBackupBudget();
         // Reset timeout if needed
         int rc = 0;
-        if (timeout_ms() >= 0) {
+        if (allowed &&
+            _nbackup_request + 1 < _max_backup_requests &&
+            _current_call.nretry + 1 < _max_retry) {
+            // Send another backup request if none of the requests responds
+            // within backup_request_ms.
+            rc = AddBackupTimer(now_us + _backup_request_ms * 1000L);
+        } else if (timeout_ms() >= 0) {
             rc = bthread_timer_add(
                     &_timeout_id,
                     butil::microseconds_to_timespec(_deadline_us),
@@ -597,6 +695,13 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
             SetFailed(rc, "Fail to add timer");
             goto END_OF_RPC;
         }
+        if (!allowed) {
+            // Too many backup requests in this process, keep waiting for
+            // the sent requests.
+            _error_code = saved_error;
+            CHECK_EQ(0, bthread_id_unlock(info.id));
+            return;
+        }
         if (!SingleServer()) {
             if (_accessed == NULL) {
                 _accessed = ExcludedServers::Create(
@@ -609,15 +714,17 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
             _accessed->Add(_current_call.peer_id);
         }
         // _current_call does not end yet.
-        CHECK(_unfinished_call == NULL);  // only one backup request now.
-        _unfinished_call = new (std::nothrow) Call(&_current_call);
-        if (_unfinished_call == NULL) {
+        Call* unfinished = new (std::nothrow) Call(&_current_call);
+        if (unfinished == NULL) {
             SetFailed(ENOMEM, "Fail to new Call");
             goto END_OF_RPC;
         }
+        unfinished->next = _unfinished_call;
+        _unfinished_call = unfinished;
         ++_current_call.nretry;
+        ++_nbackup_request;
         add_flag(FLAGS_BACKUP_REQUEST);
-        return IssueRPC(butil::gettimeofday_us());
+        return IssueRPC(now_us);
     } else if (_retry_policy ? _retry_policy->DoRetry(this)
                : DefaultRetryPolicy()->DoRetry(this)) {
         // The error must come from _current_call because:
@@ -732,6 +839,15 @@ void Controller::Call::OnComplete(
             sending_sock->FeedbackCircuitBreaker(error_code,
                 butil::gettimeofday_us() - begin_time_us);
         }
+
+        // Calls replaced by faster backup requests(EBACKUPREQUEST) are
+        // counted as well, otherwise the slowest calls are never counted
+        // and the percentile keeps decreasing.
+        if (c->_backup_request_percentile > 0 &&
+            (error_code == 0 || error_code == EBACKUPREQUEST)) {
+            sending_sock->AddRecentLatency(
+                butil::gettimeofday_us() - begin_time_us);
+        }
     }
 
     switch (c->connection_type()) {
@@ -823,7 +939,7 @@ void Controller::EndRPC(const CompletionInfo& info) {
             _local_side = _current_call.sending_sock->local_side();
         }
 
-        if (_unfinished_call != NULL) {
+        while (_unfinished_call != NULL) {
             // When _current_call is successful, mark _unfinished_call as
             // EBACKUPREQUEST, we can't use 0 because the server possibly
             // never respond, we can't use ERPCTIMEDOUT because _current_call
@@ -831,10 +947,11 @@ void Controller::EndRPC(const CompletionInfo& info) {
             // When _current_call is error, mark _unfinished_call with the
             // same error. This is not accurate as well, but we have to end
             // _unfinished_call with some sort of error anyway.
+            Call* call = _unfinished_call;
+            _unfinished_call = call->next;
             const int err = (_error_code == 0 ? EBACKUPREQUEST : _error_code);
-            _unfinished_call->OnComplete(this, err, false, false);
-            delete _unfinished_call;
-            _unfinished_call = NULL;
+            call->OnComplete(this, err, false, false);
+            delete call;
         }
         // TODO: Replace this with stream_creator.
         HandleStreamConnection(_current_call.sending_sock.get());
@@ -852,23 +969,32 @@ void Controller::EndRPC(const CompletionInfo& info) {
                          << " sending_sock=" << _current_call.sending_sock.get();
         }
         _current_call.OnComplete(this, ECANCELED, false, false);
-        if (_unfinished_call != NULL) {
-            if (_unfinished_call->sending_sock != NULL) {
-                _remote_side = _unfinished_call->sending_sock->remote_side();
-                _local_side = _unfinished_call->sending_sock->local_side();
-            }
-            // TODO: Replace this with stream_creator.
-            HandleStreamConnection(_unfinished_call->sending_sock.get());
-            if (get_id(_unfinished_call->nretry) == info.id) {
-                _unfinished_call->OnComplete(
-                        this, _error_code, info.responded, true);
+        Call** winner = FindUnfinishedCall(info.id);
+        if (_unfinished_call != NULL && winner == NULL) {
+            CHECK(false) << "A previous non-backup request responded";
+        }
+        const int winner_nretry = (winner ? (*winner)->nretry : -1);
+        while (_unfinished_call != NULL) {
+            Call* call = _unfinished_call;
+            _unfinished_call = call->next;
+            if (call->nretry == winner_nretry) {
+                if (call->sending_sock != NULL) {
+                    _remote_side = call->sending_sock->remote_side();
+                    _local_side = call->sending_sock->local_side();
+                }
+                // TODO: Replace this with stream_creator.
+                HandleStreamConnection(call->sending_sock.get());
+                call->OnComplete(this, _error_code, info.responded, true);
+            } else if (winner == NULL) {
+                call->OnComplete(this, ECANCELED, false, true);
             } else {
-                CHECK(false) << "A previous non-backup request responded";
-                _unfinished_call->OnComplete(this, ECANCELED, false, true);
+                // Same as _current_call, calls sent after the winner are
+                // canceled, calls sent before are replaced by the winner.
+                call->OnComplete(
+                    this, (call->nretry > winner_nretry ?
+                           ECANCELED : EBACKUPREQUEST), false, false);
             }
-
-            delete _unfinished_call;
-            _unfinished_call = NULL;
+            delete call;
         }
     }
     if (_stream_creator) {
@@ -1037,6 +1163,20 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
         // here.
         _remote_side = tmp_sock->remote_side();
     }
+    if (has_flag(FLAGS_BACKUP_TIMER)) {
+        if (_current_call.nretry == 0) {
+            DepositBackupBudget();
+        }
+        if (_backup_request_percentile > 0) {
+            // Send backup request after the recent latency percentile of
+            // the selected server rather than the fixed backup_request_ms.
+            const int rc = ResetBackupTimer(tmp_sock.get(), start_realtime_us);
+            if (rc != 0) {
+                SetFailed(rc, "Fail to add timer for backup request");
+                return HandleSendFailed();
+            }
+        }
+    }
     if (_stream_creator) {
         _current_call.stream_user_data =
             _stream_creator->OnCreatingStream(&tmp_sock, this);
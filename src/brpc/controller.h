@@ -129,6 +129,8 @@ friend void policy::ProcessThriftRequest(InputMessageBase*);
     static const uint32_t FLAGS_READ_PROGRESSIVELY = (1 << 3);
     static const uint32_t FLAGS_PROGRESSIVE_READER = (1 << 4);
     static const uint32_t FLAGS_BACKUP_REQUEST = (1 << 5);
+    // _timeout_id is the timer of next backup request.
+    static const uint32_t FLAGS_BACKUP_TIMER = (1 << 6);
     // Let _done delete the correlation_id, used by combo channels to
     // make lifetime of the correlation_id more flexible.
     static const uint32_t FLAGS_DESTROY_CID_IN_DONE = (1 << 7);
@@ -659,8 +661,22 @@ private:
         // socket fetched from socket pool
         SocketUniquePtr sending_sock;
         StreamUserData* stream_user_data;
+        // Next call in the list of unfinished calls.
+        Call* next;
     };
 
+    // Find the unfinished call sent with `id', returns the pointer linking
+    // to the call or NULL when it's not found.
+    Call** FindUnfinishedCall(CallId id);
+
+    // Add the timer of backup request at `backup_us', or the timer of RPC
+    // timeout if the backup request cannot be sent before the deadline.
+    int AddBackupTimer(int64_t backup_us);
+
+    // Move the pending backup timer to the recent latency percentile of
+    // `server' after `start_realtime_us'.
+    int ResetBackupTimer(Socket* server, int64_t start_realtime_us);
+
     void HandleStreamConnection(Socket *host_socket);
 
     bool SingleServer() const { return _single_server_id != INVALID_SOCKET_ID; }
@@ -736,6 +752,11 @@ private:
     int32_t _timeout_ms;
     int32_t _connect_timeout_ms;
     int32_t _backup_request_ms;
+    // Copied from ChannelOptions, see comments there.
+    int _max_backup_requests;
+    double _backup_request_percentile;
+    // Number of backup requests sent in this RPC.
+    int _nbackup_request;
     // Deadline of this RPC (since the Epoch in microseconds).
     int64_t _deadline_us;
     // Timer registered to trigger RPC timeout event
@@ -762,6 +783,8 @@ private:
     CompletionInfo _tmp_completion_info;
     
     Call _current_call;
+    // Calls replaced by backup requests and still waiting for responses,
+    // latest first.
     Call* _unfinished_call;
     ExcludedServers* _accessed;
     
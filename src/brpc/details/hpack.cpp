@@ -20,6 +20,7 @@
 
 #include <limits>                                       // std::numeric_limits
 #include <vector>
+#include <strings.h>                                    // strncasecmp
 #include "butil/containers/bounded_queue.h"              // butil::BoundedQueue
 #include "butil/containers/flat_map.h"                   // butil::FlatMap
 #include "butil/containers/case_ignored_flat_map.h"      // butil::FlatMap
@@ -49,10 +50,18 @@ struct HeaderAndHashCode {
     const HPacker::Header* header;
 };
 
+struct NameAndHashCode {
+    size_t hash_code;
+    const std::string* name;
+};
+
+inline size_t HashHeader(size_t name_hash, const std::string& value) {
+    return name_hash * 101 + butil::DefaultHasher<std::string>()(value);
+}
+
 struct HeaderHasher {
     size_t operator()(const HPacker::Header& h) const {
-        return butil::CaseIgnoredHasher()(h.name)
-            * 101 + butil::DefaultHasher<std::string>()(h.value);
+        return HashHeader(butil::CaseIgnoredHasher()(h.name), h.value);
     }
     size_t operator()(const HeaderAndHashCode& h) const {
         return h.hash_code;
@@ -69,6 +78,25 @@ struct HeaderEqualTo {
     }
 };
 
+// Hash names once for looking up both _header_index and _name_index.
+struct NameHasher {
+    size_t operator()(const std::string& name) const {
+        return butil::CaseIgnoredHasher()(name);
+    }
+    size_t operator()(const NameAndHashCode& n) const {
+        return n.hash_code;
+    }
+};
+
+struct NameEqualTo {
+    bool operator()(const std::string& n1, const std::string& n2) const {
+        return butil::CaseIgnoredEqual()(n1, n2);
+    }
+    bool operator()(const std::string& n1, const NameAndHashCode& n2) const {
+        return operator()(n1, *n2.name);
+    }
+};
+
 class BAIDU_CACHELINE_ALIGNMENT IndexTable {
 DISALLOW_COPY_AND_ASSIGN(IndexTable);
     typedef HPacker::Header Header;
@@ -99,7 +127,7 @@ public:
         return _start_index + (_add_times - *v) - 1;
     }
 
-    int GetIndexOfName(const std::string& name) {
+    int GetIndexOfName(const NameAndHashCode& name) {
         DCHECK(_need_indexes);
         const uint64_t* v = _name_index.seek(name);
         if (!v) {
@@ -214,7 +242,7 @@ private:
     // rather than which the index number is, only the latest entry of the same
     // header is indexed here, which is definitely the last one to be removed.
     butil::FlatMap<Header, uint64_t, HeaderHasher, HeaderEqualTo> _header_index;
-    butil::CaseIgnoredFlatMap<uint64_t> _name_index;
+    butil::FlatMap<std::string, uint64_t, NameHasher, NameEqualTo> _name_index;
 };
 
 int IndexTable::Init(const IndexTableOptions& options) {
@@ -319,6 +347,8 @@ public:
         node(cur).value = value;
     }
 
+    size_t size() const { return _node_memory.size(); }
+
     const HuffmanNode* node(NodeId id) const {
         if (id == 0u) {
             return NULL;
@@ -351,128 +381,176 @@ public:
     HuffmanEncoder(butil::IOBufAppender* out, const HuffmanCode* table)
         : _out(out)
         , _table(table)
-        , _partial_byte(0)
-        , _remain_bit(8)
+        , _bits(0)
+        , _nbits(0)
+        , _nbuf(0)
         , _out_bytes(0)
     {}
 
     void Encode(unsigned char byte) {
+        // Codes are at most 30 bits and less than 8 bits are pending after
+        // each call, so the accumulator never overflows. Whole bytes are
+        // collected in _buf and appended to _out together.
         const HuffmanCode code = _table[byte];
-        uint16_t bits_left = code.bit_len;
-        while (bits_left) {
-            const uint16_t adding_bits_len = std::min(_remain_bit, bits_left);
-            const uint8_t adding_bits = static_cast<uint8_t>(
-                    (code.code & ((1u << bits_left) - 1))   // clear leading bits
-                            >> (bits_left - adding_bits_len));  // align to LSB
-            _partial_byte |= adding_bits << (_remain_bit - adding_bits_len);
-            _remain_bit -= adding_bits_len;
-            bits_left -= adding_bits_len;
-            if (!_remain_bit) {
-                ++_out_bytes;
-                _out->push_back(_partial_byte);
-                _remain_bit = 8;
-                _partial_byte = 0;
+        _bits = (_bits << code.bit_len) | code.code;
+        _nbits += code.bit_len;
+        while (_nbits >= 8) {
+            _nbits -= 8;
+            _buf[_nbuf++] = static_cast<uint8_t>(_bits >> _nbits);
+            if (_nbuf == sizeof(_buf)) {
+                Flush();
             }
         }
     }
 
     void EndStream() {
-        if (_remain_bit == 8u) {
-            return;
+        if (_nbits != 0) {
+            // Add padding `1's to lsb to make _out aligned
+            const uint32_t padding = 8 - _nbits;
+            _buf[_nbuf++] = static_cast<uint8_t>(
+                (_bits << padding) | ((1u << padding) - 1));
+            _nbits = 0;
         }
-        DCHECK_LT(_remain_bit, 8u);
-        // Add padding `1's to lsb to make _out aligned
-        _partial_byte |= (1 << _remain_bit) - 1;
-        // TODO: push_back is probably costly since it acquires tls everytime it
-        // is invoked.
-        _out->push_back(_partial_byte);
-        _partial_byte = 0;
-        _remain_bit = 0;
+        Flush();
         _out = NULL;
-        ++_out_bytes;
     }
 
     uint32_t out_bytes() const { return _out_bytes; }
 
 private:
+    void Flush() {
+        if (_nbuf) {
+            _out->append(_buf, _nbuf);
+            _out_bytes += _nbuf;
+            _nbuf = 0;
+        }
+    }
+
     butil::IOBufAppender* _out;
     const HuffmanCode* _table;
-    uint8_t  _partial_byte;
-    uint16_t _remain_bit;
+    uint64_t _bits;
+    uint32_t _nbits;
+    uint32_t _nbuf;
     uint32_t _out_bytes;
+    uint8_t _buf[64];
 };
 
+enum HuffmanDecodeFlags {
+    HUFFMAN_EMIT = 1,    // A symbol is decoded.
+    HUFFMAN_ACCEPT = 2,  // The stream can end at next_state.
+    HUFFMAN_FAIL = 4,    // Reached EOS or invalid code.
+};
+
+struct HuffmanDecodeEntry {
+    uint16_t next_state;
+    uint8_t symbol;
+    uint8_t flags;
+};
+
+// Transitions of the decoder which consumes 4 bits each time instead of
+// walking the tree bit by bit. States are internal nodes of the huffman
+// tree, 0 is the root. Since codes are at least 5 bits long, at most one
+// symbol is decoded in one transition.
+static HuffmanDecodeEntry (*s_huffman_decode_table)[16] = NULL;
+
+static void BuildHuffmanDecodeTable(const HuffmanTree* tree) {
+    std::vector<HuffmanTree::NodeId> nodes(1, HuffmanTree::ROOT_NODE);
+    // Padding is valid when it is shorter than 8 bits and corresponds to
+    // the most significant bits of EOS which are all `1's.
+    // https://tools.ietf.org/html/rfc7541#section-5.2
+    std::vector<bool> paddable(1, true);
+    std::vector<int> depth(1, 0);
+    std::vector<int> state_of(tree->size() + 1, -1);
+    state_of[HuffmanTree::ROOT_NODE] = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const HuffmanNode* n = tree->node(nodes[i]);
+        for (int bit = 0; bit < 2; ++bit) {
+            const HuffmanTree::NodeId c = (bit ? n->right_child : n->left_child);
+            const HuffmanNode* child = tree->node(c);
+            if (child != NULL && child->value == HuffmanTree::INVALID_VALUE) {
+                state_of[c] = nodes.size();
+                nodes.push_back(c);
+                depth.push_back(depth[i] + 1);
+                paddable.push_back(paddable[i] && bit && depth[i] + 1 <= 7);
+            }
+        }
+    }
+    s_huffman_decode_table = new HuffmanDecodeEntry[nodes.size()][16];
+    for (size_t state = 0; state < nodes.size(); ++state) {
+        for (int nibble = 0; nibble < 16; ++nibble) {
+            HuffmanDecodeEntry e = { 0, 0, 0 };
+            HuffmanTree::NodeId cur = nodes[state];
+            for (int i = 3; i >= 0; --i) {
+                const HuffmanNode* n = tree->node(cur);
+                const HuffmanTree::NodeId c =
+                    ((nibble >> i) & 1) ? n->right_child : n->left_child;
+                const HuffmanNode* child = tree->node(c);
+                if (child == NULL || child->value == HPACK_HUFFMAN_EOS) {
+                    e.flags = HUFFMAN_FAIL;
+                    break;
+                }
+                if (child->value != HuffmanTree::INVALID_VALUE) {
+                    CHECK(!(e.flags & HUFFMAN_EMIT));
+                    e.flags |= HUFFMAN_EMIT;
+                    e.symbol = static_cast<uint8_t>(child->value);
+                    cur = HuffmanTree::ROOT_NODE;
+                } else {
+                    cur = c;
+                }
+            }
+            if (!(e.flags & HUFFMAN_FAIL)) {
+                e.next_state = state_of[cur];
+                if (paddable[e.next_state]) {
+                    e.flags |= HUFFMAN_ACCEPT;
+                }
+            }
+            s_huffman_decode_table[state][nibble] = e;
+        }
+    }
+}
+
 class HuffmanDecoder {
 DISALLOW_COPY_AND_ASSIGN(HuffmanDecoder);
 public:
-    HuffmanDecoder(std::string* out, const HuffmanTree* tree)
-        // FIXME: resizing of out is costly
+    explicit HuffmanDecoder(std::string* out)
         : _out(out)
-        , _tree(tree)
-        , _cur_node(tree->node(HuffmanTree::ROOT_NODE))
-        , _cur_depth(0)  // Depth of root node is 0
-        , _padding(true)
+        , _state(0)
+        , _accept(true)
     {}
+
     int Decode(uint8_t byte) {
-        for (int i = 7; i >= 0; --i) {
-            if (byte & (1u << i)) {
-                _cur_node = _tree->node(_cur_node->right_child);
-                if (BAIDU_UNLIKELY(!_cur_node)) {
-                    LOG(ERROR) << "Decoder stream reaches NULL_NODE";
-                    return -1;
-                }
-                if (_cur_node->value != HuffmanTree::INVALID_VALUE) {
-                    if (BAIDU_UNLIKELY(_cur_node->value == HPACK_HUFFMAN_EOS)) {
-                        LOG(ERROR) << "Decoder stream reaches EOS";
-                        return -1;
-                    }
-                    _out->push_back(static_cast<uint8_t>(_cur_node->value));
-                    _cur_node = _tree->node(HuffmanTree::ROOT_NODE);
-                    _cur_depth = 0;
-                    _padding = true;
-                    continue;
-                }
-                _padding &= 1;
-            } else {
-                _cur_node = _tree->node(_cur_node->left_child);
-                if (BAIDU_UNLIKELY(!_cur_node)) {
-                    LOG(ERROR) << "Decoder stream reaches NULL_NODE";
-                    return -1;
-                }
-                if (_cur_node->value != HuffmanTree::INVALID_VALUE) {
-                    if (BAIDU_UNLIKELY(_cur_node->value == HPACK_HUFFMAN_EOS)) {
-                        LOG(ERROR) << "Decoder stream reaches EOS";
-                        return -1;
-                    }
-                    _out->push_back(static_cast<uint8_t>(_cur_node->value));
-                    _cur_node = _tree->node(HuffmanTree::ROOT_NODE);
-                    _cur_depth = 0;
-                    _padding = true;
-                    continue;
-                }
-                _padding &= 0;
-            }
-            ++_cur_depth;
+        const HuffmanDecodeEntry& e1 = s_huffman_decode_table[_state][byte >> 4];
+        if (BAIDU_UNLIKELY(e1.flags & HUFFMAN_FAIL)) {
+            LOG(ERROR) << "Decoder stream reaches EOS or invalid code";
+            return -1;
+        }
+        if (e1.flags & HUFFMAN_EMIT) {
+            _out->push_back(e1.symbol);
+        }
+        const HuffmanDecodeEntry& e2 =
+            s_huffman_decode_table[e1.next_state][byte & 0xF];
+        if (BAIDU_UNLIKELY(e2.flags & HUFFMAN_FAIL)) {
+            LOG(ERROR) << "Decoder stream reaches EOS or invalid code";
+            return -1;
+        }
+        if (e2.flags & HUFFMAN_EMIT) {
+            _out->push_back(e2.symbol);
         }
+        _state = e2.next_state;
+        _accept = (e2.flags & HUFFMAN_ACCEPT);
         return 0;
     }
+
     int EndStream() {
-        if (_cur_depth == 0) {
-            return 0;
-        }
-        if (_cur_depth <= 7 && _padding) {
-            return 0;
-        }
-        // Invalid stream, the padding is not corresponding to MSB of EOS
+        // Invalid stream if the padding is not corresponding to MSB of EOS
         // https://tools.ietf.org/html/rfc7541#section-5.2
-        return -1;
+        return _accept ? 0 : -1;
     }
+
 private:
     std::string* _out;
-    const HuffmanTree* _tree;
-    const HuffmanNode* _cur_node;
-    uint16_t _cur_depth;
-    bool _padding;
+    uint16_t _state;
+    bool _accept;
 };
 
 // Primitive Type Representations
@@ -503,17 +581,73 @@ static HuffmanTree* s_huffman_tree = NULL;
 static IndexTable* s_static_table = NULL;
 static pthread_once_t s_create_once = PTHREAD_ONCE_INIT;
 
+// Entries sharing a name are adjacent in the static table, the slot of the
+// name stores index of the first entry and index after the last entry.
+struct StaticNameEntry {
+    uint8_t begin_index;
+    uint8_t end_index;
+    uint8_t name_len;
+};
+static StaticNameEntry s_static_names[256];
+
+// Perfect hash of the 52 distinct names in the static table, verified in
+// CreateStaticTableOrDie(). Names not in the table also hash to a slot and
+// must be compared with the name in the slot.
+inline size_t StaticNameSlot(const char* name, size_t len) {
+    return (len * 3
+            + (uint8_t)butil::ascii_tolower(name[0]) * 12
+            + (uint8_t)butil::ascii_tolower(name[len - 1]) * 16
+            + (uint8_t)butil::ascii_tolower(name[len / 2])) & 255;
+}
+
+// Returns index of the first entry in the static table with the name, 0
+// if the name is not in the table.
+inline int FindNameInStaticTable(const std::string& name,
+                                 const StaticNameEntry** entry) {
+    if (name.empty()) {
+        return 0;
+    }
+    const StaticNameEntry& e =
+        s_static_names[StaticNameSlot(name.data(), name.size())];
+    if (e.begin_index == 0 || e.name_len != name.size() ||
+        strncasecmp(s_static_headers[e.begin_index - 1].name,
+                    name.data(), name.size()) != 0) {
+        return 0;
+    }
+    *entry = &e;
+    return e.begin_index;
+}
+
 static void CreateStaticTableOrDie() {
     s_huffman_tree = new HuffmanTree;
     for (size_t i = 0; i < ARRAY_SIZE(s_huffman_table); ++i) {
         s_huffman_tree->AddLeafNode(i, s_huffman_table[i]);
     }
+    BuildHuffmanDecodeTable(s_huffman_tree);
+    for (size_t i = 0; i < ARRAY_SIZE(s_static_headers); ++i) {
+        const char* name = s_static_headers[i].name;
+        const size_t len = strlen(name);
+        StaticNameEntry& e = s_static_names[StaticNameSlot(name, len)];
+        if (e.begin_index != 0 &&
+            strcmp(s_static_headers[e.begin_index - 1].name, name) == 0) {
+            // Same name with the previous entry.
+            CHECK_EQ(e.end_index, i + 1);
+            ++e.end_index;
+            continue;
+        }
+        CHECK_EQ(0, e.begin_index) << "Collided names in static table: "
+            << s_static_headers[e.begin_index - 1].name << " and " << name;
+        e.begin_index = i + 1;
+        e.end_index = i + 2;
+        e.name_len = len;
+    }
     IndexTableOptions options;
     options.max_size = UINT_MAX;
     options.static_table = s_static_headers;
     options.static_table_size = ARRAY_SIZE(s_static_headers);
     options.start_index = 1;
-    options.need_indexes = true;
+    // Looked up by s_static_names instead.
+    options.need_indexes = false;
     s_static_table = new IndexTable;
     if (s_static_table->Init(options) != 0) {
         LOG(ERROR) << "Fail to init static table";
@@ -625,7 +759,9 @@ inline ssize_t DecodeString(butil::IOBufBytesIterator& iter, std::string* out) {
         iter.copy_and_forward(out, length);
         return in_bytes;
     }
-    HuffmanDecoder d(out, s_huffman_tree);
+    // Codes are at least 5 bits long.
+    out->reserve(length * 8 / 5);
+    HuffmanDecoder d(out);
     for (; iter != NULL && length; ++iter, --length) {
         if (d.Decode(*iter) != 0) {
             return -1;
@@ -678,35 +814,53 @@ int HPacker::Init(size_t max_table_size) {
     return 0;
 }
 
-inline int HPacker::FindHeaderFromIndexTable(const Header& h) const {
-    // saves a hash (which is a hotspot) for ones missing s_static_table
-    const HeaderAndHashCode hhc = { HeaderHasher()(h), &h };
-    int index = s_static_table->GetIndexOfHeader(hhc);
-    if (index > 0) {
-        return index;
+inline int HPacker::FindFromIndexTable(const Header& h, bool match_header,
+                                       int* name_index) const {
+    const StaticNameEntry* entry = NULL;
+    const int static_name_index = FindNameInStaticTable(h.name, &entry);
+    if (static_name_index > 0) {
+        *name_index = static_name_index;
+        // Headers with empty values are not indexed, just as the dynamic
+        // table does.
+        if (match_header && !h.value.empty()) {
+            for (int i = entry->begin_index; i < entry->end_index; ++i) {
+                if (h.value == s_static_headers[i - 1].value) {
+                    return i;
+                }
+            }
+        }
+        if (_encode_table->empty()) {
+            return 0;
+        }
+    } else if (_encode_table->empty()) {
+        *name_index = 0;
+        return 0;
     }
-    return _encode_table->GetIndexOfHeader(hhc);
-}
-
-inline int HPacker::FindNameFromIndexTable(const std::string& name) const {
-    int index = s_static_table->GetIndexOfName(name);
-    if (index > 0) {
-        return index;
+    // The name is hashed once for both lookups, which is a hotspot.
+    const NameAndHashCode nhc = { butil::CaseIgnoredHasher()(h.name), &h.name };
+    if (match_header) {
+        const HeaderAndHashCode hhc = { HashHeader(nhc.hash_code, h.value), &h };
+        const int index = _encode_table->GetIndexOfHeader(hhc);
+        if (index > 0) {
+            return index;
+        }
+    }
+    if (static_name_index == 0) {
+        *name_index = _encode_table->GetIndexOfName(nhc);
     }
-    return _encode_table->GetIndexOfName(name);
+    return 0;
 }
 
 void HPacker::Encode(butil::IOBufAppender* out, const Header& header,
                      const HPackOptions& options) {
-    if (options.index_policy != HPACK_NEVER_INDEX_HEADER) {
-        const int index = FindHeaderFromIndexTable(header);
-        if (index > 0) {
-            // This header is already in the index table
-            return EncodeInteger(out, 0x80, 7, index);
-        }
+    int name_index = 0;
+    const int index = FindFromIndexTable(
+        header, options.index_policy != HPACK_NEVER_INDEX_HEADER, &name_index);
+    if (index > 0) {
+        // This header is already in the index table
+        return EncodeInteger(out, 0x80, 7, index);
     } // The header can't be indexed or the header wasn't in the index table
-    
-    const int name_index = FindNameFromIndexTable(header.name);
+
     if (options.index_policy == HPACK_INDEX_HEADER) {
         // TODO: Add Options that indexes name independently
         _encode_table->AddHeader(header);
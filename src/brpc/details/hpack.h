@@ -124,8 +124,11 @@ public:
     
 private:
     DISALLOW_COPY_AND_ASSIGN(HPacker);
-    int FindHeaderFromIndexTable(const Header& h) const;
-    int FindNameFromIndexTable(const std::string& name) const;
+    // Returns index of `h' in the index tables or 0 if it's not found or
+    // `match_header' is false. Index of the name is set to `name_index'
+    // when 0 is returned.
+    int FindFromIndexTable(const Header& h, bool match_header,
+                           int* name_index) const;
     const Header* HeaderAt(int index) const;
     ssize_t DecodeWithKnownPrefix(
             butil::IOBufBytesIterator& iter, Header* h, uint8_t prefix_size) const;
@@ -28,6 +28,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #ifndef ULLONG_MAX
 # define ULLONG_MAX ((uint64_t) -1) /* 2^64-1 */
@@ -57,6 +60,18 @@ do {                                                                 \
 } while(0)
 
 
+/* Advance p to the byte before `q' which is found by a fast scanner and
+ * count skipped bytes as if they were parsed one by one. */
+#define SKIP_TO(q)                                                   \
+do {                                                                 \
+  parser->nread += (q) - p - 1;                                      \
+  if (parser->nread > (BRPC_HTTP_MAX_HEADER_SIZE)) {                 \
+    SET_ERRNO(HPE_HEADER_OVERFLOW);                                  \
+    goto error;                                                      \
+  }                                                                  \
+  p = (q) - 1;                                                       \
+} while (0)
+
 /* Run the notify callback FOR, returning ER if it fails */
 #define CALLBACK_NOTIFY_(FOR, ER)                                    \
 do {                                                                 \
@@ -497,6 +512,44 @@ enum http_host_state
 // Called by ParseRestfulPath() in restful.cpp
 bool is_url_char(char c) { return IS_URL_CHAR(c); }
 
+/* NOTE: Following functions skip bytes of long tokens (url, header
+ * names and values) in bulk rather than running the state machine byte by
+ * byte, which dominates parsing of headers. */
+
+/* Returns the first CR or LF in [p, end) or `end' if there's none. */
+static inline const char* find_crlf(const char* p, const char* end) {
+#if defined(__SSE2__)
+  const __m128i cr = _mm_set1_epi8(CR);
+  const __m128i lf = _mm_set1_epi8(LF);
+  for (; end - p >= 16; p += 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i*)p);
+    const int mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; p != end; ++p) {
+    if (*p == CR || *p == LF) {
+      return p;
+    }
+  }
+  return end;
+}
+
+/* Returns the first byte which is not a token in [p, end) or `end' */
+static inline const char* skip_token(const char* p, const char* end) {
+  for (; p != end && TOKEN(*p); ++p) {}
+  return p;
+}
+
+/* Returns the first byte which is not a url char in [p, end) or `end' */
+static inline const char* skip_url_chars(const char* p, const char* end) {
+  for (; p != end && IS_URL_CHAR(*p); ++p) {}
+  return p;
+}
+
 #define start_state (parser->type == HTTP_REQUEST ? s_start_req : s_start_res)
 
 
@@ -1215,6 +1268,10 @@ size_t http_parser_execute (http_parser *parser,
               goto error;
             }
             parser->state = new_state;
+            if (new_state == s_req_path || new_state == s_req_query_string) {
+              /* Both states stay for url chars */
+              SKIP_TO(skip_url_chars(p + 1, data + len));
+            }
         }
         break;
       }
@@ -1398,6 +1455,7 @@ size_t http_parser_execute (http_parser *parser,
         if (c) {
           switch (parser->header_state) {
             case h_general:
+              SKIP_TO(skip_token(p + 1, data + len));
               break;
 
             case h_C:
@@ -1578,6 +1636,11 @@ size_t http_parser_execute (http_parser *parser,
 
       case s_header_value:
       {
+        if (parser->header_state == h_general && ch != CR && ch != LF) {
+          /* Nothing but the end of line matters in general values */
+          SKIP_TO(find_crlf(p + 1, data + len));
+          break;
+        }
 
         if (ch == CR) {
           parser->state = s_header_almost_done;
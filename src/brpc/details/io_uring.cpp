@@ -0,0 +1,260 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <errno.h>
+#include <string.h>                                 // memset
+#include <unistd.h>                                 // close
+#include "butil/logging.h"
+#include "butil/fd_utility.h"                       // make_close_on_exec
+#include "brpc/details/io_uring.h"
+
+#ifdef BRPC_HAS_IO_URING
+#include <sys/mman.h>                               // mmap
+#include <sys/epoll.h>                              // EPOLLET
+#include <linux/io_uring.h>
+#endif
+
+namespace brpc {
+
+IOUring::IOUring()
+    : _ring_fd(-1)
+    , _multishot_poll(false)
+    , _sq_ptr(NULL)
+    , _sq_map_size(0)
+    , _cq_ptr(NULL)
+    , _cq_map_size(0)
+    , _sqes(NULL)
+    , _sqes_map_size(0)
+    , _sq_khead(NULL)
+    , _sq_ktail(NULL)
+    , _sq_mask(0)
+    , _sq_entries(0)
+    , _sq_array(NULL)
+    , _sq_tail(0)
+    , _cq_khead(NULL)
+    , _cq_ktail(NULL)
+    , _cq_mask(0)
+    , _cqes(NULL) {
+}
+
+IOUring::~IOUring() {
+    Destroy();
+}
+
+#ifdef BRPC_HAS_IO_URING
+
+void IOUring::Destroy() {
+    if (_sqes) {
+        munmap(_sqes, _sqes_map_size);
+        _sqes = NULL;
+    }
+    if (_cq_ptr && _cq_ptr != _sq_ptr) {
+        munmap(_cq_ptr, _cq_map_size);
+    }
+    _cq_ptr = NULL;
+    if (_sq_ptr) {
+        munmap(_sq_ptr, _sq_map_size);
+        _sq_ptr = NULL;
+    }
+    if (_ring_fd >= 0) {
+        close(_ring_fd);
+        _ring_fd = -1;
+    }
+}
+
+int IOUring::Init(unsigned entries) {
+    if (_ring_fd >= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // Completions of multishot polls outnumber submissions, reserve more
+    // room in CQ. Overflowed completions are kept by kernel anyway when
+    // IORING_FEAT_NODROP is supported.
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    _ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (_ring_fd < 0) {
+        return -1;
+    }
+    CHECK_EQ(0, butil::make_close_on_exec(_ring_fd));
+
+    _sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP);
+    if (single_mmap) {
+        if (_cq_map_size > _sq_map_size) {
+            _sq_map_size = _cq_map_size;
+        }
+        _cq_map_size = _sq_map_size;
+    }
+    _sq_ptr = mmap(NULL, _sq_map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+    if (_sq_ptr == MAP_FAILED) {
+        _sq_ptr = NULL;
+        const int saved_errno = errno;
+        Destroy();
+        errno = saved_errno;
+        return -1;
+    }
+    if (single_mmap) {
+        _cq_ptr = _sq_ptr;
+    } else {
+        _cq_ptr = mmap(NULL, _cq_map_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+        if (_cq_ptr == MAP_FAILED) {
+            _cq_ptr = NULL;
+            const int saved_errno = errno;
+            Destroy();
+            errno = saved_errno;
+            return -1;
+        }
+    }
+    _sqes_map_size = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(NULL, _sqes_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        const int saved_errno = errno;
+        Destroy();
+        errno = saved_errno;
+        return -1;
+    }
+    _sqes = (io_uring_sqe*)sqes;
+
+    char* sq = (char*)_sq_ptr;
+    _sq_khead = (unsigned*)(sq + p.sq_off.head);
+    _sq_ktail = (unsigned*)(sq + p.sq_off.tail);
+    _sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    _sq_entries = *(unsigned*)(sq + p.sq_off.ring_entries);
+    _sq_array = (unsigned*)(sq + p.sq_off.array);
+    _sq_tail = *_sq_ktail;
+
+    char* cq = (char*)_cq_ptr;
+    _cq_khead = (unsigned*)(cq + p.cq_off.head);
+    _cq_ktail = (unsigned*)(cq + p.cq_off.tail);
+    _cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    _cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // Multishot poll was added in 5.13. IORING_REGISTER_PROBE only tells
+    // supported opcodes rather than their flags and no feature bit comes
+    // with it, so assume it's supported and let the caller fallback to
+    // one-shot polls when the first poll completes with -EINVAL, which is
+    // what kernels before 5.13 return for the unknown flag.
+#ifdef IORING_POLL_ADD_MULTI
+    _multishot_poll = true;
+#endif
+    return 0;
+}
+
+io_uring_sqe* IOUring::GetSqe() {
+    const unsigned head = __atomic_load_n(_sq_khead, __ATOMIC_ACQUIRE);
+    if (_sq_tail - head >= _sq_entries) {
+        return NULL;
+    }
+    const unsigned index = _sq_tail & _sq_mask;
+    io_uring_sqe* sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    _sq_array[index] = index;
+    ++_sq_tail;
+    return sqe;
+}
+
+unsigned IOUring::Publish() {
+    __atomic_store_n(_sq_ktail, _sq_tail, __ATOMIC_RELEASE);
+    return _sq_tail - __atomic_load_n(_sq_khead, __ATOMIC_ACQUIRE);
+}
+
+int IOUring::Enter(unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+    return syscall(__NR_io_uring_enter, _ring_fd, to_submit,
+                   min_complete, flags, NULL, 0);
+}
+
+int IOUring::Submit(unsigned to_submit) {
+    if (to_submit == 0) {
+        return 0;
+    }
+    return Enter(to_submit, 0, 0);
+}
+
+int IOUring::SubmitAndWait(unsigned to_submit) {
+    return Enter(to_submit, 1, IORING_ENTER_GETEVENTS);
+}
+
+int IOUring::ForEachCqe(void (*fn)(const io_uring_cqe*, void*), void* arg) {
+    unsigned head = *_cq_khead;
+    const unsigned tail = __atomic_load_n(_cq_ktail, __ATOMIC_ACQUIRE);
+    int n = 0;
+    for (; head != tail; ++head, ++n) {
+        fn(&_cqes[head & _cq_mask], arg);
+    }
+    __atomic_store_n(_cq_khead, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+void IOUring::PrepPollAdd(io_uring_sqe* sqe, int fd, uint32_t events,
+                          bool multishot, uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+#ifdef IORING_POLL_ADD_MULTI
+    if (multishot) {
+        // Without EPOLLET multishot poll is level-triggered. One-shot polls
+        // complete at once when the fd is readable whether EPOLLET is set
+        // or not, the caller should not re-arm them before draining the fd.
+        events |= EPOLLET;
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+#endif
+#if __BYTE_ORDER == __BIG_ENDIAN
+    // poll32_events is stored in little endian halfwords.
+    events = (events << 16) | (events >> 16);
+#endif
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+}
+
+void IOUring::PrepPollRemove(io_uring_sqe* sqe, uint64_t target_user_data) {
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = target_user_data;
+}
+
+void IOUring::PrepNop(io_uring_sqe* sqe, uint64_t user_data) {
+    sqe->opcode = IORING_OP_NOP;
+    sqe->fd = -1;
+    sqe->user_data = user_data;
+}
+
+#else
+
+void IOUring::Destroy() {}
+
+int IOUring::Init(unsigned) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int IOUring::Enter(unsigned, unsigned, unsigned) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif  // BRPC_HAS_IO_URING
+
+} // namespace brpc
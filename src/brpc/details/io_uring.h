@@ -0,0 +1,123 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_DETAILS_IO_URING_H
+#define BRPC_DETAILS_IO_URING_H
+
+#include <stdint.h>
+#include "butil/build_config.h"
+#include "butil/macros.h"
+
+#if defined(OS_LINUX) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>                    // __NR_io_uring_setup
+#ifdef __NR_io_uring_setup
+#define BRPC_HAS_IO_URING 1
+#endif
+#endif
+#endif
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace brpc {
+
+// A minimal wrapper of the raw io_uring syscalls (no liburing dependency).
+// GetSqe() and Publish() are NOT thread-safe and should be serialized by
+// the caller, while Submit()/SubmitAndWait() may be called concurrently
+// from any thread since kernel only consumes published entries. The
+// completion queue should be consumed by one thread only.
+class IOUring {
+public:
+    IOUring();
+    ~IOUring();
+
+    // Setup a ring with at least `entries' submission entries.
+    // Returns 0 on success, -1 otherwise and errno is set (ENOSYS when
+    // io_uring is not supported by kernel or was not compiled in).
+    int Init(unsigned entries);
+
+    // File descriptor of the ring, -1 if not initialized.
+    int fd() const { return _ring_fd; }
+
+    // True if multishot poll with edge-triggered mask may be supported.
+    // This is a guess made at compile time, polls completed with -EINVAL
+    // tell that the kernel does not support it actually.
+    bool support_multishot_poll() const { return _multishot_poll; }
+
+#ifdef BRPC_HAS_IO_URING
+    // Get a zeroed submission entry, NULL when the queue is full. Entries
+    // are not visible to kernel until Submit() or SubmitAndWait().
+    io_uring_sqe* GetSqe();
+
+    // Make entries got by GetSqe() visible to kernel.
+    // Returns number of published entries not consumed by kernel yet.
+    unsigned Publish();
+
+    // Ask kernel to consume at most `to_submit' published entries.
+    // Returns number of consumed entries, -1 otherwise and errno is set.
+    int Submit(unsigned to_submit);
+
+    // Same as Submit() and also wait until at least one completion is
+    // available, in one syscall.
+    int SubmitAndWait(unsigned to_submit);
+
+    // Call `fn(cqe, arg)' for each available completion and mark them as
+    // seen. Returns number of completions consumed.
+    int ForEachCqe(void (*fn)(const io_uring_cqe*, void*), void* arg);
+
+    // Helpers to fill entries.
+    static void PrepPollAdd(io_uring_sqe* sqe, int fd, uint32_t events,
+                            bool multishot, uint64_t user_data);
+    static void PrepPollRemove(io_uring_sqe* sqe, uint64_t target_user_data);
+    static void PrepNop(io_uring_sqe* sqe, uint64_t user_data);
+#endif
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(IOUring);
+    void Destroy();
+    int Enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+
+    int _ring_fd;
+    bool _multishot_poll;
+
+    void* _sq_ptr;
+    size_t _sq_map_size;
+    void* _cq_ptr;
+    size_t _cq_map_size;
+    io_uring_sqe* _sqes;
+    size_t _sqes_map_size;
+
+    unsigned* _sq_khead;
+    unsigned* _sq_ktail;
+    unsigned _sq_mask;
+    unsigned _sq_entries;
+    unsigned* _sq_array;
+    // Local tail, published to *_sq_ktail in Publish()
+    unsigned _sq_tail;
+
+    unsigned* _cq_khead;
+    unsigned* _cq_ktail;
+    unsigned _cq_mask;
+    io_uring_cqe* _cqes;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_DETAILS_IO_URING_H
@@ -0,0 +1,143 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_RECENT_LATENCY_H
+#define BRPC_RECENT_LATENCY_H
+
+#include <stdint.h>
+#include <math.h>                           // ceil
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+
+namespace brpc {
+
+// Distribution of recent latencies to one server, used for deciding delays
+// of adaptive backup requests.
+// Latencies are counted in log-linear buckets(8 buckets for each power of 2,
+// so that a percentile is over-estimated by at most 12.5%) and all counters
+// are halved every DECAY_INTERVAL_US, thus latencies in last few seconds
+// dominate. Add() and GetPercentile() are lock-free and called by many
+// threads concurrently, slight inaccuracies due to races are tolerable.
+class RecentLatency {
+public:
+    static const int SUB_BUCKETS_BITS = 3;
+    static const int NUM_BUCKETS = (32 - SUB_BUCKETS_BITS + 1) << SUB_BUCKETS_BITS;
+    static const int64_t DECAY_INTERVAL_US = 1000000L;
+    // Percentiles of fewer latencies are too noisy to be useful.
+    static const uint32_t MIN_COUNT = 16;
+
+    RecentLatency() : _count(0), _last_decay_us(0) {
+        for (int i = 0; i < NUM_BUCKETS; ++i) {
+            _buckets[i].store(0, butil::memory_order_relaxed);
+        }
+    }
+
+    void Add(int64_t latency_us, int64_t now_us) {
+        if (latency_us < 0) {
+            return;
+        }
+        MaybeDecay(now_us);
+        const uint32_t v = (latency_us > 0xFFFFFFFFL ?
+                            0xFFFFFFFFu : (uint32_t)latency_us);
+        _buckets[BucketIndex(v)].fetch_add(1, butil::memory_order_relaxed);
+        _count.fetch_add(1, butil::memory_order_relaxed);
+    }
+
+    // Returns the latency at `ratio' (in (0, 1]) of recent latencies, -1
+    // when there're fewer than MIN_COUNT latencies.
+    int64_t GetPercentile(double ratio, int64_t now_us) {
+        MaybeDecay(now_us);
+        const uint32_t count = _count.load(butil::memory_order_relaxed);
+        if (count < MIN_COUNT) {
+            return -1;
+        }
+        uint32_t target = (uint32_t)ceil(ratio * count);
+        if (target == 0) {
+            target = 1;
+        }
+        uint32_t accumulated = 0;
+        for (int i = 0; i < NUM_BUCKETS; ++i) {
+            accumulated += _buckets[i].load(butil::memory_order_relaxed);
+            if (accumulated >= target) {
+                return BucketUpperBound(i);
+            }
+        }
+        // _count is ahead of buckets being modified concurrently.
+        return -1;
+    }
+
+    static int BucketIndex(uint32_t v) {
+        if (v < (1u << SUB_BUCKETS_BITS)) {
+            return (int)v;
+        }
+        const int k = 31 - __builtin_clz(v);
+        const uint32_t sub = (v >> (k - SUB_BUCKETS_BITS)) &
+            ((1u << SUB_BUCKETS_BITS) - 1);
+        return ((k - SUB_BUCKETS_BITS + 1) << SUB_BUCKETS_BITS) + (int)sub;
+    }
+
+    static int64_t BucketUpperBound(int index) {
+        if (index < (1 << SUB_BUCKETS_BITS)) {
+            return index;
+        }
+        const int k = (index >> SUB_BUCKETS_BITS) + SUB_BUCKETS_BITS - 1;
+        const int64_t sub = index & ((1 << SUB_BUCKETS_BITS) - 1);
+        const int shift = k - SUB_BUCKETS_BITS;
+        return (((1L << SUB_BUCKETS_BITS) + sub + 1) << shift) - 1;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RecentLatency);
+
+    void MaybeDecay(int64_t now_us) {
+        int64_t last_us = _last_decay_us.load(butil::memory_order_relaxed);
+        if (now_us < last_us + DECAY_INTERVAL_US) {
+            return;
+        }
+        // Only one thread halves the counters.
+        if (!_last_decay_us.compare_exchange_strong(
+                last_us, now_us, butil::memory_order_relaxed)) {
+            return;
+        }
+        const int64_t intervals = (last_us == 0 ? 0 :
+                                   (now_us - last_us) / DECAY_INTERVAL_US);
+        if (intervals <= 0) {
+            return;
+        }
+        const int shift = (intervals >= 32 ? 32 : (int)intervals);
+        uint32_t removed = 0;
+        for (int i = 0; i < NUM_BUCKETS; ++i) {
+            const uint32_t n = _buckets[i].load(butil::memory_order_relaxed);
+            if (n != 0) {
+                const uint32_t d = (shift >= 32 ? n : n - (n >> shift));
+                _buckets[i].fetch_sub(d, butil::memory_order_relaxed);
+                removed += d;
+            }
+        }
+        _count.fetch_sub(removed, butil::memory_order_relaxed);
+    }
+
+    butil::atomic<uint32_t> _count;
+    butil::atomic<int64_t> _last_decay_us;
+    butil::atomic<uint32_t> _buckets[NUM_BUCKETS];
+};
+
+} // namespace brpc
+
+
+#endif // BRPC_RECENT_LATENCY_H
@@ -19,8 +19,10 @@
 #ifndef  BRPC_USERCODE_BACKUP_POOL_H
 #define  BRPC_USERCODE_BACKUP_POOL_H
 
+#include "butil/macros.h"
 #include "butil/atomicops.h"
 #include "bthread/bthread.h"
+#include "bthread/unstable.h"
 #include <gflags/gflags_declare.h>
 
 
@@ -82,6 +84,23 @@ inline void RunUserCode(void (*fn)(void*), void* arg) {
 // called, it will be called in EndRunningUserCodeInPool
 void InitUserCodeBackupPoolOnceOrDie();
 
+// Run the calling bthread at high priority(BTHREAD_HIGH_PRIORITY) within
+// the scope if `high_priority' is true, used for running handlers of methods
+// set by Server::SetMethodHighPriority().
+class UserCodePriorityScope {
+public:
+    explicit UserCodePriorityScope(bool high_priority)
+        : _prev(high_priority ? bthread_set_high_priority(1) : -1) {}
+    ~UserCodePriorityScope() {
+        if (_prev == 0) {
+            bthread_set_high_priority(0);
+        }
+    }
+private:
+    DISALLOW_COPY_AND_ASSIGN(UserCodePriorityScope);
+    int _prev;
+};
+
 } // namespace brpc
 
 
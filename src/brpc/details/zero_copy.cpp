@@ -0,0 +1,233 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <errno.h>
+#include <algorithm>                           // std::min
+#include <sys/socket.h>                        // sendmsg
+#include <sys/uio.h>                           // iovec
+#include <unistd.h>                            // close
+#include <gflags/gflags.h>
+#include "butil/build_config.h"                 // OS_LINUX
+#include "butil/scoped_lock.h"                  // BAIDU_SCOPED_LOCK
+#include "butil/time.h"                         // gettimeofday_us
+#include "butil/logging.h"
+#include "bthread/bthread.h"                    // bthread_start_background
+#include "brpc/details/zero_copy.h"
+
+#if defined(OS_LINUX) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <netinet/in.h>                        // IPPROTO_IP
+#include <linux/errqueue.h>                    // sock_extended_err
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+#define BRPC_HAS_MSG_ZEROCOPY 1
+#endif
+#endif
+
+namespace brpc {
+
+DEFINE_int32(socket_zerocopy_linger_ms, 10000,
+             "Max milliseconds to wait for completions of MSG_ZEROCOPY writes "
+             "after the socket is closed, the connection is reset after that");
+
+struct ZeroCopyWriter::LingerArg {
+    int fd;
+    std::deque<PendingWrite> pending;
+};
+
+ZeroCopyWriter::ZeroCopyWriter()
+    : _state(-1)
+    , _next_seq(0)
+    , _npending(0) {
+}
+
+ZeroCopyWriter::~ZeroCopyWriter() {
+}
+
+void ZeroCopyWriter::Close(int fd) {
+    LingerArg* arg = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        ReapPending(fd, &_pending);
+        if (!_pending.empty()) {
+            arg = new LingerArg;
+            arg->fd = fd;
+            arg->pending.swap(_pending);
+        }
+        _npending.store(0, butil::memory_order_relaxed);
+        _next_seq = 0;
+        _state = -1;
+    }
+    if (arg == NULL) {
+        close(fd);
+        return;
+    }
+    bthread_t th;
+    if (bthread_start_background(&th, NULL, LingerAndClose, arg) != 0) {
+        LingerAndClose(arg);
+    }
+}
+
+void* ZeroCopyWriter::LingerAndClose(void* void_arg) {
+    LingerArg* arg = (LingerArg*)void_arg;
+    const int64_t deadline_us = butil::gettimeofday_us() +
+        FLAGS_socket_zerocopy_linger_ms * 1000L;
+    int64_t sleep_us = 1000;
+    while (true) {
+        ReapPending(arg->fd, &arg->pending);
+        if (arg->pending.empty()) {
+            break;
+        }
+        if (butil::gettimeofday_us() >= deadline_us) {
+            LOG(WARNING) << "Reset fd=" << arg->fd << " with "
+                         << arg->pending.size()
+                         << " uncompleted MSG_ZEROCOPY writes";
+            // Closing with zero linger sends RST and drops the send queue
+            // which references the pending blocks.
+            struct linger lg = { 1, 0 };
+            setsockopt(arg->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+            break;
+        }
+        bthread_usleep(sleep_us);
+        sleep_us = std::min(sleep_us * 2, (int64_t)100000);
+    }
+    close(arg->fd);
+    delete arg;
+    return NULL;
+}
+
+#ifdef BRPC_HAS_MSG_ZEROCOPY
+
+bool ZeroCopyWriter::IsSupported() { return true; }
+
+ssize_t ZeroCopyWriter::Write(int fd, butil::IOBuf* const* pieces,
+                              size_t count) {
+    if (_state < 0) {
+        const int on = 1;
+        _state = (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0);
+    }
+    if (_state == 0) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    const size_t MAX_IOV = 256;
+    struct iovec vec[MAX_IOV];
+    size_t nvec = 0;
+    for (size_t i = 0; i < count && nvec < MAX_IOV; ++i) {
+        const butil::IOBuf* p = pieces[i];
+        const size_t nblock = p->backing_block_num();
+        for (size_t j = 0; j < nblock && nvec < MAX_IOV; ++j, ++nvec) {
+            const butil::StringPiece blk = p->backing_block(j);
+            vec[nvec].iov_base = const_cast<char*>(blk.data());
+            vec[nvec].iov_len = blk.size();
+        }
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = nvec;
+    // The completion of this write may be read by ReapCompletions() right
+    // after sendmsg(), hold _mutex until the write is pending, otherwise
+    // the completion matches nothing and the blocks are never released.
+    // The write is counted in pending_count() before sendmsg() so that
+    // callers checking it don't skip reaping meanwhile.
+    BAIDU_SCOPED_LOCK(_mutex);
+    _npending.store(_pending.size() + 1, butil::memory_order_relaxed);
+    const ssize_t nw = sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_DONTWAIT);
+    if (nw <= 0) {
+        _npending.store(_pending.size(), butil::memory_order_relaxed);
+        return nw;
+    }
+    butil::IOBuf written;
+    size_t left = nw;
+    for (size_t i = 0; i < count && left > 0; ++i) {
+        left -= pieces[i]->cutn(&written, left);
+    }
+    _pending.push_back(PendingWrite());
+    // Kernel counts each successful send, including partial ones.
+    _pending.back().seq = _next_seq++;
+    _pending.back().data.swap(written);
+    _npending.store(_pending.size(), butil::memory_order_relaxed);
+    return nw;
+}
+
+int ZeroCopyWriter::ReapCompletions(int fd) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const int ncompleted = ReapPending(fd, &_pending);
+    _npending.store(_pending.size(), butil::memory_order_relaxed);
+    return ncompleted;
+}
+
+int ZeroCopyWriter::ReapPending(int fd, std::deque<PendingWrite>* pending) {
+    int ncompleted = 0;
+    while (!pending->empty()) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 &&
+                   cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            const sock_extended_err* serr =
+                (const sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // Writes in [ee_info, ee_data] are completed. They're reported
+            // in order for stream sockets.
+            const uint32_t last = serr->ee_data;
+            while (!pending->empty() &&
+                   (int32_t)(last - pending->front().seq) >= 0) {
+                pending->pop_front();
+                ++ncompleted;
+            }
+        }
+    }
+    return ncompleted;
+}
+
+#else
+
+bool ZeroCopyWriter::IsSupported() { return false; }
+
+ssize_t ZeroCopyWriter::Write(int, butil::IOBuf* const*, size_t) {
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int ZeroCopyWriter::ReapCompletions(int) {
+    return 0;
+}
+
+int ZeroCopyWriter::ReapPending(int, std::deque<PendingWrite>*) {
+    return 0;
+}
+
+#endif  // BRPC_HAS_MSG_ZEROCOPY
+
+} // namespace brpc
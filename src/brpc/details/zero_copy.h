@@ -0,0 +1,94 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_DETAILS_ZERO_COPY_H
+#define BRPC_DETAILS_ZERO_COPY_H
+
+#include <deque>
+#include "butil/iobuf.h"
+#include "butil/synchronization/lock.h"
+#include "butil/atomicops.h"
+
+namespace brpc {
+
+// Writes IOBuf into file descriptors with MSG_ZEROCOPY. Kernel sends the
+// pages of written blocks directly without copying them, so the blocks are
+// referenced here until kernel reports completions through the error queue
+// of the file descriptor, after which the blocks may be reused.
+// Write() and Close() should be called by one thread at a time, while
+// ReapCompletions() may be called concurrently. Both run with _mutex locked so that a
+// completion is never read before its write is recorded as pending.
+class ZeroCopyWriter {
+public:
+    ZeroCopyWriter();
+    ~ZeroCopyWriter();
+
+    // True if MSG_ZEROCOPY was compiled in.
+    static bool IsSupported();
+
+    // Write `pieces' into `fd' with MSG_ZEROCOPY, written data are cut from
+    // `pieces' and referenced until completion.
+    // Returns bytes written, -1 otherwise and errno is set. Callers should
+    // fallback to normal writes when errno is ENOBUFS (exceeding optmem
+    // limit) or EOPNOTSUPP (not supported by the fd).
+    ssize_t Write(int fd, butil::IOBuf* const* pieces, size_t count);
+
+    // Read completions from the error queue of `fd' and release blocks of
+    // completed writes. Returns number of completed writes.
+    int ReapCompletions(int fd);
+
+    // Number of writes not completed yet.
+    size_t pending_count() const
+    { return _npending.load(butil::memory_order_relaxed); }
+
+    // Close `fd' which this writer wrote into and reset this writer for
+    // another fd. Kernel may still be sending pages of pending writes and
+    // completions can't be read after closing, so `fd' and the pending
+    // blocks are kept in background until all writes complete or
+    // -socket_zerocopy_linger_ms elapses, in which case the connection is
+    // reset to drop unsent data before the blocks are released.
+    void Close(int fd);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ZeroCopyWriter);
+
+    struct PendingWrite {
+        uint32_t seq;
+        butil::IOBuf data;
+    };
+    struct LingerArg;
+
+    // Read completions from the error queue of `fd' and pop completed
+    // writes from `pending'. Returns number of completed writes.
+    static int ReapPending(int fd, std::deque<PendingWrite>* pending);
+    static void* LingerAndClose(void* arg);
+
+    // -1: not tried, 0: SO_ZEROCOPY is not supported, 1: enabled
+    int _state;
+    // Sequence number of next write, which is counted by kernel per socket
+    // from 0 and reported in completions.
+    uint32_t _next_seq;
+    butil::atomic<size_t> _npending;
+    butil::Mutex _mutex;
+    std::deque<PendingWrite> _pending;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_DETAILS_ZERO_COPY_H
@@ -17,12 +17,15 @@
 
 
 #include <gflags/gflags.h>                            // DEFINE_int32
+#include <vector>
 #include "butil/compat.h"
 #include "butil/fd_utility.h"                         // make_close_on_exec
 #include "butil/logging.h"                            // LOG
+#include "butil/synchronization/lock.h"               // butil::Mutex
 #include "butil/third_party/murmurhash3/murmurhash3.h"// fmix32
 #include "bthread/bthread.h"                          // bthread_start_background
 #include "brpc/event_dispatcher.h"
+#include "brpc/details/io_uring.h"
 #ifdef BRPC_SOCKET_HAS_EOF
 #include "brpc/details/has_epollrdhup.h"
 #endif
@@ -32,6 +35,10 @@
 #include <sys/event.h>
 #include <sys/time.h>
 #endif
+#ifdef BRPC_HAS_IO_URING
+#include <poll.h>
+#include <linux/io_uring.h>
+#endif
 
 namespace brpc {
 
@@ -40,12 +47,419 @@ DEFINE_int32(event_dispatcher_num, 1, "Number of event dispatcher");
 DEFINE_bool(usercode_in_pthread, false, 
             "Call user's callback in pthreads, use bthreads otherwise");
 
+DEFINE_bool(event_dispatcher_use_io_uring, false,
+            "Poll readiness of file descriptors with io_uring instead of "
+            "epoll. Reads and writes are still done by syscalls after the "
+            "readiness is reported, so this does not reduce syscalls. "
+            "Fallback to epoll if io_uring is not supported");
+
+DEFINE_int32(event_dispatcher_io_uring_entries, 4096,
+             "Number of submission entries of the io_uring in each "
+             "EventDispatcher");
+
+#ifdef BRPC_HAS_IO_URING
+
+// Polls file descriptors with IORING_OP_POLL_ADD. Multishot polls are used
+// when supported, otherwise one-shot polls are re-armed by Rearm() after
+// the input handler drained the fd, in the io_uring_enter() waiting for
+// next completions. One-shot polls are level-triggered, re-arming them
+// before the fd is drained completes them again at once.
+class IOUringPoller {
+public:
+    enum Kind {
+        POLL_IN = 0,
+        POLL_OUT = 1,
+        WAKEUP = 2,
+    };
+
+    struct Event {
+        SocketId socket_id;
+        uint32_t events;
+        bool pollout;
+    };
+
+    explicit IOUringPoller(int entries)
+        : _entries(entries), _multishot(false), _ready(NULL) {}
+
+    int Init() {
+        if (_ring.Init(_entries) != 0) {
+            return -1;
+        }
+        _multishot = _ring.support_multishot_poll();
+        return 0;
+    }
+
+    int fd() const { return _ring.fd(); }
+
+    int AddConsumer(SocketId socket_id, int fd) {
+        unsigned npending = 0;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            Entry* e = GetEntry(fd);
+            if (e->in_registered) {
+                errno = EEXIST;
+                return -1;
+            }
+            e->in_id = socket_id;
+            e->in_registered = true;
+            ++e->in_gen;
+            if (ArmIn(fd, e) != 0) {
+                e->in_registered = false;
+                return -1;
+            }
+            npending = _ring.Publish();
+        }
+        _ring.Submit(npending);
+        return 0;
+    }
+
+    int RemoveConsumer(int fd) {
+        unsigned npending = 0;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            if ((size_t)fd >= _fd_entries.size() ||
+                !_fd_entries[fd].in_registered) {
+                errno = ENOENT;
+                return -1;
+            }
+            Entry* e = &_fd_entries[fd];
+            // Polls hold references to the file, they must be removed
+            // otherwise the file is not released after closing `fd'.
+            if (e->in_armed) {
+                Disarm(MakeUserData(e->in_gen, POLL_IN, fd));
+                e->in_armed = false;
+            }
+            if (e->out_armed) {
+                Disarm(MakeUserData(e->out_gen, POLL_OUT, fd));
+                e->out_armed = false;
+            }
+            e->in_registered = false;
+            ++e->in_gen;
+            ++e->out_gen;
+            npending = _ring.Publish();
+        }
+        _ring.Submit(npending);
+        return 0;
+    }
+
+    int AddEpollOut(SocketId socket_id, int fd, bool pollin) {
+        unsigned npending = 0;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            Entry* e = GetEntry(fd);
+            if (pollin && !e->in_registered) {
+                // Removed by RemoveConsumer(), same as EPOLL_CTL_MOD.
+                errno = ENOENT;
+                return -1;
+            }
+            if (e->out_armed) {
+                Disarm(MakeUserData(e->out_gen, POLL_OUT, fd));
+                e->out_armed = false;
+            }
+            e->out_id = socket_id;
+            ++e->out_gen;
+            io_uring_sqe* sqe = GetSqe();
+            if (sqe == NULL) {
+                errno = EAGAIN;
+                return -1;
+            }
+            IOUring::PrepPollAdd(sqe, fd, POLLOUT, false,
+                                 MakeUserData(e->out_gen, POLL_OUT, fd));
+            e->out_armed = true;
+            npending = _ring.Publish();
+        }
+        _ring.Submit(npending);
+        return 0;
+    }
+
+    // Re-arm the one-shot poll of `fd' if it's completed.
+    void Rearm(int fd) {
+        unsigned npending = 0;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            if (_multishot || (size_t)fd >= _fd_entries.size()) {
+                return;
+            }
+            Entry* e = &_fd_entries[fd];
+            if (!e->in_registered || e->in_armed) {
+                return;
+            }
+            ArmInOrDefer(fd, e);
+            npending = _ring.Publish();
+        }
+        _ring.Submit(npending);
+    }
+
+    int RemoveEpollOut(int fd) {
+        unsigned npending = 0;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            if ((size_t)fd >= _fd_entries.size() ||
+                !_fd_entries[fd].out_armed) {
+                errno = ENOENT;
+                return -1;
+            }
+            Entry* e = &_fd_entries[fd];
+            Disarm(MakeUserData(e->out_gen, POLL_OUT, fd));
+            e->out_armed = false;
+            ++e->out_gen;
+            npending = _ring.Publish();
+        }
+        _ring.Submit(npending);
+        return 0;
+    }
+
+    void Wakeup() {
+        unsigned npending = 0;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            io_uring_sqe* sqe = GetSqe();
+            if (sqe == NULL) {
+                return;
+            }
+            IOUring::PrepNop(sqe, MakeUserData(0, WAKEUP, 0));
+            npending = _ring.Publish();
+        }
+        _ring.Submit(npending);
+    }
+
+    // Submit re-armed polls and wait for completions, then move the
+    // events into `events'. Returns 0 on success, -1 otherwise.
+    int Wait(std::vector<Event>* events) {
+        unsigned npending = 0;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            FlushDeferred();
+            npending = _ring.Publish();
+        }
+        if (_ring.SubmitAndWait(npending) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+        events->clear();
+        _ready = events;
+        BAIDU_SCOPED_LOCK(_mutex);
+        _ring.ForEachCqe(OnCompletion, this);
+        _ready = NULL;
+        return 0;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(IOUringPoller);
+
+    struct Entry {
+        SocketId in_id;
+        SocketId out_id;
+        // Generations to tell completions of removed polls.
+        uint32_t in_gen;
+        uint32_t out_gen;
+        bool in_registered;
+        bool in_armed;
+        // The armed input poll is multishot.
+        bool in_multishot;
+        bool out_armed;
+    };
+
+    static uint64_t MakeUserData(uint32_t gen, Kind kind, int fd) {
+        return ((uint64_t)(gen & 0x3FFFFFFF) << 34) |
+            ((uint64_t)kind << 32) | (uint32_t)fd;
+    }
+
+    Entry* GetEntry(int fd) {
+        if ((size_t)fd >= _fd_entries.size()) {
+            Entry init;
+            memset(&init, 0, sizeof(init));
+            _fd_entries.resize(std::max((size_t)fd + 1,
+                                        _fd_entries.size() * 2), init);
+        }
+        return &_fd_entries[fd];
+    }
+
+    // Caller should hold _mutex.
+    io_uring_sqe* GetSqe() {
+        io_uring_sqe* sqe = _ring.GetSqe();
+        if (sqe == NULL) {
+            // Full, push published entries to kernel to make room.
+            _ring.Submit(_ring.Publish());
+            sqe = _ring.GetSqe();
+        }
+        return sqe;
+    }
+
+    int ArmIn(int fd, Entry* e) {
+        io_uring_sqe* sqe = GetSqe();
+        if (sqe == NULL) {
+            errno = EAGAIN;
+            return -1;
+        }
+        uint32_t events = POLLIN;
+#ifdef BRPC_SOCKET_HAS_EOF
+        events |= has_epollrdhup;
+#endif
+        IOUring::PrepPollAdd(sqe, fd, events, _multishot,
+                             MakeUserData(e->in_gen, POLL_IN, fd));
+        e->in_armed = true;
+        e->in_multishot = _multishot;
+        return 0;
+    }
+
+    // Arm the input poll of `fd', or let the next Wait() retry if the
+    // submission queue is still full after submitting.
+    void ArmInOrDefer(int fd, Entry* e) {
+        if (ArmIn(fd, e) != 0) {
+            e->in_armed = false;
+            _deferred_arms.push_back(fd);
+            LOG_EVERY_SECOND(WARNING) << "io_uring is full, defer arming "
+                "poll of fd=" << fd;
+        }
+    }
+
+    // Remove the poll identified by `user_data'. Removals can't be dropped
+    // since the poll holds a reference to the file, if the submission queue
+    // is still full after submitting, the next Wait() retries.
+    void Disarm(uint64_t user_data) {
+        if (!PrepDisarm(user_data)) {
+            _deferred_removals.push_back(user_data);
+            LOG_EVERY_SECOND(WARNING) << "io_uring is full, defer removing "
+                "poll of fd=" << (int)(uint32_t)user_data;
+        }
+    }
+
+    bool PrepDisarm(uint64_t user_data) {
+        io_uring_sqe* sqe = GetSqe();
+        if (sqe == NULL) {
+            return false;
+        }
+        IOUring::PrepPollRemove(sqe, user_data);
+        // Completion of the removal itself is ignored.
+        sqe->user_data = MakeUserData(0, WAKEUP, 0);
+        return true;
+    }
+
+    // Caller should hold _mutex. Retry removals and arms which did not get
+    // an entry in the submission queue, the remaining ones are kept.
+    void FlushDeferred() {
+        size_t i = 0;
+        for (; i < _deferred_removals.size(); ++i) {
+            if (!PrepDisarm(_deferred_removals[i])) {
+                break;
+            }
+        }
+        _deferred_removals.erase(_deferred_removals.begin(),
+                                 _deferred_removals.begin() + i);
+        for (i = 0; i < _deferred_arms.size(); ++i) {
+            const int fd = _deferred_arms[i];
+            Entry* e = &_fd_entries[fd];
+            if (!e->in_registered || e->in_armed) {
+                // Removed or re-armed after being deferred.
+                continue;
+            }
+            if (ArmIn(fd, e) != 0) {
+                break;
+            }
+        }
+        _deferred_arms.erase(_deferred_arms.begin(),
+                             _deferred_arms.begin() + i);
+    }
+
+    static void OnCompletion(const io_uring_cqe* cqe, void* arg) {
+        static_cast<IOUringPoller*>(arg)->HandleCompletion(cqe);
+    }
+
+    void HandleCompletion(const io_uring_cqe* cqe) {
+        const uint64_t user_data = cqe->user_data;
+        const Kind kind = (Kind)((user_data >> 32) & 3);
+        if (kind == WAKEUP) {
+            return;
+        }
+        const int fd = (int)(uint32_t)user_data;
+        const uint32_t gen = (uint32_t)(user_data >> 34);
+        if ((size_t)fd >= _fd_entries.size()) {
+            return;
+        }
+        Entry* e = &_fd_entries[fd];
+        const bool more = (cqe->flags & IORING_CQE_F_MORE);
+        if (kind == POLL_IN) {
+            if (!e->in_registered || !e->in_armed ||
+                (e->in_gen & 0x3FFFFFFF) != gen) {
+                return;
+            }
+            if (cqe->res == -EINVAL && e->in_multishot) {
+                // Other polls armed before the fallback fail in the same way.
+                LOG_IF(WARNING, _multishot) << "Multishot poll is not "
+                    "supported, fallback to one-shot polls";
+                _multishot = false;
+                ArmInOrDefer(fd, e);
+                return;
+            }
+            if (cqe->res == -ECANCELED) {
+                return;
+            }
+            Event evt = { e->in_id,
+                          cqe->res < 0 ? (uint32_t)POLLERR : (uint32_t)cqe->res,
+                          false };
+            _ready->push_back(evt);
+            if (!more) {
+                if (e->in_multishot) {
+                    // Terminated by kernel, edge-triggered as well after
+                    // re-arming.
+                    ArmInOrDefer(fd, e);
+                } else {
+                    // Re-armed in Rearm() after the fd is drained.
+                    e->in_armed = false;
+                }
+            }
+        } else {
+            if (!e->out_armed || (e->out_gen & 0x3FFFFFFF) != gen ||
+                cqe->res == -ECANCELED) {
+                return;
+            }
+            e->out_armed = false;
+            Event evt = { e->out_id, (uint32_t)POLLOUT, true };
+            _ready->push_back(evt);
+        }
+    }
+
+    IOUring _ring;
+    const int _entries;
+    bool _multishot;
+    butil::Mutex _mutex;
+    std::vector<Entry> _fd_entries;
+    std::vector<Event>* _ready;
+    // User data of polls and fds whose removal or arming is deferred
+    // because the submission queue was full.
+    std::vector<uint64_t> _deferred_removals;
+    std::vector<int> _deferred_arms;
+};
+
+#else
+
+class IOUringPoller {};
+
+#endif  // BRPC_HAS_IO_URING
+
 EventDispatcher::EventDispatcher()
     : _epfd(-1)
+    , _uring(NULL)
     , _stop(false)
     , _tid(0)
     , _consumer_thread_attr(BTHREAD_ATTR_NORMAL)
 {
+    _wakeup_fds[0] = -1;
+    _wakeup_fds[1] = -1;
+#ifdef BRPC_HAS_IO_URING
+    if (FLAGS_event_dispatcher_use_io_uring) {
+        IOUringPoller* uring =
+            new IOUringPoller(FLAGS_event_dispatcher_io_uring_entries);
+        if (uring->Init() == 0) {
+            _uring = uring;
+            _epfd = _uring->fd();
+            return;
+        }
+        PLOG(WARNING) << "Fail to setup io_uring, fallback to epoll";
+        delete uring;
+    }
+#endif
 #if defined(OS_LINUX)
     _epfd = epoll_create(1024 * 1024);
     if (_epfd < 0) {
@@ -63,8 +477,6 @@ EventDispatcher::EventDispatcher()
 #endif
     CHECK_EQ(0, butil::make_close_on_exec(_epfd));
 
-    _wakeup_fds[0] = -1;
-    _wakeup_fds[1] = -1;
     if (pipe(_wakeup_fds) != 0) {
         PLOG(FATAL) << "Fail to create pipe";
         return;
@@ -74,6 +486,12 @@ EventDispatcher::EventDispatcher()
 EventDispatcher::~EventDispatcher() {
     Stop();
     Join();
+    if (_uring) {
+        // _epfd is closed along with the ring.
+        delete _uring;
+        _uring = NULL;
+        _epfd = -1;
+    }
     if (_epfd >= 0) {
         close(_epfd);
         _epfd = -1;
@@ -130,6 +548,12 @@ bool EventDispatcher::Running() const {
 void EventDispatcher::Stop() {
     _stop = true;
 
+#ifdef BRPC_HAS_IO_URING
+    if (_uring) {
+        _uring->Wakeup();
+        return;
+    }
+#endif
     if (_epfd >= 0) {
 #if defined(OS_LINUX)
         epoll_event evt = { EPOLLOUT,  { NULL } };
@@ -155,6 +579,11 @@ int EventDispatcher::AddEpollOut(SocketId socket_id, int fd, bool pollin) {
         errno = EINVAL;
         return -1;
     }
+#ifdef BRPC_HAS_IO_URING
+    if (_uring) {
+        return _uring->AddEpollOut(socket_id, fd, pollin);
+    }
+#endif
 
 #if defined(OS_LINUX)
     epoll_event evt;
@@ -196,6 +625,12 @@ int EventDispatcher::AddEpollOut(SocketId socket_id, int fd, bool pollin) {
 
 int EventDispatcher::RemoveEpollOut(SocketId socket_id, 
                                     int fd, bool pollin) {
+#ifdef BRPC_HAS_IO_URING
+    if (_uring) {
+        // EPOLLIN is kept by a separate poll, `pollin' does not matter.
+        return _uring->RemoveEpollOut(fd);
+    }
+#endif
 #if defined(OS_LINUX)
     if (pollin) {
         epoll_event evt;
@@ -229,6 +664,11 @@ int EventDispatcher::AddConsumer(SocketId socket_id, int fd) {
         errno = EINVAL;
         return -1;
     }
+#ifdef BRPC_HAS_IO_URING
+    if (_uring) {
+        return _uring->AddConsumer(socket_id, fd);
+    }
+#endif
 #if defined(OS_LINUX)
     epoll_event evt;
     evt.events = EPOLLIN | EPOLLET;
@@ -246,6 +686,14 @@ int EventDispatcher::AddConsumer(SocketId socket_id, int fd) {
     return -1;
 }
 
+void EventDispatcher::RearmConsumer(int fd) {
+#ifdef BRPC_HAS_IO_URING
+    if (_uring && fd >= 0) {
+        _uring->Rearm(fd);
+    }
+#endif
+}
+
 int EventDispatcher::RemoveConsumer(int fd) {
     if (fd < 0) {
         return -1;
@@ -257,6 +705,15 @@ int EventDispatcher::RemoveConsumer(int fd) {
     // from epoll again! If the fd was level-triggered and there's data left,
     // epoll_wait will keep returning events of the fd continuously, making
     // program abnormal.
+#ifdef BRPC_HAS_IO_URING
+    if (_uring) {
+        if (_uring->RemoveConsumer(fd) < 0) {
+            PLOG(WARNING) << "Fail to remove fd=" << fd << " from io_uring";
+            return -1;
+        }
+        return 0;
+    }
+#endif
 #if defined(OS_LINUX)
     if (epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
         PLOG(WARNING) << "Fail to remove fd=" << fd << " from epfd=" << _epfd;
@@ -278,6 +735,9 @@ void* EventDispatcher::RunThis(void* arg) {
 }
 
 void EventDispatcher::Run() {
+    if (_uring) {
+        return RunIOUring();
+    }
     while (!_stop) {
 #if defined(OS_LINUX)
         epoll_event e[32];
@@ -347,6 +807,34 @@ void EventDispatcher::Run() {
     }
 }
 
+void EventDispatcher::RunIOUring() {
+#ifdef BRPC_HAS_IO_URING
+    std::vector<IOUringPoller::Event> events;
+    while (!_stop) {
+        if (_uring->Wait(&events) != 0) {
+            PLOG(FATAL) << "Fail to wait io_uring fd=" << _epfd;
+            break;
+        }
+        if (_stop) {
+            break;
+        }
+        for (size_t i = 0; i < events.size(); ++i) {
+            if (!events[i].pollout) {
+                // We don't care about the return value.
+                Socket::StartInputEvent(events[i].socket_id, events[i].events,
+                                        _consumer_thread_attr);
+            }
+        }
+        for (size_t i = 0; i < events.size(); ++i) {
+            if (events[i].pollout) {
+                // We don't care about the return value.
+                Socket::HandleEpollOut(events[i].socket_id);
+            }
+        }
+    }
+#endif
+}
+
 static EventDispatcher* g_edisp = NULL;
 static pthread_once_t g_edisp_once = PTHREAD_ONCE_INIT;
 
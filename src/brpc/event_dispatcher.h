@@ -26,6 +26,8 @@
 
 namespace brpc {
 
+class IOUringPoller;
+
 // Dispatch edge-triggered events of file descriptors to consumers
 // running in separate bthreads.
 class EventDispatcher {
@@ -82,9 +84,22 @@ private:
     // Remove the file descriptor `fd' from epoll.
     int RemoveConsumer(int fd);
 
-    // The epoll to watch events.
+    // Called after the consumer of `fd' read until EAGAIN and found no more
+    // events. Only one-shot polls of io_uring need this to be watched
+    // again, edge-triggered epoll does nothing.
+    void RearmConsumer(int fd);
+
+    // Thread entry when events are polled by io_uring.
+    void RunIOUring();
+
+    // The epoll to watch events. When io_uring is used, this is the fd of
+    // the ring which is owned by _uring.
     int _epfd;
 
+    // Non-NULL iff -event_dispatcher_use_io_uring is on and io_uring is
+    // supported by the kernel.
+    IOUringPoller* _uring;
+
     // false unless Stop() is called.
     volatile bool _stop;
 
@@ -90,6 +90,7 @@
 #endif
 #include "butil/fd_guard.h"
 #include "butil/files/file_watcher.h"
+#include "butil/huge_page_allocator.h"
 
 extern "C" {
 // defined in gperftools/malloc_extension_c.h
@@ -105,6 +106,15 @@ DEFINE_int32(free_memory_to_system_interval, 0,
              "values <= 0 disables this feature");
 BRPC_VALIDATE_GFLAG(free_memory_to_system_interval, PassValidate);
 
+DEFINE_int32(iobuf_huge_page_memory_mb, 0,
+             "Allocate blocks of IOBuf from 2MB huge-page arenas of at most "
+             "so many megabytes in total, blocks are allocated by malloc "
+             "after exceeding. 0 disables huge-page arenas. Read at "
+             "initialization of brpc only");
+
+DEFINE_bool(iobuf_huge_page_mlock, false,
+            "mlock() huge-page arenas of -iobuf_huge_page_memory_mb");
+
 namespace policy {
 // Defined in http_rpc_protocol.cpp
 void InitCommonStrings();
@@ -192,6 +202,14 @@ static int64_t GetIOBufNewBigViewCount(void*) {
 static int64_t GetIOBufBlockMemory(void*) {
     return butil::IOBuf::block_memory();
 }
+static void PrintIOBufHugePageAllocator(std::ostream& os, void*) {
+    butil::HugePageAllocator* a = butil::iobuf::huge_page_allocator();
+    if (a) {
+        a->Describe(os);
+    } else {
+        os << "disabled";
+    }
+}
 
 // Defined in server.cpp
 extern butil::static_atomic<int> g_running_server_count;
@@ -213,6 +231,8 @@ static void* GlobalUpdate(void*) {
         "iobuf_newbigview_second", &var_iobuf_new_bigview_count);
     bvar::PassiveStatus<int64_t> var_iobuf_block_memory(
         "iobuf_block_memory", GetIOBufBlockMemory, NULL);
+    bvar::PassiveStatus<std::string> var_iobuf_huge_page_allocator(
+        "iobuf_huge_page_allocator", PrintIOBufHugePageAllocator, NULL);
     bvar::PassiveStatus<int> var_running_server_count(
         "rpc_server_count", GetRunningServerCount, NULL);
 
@@ -340,6 +360,15 @@ static void GlobalInitializeOrDieImpl() {
     // Defined in http_rpc_protocol.cpp
     InitCommonStrings();
 
+    if (FLAGS_iobuf_huge_page_memory_mb > 0) {
+        butil::HugePageAllocator::Options opt;
+        opt.max_memory = FLAGS_iobuf_huge_page_memory_mb * 1024UL * 1024UL;
+        opt.lock_memory = FLAGS_iobuf_huge_page_mlock;
+        if (butil::iobuf::use_huge_page_allocator(opt) != 0) {
+            LOG(WARNING) << "IOBuf is using huge-page allocator already";
+        }
+    }
+
     // Leave memory of these extensions to process's clean up.
     g_ext = new(std::nothrow) GlobalExtensions();
     if (NULL == g_ext) {
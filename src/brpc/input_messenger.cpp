@@ -16,10 +16,12 @@
 // under the License.
 
 
+#include <sys/ioctl.h>                          // FIONREAD
 #include <gflags/gflags.h>
 #include "butil/fd_guard.h"                      // fd_guard
 #include "butil/logging.h"                       // CHECK
 #include "butil/time.h"                          // cpuwide_time_us
+#include "butil/third_party/murmurhash3/murmurhash3.h" // fmix32
 #include "butil/fd_utility.h"                    // make_non_blocking
 #include "bthread/bthread.h"                     // bthread_start_background
 #include "bthread/unstable.h"                   // bthread_flush
@@ -52,13 +54,78 @@ DEFINE_bool(log_connection_close, false,
             "Print log when remote side closes the connection");
 BRPC_VALIDATE_GFLAG(log_connection_close, PassValidate);
 
+DEFINE_bool(read_size_from_fionread, false,
+            "When a read fills the given buffer, query bytes available "
+            "with ioctl(FIONREAD) to size the next read, so that bulk "
+            "transfers are read in fewer calls");
+BRPC_VALIDATE_GFLAG(read_size_from_fionread, PassValidate);
+
+DEFINE_int32(input_busy_poll_us, 0,
+             "Keep reading a socket which had data for at most so many "
+             "microseconds before waiting for next event from dispatcher. "
+             "0 disables busy polling");
+BRPC_VALIDATE_GFLAG(input_busy_poll_us, NonNegativeInteger);
+
 DECLARE_bool(usercode_in_pthread);
 DECLARE_uint64(max_body_size);
 
+DEFINE_bool(sniff_protocol_by_prefix, true,
+            "Try the protocol which parsed the same first bytes last time "
+            "before other protocols on new server-side connections");
+BRPC_VALIDATE_GFLAG(sniff_protocol_by_prefix, PassValidate);
+
+struct ProtocolDetectionVars {
+    // Number of parse() called before a protocol is determined.
+    bvar::IntRecorder attempts;
+    bvar::Adder<int64_t> sniff_hit;
+
+    ProtocolDetectionVars()
+        : attempts("rpc_protocol_detection_attempts")
+        , sniff_hit("rpc_protocol_sniff_hit") {}
+};
+static ProtocolDetectionVars* g_detection_vars = NULL;
+static pthread_once_t g_detection_vars_once = PTHREAD_ONCE_INIT;
+static void CreateProtocolDetectionVars() {
+    g_detection_vars = new ProtocolDetectionVars;
+}
+static ProtocolDetectionVars* get_detection_vars() {
+    pthread_once(&g_detection_vars_once, CreateProtocolDetectionVars);
+    return g_detection_vars;
+}
+
 const size_t MSG_SIZE_WINDOW = 10;  // Take last so many message into stat.
 const size_t MIN_ONCE_READ = 4096;
 const size_t MAX_ONCE_READ = 524288;
 
+size_t InputMessenger::GetOnceReadSize(Socket* m, bool last_read_full) {
+    // Large enough to hold several messages.
+    size_t once_read = std::max((size_t)m->_avg_msg_size * 16,
+                                (size_t)m->_once_read_size);
+    if (last_read_full && FLAGS_read_size_from_fionread) {
+        int avail = 0;
+        if (ioctl(m->fd(), FIONREAD, &avail) == 0 && avail > 0) {
+            once_read = avail;
+        }
+    }
+    if (once_read < MIN_ONCE_READ) {
+        once_read = MIN_ONCE_READ;
+    } else if (once_read > MAX_ONCE_READ) {
+        once_read = MAX_ONCE_READ;
+    }
+    return once_read;
+}
+
+bool InputMessenger::UpdateOnceReadSize(Socket* m, size_t once_read,
+                                        size_t nr) {
+    if (nr >= once_read) {
+        // Double the size to drain the socket with fewer reads.
+        m->_once_read_size = std::min(once_read * 2, MAX_ONCE_READ);
+        return true;
+    }
+    m->_once_read_size = nr;
+    return false;
+}
+
 ParseResult InputMessenger::CutInputMessage(
         Socket* m, size_t* index, bool read_eof) {
     const int preferred = m->preferred_index();
@@ -99,16 +166,44 @@ ParseResult InputMessenger::CutInputMessage(
         }
         m->set_preferred_index(-1);
     }
-    for (int i = 0; i <= max_index; ++i) {
-        if (i == preferred || _handlers[i].parse == NULL) {
-            // Don't try preferred handler(already tried) or invalid handler
+    int attempts = (preferred >= 0 ? 1 : 0);
+    // Look up the handler which parsed the same first bytes last time on a
+    // new server-side connection and try it before others.
+    uint32_t prefix = 0;
+    const bool sniff = (FLAGS_sniff_protocol_by_prefix &&
+                        !m->CreatedByConnect() &&
+                        m->_read_buf.copy_to(&prefix, sizeof(prefix))
+                        == sizeof(prefix));
+    int sniffed = -1;
+    if (sniff) {
+        sniffed = FindSniffedHandler(prefix);
+        if (sniffed > max_index || sniffed == preferred ||
+            (sniffed >= 0 && _handlers[sniffed].parse == NULL)) {
+            sniffed = -1;
+        }
+    }
+    // k = -1 stands for the sniffed handler.
+    for (int k = -1; k <= max_index; ++k) {
+        const int i = (k < 0 ? sniffed : k);
+        if (i < 0 || (k >= 0 && i == sniffed) ||
+            i == preferred || _handlers[i].parse == NULL) {
+            // Don't try preferred/sniffed handler(already tried) or invalid
+            // handler
             continue;
         }
+        ++attempts;
         ParseResult result = _handlers[i].parse(&m->_read_buf, m, read_eof, _handlers[i].arg);
         if (result.is_ok() ||
             result.error() == PARSE_ERROR_NOT_ENOUGH_DATA) {
             m->set_preferred_index(i);
             *index = i;
+            ProtocolDetectionVars* vars = get_detection_vars();
+            vars->attempts << attempts;
+            if (i == sniffed) {
+                vars->sniff_hit << 1;
+            } else if (sniff && result.is_ok()) {
+                RememberSniffedHandler(prefix, i);
+            }
             return result;
         } else if (result.error() != PARSE_ERROR_TRY_OTHERS) {
             // Critical error, return directly.
@@ -130,6 +225,24 @@ ParseResult InputMessenger::CutInputMessage(
     return MakeParseError(PARSE_ERROR_TRY_OTHERS);
 }
 
+int InputMessenger::FindSniffedHandler(uint32_t prefix) const {
+    const uint64_t entry = _sniff_table[butil::fmix32(prefix) % SNIFF_TABLE_SIZE]
+        .load(butil::memory_order_relaxed);
+    if ((uint32_t)(entry >> 32) != prefix) {
+        return -1;
+    }
+    return (int)(uint32_t)entry - 1;
+}
+
+void InputMessenger::RememberSniffedHandler(uint32_t prefix, int index) {
+    const uint64_t entry = ((uint64_t)prefix << 32) | (uint32_t)(index + 1);
+    butil::atomic<uint64_t>& slot =
+        _sniff_table[butil::fmix32(prefix) % SNIFF_TABLE_SIZE];
+    if (slot.load(butil::memory_order_relaxed) != entry) {
+        slot.store(entry, butil::memory_order_relaxed);
+    }
+}
+
 void* ProcessInputMessage(void* void_arg) {
     InputMessageBase* msg = static_cast<InputMessageBase*>(void_arg);
     msg->_process(msg);
@@ -165,6 +278,36 @@ static void QueueMessage(InputMessageBase* to_run_msg,
     }
 }
 
+// Returns true if the caller should read `m' again rather than waiting for
+// next event, which happens in at most -input_busy_poll_us microseconds
+// after the socket ran out of data. `*busy_poll_end_us' is -1 if polling
+// has not started yet.
+template <typename LastMessagePtr>
+static bool ContinueBusyPoll(Socket* m, int64_t* busy_poll_end_us,
+                             LastMessagePtr* last_msg) {
+    const int32_t budget_us = FLAGS_input_busy_poll_us;
+    if (budget_us <= 0) {
+        return false;
+    }
+    const int64_t now_us = butil::cpuwide_time_us();
+    if (*busy_poll_end_us < 0) {
+        *busy_poll_end_us = now_us + budget_us;
+        // Don't delay the last message until polling ends.
+        int num_bthread_created = 0;
+        QueueMessage(last_msg->release(), &num_bthread_created,
+                     m->keytable_pool());
+        if (num_bthread_created) {
+            bthread_flush();
+        }
+    }
+    if (now_us >= *busy_poll_end_us) {
+        return false;
+    }
+    // Let other bthreads queued in this worker run.
+    bthread_yield();
+    return true;
+}
+
 void InputMessenger::OnNewMessages(Socket* m) {
     // Notes:
     // - If the socket has only one message, the message will be parsed and
@@ -185,17 +328,16 @@ void InputMessenger::OnNewMessages(Socket* m) {
     // OK in most cases.
     std::unique_ptr<InputMessageBase, RunLastMessage> last_msg;
     bool read_eof = false;
+    bool last_read_full = false;
+    // Busy polling only happens to sockets which had data in this call.
+    bool has_data = false;
+    int64_t busy_poll_end_us = -1;
     while (!read_eof) {
         const int64_t received_us = butil::cpuwide_time_us();
         const int64_t base_realtime = butil::gettimeofday_us() - received_us;
 
         // Calculate bytes to be read.
-        size_t once_read = m->_avg_msg_size * 16;
-        if (once_read < MIN_ONCE_READ) {
-            once_read = MIN_ONCE_READ;
-        } else if (once_read > MAX_ONCE_READ) {
-            once_read = MAX_ONCE_READ;
-        }
+        const size_t once_read = GetOnceReadSize(m, last_read_full);
 
         // Read.
         const ssize_t nr = m->DoRead(once_read);
@@ -215,6 +357,9 @@ void InputMessenger::OnNewMessages(Socket* m) {
                 m->SetFailed(saved_errno, "Fail to read from %s: %s",
                              m->description().c_str(), berror(saved_errno));
                 return;
+            } else if (has_data &&
+                       ContinueBusyPoll(m, &busy_poll_end_us, &last_msg)) {
+                continue;
             } else if (!m->MoreReadEvents(&progress)) {
                 return;
             } else { // new events during processing
@@ -223,6 +368,12 @@ void InputMessenger::OnNewMessages(Socket* m) {
         }
         
         m->AddInputBytes(nr);
+        last_read_full = UpdateOnceReadSize(m, once_read, nr);
+        has_data = true;
+        if (busy_poll_end_us > 0) {
+            // Data arrived during polling, restart the polling next time.
+            busy_poll_end_us = -1;
+        }
 
         // Avoid this socket to be closed due to idle_timeout_s
         m->_last_readtime_us.store(received_us, butil::memory_order_relaxed);
@@ -339,6 +490,9 @@ InputMessenger::InputMessenger(size_t capacity)
     , _max_index(-1)
     , _non_protocol(false)
     , _capacity(capacity) {
+    for (size_t i = 0; i < SNIFF_TABLE_SIZE; ++i) {
+        _sniff_table[i].store(0, butil::memory_order_relaxed);
+    }
 }
 
 InputMessenger::~InputMessenger() {
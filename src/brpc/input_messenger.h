@@ -111,6 +111,23 @@ private:
     // from m->read_buf, save index of the scissor into `index'.
     ParseResult CutInputMessage(Socket* m, size_t* index, bool read_eof);
 
+    // Bytes to be read from `m' in next DoRead(). `last_read_full' is true
+    // when the previous read filled the buffer, in which case more data is
+    // probably pending in the kernel.
+    static size_t GetOnceReadSize(Socket* m, bool last_read_full);
+
+    // Adapt size of next read to the result `nr' of reading `once_read'
+    // bytes. Returns true if the read filled the buffer.
+    static bool UpdateOnceReadSize(Socket* m, size_t once_read, size_t nr);
+
+    // Index of the handler which parsed the last message beginning with
+    // `prefix' on a new connection, -1 if unknown.
+    int FindSniffedHandler(uint32_t prefix) const;
+
+    // Remember that messages beginning with `prefix' are parsed by the
+    // handler at `index'.
+    void RememberSniffedHandler(uint32_t prefix, int index);
+
     // User-supplied scissors and handlers.
     // the index of handler is exactly the same as the protocol
     InputMessageHandler* _handlers;
@@ -119,6 +136,13 @@ private:
     bool _non_protocol;
     size_t _capacity;
 
+    // Maps first 4 bytes of new server-side connections to (index + 1) of
+    // the handler parsing them, so that the right handler is tried first
+    // rather than all handlers in order. Entries are (prefix << 32 | index+1)
+    // and may be overwritten by other prefixes colliding on the slot.
+    static const size_t SNIFF_TABLE_SIZE = 256;
+    butil::atomic<uint64_t> _sniff_table[SNIFF_TABLE_SIZE];
+
     butil::Mutex _add_handler_mutex;
 };
 
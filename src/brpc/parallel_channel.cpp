@@ -18,6 +18,7 @@
 
 #include "bthread/bthread.h"                  // bthread_id_xx
 #include "bthread/unstable.h"                 // bthread_timer_add
+#include "bthread/mutex.h"                    // bthread::Mutex
 #include "butil/atomicops.h"
 #include "butil/time.h"
 #include "butil/macros.h"
@@ -29,7 +30,9 @@ namespace brpc {
 
 ParallelChannelOptions::ParallelChannelOptions()
     : timeout_ms(500)
-    , fail_limit(-1) {
+    , fail_limit(-1)
+    , success_limit(-1)
+    , merge_incrementally(false) {
 }
 
 DECLARE_bool(usercode_in_pthread);
@@ -45,14 +48,20 @@ static __thread Memory tls_cached_pchan_mem = { 0, NULL };
 
 class ParallelChannelDone : public google::protobuf::Closure {
 private:
-    ParallelChannelDone(int fail_limit, int ndone, int nchan, int memsize,
-                        Controller* cntl, google::protobuf::Closure* user_done)
+    ParallelChannelDone(int fail_limit, int success_limit,
+                        bool merge_incrementally, int ndone, int nchan,
+                        int memsize, Controller* cntl,
+                        google::protobuf::Closure* user_done)
         : _fail_limit(fail_limit)
+        , _success_limit(success_limit)
+        , _merge_incrementally(merge_incrementally)
         , _ndone(ndone)
         , _nchan(nchan)
         , _memsize(memsize)
         , _current_fail(0)
+        , _current_success(0)
         , _current_done(0)
+        , _merge_failed_all(false)
         , _cntl(cntl)
         , _user_done(user_done)
         , _callmethod_bthread(INVALID_BTHREAD)
@@ -89,7 +98,8 @@ public:
     };
     
     static ParallelChannelDone* Create(
-        int fail_limit, int ndone, const SubCall* aps, int nchan,
+        int fail_limit, int success_limit, bool merge_incrementally,
+        int ndone, const SubCall* aps, int nchan,
         Controller* cntl, google::protobuf::Closure* user_done) {
         // We need to create the object in this way because _sub_done is
         // dynamically allocated.
@@ -131,7 +141,8 @@ public:
         }
 #endif
         ParallelChannelDone* d = new (mem) ParallelChannelDone(
-            fail_limit, ndone, nchan, memsize, cntl, user_done);
+            fail_limit, success_limit, merge_incrementally,
+            ndone, nchan, memsize, cntl, user_done);
 
         // Apply client settings of _cntl to controllers of sub calls, except
         // timeout. If we let sub channel do their timeout separately, when
@@ -220,16 +231,21 @@ public:
         if (fin != NULL) {
             // [ called from SubDone::Run() ]
 
-            // Count failed sub calls, if fail_limit is reached, cancel others.
-            if (fin->cntl.FailedInline() &&
-                _current_fail.fetch_add(1, butil::memory_order_relaxed) + 1
-                == _fail_limit) {
-                for (int i = 0; i < _ndone; ++i) {
-                    SubDone* sd = sub_done(i);
-                    if (fin != sd) {
-                        bthread_id_error(sd->cntl.call_id(), ECANCELED);
-                    }
+            bool failed = fin->cntl.FailedInline();
+            if (!failed && _merge_incrementally) {
+                failed = !MergeSubResponse(fin);
+            }
+            // Count failed and successful sub calls, if fail_limit or
+            // success_limit is reached, the result is known, cancel others.
+            if (failed) {
+                if (_current_fail.fetch_add(1, butil::memory_order_relaxed) + 1
+                    == _fail_limit) {
+                    CancelOtherSubCalls(fin);
                 }
+            } else if (_current_success.fetch_add(
+                           1, butil::memory_order_relaxed) + 1
+                       == _success_limit) {
+                CancelOtherSubCalls(fin);
             }
             // NOTE: Don't access any member after the fetch_add because
             // another thread may already go down and Destroy()-ed this object.
@@ -297,19 +313,80 @@ public:
         }
     }
 
+    void CancelOtherSubCalls(const SubDone* fin) {
+        for (int i = 0; i < _ndone; ++i) {
+            SubDone* sd = sub_done(i);
+            if (fin != sd) {
+                bthread_id_error(sd->cntl.call_id(), ECANCELED);
+            }
+        }
+    }
+
+    // Merge response of successful sub call `sd' into _cntl->_response,
+    // called when sub calls end if merge_incrementally is true.
+    // Returns false if the sub call should be counted as a failure.
+    bool MergeSubResponse(SubDone* sd) {
+        const int index = sd - _sub_done;
+        std::unique_lock<bthread::Mutex> mu(_merge_mutex);
+        if (_merge_failed_all) {
+            return false;
+        }
+        ResponseMerger::Result res = ResponseMerger::MERGED;
+        if (sd->merger == NULL) {
+            try {
+                _cntl->_response->MergeFrom(*sd->cntl._response);
+            } catch (const std::exception& e) {
+                _merge_error = e.what();
+                res = ResponseMerger::FAIL_ALL;
+            }
+        } else {
+            res = sd->merger->Merge(_cntl->_response, sd->cntl._response);
+            if (res == ResponseMerger::FAIL_ALL) {
+                char buf[64];
+                snprintf(buf, sizeof(buf),
+                         "Fail to merge response of channel[%d]", index);
+                _merge_error = buf;
+            }
+        }
+        switch (res) {
+        case ResponseMerger::MERGED:
+            return true;
+        case ResponseMerger::FAIL:
+            return false;
+        case ResponseMerger::FAIL_ALL:
+            _merge_failed_all = true;
+            mu.unlock();
+            // The RPC fails anyway, don't wait for others.
+            CancelOtherSubCalls(sd);
+            return false;
+        }
+        return false;
+    }
+
     void OnComplete() {
         // [ Rendezvous point ]
         // One and only one thread arrives here.
         // all call_id of sub calls are destroyed and call_id of _cntl is
         // still locked (because FLAGS_DESTROY_CID_IN_DONE is true);
 
-        // Merge responses of successful calls if fail_limit is not reached.
-        // nfailed may be increased during the merging.
-        // NOTE: Don't forget to set "nfailed = _ndone" when the _cntl is set
-        // to be failed since the RPC is still considered to be successful if
-        // nfailed is less than fail_limit
+        // Merge responses of successful calls if fail_limit is not reached
+        // or success_limit is reached.
+        // nfailed may be increased and nsuccess may be decreased during the
+        // merging.
+        // NOTE: Don't forget to set "nfailed = _ndone" and "nsuccess = 0"
+        // when the _cntl is set to be failed since the RPC is still
+        // considered to be successful if nfailed is less than fail_limit
+        // or nsuccess is not less than success_limit.
         int nfailed = _current_fail.load(butil::memory_order_relaxed);
-        if (nfailed < _fail_limit) {
+        int nsuccess = _current_success.load(butil::memory_order_relaxed);
+        if (_merge_incrementally) {
+            // Responses were merged in OnSubDoneRun().
+            if (_merge_failed_all) {
+                nfailed = _ndone;
+                nsuccess = 0;
+                _cntl->SetFailed(ERESPONSE, "%s", _merge_error.c_str());
+            }
+        } else if (nfailed < _fail_limit || nsuccess >= _success_limit) {
             for (int i = 0; i < _ndone; ++i) {
                 SubDone* sd = sub_done(i);
                 google::protobuf::Message* sub_res = sd->cntl._response;
@@ -319,6 +396,7 @@ public:
                             _cntl->_response->MergeFrom(*sub_res);
                         } catch (const std::exception& e) {
                             nfailed = _ndone;
+                            nsuccess = 0;
                             _cntl->SetFailed(ERESPONSE, "%s", e.what());
                             break;
                         }
@@ -330,9 +408,11 @@ public:
                             break;
                         case ResponseMerger::FAIL:
                             ++nfailed;
+                            --nsuccess;
                             break;
                         case ResponseMerger::FAIL_ALL:
                             nfailed = _ndone;
+                            nsuccess = 0;
                             _cntl->SetFailed(
                                 ERESPONSE,
                                 "Fail to merge response of channel[%d]", i);
@@ -343,8 +423,8 @@ public:
             }
         }
 
-        // Note: 1 <= _fail_limit <= _ndone.
-        if (nfailed >= _fail_limit) {
+        // Note: 1 <= _fail_limit <= _ndone, 1 <= _success_limit <= _ndone + 1.
+        if (nfailed >= _fail_limit && nsuccess < _success_limit) {
             // If controller was already failed, don't change it.
             if (!_cntl->FailedInline()) {
                 char buf[16];
@@ -423,6 +503,9 @@ public:
 
 private:
     int _fail_limit;
+    // _ndone + 1 when success_limit is not set, which is never reached.
+    int _success_limit;
+    bool _merge_incrementally;
     int _ndone;
     int _nchan;
 #if defined(__clang__)
@@ -431,7 +514,12 @@ private:
     int _memsize;
 #endif
     butil::atomic<int> _current_fail;
+    butil::atomic<int> _current_success;
     butil::atomic<uint32_t> _current_done;
+    // Serialize merges when _merge_incrementally is true.
+    bthread::Mutex _merge_mutex;
+    bool _merge_failed_all;
+    std::string _merge_error;
     Controller* _cntl;
     google::protobuf::Closure* _user_done;
     bthread_t _callmethod_bthread;
@@ -582,6 +670,7 @@ void ParallelChannel::CallMethod(
     ParallelChannelDone* d = NULL;
     int ndone = nchan;
     int fail_limit = 1;
+    int success_limit = 1;
     DEFINE_SMALL_ARRAY(SubCall, aps, nchan, 64);
 
     if (cntl->FailedInline()) {
@@ -624,9 +713,24 @@ void ParallelChannel::CallMethod(
         goto FAIL;
     }
 
+    if (_options.success_limit < 0) {
+        success_limit = ndone + 1;
+    } else {
+        success_limit = _options.success_limit;
+        if (success_limit < 1) {
+            success_limit = 1;
+        } else if (success_limit > ndone) {
+            success_limit = ndone;
+        }
+    }
     if (_options.fail_limit < 0) {
         // Both Controller and ParallelChannel haven't set `fail_limit'
-        fail_limit = ndone;
+        if (success_limit <= ndone) {
+            // Stop soon when success_limit can't be reached.
+            fail_limit = ndone - success_limit + 1;
+        } else {
+            fail_limit = ndone;
+        }
     } else {
         fail_limit = _options.fail_limit;
         if (fail_limit < 1) {
@@ -636,8 +740,9 @@ void ParallelChannel::CallMethod(
         }
     }
     
-    d = ParallelChannelDone::Create(fail_limit, ndone, aps, nchan,
-                                    cntl, done);
+    d = ParallelChannelDone::Create(fail_limit, success_limit,
+                                    _options.merge_incrementally,
+                                    ndone, aps, nchan, cntl, done);
     if (NULL == d) {
         cntl->SetFailed(ENOMEM, "Fail to new ParallelChannelDone");
         goto FAIL;
@@ -744,6 +849,9 @@ int ParallelChannel::CheckHealth() {
         threshold -= _options.fail_limit;
         ++threshold;
     }
+    if (_options.success_limit > 0 && _options.success_limit < threshold) {
+        threshold = _options.success_limit;
+    }
     if (threshold <= 0) {
         return 0;
     }
@@ -123,11 +123,14 @@ public:
         // failures which reaches fail_limit, thus the call is failed.
         FAIL,
 
-        // make the call to ParallelChannel fail.
+        // make the call to ParallelChannel fail. Pending sub calls are
+        // canceled if ParallelChannelOptions.merge_incrementally is true.
         FAIL_ALL
     };
 
     ResponseMerger() { }
+    // Called one by one for different sub responses, thus implementations
+    // don't need to be thread-safe.
     virtual Result Merge(google::protobuf::Message* response,
                          const google::protobuf::Message* sub_response) = 0;
 protected:
@@ -154,6 +157,24 @@ struct ParallelChannelOptions {
     // does not fail unless all sub RPC failed.
     int fail_limit;
 
+    // The RPC is considered to be successful as soon as number of
+    // successful sub RPC reaches this limit, and pending sub RPC are
+    // canceled rather than waited, which cuts the latency of fanning out
+    // to many sub channels when results from a quorum of them suffice.
+    // If fail_limit is not set, it's set to make the RPC end soon when
+    // the limit can't be reached anymore, namely
+    // number-of-sub-channels - success_limit + 1.
+    // Default: -1, meaning that the RPC waits for all sub RPC.
+    int success_limit;
+
+    // If true, response of a sub RPC is merged as soon as the sub RPC
+    // succeeds, rather than merging all responses after all sub RPC end,
+    // so that merging overlaps with pending sub RPC. Merges are still
+    // called one by one, however in the order of completions of sub RPC
+    // rather than order of sub channels.
+    // Default: false
+    bool merge_incrementally;
+
     // Construct with default options.
     ParallelChannelOptions();
 };
@@ -220,7 +241,7 @@ public:
     size_t channel_count() const { return _chans.size(); }
     
     // Reset to the state that this channel was just constructed.
-    // NOTE: fail_limit is kept.
+    // NOTE: fail_limit and success_limit are kept.
     void Reset();
 
     // Minimum weight of sub channels.
@@ -453,6 +453,7 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
                 break;
             }
         }
+        UserCodePriorityScope priority_scope(mp->high_priority);
         google::protobuf::Service* svc = mp->service;
         const google::protobuf::MethodDescriptor* method = mp->method;
         accessor.set_method(method);
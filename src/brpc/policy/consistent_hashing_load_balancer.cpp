@@ -18,10 +18,14 @@
 
 #include <algorithm>                                           // std::set_union
 #include <array>
+#include <limits>                                              // numeric_limits
+#include <math.h>                                              // ceil
 #include <gflags/gflags.h>
 #include "butil/containers/flat_map.h"
 #include "butil/errno.h"
+#include "butil/string_splitter.h"
 #include "butil/strings/string_number_conversions.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"
 #include "brpc/socket.h"
 #include "brpc/policy/consistent_hashing_load_balancer.h"
 #include "brpc/policy/hasher.h"
@@ -143,35 +147,132 @@ inline const ReplicaPolicy* GetReplicaPolicy(ConsistentHashingLoadBalancerType t
 
 ConsistentHashingLoadBalancer::ConsistentHashingLoadBalancer(
     ConsistentHashingLoadBalancerType type)
-    : _num_replicas(FLAGS_chash_num_replicas), _type(type) {
+    : _num_replicas(FLAGS_chash_num_replicas)
+    , _maglev_table_size(0)
+    , _load_factor(0)
+    , _type(type)
+    , _total_inflight(0) {
     CHECK(GetReplicaPolicy(_type))
         << "Fail to find replica policy for consistency lb type: '" << _type << '\'';
 }
 
+static bool ServerIdLess(const ConsistentHashingLoadBalancer::ServerInfo& s,
+                         SocketId id) {
+    return s.server_sock.id < id;
+}
+
+static bool NodeServerLess(const ConsistentHashingLoadBalancer::Node& n1,
+                           const ConsistentHashingLoadBalancer::Node& n2) {
+    return n1.server_sock.id < n2.server_sock.id;
+}
+
+static bool NodeServerEqual(const ConsistentHashingLoadBalancer::Node& n1,
+                            const ConsistentHashingLoadBalancer::Node& n2) {
+    return n1.server_sock.id == n2.server_sock.id;
+}
+
+void ConsistentHashingLoadBalancer::UpdateServers(
+        HashRing &bg, const HashRing &fg, size_t maglev_table_size) {
+    std::vector<Node> distinct(bg.nodes);
+    std::sort(distinct.begin(), distinct.end(), NodeServerLess);
+    distinct.erase(std::unique(distinct.begin(), distinct.end(), NodeServerEqual),
+                   distinct.end());
+    bg.servers.clear();
+    bg.servers.reserve(distinct.size());
+    for (size_t i = 0; i < distinct.size(); ++i) {
+        ServerInfo info;
+        info.server_sock = distinct[i].server_sock;
+        info.server_addr = distinct[i].server_addr;
+        std::vector<ServerInfo>::const_iterator it = std::lower_bound(
+            fg.servers.begin(), fg.servers.end(), info.server_sock.id, ServerIdLess);
+        if (it != fg.servers.end() && it->server_sock.id == info.server_sock.id) {
+            info.inflight = it->inflight;
+        } else {
+            info.inflight = std::make_shared<butil::atomic<int64_t> >(0);
+        }
+        bg.servers.push_back(info);
+    }
+    for (size_t i = 0; i < bg.nodes.size(); ++i) {
+        bg.nodes[i].server_index = std::lower_bound(
+            bg.servers.begin(), bg.servers.end(),
+            bg.nodes[i].server_sock.id, ServerIdLess) - bg.servers.begin();
+    }
+    BuildMaglevTable(bg, maglev_table_size);
+}
+
+static bool EndPointOrder(const ConsistentHashingLoadBalancer::ServerInfo* s1,
+                          const ConsistentHashingLoadBalancer::ServerInfo* s2) {
+    if (s1->server_addr != s2->server_addr) {
+        return s1->server_addr < s2->server_addr;
+    }
+    return s1->server_sock.id < s2->server_sock.id;
+}
+
+// Populate the lookup table as described in "Maglev: A Fast and Reliable
+// Software Network Load Balancer". Every server fills slots following its
+// own permutation of the table, which is derived from the address of the
+// server, so that all clients build the same table and most slots are kept
+// when servers are added or removed.
+void ConsistentHashingLoadBalancer::BuildMaglevTable(
+        HashRing &ring, size_t table_size) {
+    ring.table.clear();
+    const size_t n = ring.servers.size();
+    if (table_size == 0 || n == 0) {
+        return;
+    }
+    std::vector<const ServerInfo*> ordered(n);
+    for (size_t i = 0; i < n; ++i) {
+        ordered[i] = &ring.servers[i];
+    }
+    std::sort(ordered.begin(), ordered.end(), EndPointOrder);
+    std::vector<size_t> offset(n);
+    std::vector<size_t> skip(n);
+    std::vector<size_t> next(n, 0);
+    for (size_t i = 0; i < n; ++i) {
+        const std::string addr = endpoint2str(ordered[i]->server_addr).c_str();
+        uint64_t h[2];
+        butil::MurmurHash3_x64_128(addr.data(), addr.size(), 0, h);
+        offset[i] = h[0] % table_size;
+        skip[i] = h[1] % (table_size - 1) + 1;
+    }
+    const uint32_t EMPTY = (uint32_t)-1;
+    ring.table.assign(table_size, EMPTY);
+    size_t filled = 0;
+    while (true) {
+        for (size_t i = 0; i < n; ++i) {
+            size_t slot = (offset[i] + next[i] * skip[i]) % table_size;
+            while (ring.table[slot] != EMPTY) {
+                ++next[i];
+                slot = (offset[i] + next[i] * skip[i]) % table_size;
+            }
+            ring.table[slot] = ordered[i] - &ring.servers[0];
+            ++next[i];
+            if (++filled == table_size) {
+                return;
+            }
+        }
+    }
+}
+
 size_t ConsistentHashingLoadBalancer::AddBatch(
-        std::vector<Node> &bg, const std::vector<Node> &fg, 
-        const std::vector<Node> &servers, bool *executed) {
-    if (*executed) {
-        // Hack DBD
-        return fg.size() - bg.size();
-    }
-    *executed = true;
-    bg.resize(fg.size() + servers.size());
-    bg.resize(std::set_union(fg.begin(), fg.end(), 
-                             servers.begin(), servers.end(), bg.begin())
-              - bg.begin());
-    return bg.size() - fg.size();
+        HashRing &bg, const HashRing &fg, 
+        const std::vector<Node> &servers, size_t maglev_table_size) {
+    bg.nodes.resize(fg.nodes.size() + servers.size());
+    bg.nodes.resize(std::set_union(fg.nodes.begin(), fg.nodes.end(), 
+                                   servers.begin(), servers.end(),
+                                   bg.nodes.begin())
+                    - bg.nodes.begin());
+    const size_t n = bg.nodes.size() - fg.nodes.size();
+    if (n != 0) {
+        UpdateServers(bg, fg, maglev_table_size);
+    }
+    return n;
 }
 
 size_t ConsistentHashingLoadBalancer::RemoveBatch(
-        std::vector<Node> &bg, const std::vector<Node> &fg,
-        const std::vector<ServerId> &servers, bool *executed) {
-    if (*executed) {
-        return bg.size() - fg.size();
-    }
-    *executed = true;
+        HashRing &bg, const HashRing &fg,
+        const std::vector<ServerId> &servers, size_t maglev_table_size) {
     if (servers.empty()) {
-        bg = fg;
         return 0;
     }
     butil::FlatSet<ServerId> id_set;
@@ -187,33 +288,37 @@ size_t ConsistentHashingLoadBalancer::RemoveBatch(
         use_set = false;
     }
     CHECK(use_set) << "Fail to construct id_set, " << berror();
-    bg.clear();
-    for (size_t i = 0; i < fg.size(); ++i) {
+    bg.nodes.clear();
+    for (size_t i = 0; i < fg.nodes.size(); ++i) {
         const bool removed = 
-            use_set ? (id_set.seek(fg[i].server_sock) != NULL)
+            use_set ? (id_set.seek(fg.nodes[i].server_sock) != NULL)
                     : (std::find(servers.begin(), servers.end(), 
-                                fg[i].server_sock) != servers.end());
+                                fg.nodes[i].server_sock) != servers.end());
         if (!removed) {
-            bg.push_back(fg[i]);
+            bg.nodes.push_back(fg.nodes[i]);
         }
     }
-    return fg.size() - bg.size();
+    const size_t n = fg.nodes.size() - bg.nodes.size();
+    if (n != 0) {
+        UpdateServers(bg, fg, maglev_table_size);
+    }
+    return n;
 }
 
 size_t ConsistentHashingLoadBalancer::Remove(
-        std::vector<Node> &bg, const std::vector<Node> &fg,
-        const ServerId& server, bool *executed) {
-    if (*executed) {
-        return bg.size() - fg.size();
-    }
-    *executed = true;
-    bg.clear();
-    for (size_t i = 0; i < fg.size(); ++i) {
-        if (fg[i].server_sock != server) {
-            bg.push_back(fg[i]);
+        HashRing &bg, const HashRing &fg,
+        const ServerId& server, size_t maglev_table_size) {
+    bg.nodes.clear();
+    for (size_t i = 0; i < fg.nodes.size(); ++i) {
+        if (fg.nodes[i].server_sock != server) {
+            bg.nodes.push_back(fg.nodes[i]);
         }
     }
-    return fg.size() - bg.size();
+    const size_t n = fg.nodes.size() - bg.nodes.size();
+    if (n != 0) {
+        UpdateServers(bg, fg, maglev_table_size);
+    }
+    return n;
 }
 
 bool ConsistentHashingLoadBalancer::AddServer(const ServerId& server) {
@@ -223,9 +328,8 @@ bool ConsistentHashingLoadBalancer::AddServer(const ServerId& server) {
         return false;
     }
     std::sort(add_nodes.begin(), add_nodes.end());
-    bool executed = false;
     const size_t ret = _db_hash_ring.ModifyWithForeground(
-                        AddBatch, add_nodes, &executed);
+        AddBatch, add_nodes, _maglev_table_size);
     CHECK(ret == 0 || ret == _num_replicas) << ret;
     return ret != 0;
 }
@@ -243,8 +347,8 @@ size_t ConsistentHashingLoadBalancer::AddServersInBatch(
         }
     }
     std::sort(add_nodes.begin(), add_nodes.end());
-    bool executed = false;
-    const size_t ret = _db_hash_ring.ModifyWithForeground(AddBatch, add_nodes, &executed);
+    const size_t ret = _db_hash_ring.ModifyWithForeground(
+        AddBatch, add_nodes, _maglev_table_size);
     CHECK(ret % _num_replicas == 0);
     const size_t n = ret / _num_replicas;
     LOG_IF(ERROR, n != servers.size())
@@ -254,16 +358,16 @@ size_t ConsistentHashingLoadBalancer::AddServersInBatch(
 }
 
 bool ConsistentHashingLoadBalancer::RemoveServer(const ServerId& server) {
-    bool executed = false;
-    const size_t ret = _db_hash_ring.ModifyWithForeground(Remove, server, &executed);
+    const size_t ret = _db_hash_ring.ModifyWithForeground(
+        Remove, server, _maglev_table_size);
     CHECK(ret == 0 || ret == _num_replicas);
     return ret != 0;
 }
 
 size_t ConsistentHashingLoadBalancer::RemoveServersInBatch(
     const std::vector<ServerId> &servers) {
-    bool executed = false;
-    const size_t ret = _db_hash_ring.ModifyWithForeground(RemoveBatch, servers, &executed);
+    const size_t ret = _db_hash_ring.ModifyWithForeground(
+        RemoveBatch, servers, _maglev_table_size);
     CHECK(ret % _num_replicas == 0);
     const size_t n = ret / _num_replicas;
     LOG_IF(ERROR, n != servers.size())
@@ -296,33 +400,86 @@ int ConsistentHashingLoadBalancer::SelectServer(
         LOG(ERROR) << "request_code must be 32-bit currently";
         return EINVAL;
     }
-    butil::DoublyBufferedData<std::vector<Node> >::ScopedPtr s;
+    butil::EpochBufferedData<HashRing>::ScopedPtr s;
     if (_db_hash_ring.Read(&s) != 0) {
         return ENOMEM;
     }
-    if (s->empty()) {
+    if (s->nodes.empty()) {
         return ENODATA;
     }
-    std::vector<Node>::const_iterator choice =
-        std::lower_bound(s->begin(), s->end(), (uint32_t)in.request_code);
-    if (choice == s->end()) {
-        choice = s->begin();
+    // Candidates are visited from the position of the request code in the
+    // table or on the ring, wrapping around.
+    const bool use_table = !s->table.empty();
+    const size_t n = use_table ? s->table.size() : s->nodes.size();
+    size_t pos = 0;
+    if (use_table) {
+        pos = in.request_code % n;
+    } else {
+        pos = std::lower_bound(s->nodes.begin(), s->nodes.end(),
+                               (uint32_t)in.request_code) - s->nodes.begin();
+        if (pos == n) {
+            pos = 0;
+        }
+    }
+    int64_t capacity = std::numeric_limits<int64_t>::max();
+    if (_load_factor > 0) {
+        const int64_t total = _total_inflight.load(butil::memory_order_relaxed);
+        capacity = (int64_t)ceil(
+            _load_factor * (std::max(total, (int64_t)0) + 1) / s->servers.size());
     }
-    for (size_t i = 0; i < s->size(); ++i) {
-        if (((i + 1) == s->size() // always take last chance
-             || !ExcludedServers::IsExcluded(in.excluded, choice->server_sock.id))
-            && Socket::Address(choice->server_sock.id, out->ptr) == 0 
+    const ServerInfo* overloaded = NULL;
+    for (size_t i = 0; i < n; ++i) {
+        const ServerInfo& server = s->servers[
+            use_table ? s->table[pos] : s->nodes[pos].server_index];
+        if (++pos == n) {
+            pos = 0;
+        }
+        if (((i + 1) == n // always take last chance
+             || !ExcludedServers::IsExcluded(in.excluded, server.server_sock.id))
+            && Socket::Address(server.server_sock.id, out->ptr) == 0
             && (*out->ptr)->IsAvailable()) {
-            return 0;
-        } else {
-            if (++choice == s->end()) {
-                choice = s->begin();
+            if (server.inflight->load(butil::memory_order_relaxed) < capacity) {
+                if (_load_factor > 0) {
+                    server.inflight->fetch_add(1, butil::memory_order_relaxed);
+                    _total_inflight.fetch_add(1, butil::memory_order_relaxed);
+                    out->need_feedback = true;
+                }
+                return 0;
+            }
+            if (overloaded == NULL) {
+                overloaded = &server;
             }
         }
     }
+    // All available servers are overloaded, which is possible when some
+    // servers are excluded or down. Choose the first one as if loads
+    // were not bounded.
+    if (overloaded != NULL
+        && Socket::Address(overloaded->server_sock.id, out->ptr) == 0) {
+        overloaded->inflight->fetch_add(1, butil::memory_order_relaxed);
+        _total_inflight.fetch_add(1, butil::memory_order_relaxed);
+        out->need_feedback = true;
+        return 0;
+    }
     return EHOSTDOWN;
 }
 
+void ConsistentHashingLoadBalancer::Feedback(const CallInfo& info) {
+    if (_load_factor <= 0) {
+        return;
+    }
+    _total_inflight.fetch_sub(1, butil::memory_order_relaxed);
+    butil::EpochBufferedData<HashRing>::ScopedPtr s;
+    if (_db_hash_ring.Read(&s) != 0) {
+        return;
+    }
+    std::vector<ServerInfo>::const_iterator it = std::lower_bound(
+        s->servers.begin(), s->servers.end(), info.server_id, ServerIdLess);
+    if (it != s->servers.end() && it->server_sock.id == info.server_id) {
+        it->inflight->fetch_sub(1, butil::memory_order_relaxed);
+    }
+}
+
 void ConsistentHashingLoadBalancer::Describe(
     std::ostream &os, const DescribeOptions& options) {
     if (!options.verbose) {
@@ -332,6 +489,14 @@ void ConsistentHashingLoadBalancer::Describe(
     os << "ConsistentHashingLoadBalancer {\n"
        << "  hash function: " << GetReplicaPolicy(_type)->name() << '\n'
        << "  replica per host: " << _num_replicas << '\n';
+    if (_maglev_table_size) {
+        os << "  maglev table size: " << _maglev_table_size << '\n';
+    }
+    if (_load_factor > 0) {
+        os << "  load factor: " << _load_factor << '\n'
+           << "  inflight: " << _total_inflight.load(butil::memory_order_relaxed)
+           << '\n';
+    }
     std::map<butil::EndPoint, double> load_map;
     GetLoads(&load_map);
     os << "  number of hosts: " << load_map.size() << '\n';
@@ -358,18 +523,28 @@ void ConsistentHashingLoadBalancer::GetLoads(
     load_map->clear();
     std::map<butil::EndPoint, uint32_t> count_map;
     do {
-        butil::DoublyBufferedData<std::vector<Node> >::ScopedPtr s;
+        butil::EpochBufferedData<HashRing>::ScopedPtr s;
         if (_db_hash_ring.Read(&s) != 0) {
             break;
         }
-        if (s->empty()) {
+        if (!s->table.empty()) {
+            for (size_t i = 0; i < s->table.size(); ++i) {
+                ++count_map[s->servers[s->table[i]].server_addr];
+            }
+            for (std::map<butil::EndPoint, uint32_t>::iterator 
+                    it = count_map.begin(); it!= count_map.end(); ++it) {
+                (*load_map)[it->first] = (double)it->second / s->table.size();
+            }
+            return;
+        }
+        const std::vector<Node>& nodes = s->nodes;
+        if (nodes.empty()) {
             break;
         }
-        count_map[s->begin()->server_addr] += 
-                s->begin()->hash + (UINT_MAX - (s->end() - 1)->hash);
-        for (size_t i = 1; i < s->size(); ++i) {
-            count_map[(*s.get())[i].server_addr] +=
-                    (*s.get())[i].hash - (*s.get())[i - 1].hash;
+        count_map[nodes.front().server_addr] += 
+                nodes.front().hash + (UINT_MAX - nodes.back().hash);
+        for (size_t i = 1; i < nodes.size(); ++i) {
+            count_map[nodes[i].server_addr] += nodes[i].hash - nodes[i - 1].hash;
         }
     } while (0);
     for (std::map<butil::EndPoint, uint32_t>::iterator 
@@ -378,6 +553,18 @@ void ConsistentHashingLoadBalancer::GetLoads(
     }
 }
 
+static bool IsPrime(size_t n) {
+    if (n < 2) {
+        return false;
+    }
+    for (size_t i = 2; i * i <= n; ++i) {
+        if (n % i == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool ConsistentHashingLoadBalancer::SetParameters(const butil::StringPiece& params) {
     for (butil::KeyValuePairsSplitter sp(params.begin(), params.end(), ' ', '=');
             sp; ++sp) {
@@ -391,6 +578,25 @@ bool ConsistentHashingLoadBalancer::SetParameters(const butil::StringPiece& para
             }
             continue;
         }
+        if (sp.key() == "maglev_table_size") {
+            if (!butil::StringToSizeT(sp.value(), &_maglev_table_size)
+                || !IsPrime(_maglev_table_size)
+                || _maglev_table_size > std::numeric_limits<uint32_t>::max()) {
+                LOG(ERROR) << "maglev_table_size=" << sp.value()
+                           << " is not a prime";
+                return false;
+            }
+            continue;
+        }
+        if (sp.key() == "load_factor") {
+            if (!butil::StringToDouble(sp.value().as_string(), &_load_factor)
+                || _load_factor <= 1) {
+                LOG(ERROR) << "load_factor=" << sp.value()
+                           << " should be greater than 1";
+                return false;
+            }
+            continue;
+        }
         LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
     }
     return true;
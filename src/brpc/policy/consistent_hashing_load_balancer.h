@@ -21,9 +21,10 @@
 
 #include <stdint.h>                                     // uint32_t
 #include <functional>
+#include <memory>                                       // std::shared_ptr
 #include <vector>                                       // std::vector
 #include "butil/endpoint.h"                              // butil::EndPoint
-#include "butil/containers/doubly_buffered_data.h"
+#include "butil/containers/epoch_buffered_data.h"
 #include "brpc/load_balancer.h"
 
 
@@ -41,10 +42,24 @@ enum ConsistentHashingLoadBalancerType {
     CONS_HASH_LB_LAST = 3
 };
 
+// Parameters (e.g. "c_murmurhash:replicas=160 load_factor=1.25"):
+//   replicas=N            number of virtual nodes per server on the ring.
+//   maglev_table_size=M   select servers by looking up a Maglev table of M
+//                         (a prime) slots in O(1) instead of binary searching
+//                         the ring. M should be much larger than the number
+//                         of servers, e.g. 65537.
+//   load_factor=C         consistent hashing with bounded loads: a server
+//                         whose in-flight requests reach C times the average
+//                         is skipped and the request goes to the next server
+//                         on the ring (or the next slot of the table). C
+//                         must be greater than 1.
 class ConsistentHashingLoadBalancer : public LoadBalancer {
 public:
     struct Node {
         uint32_t hash;
+        // Index of the server in HashRing.servers, filled after every
+        // modification of the ring.
+        uint32_t server_index;
         ServerId server_sock;
         butil::EndPoint server_addr;  // To make sorting stable among all clients
         bool operator<(const Node &rhs) const {
@@ -56,6 +71,22 @@ public:
             return hash < code;
         }
     };
+    struct ServerInfo {
+        ServerId server_sock;
+        butil::EndPoint server_addr;
+        // Shared by all versions of the ring containing the server.
+        std::shared_ptr<butil::atomic<int64_t> > inflight;
+    };
+    struct HashRing {
+        // Virtual nodes sorted by hash.
+        std::vector<Node> nodes;
+        // Distinct servers in `nodes', sorted by SocketId.
+        std::vector<ServerInfo> servers;
+        // Maglev lookup table mapping slots to indexes of `servers', empty
+        // unless maglev_table_size is set.
+        std::vector<uint32_t> table;
+    };
+
     explicit ConsistentHashingLoadBalancer(ConsistentHashingLoadBalancerType type);
     bool AddServer(const ServerId& server);
     bool RemoveServer(const ServerId& server);
@@ -64,20 +95,31 @@ public:
     LoadBalancer *New(const butil::StringPiece& params) const;
     void Destroy();
     int SelectServer(const SelectIn &in, SelectOut *out);
+    void Feedback(const CallInfo& info);
     void Describe(std::ostream &os, const DescribeOptions& options);
 
 private:
     bool SetParameters(const butil::StringPiece& params);
     void GetLoads(std::map<butil::EndPoint, double> *load_map);
-    static size_t AddBatch(std::vector<Node> &bg, const std::vector<Node> &fg,
-                           const std::vector<Node> &servers, bool *executed);
-    static size_t RemoveBatch(std::vector<Node> &bg, const std::vector<Node> &fg,
-                              const std::vector<ServerId> &servers, bool *executed);
-    static size_t Remove(std::vector<Node> &bg, const std::vector<Node> &fg,
-                         const ServerId& server, bool *executed);
+    static size_t AddBatch(HashRing &bg, const HashRing &fg,
+                           const std::vector<Node> &servers,
+                           size_t maglev_table_size);
+    static size_t RemoveBatch(HashRing &bg, const HashRing &fg,
+                              const std::vector<ServerId> &servers,
+                              size_t maglev_table_size);
+    static size_t Remove(HashRing &bg, const HashRing &fg,
+                         const ServerId& server, size_t maglev_table_size);
+    // Rebuild bg.servers and bg.table after bg.nodes was changed. Counters of
+    // in-flight requests of servers existing in `fg' are inherited.
+    static void UpdateServers(HashRing &bg, const HashRing &fg,
+                              size_t maglev_table_size);
+    static void BuildMaglevTable(HashRing &ring, size_t table_size);
     size_t _num_replicas;
+    size_t _maglev_table_size;
+    double _load_factor;
     ConsistentHashingLoadBalancerType _type;
-    butil::DoublyBufferedData<std::vector<Node> > _db_hash_ring;
+    butil::atomic<int64_t> _total_inflight;
+    butil::EpochBufferedData<HashRing> _db_hash_ring;
 };
 
 }  // namespace policy
@@ -523,7 +523,8 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
             opt.enum_option = (FLAGS_pb_enum_as_number
                                ? json2pb::OUTPUT_ENUM_BY_NUMBER
                                : json2pb::OUTPUT_ENUM_BY_NAME);
-            if (!json2pb::ProtoMessageToJson(*pbreq, &wrapper, opt, &err)) {
+            if (!json2pb::ProtoMessageToJson(*pbreq, &cntl->request_attachment(),
+                                             opt, &err)) {
                 cntl->request_attachment().clear();
                 return cntl->SetFailed(
                     EREQUEST, "Fail to convert request to json, %s", err.c_str());
@@ -766,7 +767,8 @@ HttpResponseSender::~HttpResponseSender() {
             opt.enum_option = (FLAGS_pb_enum_as_number
                                ? json2pb::OUTPUT_ENUM_BY_NUMBER
                                : json2pb::OUTPUT_ENUM_BY_NAME);
-            if (!json2pb::ProtoMessageToJson(*res, &wrapper, opt, &err)) {
+            if (!json2pb::ProtoMessageToJson(*res, &cntl->response_attachment(),
+                                             opt, &err)) {
                 cntl->SetFailed(ERESPONSE, "Fail to convert response to json, %s", err.c_str());
             }
         }
@@ -1367,6 +1369,7 @@ void ProcessHttpRequest(InputMessageBase *msg) {
             return;
         }
     }
+    UserCodePriorityScope priority_scope(sp->high_priority);
     
     if (span) {
         span->ResetServerSpanName(sp->method->full_name());
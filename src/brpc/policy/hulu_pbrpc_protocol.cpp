@@ -465,6 +465,7 @@ void ProcessHuluRequest(InputMessageBase* msg_base) {
                 break;
             }
         }
+        UserCodePriorityScope priority_scope(sp->high_priority);
         
         google::protobuf::Service* svc = sp->service;
         const google::protobuf::MethodDescriptor* method = sp->method;
@@ -16,10 +16,14 @@
 // under the License.
 
 
+#include <algorithm>                                         // std::max
 #include <limits>                                            // numeric_limits
 #include <gflags/gflags.h>
 #include "butil/time.h"                                       // gettimeofday_us
 #include "butil/fast_rand.h"
+#include "butil/string_splitter.h"                            // KeyValuePairsSplitter
+#include "butil/strings/string_number_conversions.h"          // StringToSizeT
+#include "butil/third_party/murmurhash3/murmurhash3.h"        // fmix64
 #include "brpc/log.h"
 #include "brpc/socket.h"
 #include "brpc/reloadable_flags.h"
@@ -41,14 +45,37 @@ static const size_t INITIAL_WEIGHT_TREE_SIZE = 128;
 static const int64_t WEIGHT_SCALE =
     std::numeric_limits<int64_t>::max() / 72000000 / (INITIAL_WEIGHT_TREE_SIZE - 1);
 
+const size_t LocalityAwareLoadBalancer::MAX_SHARDS;
+
+// Interval of sampling totals of shards for choosing shards.
+static const int64_t SHARD_TOTALS_INTERVAL_US = 1000;
+
 LocalityAwareLoadBalancer::LocalityAwareLoadBalancer()
-    : _total(0) {
+    : _total(0)
+    , _next_sample_us(0) {
+    for (size_t i = 0; i < MAX_SHARDS; ++i) {
+        _shard_totals[i].store(0, butil::memory_order_relaxed);
+    }
 }
 
 LocalityAwareLoadBalancer::~LocalityAwareLoadBalancer() {
+    // _shards[0] is this instance.
+    for (size_t i = 1; i < _shards.size(); ++i) {
+        delete _shards[i];
+    }
+    _shards.clear();
     _db_servers.ModifyWithForeground(RemoveAll);
 }
 
+inline size_t LocalityAwareLoadBalancer::shard_index(SocketId id) const {
+    return butil::fmix64(id) % _shards.size();
+}
+
+inline LocalityAwareLoadBalancer*
+LocalityAwareLoadBalancer::shard_of(SocketId id) {
+    return _shards.empty() ? this : _shards[shard_index(id)];
+}
+
 bool LocalityAwareLoadBalancer::Add(Servers& bg, const Servers& fg,
                                     SocketId id,
                                     LocalityAwareLoadBalancer* lb) {
@@ -224,6 +251,10 @@ size_t LocalityAwareLoadBalancer::BatchRemove(
 }
 
 bool LocalityAwareLoadBalancer::AddServer(const ServerId& id) {
+    LocalityAwareLoadBalancer* shard = shard_of(id.id);
+    if (shard != this) {
+        return shard->AddServer(id);
+    }
     if (_id_mapper.AddServer(id)) {
         RPC_VLOG << "LALB: added " << id;
         return _db_servers.ModifyWithForeground(Add, id.id, this);
@@ -233,6 +264,10 @@ bool LocalityAwareLoadBalancer::AddServer(const ServerId& id) {
 }
 
 bool LocalityAwareLoadBalancer::RemoveServer(const ServerId& id) {
+    LocalityAwareLoadBalancer* shard = shard_of(id.id);
+    if (shard != this) {
+        return shard->RemoveServer(id);
+    }
     if (_id_mapper.RemoveServer(id)) {
         RPC_VLOG << "LALB: removed " << id;
         return _db_servers.Modify(Remove, id.id, this);
@@ -241,19 +276,51 @@ bool LocalityAwareLoadBalancer::RemoveServer(const ServerId& id) {
     }
 }
 
+void LocalityAwareLoadBalancer::SplitByShard(
+    const std::vector<ServerId>& servers,
+    std::vector<std::vector<ServerId> >* parts) const {
+    parts->resize(_shards.size());
+    for (size_t i = 0; i < servers.size(); ++i) {
+        (*parts)[shard_index(servers[i].id)].push_back(servers[i]);
+    }
+}
+
 size_t LocalityAwareLoadBalancer::AddServersInBatch(
     const std::vector<ServerId>& servers) {
-    std::vector<SocketId> & ids = _id_mapper.AddServers(servers);
+    std::vector<std::vector<ServerId> > parts;
+    size_t count = 0;
+    if (!_shards.empty()) {
+        SplitByShard(servers, &parts);
+        // Servers of shard 0 are added into this instance below.
+        for (size_t i = 1; i < parts.size(); ++i) {
+            if (!parts[i].empty()) {
+                count += _shards[i]->AddServersInBatch(parts[i]);
+            }
+        }
+    }
+    const std::vector<ServerId>& own = (parts.empty() ? servers : parts[0]);
+    std::vector<SocketId> & ids = _id_mapper.AddServers(own);
     RPC_VLOG << "LALB: added " << ids.size();
     _db_servers.ModifyWithForeground(BatchAdd, ids, this);
-    return servers.size();
+    return count + own.size();
 }
 
 size_t LocalityAwareLoadBalancer::RemoveServersInBatch(
     const std::vector<ServerId>& servers) {
-    std::vector<SocketId> & ids = _id_mapper.RemoveServers(servers);
-    RPC_VLOG << "LALB: removed " << ids.size();
+    std::vector<std::vector<ServerId> > parts;
     size_t count = 0;
+    if (!_shards.empty()) {
+        SplitByShard(servers, &parts);
+        // Servers of shard 0 are removed from this instance below.
+        for (size_t i = 1; i < parts.size(); ++i) {
+            if (!parts[i].empty()) {
+                count += _shards[i]->RemoveServersInBatch(parts[i]);
+            }
+        }
+    }
+    std::vector<SocketId> & ids =
+        _id_mapper.RemoveServers(parts.empty() ? servers : parts[0]);
+    RPC_VLOG << "LALB: removed " << ids.size();
     for (size_t i = 0; i < ids.size(); ++i) {
         count += _db_servers.Modify(Remove, ids[i], this);
     }
@@ -262,7 +329,67 @@ size_t LocalityAwareLoadBalancer::RemoveServersInBatch(
     // return _db_servers.Modify(BatchRemove, servers, this);
 }
 
+int LocalityAwareLoadBalancer::SelectServerFromShards(
+    const SelectIn& in, SelectOut* out) {
+    const size_t nshard = _shards.size();
+    // _total of shards are modified by every feedback, reading them in each
+    // selection brings back the cache bouncing that sharding removes. They
+    // are sampled into _shard_totals by one selection in every interval
+    // instead, which is only used to spread selections proportionally to
+    // weights of the shards.
+    const int64_t now_us = butil::cpuwide_time_us();
+    int64_t next_sample_us = _next_sample_us.load(butil::memory_order_relaxed);
+    if (now_us >= next_sample_us &&
+        _next_sample_us.compare_exchange_strong(
+            next_sample_us, now_us + SHARD_TOTALS_INTERVAL_US,
+            butil::memory_order_relaxed)) {
+        for (size_t i = 0; i < nshard; ++i) {
+            _shard_totals[i].store(
+                _shards[i]->_total.load(butil::memory_order_relaxed),
+                butil::memory_order_relaxed);
+        }
+    }
+    int64_t totals[MAX_SHARDS];
+    int64_t sum = 0;
+    for (size_t i = 0; i < nshard; ++i) {
+        totals[i] = std::max(
+            _shard_totals[i].load(butil::memory_order_relaxed), (int64_t)0);
+        sum += totals[i];
+    }
+    size_t first = 0;
+    if (sum > 0) {
+        int64_t dice = butil::fast_rand_less_than(sum);
+        for (; first + 1 < nshard && dice >= totals[first]; ++first) {
+            dice -= totals[first];
+        }
+    } else {
+        first = butil::fast_rand_less_than(nshard);
+    }
+    // Try other shards if the chosen one is empty or all servers inside
+    // are unavailable.
+    int rc = ENODATA;
+    for (size_t i = 0; i < nshard; ++i) {
+        const int rc2 =
+            _shards[(first + i) % nshard]->SelectServerFromTree(in, out);
+        if (rc2 == 0) {
+            return 0;
+        }
+        if (rc2 != ENODATA) {
+            rc = rc2;
+        }
+    }
+    return rc;
+}
+
 int LocalityAwareLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    if (!_shards.empty()) {
+        return SelectServerFromShards(in, out);
+    }
+    return SelectServerFromTree(in, out);
+}
+
+int LocalityAwareLoadBalancer::SelectServerFromTree(
+    const SelectIn& in, SelectOut* out) {
     butil::DoublyBufferedData<Servers>::ScopedPtr s;
     if (_db_servers.Read(&s) != 0) {
         return ENOMEM;
@@ -350,6 +477,10 @@ int LocalityAwareLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out)
 }
 
 void LocalityAwareLoadBalancer::Feedback(const CallInfo& info) {        
+    LocalityAwareLoadBalancer* shard = shard_of(info.server_id);
+    if (shard != this) {
+        return shard->Feedback(info);
+    }
     butil::DoublyBufferedData<Servers>::ScopedPtr s;
     if (_db_servers.Read(&s) != 0) {
         return;
@@ -464,8 +595,50 @@ int64_t LocalityAwareLoadBalancer::Weight::Update(
 }
 
 LocalityAwareLoadBalancer* LocalityAwareLoadBalancer::New(
-    const butil::StringPiece&) const {
-    return new (std::nothrow) LocalityAwareLoadBalancer;
+    const butil::StringPiece& params) const {
+    LocalityAwareLoadBalancer* lb = new (std::nothrow) LocalityAwareLoadBalancer;
+    if (lb && !lb->SetParameters(params)) {
+        delete lb;
+        lb = NULL;
+    }
+    return lb;
+}
+
+bool LocalityAwareLoadBalancer::SetParameters(const butil::StringPiece& params) {
+    size_t nshard = 1;
+    for (butil::KeyValuePairsSplitter sp(params.begin(), params.end(), ' ', '=');
+            sp; ++sp) {
+        if (sp.value().empty()) {
+            LOG(ERROR) << "Empty value for " << sp.key() << " in lb parameter";
+            return false;
+        }
+        if (sp.key() == "shards") {
+            if (!butil::StringToSizeT(sp.value(), &nshard)
+                || nshard == 0 || nshard > MAX_SHARDS) {
+                LOG(ERROR) << "Invalid shards=" << sp.value()
+                           << ", should be in [1, " << MAX_SHARDS << ']';
+                return false;
+            }
+            continue;
+        }
+        LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
+        return false;
+    }
+    if (nshard > 1) {
+        // This instance is shard 0, so that no DoublyBufferedData (which
+        // takes a pthread key) is left unused.
+        _shards.reserve(nshard);
+        _shards.push_back(this);
+        for (size_t i = 1; i < nshard; ++i) {
+            LocalityAwareLoadBalancer* shard =
+                new (std::nothrow) LocalityAwareLoadBalancer;
+            if (shard == NULL) {
+                return false;
+            }
+            _shards.push_back(shard);
+        }
+    }
+    return true;
 }
 
 void LocalityAwareLoadBalancer::Destroy() {
@@ -511,6 +684,19 @@ void LocalityAwareLoadBalancer::Describe(
         os << "la";
         return;
     }
+    if (!_shards.empty()) {
+        os << "LocalityAware{shards=" << _shards.size() << " [";
+        for (size_t i = 0; i < _shards.size(); ++i) {
+            os << '\n';
+            _shards[i]->DescribeTree(os);
+        }
+        os << "]}";
+        return;
+    }
+    DescribeTree(os);
+}
+
+void LocalityAwareLoadBalancer::DescribeTree(std::ostream& os) {
     os << "LocalityAware{total="
        << _total.load(butil::memory_order_relaxed) << ' ';
     butil::DoublyBufferedData<Servers>::ScopedPtr s;
@@ -38,6 +38,16 @@ DECLARE_double(punish_inflight_ratio);
 // Locality-aware is an iterative algorithm to send requests to servers which
 // have lowest expected latencies. Read docs/cn/lalb.md to get a peek at the
 // algorithm. The implementation is complex.
+//
+// With parameter "shards=N" (e.g. "la:shards=8"), servers are partitioned
+// by SocketId into N independent weight trees. Feedback and selection of a
+// server only touch the tree (and the total weight) of its own shard, which
+// reduces cache-line bouncing on the shared weights when there are thousands
+// of servers and many cores calling. A shard is chosen proportionally to
+// its total weight sampled periodically before selecting inside it, so the
+// distribution of traffic approximates the one of a single tree. Every
+// shard has its own DoublyBufferedData taking a pthread key, thus N is
+// capped at MAX_SHARDS.
 class LocalityAwareLoadBalancer : public LoadBalancer {
 public:
     LocalityAwareLoadBalancer();
@@ -52,7 +62,20 @@ public:
     void Feedback(const CallInfo& info);
     void Describe(std::ostream& os, const DescribeOptions& options);
 
+    static const size_t MAX_SHARDS = 8;
+
 private:
+    bool SetParameters(const butil::StringPiece& params);
+    size_t shard_index(SocketId id) const;
+    // The shard containing `id', this instance if it's not sharded.
+    LocalityAwareLoadBalancer* shard_of(SocketId id);
+    void SplitByShard(const std::vector<ServerId>& servers,
+                      std::vector<std::vector<ServerId> >* parts) const;
+    int SelectServerFromShards(const SelectIn& in, SelectOut* out);
+    // Select from the weight tree of this instance.
+    int SelectServerFromTree(const SelectIn& in, SelectOut* out);
+    void DescribeTree(std::ostream& os);
+
     struct TimeInfo {
         int64_t latency_sum;         // microseconds
         int64_t end_time_us;
@@ -148,6 +171,12 @@ private:
     butil::DoublyBufferedData<Servers> _db_servers;
     std::deque<int64_t> _left_weights;
     ServerId2SocketIdMapper _id_mapper;
+    // Non-empty in sharded mode, in which _shards[0] is this instance and
+    // others are owned by this instance.
+    std::vector<LocalityAwareLoadBalancer*> _shards;
+    // Sampled _total of shards and when to sample them again.
+    butil::atomic<int64_t> _shard_totals[MAX_SHARDS];
+    butil::atomic<int64_t> _next_sample_us;
 };
 
 inline void LocalityAwareLoadBalancer::Servers::UpdateParentWeights(
@@ -417,6 +417,7 @@ void ProcessSofaRequest(InputMessageBase* msg_base) {
                 break;
             }
         }
+        UserCodePriorityScope priority_scope(sp->high_priority);
         google::protobuf::Service* svc = sp->service;
         const google::protobuf::MethodDescriptor* method = sp->method;
         accessor.set_method(method);
@@ -166,7 +166,8 @@ Server::MethodProperty::MethodProperty()
     , http_url(NULL)
     , service(NULL)
     , method(NULL)
-    , status(NULL) {
+    , status(NULL)
+    , high_priority(false) {
 }
 
 static timeval GetUptime(void* arg/*start_time*/) {
@@ -2085,6 +2086,22 @@ int Server::MaxConcurrencyOf(const butil::StringPiece& full_method_name) const {
     return MaxConcurrencyOf(_method_map.seek(full_method_name));
 }
 
+int Server::SetMethodHighPriority(const butil::StringPiece& full_method_name,
+                                  bool high_priority) {
+    if (IsRunning()) {
+        LOG(ERROR) << "Can't set priority of method="
+                   << full_method_name << " to a running server";
+        return -1;
+    }
+    MethodProperty* mp = _method_map.seek(full_method_name);
+    if (mp == NULL) {
+        LOG(ERROR) << "Fail to find method=" << full_method_name;
+        return -1;
+    }
+    mp->high_priority = high_priority;
+    return 0;
+}
+
 AdaptiveMaxConcurrency& Server::MaxConcurrencyOf(const butil::StringPiece& full_service_name,
                               const butil::StringPiece& method_name) {
     MethodProperty* mp = const_cast<MethodProperty*>(
@@ -356,6 +356,8 @@ public:
         const google::protobuf::MethodDescriptor* method;
         MethodStatus* status;
         AdaptiveMaxConcurrency max_concurrency;
+        // Set by Server::SetMethodHighPriority()
+        bool high_priority;
 
         MethodProperty();
     };
@@ -532,6 +534,17 @@ public:
     int MaxConcurrencyOf(google::protobuf::Service* service,
                          const butil::StringPiece& method_name) const;
 
+    // Run handlers of a method at high priority: the bthread running the
+    // handler is queued before normal bthreads (e.g. processing offline
+    // batches) whenever it's woken up, see BTHREAD_HIGH_PRIORITY in
+    // bthread/types.h. Asynchronous handlers are prioritized only before
+    // they return. Example:
+    //    server.SetMethodHighPriority("example.EchoService.Echo");
+    // Note: Can ONLY be called before the server is started.
+    // Returns 0 on success, -1 otherwise.
+    int SetMethodHighPriority(const butil::StringPiece& full_method_name,
+                              bool high_priority = true);
+
 private:
 friend class StatusService;
 friend class ProtobufsService;
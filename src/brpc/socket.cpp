@@ -38,11 +38,13 @@
 #include "brpc/reloadable_flags.h"          // BRPC_VALIDATE_GFLAG
 #include "brpc/errno.pb.h"
 #include "brpc/event_dispatcher.h"          // RemoveConsumer
+#include "brpc/details/zero_copy.h"         // ZeroCopyWriter
 #include "brpc/socket.h"
 #include "brpc/describable.h"               // Describable
 #include "brpc/circuit_breaker.h"           // CircuitBreaker
 #include "brpc/input_messenger.h"
 #include "brpc/details/sparse_minute_counter.h"
+#include "brpc/details/recent_latency.h"   // RecentLatency
 #include "brpc/stream_impl.h"
 #include "brpc/shared_object.h"
 #include "brpc/policy/rtmp_protocol.h"  // FIXME
@@ -83,6 +85,27 @@ DEFINE_int64(socket_max_unwritten_bytes, 64 * 1024 * 1024,
              "Max unwritten bytes in each socket, if the limit is reached,"
              " Socket.Write fails with EOVERCROWDED");
 
+DEFINE_int64(socket_zerocopy_min_bytes, 0,
+             "Write with MSG_ZEROCOPY when data queued in one write is at "
+             "least so many bytes, so that kernel sends pages of IOBuf "
+             "directly rather than copying them. Blocks are not reused until "
+             "kernel notifies completion. 0 disables zero-copy, which "
+             "generally pays off for writes larger than 10KB");
+BRPC_VALIDATE_GFLAG(socket_zerocopy_min_bytes, NonNegativeInteger);
+
+DEFINE_int32(socket_cork_us, 0,
+             "Delay a write smaller than -socket_cork_bytes for at most so "
+             "many microseconds when no one is writing the socket, so that "
+             "writes queued meanwhile are sent together in one writev. This "
+             "increases throughput of connections with lots of small "
+             "pipelined messages at the cost of latency. 0 disables corking");
+BRPC_VALIDATE_GFLAG(socket_cork_us, NonNegativeInteger);
+
+DEFINE_int32(socket_cork_bytes, 16 * 1024,
+             "Stop delaying writes once so many bytes are queued, "
+             "see -socket_cork_us");
+BRPC_VALIDATE_GFLAG(socket_cork_bytes, PositiveInteger);
+
 DEFINE_int32(max_connection_pool_size, 100,
              "Max number of pooled connections to a single endpoint");
 BRPC_VALIDATE_GFLAG(max_connection_pool_size, PassValidate);
@@ -187,6 +210,9 @@ public:
 
     butil::atomic<uint64_t> recent_error_count;
 
+    // Created on first latency fed by adaptive backup requests.
+    butil::atomic<RecentLatency*> recent_latency;
+
     explicit SharedPart(SocketId creator_socket_id);
     ~SharedPart();
 
@@ -203,13 +229,15 @@ Socket::SharedPart::SharedPart(SocketId creator_socket_id2)
     , out_size(0)
     , out_num_messages(0)
     , extended_stat(NULL)
-    , recent_error_count(0) {
+    , recent_error_count(0)
+    , recent_latency(NULL) {
 }
 
 Socket::SharedPart::~SharedPart() {
     delete extended_stat;
     extended_stat = NULL;
     delete socket_pool.exchange(NULL, butil::memory_order_relaxed);
+    delete recent_latency.exchange(NULL, butil::memory_order_relaxed);
 }
 
 void Socket::SharedPart::UpdateStatsEverySecond(int64_t now_ms) {
@@ -430,6 +458,7 @@ Socket::Socket(Forbidden)
     , _hc_count(0)
     , _last_msg_size(0)
     , _avg_msg_size(0)
+    , _once_read_size(0)
     , _last_readtime_us(0)
     , _parsing_context(NULL)
     , _correlation_id(0)
@@ -452,6 +481,8 @@ Socket::Socket(Forbidden)
     , _unwritten_bytes(0)
     , _epollout_butex(NULL)
     , _write_head(NULL)
+    , _corked_bytes(-1)
+    , _zerocopy_writer(NULL)
     , _stream_set(NULL)
     , _ninflight_app_health_check(0)
 {
@@ -461,6 +492,7 @@ Socket::Socket(Forbidden)
 }
 
 Socket::~Socket() {
+    delete _zerocopy_writer.exchange(NULL, butil::memory_order_relaxed);
     pthread_mutex_destroy(&_id_wait_list_mutex);
     bthread::butex_destroy(_epollout_butex);
 }
@@ -520,6 +552,7 @@ int Socket::ResetFileDescriptor(int fd) {
     // Reset message sizes when fd is changed.
     _last_msg_size = 0;
     _avg_msg_size = 0;
+    _once_read_size = 0;
     // MUST store `_fd' before adding itself into epoll device to avoid
     // race conditions with the callback function inside epoll
     _fd.store(fd, butil::memory_order_release);
@@ -647,6 +680,7 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
     m->_last_writetime_us.store(cpuwide_now, butil::memory_order_relaxed);
     m->_unwritten_bytes.store(0, butil::memory_order_relaxed);
     CHECK(NULL == m->_write_head.load(butil::memory_order_relaxed));
+    m->_corked_bytes.store(-1, butil::memory_order_relaxed);
     // Must be last one! Internal fields of this Socket may be access
     // just after calling ResetFileDescriptor.
     if (m->ResetFileDescriptor(options.fd) != 0) {
@@ -692,7 +726,14 @@ int Socket::WaitAndReset(int32_t expected_nref) {
         if (_on_edge_triggered_events != NULL) {
             GetGlobalEventDispatcher(prev_fd).RemoveConsumer(prev_fd);
         }
-        close(prev_fd);
+        ZeroCopyWriter* zw = _zerocopy_writer.load(butil::memory_order_relaxed);
+        if (zw) {
+            // Blocks of uncompleted MSG_ZEROCOPY writes are kept until the
+            // kernel is done with them.
+            zw->Close(prev_fd);
+        } else {
+            close(prev_fd);
+        }
         if (CreatedByConnect()) {
             g_vars->channel_conn << -1;
         }
@@ -883,6 +924,36 @@ void Socket::FeedbackCircuitBreaker(int error_code, int64_t latency_us) {
     }
 }
 
+void Socket::AddRecentLatency(int64_t latency_us) {
+    SharedPart* sp = GetOrNewSharedPart();
+    RecentLatency* rl = sp->recent_latency.load(butil::memory_order_consume);
+    if (rl == NULL) {
+        rl = new (std::nothrow) RecentLatency;
+        if (rl == NULL) {
+            return;
+        }
+        RecentLatency* expected = NULL;
+        if (!sp->recent_latency.compare_exchange_strong(
+                expected, rl, butil::memory_order_acq_rel)) {
+            delete rl;
+            rl = expected;
+        }
+    }
+    rl->Add(latency_us, butil::gettimeofday_us());
+}
+
+int64_t Socket::GetRecentLatencyPercentile(double ratio) const {
+    SharedPart* sp = GetSharedPart();
+    if (sp == NULL) {
+        return -1;
+    }
+    RecentLatency* rl = sp->recent_latency.load(butil::memory_order_consume);
+    if (rl == NULL) {
+        return -1;
+    }
+    return rl->GetPercentile(ratio, butil::gettimeofday_us());
+}
+
 int Socket::ReleaseReferenceIfIdle(int idle_seconds) {
     const int64_t last_active_us = last_active_time_us();
     if (butil::cpuwide_time_us() - last_active_us <= idle_seconds * 1000000L) {
@@ -972,7 +1043,14 @@ void Socket::OnRecycle() {
         if (_on_edge_triggered_events != NULL) {
             GetGlobalEventDispatcher(prev_fd).RemoveConsumer(prev_fd);
         }
-        close(prev_fd);
+        ZeroCopyWriter* zw = _zerocopy_writer.load(butil::memory_order_relaxed);
+        if (zw) {
+            // Blocks of uncompleted MSG_ZEROCOPY writes are kept until the
+            // kernel is done with them.
+            zw->Close(prev_fd);
+        } else {
+            close(prev_fd);
+        }
         if (create_by_connect) {
             g_vars->channel_conn << -1;
         }
@@ -1015,6 +1093,8 @@ void Socket::OnRecycle() {
 void* Socket::ProcessEvent(void* arg) {
     // the enclosed Socket is valid and free to access inside this function.
     SocketUniquePtr s(static_cast<Socket*>(arg));
+    // Completions of zero-copy writes are notified as EPOLLERR.
+    s->ReapZeroCopyCompletions();
     s->_on_edge_triggered_events(s.get());
     return NULL;
 }
@@ -1502,6 +1582,10 @@ int Socket::Write(SocketMessagePtr<>& msg, const WriteOptions* options_in) {
 }
 
 int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
+    // `req' may be written and recycled by KeepWrite once it's linked.
+    // Size of a user message is unknown until it's serialized in Setup(),
+    // which is not counted into corked bytes.
+    const int64_t nbytes = req->data.size();
     // Release fence makes sure the thread getting request sees *req
     WriteRequest* const prev_head =
         _write_head.exchange(req, butil::memory_order_release);
@@ -1512,6 +1596,9 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
         // depending on compiler) that the spin rarely occurs in practice
         // (I've not seen any spin in highly contended tests).
         req->next = prev_head;
+        if (_corked_bytes.load(butil::memory_order_relaxed) >= 0) {
+            AddCorkedBytes(nbytes, opt.flush_immediately);
+        }
         return 0;
     }
 
@@ -1545,7 +1632,16 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
         // in the background.
         goto KEEPWRITE_IN_BACKGROUND;
     }
-    
+
+    if (FLAGS_socket_cork_us > 0 && !opt.flush_immediately &&
+        req->data.size() < (size_t)FLAGS_socket_cork_bytes) {
+        // Don't write small data right now, KeepWrite waits a while for
+        // more requests and writes them together.
+        _corked_bytes.store(req->data.size(), butil::memory_order_relaxed);
+        g_vars->ncorkedwrite << 1;
+        goto KEEPWRITE_IN_BACKGROUND;
+    }
+
     // Write once in the calling thread. If the write is not complete,
     // continue it in KeepWrite thread.
     if (_conn) {
@@ -1602,6 +1698,12 @@ void* Socket::KeepWrite(void* void_arg) {
     // returning directly otherwise _write_head is permantly non-NULL which
     // makes later Write() abnormal.
     WriteRequest* cur_tail = NULL;
+    if (s->_corked_bytes.load(butil::memory_order_relaxed) >= 0) {
+        s->WaitForCorkedWrites();
+        // Link requests queued meanwhile so that the first DoWrite sends
+        // all of them.
+        s->IsWriteComplete(req, false, &cur_tail);
+    }
     do {
         // req was written, skip it.
         if (req->next != NULL && req->data.empty()) {
@@ -1669,6 +1771,39 @@ void* Socket::KeepWrite(void* void_arg) {
     return NULL;
 }
 
+void Socket::AddCorkedBytes(int64_t nbytes, bool flush) {
+    const int64_t max_corked_bytes = FLAGS_socket_cork_bytes;
+    int64_t cur = _corked_bytes.load(butil::memory_order_relaxed);
+    while (cur >= 0 && cur < max_corked_bytes) {
+        int64_t desired = cur + nbytes;
+        if (flush && desired < max_corked_bytes) {
+            desired = max_corked_bytes;
+        }
+        if (_corked_bytes.compare_exchange_weak(
+                cur, desired, butil::memory_order_relaxed)) {
+            if (desired >= max_corked_bytes) {
+                // Share the butex with WaitEpollOut, the KeepWrite thread
+                // treats wakeups after corking as spurious ones.
+                _epollout_butex->fetch_add(1, butil::memory_order_relaxed);
+                bthread::butex_wake_all(_epollout_butex);
+            }
+            return;
+        }
+    }
+}
+
+void Socket::WaitForCorkedWrites() {
+    // Load the butex before checking _corked_bytes so that the wakeup
+    // in AddCorkedBytes is not missed.
+    const int expected_val = _epollout_butex->load(butil::memory_order_relaxed);
+    if (_corked_bytes.load(butil::memory_order_relaxed) <
+        FLAGS_socket_cork_bytes) {
+        const timespec duetime = butil::microseconds_from_now(FLAGS_socket_cork_us);
+        bthread::butex_wait(_epollout_butex, expected_val, &duetime);
+    }
+    _corked_bytes.store(-1, butil::memory_order_relaxed);
+}
+
 ssize_t Socket::DoWrite(WriteRequest* req) {
     // Group butil::IOBuf in the list into a batch array.
     butil::IOBuf* data_list[DATA_LIST_MAX];
@@ -1683,6 +1818,12 @@ ssize_t Socket::DoWrite(WriteRequest* req) {
         if (_conn) {
             return _conn->CutMessageIntoFileDescriptor(fd(), data_list, ndata);
         } else {
+            if (FLAGS_socket_zerocopy_min_bytes > 0) {
+                const ssize_t nw = DoWriteZeroCopy(data_list, ndata);
+                if (nw >= 0 || errno != EOPNOTSUPP) {
+                    return nw;
+                }
+            }
             ssize_t nw = butil::IOBuf::cut_multiple_into_file_descriptor(
                 fd(), data_list, ndata);
             return nw;
@@ -1726,6 +1867,45 @@ ssize_t Socket::DoWrite(WriteRequest* req) {
     return nw;
 }
 
+ssize_t Socket::DoWriteZeroCopy(butil::IOBuf* const* data_list,
+                                size_t ndata) {
+    // Completions are read in ProcessEvent, sockets not watched by
+    // dispatcher may hold blocks for too long.
+    if (_on_edge_triggered_events == NULL || !ZeroCopyWriter::IsSupported()) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    size_t nbytes = 0;
+    for (size_t i = 0; i < ndata; ++i) {
+        nbytes += data_list[i]->size();
+    }
+    if (nbytes < (size_t)FLAGS_socket_zerocopy_min_bytes) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    ZeroCopyWriter* zw = _zerocopy_writer.load(butil::memory_order_acquire);
+    if (zw == NULL) {
+        // Only the writing thread creates it.
+        zw = new ZeroCopyWriter;
+        _zerocopy_writer.store(zw, butil::memory_order_release);
+    } else {
+        zw->ReapCompletions(fd());
+    }
+    const ssize_t nw = zw->Write(fd(), data_list, ndata);
+    if (nw < 0 && errno == ENOBUFS) {
+        // Exceeded optmem limit for pinned pages, write with copying.
+        errno = EOPNOTSUPP;
+    }
+    return nw;
+}
+
+void Socket::ReapZeroCopyCompletions() {
+    ZeroCopyWriter* zw = _zerocopy_writer.load(butil::memory_order_acquire);
+    if (zw && zw->pending_count() != 0) {
+        zw->ReapCompletions(fd());
+    }
+}
+
 int Socket::SSLHandshake(int fd, bool server_mode) {
     if (_ssl_ctx == NULL) {
         if (server_mode) {
@@ -1965,6 +2145,13 @@ int Socket::StartInputEvent(SocketId id, uint32_t events,
     return 0;
 }
 
+void Socket::RearmInputEvent() {
+    const int fd = this->fd();
+    if (fd >= 0) {
+        GetGlobalEventDispatcher(fd).RearmConsumer(fd);
+    }
+}
+
 void DereferenceSocket(Socket* s) {
     if (s) {
         s->Dereference();
@@ -2080,12 +2267,17 @@ void Socket::DebugSocket(std::ostream& os, SocketId id) {
     const int64_t cpuwide_now = butil::cpuwide_time_us();
     os << "\nhc_count=" << ptr->_hc_count
        << "\navg_input_msg_size=" << ptr->_avg_msg_size
+       << "\nonce_read_size=" << ptr->_once_read_size
         // NOTE: We're assuming that butil::IOBuf.size() is thread-safe, it is now
         // however it's not guaranteed.
        << "\nread_buf=" << ptr->_read_buf.size()
        << "\nlast_read_to_now=" << cpuwide_now - ptr->_last_readtime_us << "us"
        << "\nlast_write_to_now=" << cpuwide_now - ptr->_last_writetime_us << "us"
        << "\novercrowded=" << ptr->_overcrowded;
+    ZeroCopyWriter* zw = ptr->_zerocopy_writer.load(butil::memory_order_acquire);
+    if (zw) {
+        os << "\nzerocopy_pending=" << zw->pending_count();
+    }
     os << "\nid_wait_list={";
     for (size_t i = 0; i < nidsize; ++i) {
         if (i) {
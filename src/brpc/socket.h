@@ -53,6 +53,7 @@ class Socket;
 class AuthContext;
 class EventDispatcher;
 class Stream;
+class ZeroCopyWriter;
 
 // A special closure for processing the about-to-recycle socket. Socket does
 // not delete SocketUser, if you want, `delete this' at the end of
@@ -136,6 +137,7 @@ struct SocketVarsCollector {
         , nkeepwrite_second("rpc_keepwrite_second", &nkeepwrite)
         , nwaitepollout("rpc_waitepollout_count")
         , nwaitepollout_second("rpc_waitepollout_second", &nwaitepollout)
+        , ncorkedwrite("rpc_corked_write_count")
     {}
 
     bvar::Adder<int64_t> nsocket;
@@ -147,6 +149,7 @@ struct SocketVarsCollector {
     bvar::PerSecond<bvar::Adder<int64_t> > nkeepwrite_second;
     bvar::Adder<int64_t> nwaitepollout;
     bvar::PerSecond<bvar::Adder<int64_t> > nwaitepollout_second;
+    bvar::Adder<int64_t> ncorkedwrite;
 };
 
 struct PipelinedInfo {
@@ -262,10 +265,16 @@ public:
         // Default: false
         bool ignore_eovercrowded;
 
+        // Write the data as soon as possible even if -socket_cork_us is
+        // positive, which delays small writes to coalesce them with
+        // following ones. Corked data queued before are flushed together.
+        // Default: false
+        bool flush_immediately;
+
         WriteOptions()
             : id_wait(INVALID_BTHREAD_ID), abstime(NULL)
             , pipelined_count(0), with_auth(false)
-            , ignore_eovercrowded(false) {}
+            , ignore_eovercrowded(false), flush_immediately(false) {}
     };
     int Write(butil::IOBuf *msg, const WriteOptions* options = NULL);
 
@@ -353,6 +362,14 @@ public:
 
     void FeedbackCircuitBreaker(int error_code, int64_t latency_us);
 
+    // Record latency of a call to the server, shared by pooled and short
+    // connections of the server. Used by adaptive backup requests.
+    void AddRecentLatency(int64_t latency_us);
+
+    // Latency at `ratio' of recent calls to the server, -1 if there're too
+    // few calls recently.
+    int64_t GetRecentLatencyPercentile(double ratio) const;
+
     bool Failed() const;
 
     bool DidReleaseAdditionalRereference() const
@@ -387,6 +404,10 @@ public:
     static const int PROGRESS_INIT = 1;
     bool MoreReadEvents(int* progress);
 
+    // Watch input events of the fd again after it's drained, needed by
+    // dispatchers polling with one-shot polls.
+    void RearmInputEvent();
+
     // Fight for the right to authenticate this socket. Only one
     // fighter will get 0 as return value. Others will wait until
     // authentication finishes (succeed or not) and the error code
@@ -557,6 +578,14 @@ friend void DereferenceSocket(Socket*);
     // success, -1 otherwise and errno is set
     ssize_t DoWrite(WriteRequest* req);
 
+    // Write `data_list' with MSG_ZEROCOPY if -socket_zerocopy_min_bytes
+    // allows, returns -1 with errno=EOPNOTSUPP when the data should be
+    // written normally.
+    ssize_t DoWriteZeroCopy(butil::IOBuf* const* data_list, size_t ndata);
+
+    // Release data written with MSG_ZEROCOPY which were sent.
+    void ReapZeroCopyCompletions();
+
     // Called before returning to pool.
     void OnRecycle();
 
@@ -596,6 +625,14 @@ friend void DereferenceSocket(Socket*);
 
     static void* KeepWrite(void*);
 
+    // Called by writers queueing `nbytes' after the KeepWrite thread,
+    // wake up the thread if it's corked and enough data are queued.
+    void AddCorkedBytes(int64_t nbytes, bool flush);
+
+    // Called by the KeepWrite thread to wait for more data to be queued
+    // before the first write.
+    void WaitForCorkedWrites();
+
     bool IsWriteComplete(WriteRequest* old_head, bool singular_node,
                          WriteRequest** new_tail);
 
@@ -729,6 +766,9 @@ private:
     uint32_t _last_msg_size;
     // Average message size of last #MSG_SIZE_WINDOW messages (roughly)
     uint32_t _avg_msg_size;
+    // Bytes to read in next DoRead() of InputMessenger, grows when reads
+    // fill the given size and shrinks to the last read otherwise.
+    uint32_t _once_read_size;
 
     // Storing data read from `_fd' but cut-off yet.
     butil::IOPortal _read_buf;
@@ -814,6 +854,14 @@ private:
     // Storing data that are not flushed into `fd' yet.
     butil::atomic<WriteRequest*> _write_head;
 
+    // Bytes queued while the KeepWrite thread is delaying the first write
+    // to coalesce small writes, -1 when the thread is not corked.
+    butil::atomic<int64_t> _corked_bytes;
+
+    // Created at first write with MSG_ZEROCOPY, holding blocks written
+    // until kernel completes sending them.
+    butil::atomic<ZeroCopyWriter*> _zerocopy_writer;
+
     butil::Mutex _stream_mutex;
     std::set<StreamId> *_stream_set;
 
@@ -226,9 +226,13 @@ inline bool Socket::Failed() const {
 
 inline bool Socket::MoreReadEvents(int* progress) {
     // Fail to CAS means that new events arrived.
-    return !_nevent.compare_exchange_strong(
-        *progress, 0, butil::memory_order_release,
-            butil::memory_order_acquire);
+    if (!_nevent.compare_exchange_strong(
+            *progress, 0, butil::memory_order_release,
+            butil::memory_order_acquire)) {
+        return true;
+    }
+    RearmInputEvent();
+    return false;
 }
 
 inline void Socket::SetLogOff() {
@@ -219,6 +219,21 @@ int bthread_stopped(bthread_t tid) {
     return (int)bthread::TaskGroup::is_stopped(tid);
 }
 
+int bthread_set_high_priority(int high) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g == NULL || g->is_current_main_task()) {
+        return -1;
+    }
+    bthread_attrflags_t& flags = g->current_task()->attr.flags;
+    const int prev = !!(flags & BTHREAD_HIGH_PRIORITY);
+    if (high) {
+        flags |= BTHREAD_HIGH_PRIORITY;
+    } else {
+        flags &= ~BTHREAD_HIGH_PRIORITY;
+    }
+    return prev;
+}
+
 bthread_t bthread_self(void) {
     bthread::TaskGroup* g = bthread::tls_task_group;
     // note: return 0 for main tasks now, which include main thread and
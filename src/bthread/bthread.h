@@ -263,11 +263,13 @@ extern int bthread_rwlockattr_init(bthread_rwlockattr_t* attr);
 // Destroy attribute object `attr'.
 extern int bthread_rwlockattr_destroy(bthread_rwlockattr_t* attr);
 
-// Return current setting of reader/writer preference.
+// Return current setting of reader/writer preference, which is always
+// BTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP.
 extern int bthread_rwlockattr_getkind_np(const bthread_rwlockattr_t* attr,
                                          int* pref);
 
-// Set reader/write preference.
+// Set reader/write preference. Returns ENOTSUP unless `pref' is
+// BTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP.
 extern int bthread_rwlockattr_setkind_np(bthread_rwlockattr_t* attr,
                                          int pref);
 
@@ -19,6 +19,9 @@
 
 // Date: Tue Jul 22 17:30:12 CST 2014
 
+#include <unistd.h>                         // sysconf
+#include <algorithm>                        // std::min
+#include <gflags/gflags.h>
 #include "butil/atomicops.h"                // butil::atomic
 #include "butil/scoped_lock.h"              // BAIDU_SCOPED_LOCK
 #include "butil/macros.h"
@@ -78,6 +81,7 @@ enum WaiterState {
     WAITER_STATE_TIMEDOUT,
     WAITER_STATE_UNMATCHEDVALUE,
     WAITER_STATE_INTERRUPTED,
+    WAITER_STATE_STOPPED,
 };
 
 struct Butex;
@@ -100,6 +104,7 @@ struct ButexBthreadWaiter : public ButexWaiter {
     int expected_value;
     Butex* initial_butex;
     TaskControl* control;
+    const timespec* abstime;
 };
 
 // pthread_task or main_task allocates this structure on stack and queue it
@@ -119,6 +124,10 @@ struct BAIDU_CACHELINE_ALIGNMENT Butex {
     butil::atomic<int> value;
     ButexWaiterList waiters;
     internal::FastPthreadMutex waiter_lock;
+    // Moving average of rounds that butex_spin_wait() spun, approximating
+    // how long the value stays unchanged. Not reset when the butex is
+    // reused, which is harmless for a hint.
+    butil::atomic<int> spin_estimate;
 };
 
 BAIDU_CASSERT(offsetof(Butex, value) == 0, offsetof_value_must_0);
@@ -239,6 +248,11 @@ inline int unsleep_if_necessary(ButexBthreadWaiter* w,
 // and cause spurious wakeups. According to our observations, the race is 
 // infrequent, even rare. The extra spurious wakeups should be acceptable.
 
+DEFINE_int32(bthread_butex_max_spin, 100,
+             "Max rounds of cpu_relax() in butex_spin_wait() before parking, "
+             "spinning is disabled when this value is non-positive or there's "
+             "only one cpu");
+
 void* butex_create() {
     Butex* b = butil::get_object<Butex>();
     if (b) {
@@ -494,29 +508,31 @@ inline bool erase_from_butex(ButexWaiter* bw, bool wakeup, WaiterState state) {
 static void wait_for_butex(void* arg) {
     ButexBthreadWaiter* const bw = static_cast<ButexBthreadWaiter*>(arg);
     Butex* const b = bw->initial_butex;
-    // 1: waiter with timeout should have waiter_state == WAITER_STATE_READY
-    //    before they're queued, otherwise the waiter is already timedout
-    //    and removed by TimerThread, in which case we should stop queueing.
-    //
-    // Visibility of waiter_state:
-    //    [bthread]                         [TimerThread]
-    //    waiter_state = TIMED
-    //    tt_lock { add task }
-    //                                      tt_lock { get task }
-    //                                      waiter_lock { waiter_state=TIMEDOUT }
-    //    waiter_lock { use waiter_state }
-    // tt_lock represents TimerThread::_mutex. Visibility of waiter_state is
-    // sequenced by two locks, both threads are guaranteed to see the correct
-    // value.
+    // 1: The timer is scheduled after the waiter is queued, otherwise the
+    //    timer may fire before queueing, find nothing to erase and the
+    //    waiter sleeps forever. The timer does not erase the waiter before
+    //    waiter_lock is unlocked, and butex_wake() always sees sleep_id of
+    //    the waiter which is set inside waiter_lock.
     {
         BAIDU_SCOPED_LOCK(b->waiter_lock);
         if (b->value.load(butil::memory_order_relaxed) != bw->expected_value) {
             bw->waiter_state = WAITER_STATE_UNMATCHEDVALUE;
-        } else if (bw->waiter_state == WAITER_STATE_READY/*1*/ &&
+        } else if (bw->waiter_state == WAITER_STATE_READY &&
                    !bw->task_meta->interrupted) {
             b->waiters.Append(bw);
             bw->container.store(b, butil::memory_order_relaxed);
-            return;
+            if (bw->abstime == NULL) {
+                return;
+            }
+            bw->sleep_id = get_global_timer_thread()->schedule(
+                erase_from_butex_and_wakeup, bw, *bw->abstime/*1*/);
+            if (bw->sleep_id) {
+                return;
+            }
+            // TimerThread stopped.
+            bw->RemoveFromList();
+            bw->container.store(NULL, butil::memory_order_relaxed);
+            bw->waiter_state = WAITER_STATE_STOPPED;
         }
     }
     
@@ -607,6 +623,39 @@ static int butex_wait_from_pthread(TaskGroup* g, Butex* b, int expected_value,
     return rc;
 }
 
+static bool has_multiple_cpus() {
+    static const bool multiple = (sysconf(_SC_NPROCESSORS_ONLN) > 1);
+    return multiple;
+}
+
+bool butex_spin_wait(void* arg, int expected_value) {
+    const int max_spin = FLAGS_bthread_butex_max_spin;
+    if (max_spin <= 0 || !has_multiple_cpus()) {
+        return false;
+    }
+    Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
+    const int estimate = b->spin_estimate.load(butil::memory_order_relaxed);
+    // Spin a bit longer than before so that the estimate can grow, which is
+    // the same policy as PTHREAD_MUTEX_ADAPTIVE_NP of glibc.
+    const int limit = std::min(max_spin, std::max(estimate, 0) * 2 + 10);
+    int nspin = 0;
+    for (; nspin < limit; ++nspin) {
+        if (b->value.load(butil::memory_order_relaxed) != expected_value) {
+            break;
+        }
+        cpu_relax();
+    }
+    b->spin_estimate.store(estimate + (nspin - estimate) / 8,
+                           butil::memory_order_relaxed);
+    if (nspin < limit) {
+        // Make changes before changing the butex visible, same as the fence
+        // in butex_wait().
+        butil::atomic_thread_fence(butil::memory_order_acquire);
+        return true;
+    }
+    return false;
+}
+
 int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
     if (b->value.load(butil::memory_order_relaxed) != expected_value) {
@@ -630,22 +679,16 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     bbw.expected_value = expected_value;
     bbw.initial_butex = b;
     bbw.control = g->control();
+    bbw.abstime = abstime;
 
     if (abstime != NULL) {
-        // Schedule timer before queueing. If the timer is triggered before
-        // queueing, cancel queueing. This is a kind of optimistic locking.
+        // The timer is scheduled in wait_for_butex() after queueing.
         if (butil::timespec_to_microseconds(*abstime) <
             (butil::gettimeofday_us() + MIN_SLEEP_US)) {
             // Already timed out.
             errno = ETIMEDOUT;
             return -1;
         }
-        bbw.sleep_id = get_global_timer_thread()->schedule(
-            erase_from_butex_and_wakeup, &bbw, *abstime);
-        if (!bbw.sleep_id) {  // TimerThread stopped.
-            errno = ESTOP;
-            return -1;
-        }
     }
 #ifdef SHOW_BTHREAD_BUTEX_WAITER_COUNT_IN_VARS
     bvar::Adder<int64_t>& num_waiters = butex_waiter_count();
@@ -685,6 +728,9 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     } else if (WAITER_STATE_UNMATCHEDVALUE == bbw.waiter_state) {
         errno = EWOULDBLOCK;
         return -1;
+    } else if (WAITER_STATE_STOPPED == bbw.waiter_state) {
+        errno = ESTOP;
+        return -1;
     } else if (is_interrupted) {
         errno = EINTR;
         return -1;
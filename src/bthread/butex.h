@@ -70,6 +70,14 @@ int butex_requeue(void* butex1, void* butex2);
 // Returns 0 on success, -1 otherwise and errno is set.
 int butex_wait(void* butex, int expected_value, const timespec* abstime);
 
+// Spin while *butex equals |expected_value|, for at most
+// -bthread_butex_max_spin rounds. The number of rounds adapts to how long the
+// value stayed unchanged in previous calls on the same butex, so that waiting
+// for short critical sections does not pay for parking and rescheduling.
+// Call this before butex_wait() to avoid a context switch.
+// Returns true if the value changed, false otherwise.
+bool butex_spin_wait(void* butex, int expected_value);
+
 }  // namespace bthread
 
 #endif  // BTHREAD_BUTEX_H
@@ -61,6 +61,9 @@ int CountdownEvent::wait() {
         if (seen_counter <= 0) {
             return 0;
         }
+        if (butex_spin_wait(_butex, seen_counter)) {
+            continue;
+        }
         if (butex_wait(_butex, seen_counter, NULL) < 0 &&
             errno != EWOULDBLOCK && errno != EINTR) {
             return errno;
@@ -99,6 +102,9 @@ int CountdownEvent::timed_wait(const timespec& duetime) {
         if (seen_counter <= 0) {
             return 0;
         }
+        if (butex_spin_wait(_butex, seen_counter)) {
+            continue;
+        }
         if (butex_wait(_butex, seen_counter, &duetime) < 0 &&
             errno != EWOULDBLOCK && errno != EINTR) {
             return errno;
@@ -195,6 +195,11 @@ void ExecutionQueueBase::return_task_node(TaskNode* node) {
     get_execq_vars()->running_task_count << -1;
 }
 
+void ExecutionQueueBase::return_unused_node(TaskNode* node) {
+    butil::return_object<TaskNode>(node);
+    get_execq_vars()->running_task_count << -1;
+}
+
 void ExecutionQueueBase::_on_recycle() {
     // Push a closed tasks
     while (true) {
@@ -271,6 +276,9 @@ int ExecutionQueueBase::_execute(TaskNode* head, bool high_priority, int* nitera
     if (iter) {
         _execute_func(_meta, _type_specific_function, iter);
     }
+    // Tasks of the batch after the current one are not consumed, execute
+    // them in next round instead of dropping them.
+    iter.put_back_unconsumed();
     // We must assign |niterated| with num_iterated even if we couldn't peek
     // any task to execute at the begining, in which case all the iterated 
     // tasks have been cancelled at this point. And we must return the 
@@ -287,6 +295,7 @@ TaskNode* ExecutionQueueBase::allocate_node() {
 }
 
 TaskNode* const TaskNode::UNCONNECTED = (TaskNode*)-1L;
+const size_t TaskNode::MAX_BATCH_SIZE;
 
 ExecutionQueueBase::scoped_ptr_t ExecutionQueueBase::address(uint64_t id) {
     scoped_ptr_t ret;
@@ -384,6 +393,13 @@ void TaskIteratorBase::operator++() {
     if (!(*this)) {
         return;
     }
+    // Don't break in the middle of a batch since the node is returned as
+    // a whole.
+    if (_num_left_in_node > 0) {
+        --_num_left_in_node;
+        ++_index_in_node;
+        return;
+    }
     if (_cur_node->iterated) {
         _cur_node = _cur_node->next;
     }
@@ -396,6 +412,9 @@ void TaskIteratorBase::operator++() {
             if (!_cur_node->iterated && _cur_node->peek_to_execute()) {
                 ++_num_iterated;
                 _cur_node->iterated = true;
+                _index_in_node = _cur_node->batch_consumed;
+                _num_left_in_node = _cur_node->batch_size == 0 ? 0 :
+                    _cur_node->batch_size - 1 - _cur_node->batch_consumed;
                 return;
             }
             _num_iterated += !_cur_node->iterated;
@@ -406,6 +425,18 @@ void TaskIteratorBase::operator++() {
     return;
 }
 
+void TaskIteratorBase::put_back_unconsumed() {
+    if (_num_left_in_node == 0) {
+        return;
+    }
+    // The node is executed again from the task after current one, as a
+    // single task is regarded as consumed once it's iterated.
+    _cur_node->put_back(_index_in_node + 1);
+    _cur_node->iterated = false;
+    --_num_iterated;
+    _num_left_in_node = 0;
+}
+
 TaskIteratorBase::~TaskIteratorBase() {
     // Set the iterated tasks as EXECUTED here instead of waiting them to be
     // returned in _start_execute as the high_priority_task might be in the
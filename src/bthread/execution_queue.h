@@ -55,13 +55,25 @@ protected:
         , _high_priority(high_priority)
         , _should_break(false)
         , _num_iterated(0)
+        , _index_in_node(0)
+        , _num_left_in_node(0)
     { operator++(); }
     ~TaskIteratorBase();
     void operator++();
     TaskNode* cur_node() const { return _cur_node; }
+    // Position of current task in the batch of cur_node() and number of
+    // tasks after it.
+    size_t index_in_node() const { return _index_in_node; }
+    size_t num_left_in_node() const { return _num_left_in_node; }
+    void skip_left_in_node() {
+        _index_in_node += _num_left_in_node;
+        _num_left_in_node = 0;
+    }
 private:
     int num_iterated() const { return _num_iterated; }
     bool should_break_for_high_priority_tasks();
+    // Called after the execute function returned.
+    void put_back_unconsumed();
 
     TaskNode*               _cur_node;
     TaskNode*               _head;
@@ -70,6 +82,8 @@ private:
     bool                    _high_priority;
     bool                    _should_break;
     int                     _num_iterated;
+    uint32_t                _index_in_node;
+    uint32_t                _num_left_in_node;
 };
 
 // Iterate over the given tasks
@@ -86,6 +100,16 @@ private:
 //     }
 //     return 0;
 // }
+//
+// Tasks executed together by execution_queue_execute_batch are stored
+// contiguously, which can be consumed as a whole:
+//     while (iter) {
+//         size_t n = 0;
+//         T* tasks = iter.take_span(&n);
+//         // do_something(tasks, n)
+//     }
+// If |execute| returns in the middle of such tasks, the ones after the
+// current task are passed to |execute| again rather than being dropped.
 template <typename T>
 class TaskIterator : public TaskIteratorBase {
     TaskIterator();
@@ -97,6 +121,13 @@ public:
     pointer operator->() const { return &(operator*()); }
     TaskIterator& operator++();
     void operator++(int);
+
+    // Get current task and the following tasks stored contiguously with it,
+    // and move the iterator after them. Tasks are contiguous if they're
+    // executed by one execution_queue_execute_batch, otherwise the span
+    // only contains the current task.
+    // Returns address of the first task, number of tasks is stored in |n|.
+    pointer take_span(size_t* n);
 };
 
 struct TaskHandle {
@@ -198,6 +229,20 @@ int execution_queue_execute(ExecutionQueueId<T> id,
                             const TaskOptions* options,
                             TaskHandle* handle);
 
+// Thread-safe and Wait-free.
+// Execute |n| tasks in order. Up to TaskNode::MAX_BATCH_SIZE tasks are
+// copied into one contiguous buffer and pushed into the queue with one
+// atomic operation, which costs much less than executing them one by one.
+// Tasks of a batch are not cancellable.
+// Returns 0 on success, otherwise none of the tasks is submitted.
+template <typename T>
+int execution_queue_execute_batch(ExecutionQueueId<T> id,
+                                  const T* tasks, size_t n);
+template <typename T>
+int execution_queue_execute_batch(ExecutionQueueId<T> id,
+                                  const T* tasks, size_t n,
+                                  const TaskOptions* options);
+
 // [Thread safe and ABA free] Cancel the corrosponding task.
 // Returns:
 //  -1: The task was executed or h is an invalid handle
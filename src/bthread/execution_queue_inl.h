@@ -22,6 +22,7 @@
 #ifndef  BTHREAD_EXECUTION_QUEUE_INL_H
 #define  BTHREAD_EXECUTION_QUEUE_INL_H
 
+#include <algorithm>                     // std::min
 #include "butil/atomicops.h"             // butil::atomic
 #include "butil/macros.h"                // BAIDU_CACHELINE_ALIGNMENT
 #include "butil/memory/scoped_ptr.h"     // butil::scoped_ptr
@@ -55,6 +56,8 @@ struct BAIDU_CACHELINE_ALIGNMENT TaskNode {
         , iterated(false) 
         , high_priority(false)
         , in_place(false) 
+        , batch_size(0)
+        , batch_consumed(0)
         , next(UNCONNECTED)
         , q(NULL)
     {}
@@ -74,6 +77,12 @@ struct BAIDU_CACHELINE_ALIGNMENT TaskNode {
         BAIDU_SCOPED_LOCK(mutex);
         status = EXECUTED;
     }
+    // Make the tasks of the batch from `consumed' executable again.
+    void put_back(size_t consumed) {
+        BAIDU_SCOPED_LOCK(mutex);
+        batch_consumed = consumed;
+        status = UNEXECUTED;
+    }
     bool peek_to_execute() {
         BAIDU_SCOPED_LOCK(mutex);
         if (status == UNEXECUTED) {
@@ -87,8 +96,16 @@ struct BAIDU_CACHELINE_ALIGNMENT TaskNode {
     uint8_t status;
     bool stop_task;
     bool iterated;
-    bool high_priority;
-    bool in_place;
+    // Set before the node is pushed and never changed after, sharing one
+    // byte is safe.
+    bool high_priority : 1;
+    bool in_place : 1;
+    // Number of tasks stored contiguously in this node by
+    // execution_queue_execute_batch(), 0 for a single task.
+    uint16_t batch_size;
+    // Number of tasks in the batch consumed by previous executions which
+    // returned before reaching the end of the batch.
+    uint16_t batch_consumed;
     TaskNode* next;
     ExecutionQueueBase* q;
     union {
@@ -102,6 +119,8 @@ struct BAIDU_CACHELINE_ALIGNMENT TaskNode {
             CHECK(iterated);
         }
         q = NULL;
+        batch_size = 0;
+        batch_consumed = 0;
         std::unique_lock<butil::Mutex> lck(mutex);
         ++version;
         const int saved_status = status;
@@ -114,6 +133,7 @@ struct BAIDU_CACHELINE_ALIGNMENT TaskNode {
     }
 
     static TaskNode* const UNCONNECTED;
+    static const size_t MAX_BATCH_SIZE = 65535;
 };
 
 // Specialize TaskNodeAllocator for types with different sizes
@@ -149,6 +169,33 @@ struct TaskAllocator : public TaskAllocatorBase<
                sizeof(T), sizeof(T) <= sizeof(TaskNode().static_task_mem)>
 {};
 
+// Tasks of a batch are stored in the node if they fit, or in one malloc-ed
+// array otherwise.
+template <typename T>
+struct TaskBatchAllocator {
+    inline static bool is_static(size_t n)
+    { return n * sizeof(T) <= sizeof(TaskNode().static_task_mem); }
+
+    inline static void* allocate(TaskNode* node, size_t n) {
+        if (is_static(n)) {
+            return node->static_task_mem;
+        }
+        node->dynamic_task_mem = (char*)malloc(n * sizeof(T));
+        return node->dynamic_task_mem;
+    }
+
+    inline static T* get_allocated_mem(TaskNode* node) {
+        return (T*)(is_static(node->batch_size) ? node->static_task_mem
+                                                : node->dynamic_task_mem);
+    }
+
+    inline static void deallocate(TaskNode* node) {
+        if (!is_static(node->batch_size)) {
+            free(node->dynamic_task_mem);
+        }
+    }
+};
+
 class TaskIteratorBase;
 
 class BAIDU_CACHELINE_ALIGNMENT ExecutionQueueBase {
@@ -192,6 +239,8 @@ protected:
     void start_execute(TaskNode* node);
     TaskNode* allocate_node();
     void return_task_node(TaskNode* node);
+    // Return a node which was never pushed into the queue.
+    void return_unused_node(TaskNode* node);
 
 private:
 
@@ -256,10 +305,19 @@ public:
     typedef TaskIterator<T>                                     iterator;
     typedef int (*execute_func_t)(void*, iterator&);
     typedef TaskAllocator<T>                                    allocator;
+    typedef TaskBatchAllocator<T>                               batch_allocator;
     BAIDU_CASSERT(sizeof(execute_func_t) == sizeof(void*),
                   sizeof_function_must_be_equal_to_sizeof_voidptr);
 
     static void clear_task_mem(TaskNode* node) {
+        if (node->batch_size != 0) {
+            T* const tasks = batch_allocator::get_allocated_mem(node);
+            for (size_t i = 0; i < node->batch_size; ++i) {
+                tasks[i].~T();
+            }
+            batch_allocator::deallocate(node);
+            return;
+        }
         T* const task = (T*)allocator::get_allocated_mem(node);
         task->~T();
         allocator::deallocate(node);
@@ -317,6 +375,66 @@ public:
         start_execute(node);
         return 0;
     }
+
+    int execute_batch(const T* tasks, size_t n, const TaskOptions* options) {
+        if (stopped()) {
+            return EINVAL;
+        }
+        TaskOptions opt;
+        if (options) {
+            opt = *options;
+        }
+        // Prepare all nodes before pushing any of them so that either all
+        // tasks or none of them are submitted. Prepared nodes are linked by
+        // `next' which is overwritten by start_execute().
+        TaskNode* first = NULL;
+        TaskNode** last_next = &first;
+        for (size_t i = 0; i < n; ) {
+            const size_t batch_size = std::min(n - i, TaskNode::MAX_BATCH_SIZE);
+            TaskNode* node = allocate_node();
+            if (BAIDU_UNLIKELY(node == NULL)) {
+                *last_next = NULL;
+                return_prepared_nodes(first);
+                return ENOMEM;
+            }
+            T* const mem = (T*)batch_allocator::allocate(node, batch_size);
+            if (BAIDU_UNLIKELY(!mem)) {
+                return_unused_node(node);
+                *last_next = NULL;
+                return_prepared_nodes(first);
+                return ENOMEM;
+            }
+            for (size_t j = 0; j < batch_size; ++j) {
+                new (mem + j) T(tasks[i + j]);
+            }
+            node->batch_size = batch_size;
+            node->stop_task = false;
+            node->high_priority = opt.high_priority;
+            node->in_place = opt.in_place_if_possible;
+            *last_next = node;
+            last_next = &node->next;
+            i += batch_size;
+        }
+        *last_next = NULL;
+        while (first != NULL) {
+            TaskNode* const node = first;
+            first = first->next;
+            start_execute(node);
+        }
+        return 0;
+    }
+
+private:
+    // Destroy tasks of nodes prepared by execute_batch() and return them.
+    void return_prepared_nodes(TaskNode* node) {
+        while (node != NULL) {
+            TaskNode* const saved_next = node->next;
+            clear_task_mem(node);
+            node->batch_size = 0;
+            return_unused_node(node);
+            node = saved_next;
+        }
+    }
 };
 
 inline ExecutionQueueOptions::ExecutionQueueOptions()
@@ -365,6 +483,25 @@ inline int execution_queue_execute(ExecutionQueueId<T> id,
     }
 }
 
+template <typename T>
+inline int execution_queue_execute_batch(ExecutionQueueId<T> id,
+                                         const T* tasks, size_t n) {
+    return execution_queue_execute_batch(id, tasks, n, NULL);
+}
+
+template <typename T>
+inline int execution_queue_execute_batch(ExecutionQueueId<T> id,
+                                         const T* tasks, size_t n,
+                                         const TaskOptions* options) {
+    typename ExecutionQueue<T>::scoped_ptr_t 
+        ptr = ExecutionQueue<T>::address(id);
+    if (ptr != NULL) {
+        return ptr->execute_batch(tasks, n, options);
+    } else {
+        return EINVAL;
+    }
+}
+
 template <typename T>
 inline int execution_queue_stop(ExecutionQueueId<T> id) {
     typename ExecutionQueue<T>::scoped_ptr_t 
@@ -401,10 +538,23 @@ inline TaskIteratorBase::operator bool() const {
 template <typename T>
 inline typename TaskIterator<T>::reference
 TaskIterator<T>::operator*() const {
-    T* const ptr = (T* const)TaskAllocator<T>::get_allocated_mem(cur_node());
+    TaskNode* const node = cur_node();
+    if (node->batch_size != 0) {
+        return TaskBatchAllocator<T>::get_allocated_mem(node)[index_in_node()];
+    }
+    T* const ptr = (T* const)TaskAllocator<T>::get_allocated_mem(node);
     return *ptr;
 }
 
+template <typename T>
+inline T* TaskIterator<T>::take_span(size_t* n) {
+    T* const first = &operator*();
+    *n = num_left_in_node() + 1;
+    skip_left_in_node();
+    TaskIteratorBase::operator++();
+    return first;
+}
+
 template <typename T>
 TaskIterator<T>& TaskIterator<T>::operator++() {
     TaskIteratorBase::operator++();
@@ -517,6 +517,15 @@ void submit_contention(const bthread_contention_site_t& csite, int64_t now_ns) {
     tls_inside_lock = false;
 }
 
+// Sampling range of a contended locking of other primitives such as
+// bthread_rwlock_t, 0 means that the locking should not be sampled.
+size_t contention_sampling_range() {
+    if (!g_cp || tls_inside_lock) {
+        return 0;
+    }
+    return bvar::is_collectable(&g_cp_sl);
+}
+
 BUTIL_FORCE_INLINE int pthread_mutex_lock_impl(pthread_mutex_t* mutex) {
     // Don't change behavior of lock when profiler is off.
     if (!g_cp ||
@@ -628,8 +637,19 @@ const MutexInternal MUTEX_LOCKED_RAW = {{1},{0},0};
 BAIDU_CASSERT(sizeof(unsigned) == sizeof(MutexInternal),
               sizeof_mutex_internal_must_equal_unsigned);
 
+// Spin for a while if the mutex is locked without waiters, which is likely
+// to be a short critical section. Returns true if the lock is acquired.
+inline bool mutex_spin_lock(butil::atomic<unsigned>* whole) {
+    return whole->load(butil::memory_order_relaxed) == BTHREAD_MUTEX_LOCKED &&
+        bthread::butex_spin_wait(whole, (int)BTHREAD_MUTEX_LOCKED) &&
+        !((MutexInternal*)whole)->locked.exchange(1, butil::memory_order_acquire);
+}
+
 inline int mutex_lock_contended(bthread_mutex_t* m) {
     butil::atomic<unsigned>* whole = (butil::atomic<unsigned>*)m->butex;
+    if (mutex_spin_lock(whole)) {
+        return 0;
+    }
     while (whole->exchange(BTHREAD_MUTEX_CONTENDED) & BTHREAD_MUTEX_LOCKED) {
         if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, NULL) < 0 &&
             errno != EWOULDBLOCK && errno != EINTR/*note*/) {
@@ -644,6 +664,9 @@ inline int mutex_lock_contended(bthread_mutex_t* m) {
 inline int mutex_timedlock_contended(
     bthread_mutex_t* m, const struct timespec* __restrict abstime) {
     butil::atomic<unsigned>* whole = (butil::atomic<unsigned>*)m->butex;
+    if (mutex_spin_lock(whole)) {
+        return 0;
+    }
     while (whole->exchange(BTHREAD_MUTEX_CONTENDED) & BTHREAD_MUTEX_LOCKED) {
         if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, abstime) < 0 &&
             errno != EWOULDBLOCK && errno != EINTR/*note*/) {
@@ -0,0 +1,372 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#include <errno.h>
+#include "butil/atomicops.h"
+#include "butil/macros.h"                        // BAIDU_CASSERT
+#include "butil/time.h"                          // cpuwide_time_ns
+#include "bthread/butex.h"                       // butex_*
+#include "bthread/bthread.h"
+
+namespace bthread {
+
+// Defined in mutex.cpp
+size_t contention_sampling_range();
+void submit_contention(const bthread_contention_site_t& csite, int64_t now_ns);
+
+// Layout of bthread_rwlock_t::state:
+//   bits 0-22:  number of readers holding the lock.
+//   bits 23-45: number of readers waiting for the writer.
+//   bits 46-61: generation, increased each time the lock is handed over to
+//               waiting readers. A woken reader checks the generation to
+//               know whether it holds the lock, which must not wrap around
+//               before the reader runs, thus a single bit is not enough:
+//               timedout writers may hand over the lock again and again.
+//   bit 62:     a writer is waiting for readers holding the lock to leave.
+//   bit 63:     a writer holds the lock.
+// Writers are serialized by write_queue_mutex and preferred: new readers
+// wait as soon as a writer is waiting. When the writer unlocks, all readers
+// waiting by then get the lock before next writer, so that a reader waits
+// for at most one writer.
+static const uint64_t RWLOCK_READER_MASK = (1ULL << 23) - 1;
+static const int RWLOCK_WAITING_SHIFT = 23;
+static const uint64_t RWLOCK_WAITING_ONE = 1ULL << RWLOCK_WAITING_SHIFT;
+static const uint64_t RWLOCK_WAITING_MASK =
+    RWLOCK_READER_MASK << RWLOCK_WAITING_SHIFT;
+static const int RWLOCK_GENERATION_SHIFT = 46;
+static const uint64_t RWLOCK_GENERATION_ONE = 1ULL << RWLOCK_GENERATION_SHIFT;
+static const uint64_t RWLOCK_GENERATION_MASK =
+    ((1ULL << 16) - 1) << RWLOCK_GENERATION_SHIFT;
+static const uint64_t RWLOCK_WRITER_WAITING = 1ULL << 62;
+static const uint64_t RWLOCK_WRITER_LOCKED = 1ULL << 63;
+static const uint64_t RWLOCK_WRITER_MASK =
+    RWLOCK_WRITER_WAITING | RWLOCK_WRITER_LOCKED;
+
+BAIDU_CASSERT(sizeof(uint64_t) == sizeof(butil::atomic<uint64_t>),
+              sizeof_atomic_uint64_must_equal_uint64);
+
+inline butil::atomic<uint64_t>* rwlock_state(bthread_rwlock_t* rw) {
+    return (butil::atomic<uint64_t>*)&rw->state;
+}
+
+// Hand the lock over to waiting readers and clear `clear_flags'.
+// `reader_butex' is loaded before because `rw' may be destroyed by
+// readers getting the lock.
+// Returns the state before releasing.
+static uint64_t rwlock_release_to_readers(butil::atomic<uint64_t>* state,
+                                      void* reader_butex,
+                                      uint64_t clear_flags) {
+    uint64_t s = state->load(butil::memory_order_relaxed);
+    uint64_t new_s = 0;
+    uint64_t nwaiting = 0;
+    do {
+        new_s = s & ~clear_flags;
+        nwaiting = 0;
+        if (!(new_s & RWLOCK_WRITER_LOCKED)) {
+            // Another writer can't hold the lock before the waiting readers.
+            nwaiting = (s & RWLOCK_WAITING_MASK) >> RWLOCK_WAITING_SHIFT;
+            if (nwaiting) {
+                new_s = (new_s & ~RWLOCK_WAITING_MASK) + nwaiting;
+                // Wrap around within the generation bits.
+                new_s = (new_s & ~RWLOCK_GENERATION_MASK) |
+                    ((new_s + RWLOCK_GENERATION_ONE) & RWLOCK_GENERATION_MASK);
+            }
+        }
+    } while (!state->compare_exchange_weak(
+                 s, new_s, butil::memory_order_release,
+                 butil::memory_order_relaxed));
+    if (nwaiting) {
+        ((butil::atomic<unsigned>*)reader_butex)->fetch_add(
+            1, butil::memory_order_release);
+        butex_wake_all(reader_butex);
+    }
+    return s;
+}
+
+static int rwlock_rdlock_contended(bthread_rwlock_t* rw,
+                                   const struct timespec* abstime) {
+    butil::atomic<uint64_t>* state = rwlock_state(rw);
+    butil::atomic<unsigned>* reader_butex =
+        (butil::atomic<unsigned>*)rw->reader_butex;
+    uint64_t s = state->load(butil::memory_order_relaxed);
+    while (true) {
+        if (!(s & RWLOCK_WRITER_MASK)) {
+            if (state->compare_exchange_weak(
+                    s, s + 1, butil::memory_order_acquire,
+                    butil::memory_order_relaxed)) {
+                return 0;
+            }
+        } else if (state->compare_exchange_weak(
+                       s, s + RWLOCK_WAITING_ONE, butil::memory_order_relaxed)) {
+            break;
+        }
+    }
+    // Registered as a waiting reader, wait for the handover.
+    const uint64_t generation = s & RWLOCK_GENERATION_MASK;
+    while (true) {
+        const unsigned expected = reader_butex->load(butil::memory_order_acquire);
+        s = state->load(butil::memory_order_acquire);
+        if ((s & RWLOCK_GENERATION_MASK) != generation) {
+            return 0;
+        }
+        if (butex_wait(reader_butex, expected, abstime) < 0 &&
+            errno == ETIMEDOUT) {
+            break;
+        }
+    }
+    // Timedout, unregister unless the lock was just handed over.
+    s = state->load(butil::memory_order_relaxed);
+    do {
+        if ((s & RWLOCK_GENERATION_MASK) != generation) {
+            butil::atomic_thread_fence(butil::memory_order_acquire);
+            return 0;
+        }
+    } while (!state->compare_exchange_weak(
+                 s, s - RWLOCK_WAITING_ONE, butil::memory_order_relaxed));
+    return ETIMEDOUT;
+}
+
+static int rwlock_rdlock(bthread_rwlock_t* rw,
+                         const struct timespec* abstime) {
+    butil::atomic<uint64_t>* state = rwlock_state(rw);
+    uint64_t s = state->load(butil::memory_order_relaxed);
+    while (!(s & RWLOCK_WRITER_MASK)) {
+        if (state->compare_exchange_weak(
+                s, s + 1, butil::memory_order_acquire,
+                butil::memory_order_relaxed)) {
+            return 0;
+        }
+    }
+    // Don't sample when contention profiler is off.
+    const size_t sampling_range = contention_sampling_range();
+    if (!sampling_range) {
+        return rwlock_rdlock_contended(rw, abstime);
+    }
+    const int64_t start_ns = butil::cpuwide_time_ns();
+    const int rc = rwlock_rdlock_contended(rw, abstime);
+    const int64_t end_ns = butil::cpuwide_time_ns();
+    const bthread_contention_site_t csite = {end_ns - start_ns, sampling_range};
+    submit_contention(csite, end_ns);
+    return rc;
+}
+
+// Called with write_queue_mutex locked.
+static int rwlock_wrlock_contended(bthread_rwlock_t* rw,
+                                   const struct timespec* abstime) {
+    butil::atomic<uint64_t>* state = rwlock_state(rw);
+    butil::atomic<unsigned>* writer_butex =
+        (butil::atomic<unsigned>*)rw->writer_butex;
+    while (true) {
+        const unsigned expected = writer_butex->load(butil::memory_order_acquire);
+        const uint64_t s = state->load(butil::memory_order_acquire);
+        if (!(s & (RWLOCK_READER_MASK | RWLOCK_WRITER_LOCKED))) {
+            // No one else changes the writer flags.
+            state->fetch_add(RWLOCK_WRITER_LOCKED - RWLOCK_WRITER_WAITING,
+                             butil::memory_order_acquire);
+            return 0;
+        }
+        if (butex_wait(writer_butex, expected, abstime) < 0 &&
+            errno == ETIMEDOUT) {
+            // Let readers blocked by us go.
+            rwlock_release_to_readers(state, rw->reader_butex,
+                                      RWLOCK_WRITER_WAITING);
+            bthread_mutex_unlock(&rw->write_queue_mutex);
+            return ETIMEDOUT;
+        }
+    }
+}
+
+static int rwlock_wrlock(bthread_rwlock_t* rw,
+                         const struct timespec* abstime) {
+    // Contentions between writers are sampled by the mutex.
+    const int rc = (abstime ?
+                    bthread_mutex_timedlock(&rw->write_queue_mutex, abstime) :
+                    bthread_mutex_lock(&rw->write_queue_mutex));
+    if (rc) {
+        return rc;
+    }
+    butil::atomic<uint64_t>* state = rwlock_state(rw);
+    const uint64_t s = state->fetch_or(RWLOCK_WRITER_WAITING,
+                                       butil::memory_order_acquire);
+    if (!(s & (RWLOCK_READER_MASK | RWLOCK_WRITER_LOCKED))) {
+        state->fetch_add(RWLOCK_WRITER_LOCKED - RWLOCK_WRITER_WAITING,
+                         butil::memory_order_acquire);
+        return 0;
+    }
+    const size_t sampling_range = contention_sampling_range();
+    if (!sampling_range) {
+        return rwlock_wrlock_contended(rw, abstime);
+    }
+    const int64_t start_ns = butil::cpuwide_time_ns();
+    const int rc2 = rwlock_wrlock_contended(rw, abstime);
+    const int64_t end_ns = butil::cpuwide_time_ns();
+    const bthread_contention_site_t csite = {end_ns - start_ns, sampling_range};
+    submit_contention(csite, end_ns);
+    return rc2;
+}
+
+static void rwlock_unlock_writer(bthread_rwlock_t* rw) {
+    butil::atomic<uint64_t>* state = rwlock_state(rw);
+    void* const reader_butex = rw->reader_butex;
+    butil::atomic<unsigned>* const writer_butex =
+        (butil::atomic<unsigned>*)rw->writer_butex;
+    // Unlock the mutex before the lock is released, after which `rw' may
+    // be destroyed. Next writer waits for the release.
+    bthread_mutex_unlock(&rw->write_queue_mutex);
+    const uint64_t prev =
+        rwlock_release_to_readers(state, reader_butex, RWLOCK_WRITER_LOCKED);
+    if (prev & RWLOCK_WRITER_WAITING) {
+        writer_butex->fetch_add(1, butil::memory_order_release);
+        butex_wake(writer_butex);
+    }
+}
+
+static void rwlock_unlock_reader(bthread_rwlock_t* rw) {
+    butil::atomic<unsigned>* const writer_butex =
+        (butil::atomic<unsigned>*)rw->writer_butex;
+    const uint64_t prev = rwlock_state(rw)->fetch_sub(
+        1, butil::memory_order_release);
+    if ((prev & RWLOCK_READER_MASK) == 1 && (prev & RWLOCK_WRITER_WAITING)) {
+        writer_butex->fetch_add(1, butil::memory_order_release);
+        butex_wake(writer_butex);
+    }
+}
+
+}  // namespace bthread
+
+extern "C" {
+
+int bthread_rwlock_init(bthread_rwlock_t* __restrict rw,
+                        const bthread_rwlockattr_t* __restrict) {
+    rw->reader_butex = bthread::butex_create_checked<unsigned>();
+    if (!rw->reader_butex) {
+        return ENOMEM;
+    }
+    rw->writer_butex = bthread::butex_create_checked<unsigned>();
+    if (!rw->writer_butex) {
+        bthread::butex_destroy(rw->reader_butex);
+        return ENOMEM;
+    }
+    const int rc = bthread_mutex_init(&rw->write_queue_mutex, NULL);
+    if (rc) {
+        bthread::butex_destroy(rw->writer_butex);
+        bthread::butex_destroy(rw->reader_butex);
+        return rc;
+    }
+    *rw->reader_butex = 0;
+    *rw->writer_butex = 0;
+    rw->state = 0;
+    return 0;
+}
+
+int bthread_rwlock_destroy(bthread_rwlock_t* rw) {
+    bthread_mutex_destroy(&rw->write_queue_mutex);
+    bthread::butex_destroy(rw->writer_butex);
+    bthread::butex_destroy(rw->reader_butex);
+    return 0;
+}
+
+int bthread_rwlock_rdlock(bthread_rwlock_t* rw) {
+    return bthread::rwlock_rdlock(rw, NULL);
+}
+
+int bthread_rwlock_tryrdlock(bthread_rwlock_t* rw) {
+    butil::atomic<uint64_t>* state = bthread::rwlock_state(rw);
+    uint64_t s = state->load(butil::memory_order_relaxed);
+    while (!(s & bthread::RWLOCK_WRITER_MASK)) {
+        if (state->compare_exchange_weak(
+                s, s + 1, butil::memory_order_acquire,
+                butil::memory_order_relaxed)) {
+            return 0;
+        }
+    }
+    return EBUSY;
+}
+
+int bthread_rwlock_timedrdlock(bthread_rwlock_t* __restrict rw,
+                               const struct timespec* __restrict abstime) {
+    return bthread::rwlock_rdlock(rw, abstime);
+}
+
+int bthread_rwlock_wrlock(bthread_rwlock_t* rw) {
+    return bthread::rwlock_wrlock(rw, NULL);
+}
+
+int bthread_rwlock_trywrlock(bthread_rwlock_t* rw) {
+    if (bthread_mutex_trylock(&rw->write_queue_mutex) != 0) {
+        return EBUSY;
+    }
+    butil::atomic<uint64_t>* state = bthread::rwlock_state(rw);
+    uint64_t s = state->load(butil::memory_order_relaxed);
+    while (!(s & (bthread::RWLOCK_READER_MASK |
+                  bthread::RWLOCK_WRITER_LOCKED))) {
+        if (state->compare_exchange_weak(
+                s, s | bthread::RWLOCK_WRITER_LOCKED,
+                butil::memory_order_acquire, butil::memory_order_relaxed)) {
+            return 0;
+        }
+    }
+    bthread_mutex_unlock(&rw->write_queue_mutex);
+    return EBUSY;
+}
+
+int bthread_rwlock_timedwrlock(bthread_rwlock_t* __restrict rw,
+                               const struct timespec* __restrict abstime) {
+    return bthread::rwlock_wrlock(rw, abstime);
+}
+
+int bthread_rwlock_unlock(bthread_rwlock_t* rw) {
+    const uint64_t s =
+        bthread::rwlock_state(rw)->load(butil::memory_order_relaxed);
+    if (s & bthread::RWLOCK_WRITER_LOCKED) {
+        bthread::rwlock_unlock_writer(rw);
+    } else if (s & bthread::RWLOCK_READER_MASK) {
+        bthread::rwlock_unlock_reader(rw);
+    } else {
+        return EPERM;
+    }
+    return 0;
+}
+
+int bthread_rwlockattr_init(bthread_rwlockattr_t*) {
+    return 0;
+}
+
+int bthread_rwlockattr_destroy(bthread_rwlockattr_t*) {
+    return 0;
+}
+
+#ifdef __GLIBC__
+BAIDU_CASSERT(BTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP ==
+              PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP,
+              rwlock_kind_must_match_glibc);
+#endif
+
+// bthread_rwlock_t is always writer-preferring.
+int bthread_rwlockattr_getkind_np(const bthread_rwlockattr_t*, int* pref) {
+    *pref = BTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP;
+    return 0;
+}
+
+int bthread_rwlockattr_setkind_np(bthread_rwlockattr_t*, int pref) {
+    return (pref == BTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP ?
+            0 : ENOTSUP);
+}
+
+}  // extern "C"
@@ -0,0 +1,70 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_RWLOCK_H
+#define BTHREAD_RWLOCK_H
+
+#include <system_error>                      // std::system_error
+#include "butil/logging.h"                     // CHECK_EQ
+#include "bthread/bthread.h"
+
+namespace bthread {
+
+// The C++ Wrapper of bthread_rwlock_t, satisfies SharedMutex of C++17 so
+// that it can be used with std::unique_lock and std::shared_lock.
+class RWLock {
+public:
+    typedef bthread_rwlock_t* native_handler_type;
+    RWLock() {
+        int ec = bthread_rwlock_init(&_rwlock, NULL);
+        if (ec != 0) {
+            throw std::system_error(std::error_code(ec, std::system_category()), "RWLock constructor failed");
+        }
+    }
+    ~RWLock() { CHECK_EQ(0, bthread_rwlock_destroy(&_rwlock)); }
+    native_handler_type native_handler() { return &_rwlock; }
+
+    // Exclusive locking.
+    void lock() {
+        int ec = bthread_rwlock_wrlock(&_rwlock);
+        if (ec != 0) {
+            throw std::system_error(std::error_code(ec, std::system_category()), "RWLock lock failed");
+        }
+    }
+    bool try_lock() { return !bthread_rwlock_trywrlock(&_rwlock); }
+    void unlock() { bthread_rwlock_unlock(&_rwlock); }
+
+    // Shared locking.
+    void lock_shared() {
+        int ec = bthread_rwlock_rdlock(&_rwlock);
+        if (ec != 0) {
+            throw std::system_error(std::error_code(ec, std::system_category()), "RWLock lock_shared failed");
+        }
+    }
+    bool try_lock_shared() { return !bthread_rwlock_tryrdlock(&_rwlock); }
+    void unlock_shared() { bthread_rwlock_unlock(&_rwlock); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RWLock);
+    bthread_rwlock_t _rwlock;
+};
+
+}  // namespace bthread
+
+#endif  // BTHREAD_RWLOCK_H
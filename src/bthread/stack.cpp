@@ -20,10 +20,16 @@
 // Date: Sun Sep  7 22:37:39 CST 2014
 
 #include <unistd.h>                               // getpagesize
+#include <dlfcn.h>                                // dladdr
 #include <sys/mman.h>                             // mmap, munmap, mprotect
 #include <algorithm>                              // std::max
 #include <stdlib.h>                               // posix_memalign
+#include <map>
+#include <vector>
 #include "butil/macros.h"                          // BAIDU_CASSERT
+#include "butil/scoped_lock.h"
+#include "butil/synchronization/lock.h"
+#include "butil/time.h"                            // monotonic_time_us
 #include "butil/memory/singleton_on_pthread_once.h"
 #include "butil/third_party/dynamic_annotations/dynamic_annotations.h" // RunningOnValgrind
 #include "butil/third_party/valgrind/valgrind.h"   // VALGRIND_STACK_REGISTER
@@ -37,6 +43,15 @@ DEFINE_int32(stack_size_large, 8388608, "size of large stacks");
 DEFINE_int32(guard_page_size, 4096, "size of guard page, allocate stacks by malloc if it's 0(not recommended)");
 DEFINE_int32(tc_stack_small, 32, "maximum small stacks cached by each thread");
 DEFINE_int32(tc_stack_normal, 8, "maximum normal stacks cached by each thread");
+DEFINE_int32(stack_usage_sampling_interval, 0, "Sample stack usage of one in "
+             "so many bthreads run by each worker, 0 to disable. Sampled "
+             "usages are shown in bvar `bthread_stack_usage'");
+DEFINE_bool(stack_trim_cached, false, "Release pages of returned stacks "
+            "beyond the sampled high-water mark of stacks in the same type, "
+            "requires -stack_usage_sampling_interval > 0");
+DEFINE_int32(stack_high_water_window_s, 10, "The high-water mark of stacks "
+             "is the max usage sampled in last 1 or 2 windows of so many "
+             "seconds, so that a deep bthread does not stop trimming forever");
 
 namespace bthread {
 
@@ -75,6 +90,7 @@ int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in)
         s->bottom = (char*)mem + stacksize;
         s->stacksize = stacksize;
         s->guardsize = 0;
+        s->keep_size = 0;
         if (RunningOnValgrind()) {
             s->valgrind_stack_id = VALGRIND_STACK_REGISTER(
                 s->bottom, (char*)s->bottom - stacksize);
@@ -120,6 +136,7 @@ int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in)
         s->bottom = (char*)mem + memsize;
         s->stacksize = stacksize;
         s->guardsize = guardsize;
+        s->keep_size = 0;
         if (RunningOnValgrind()) {
             s->valgrind_stack_id = VALGRIND_STACK_REGISTER(
                 s->bottom, (char*)s->bottom - stacksize);
@@ -146,6 +163,195 @@ void deallocate_stack_storage(StackStorage* s) {
     }
 }
 
+// Sampled max usage of stacks of each type in current and previous window,
+// read by trim_stack() without locking.
+static butil::static_atomic<int64_t> s_stack_high_water[STACK_TYPE_LARGE + 1] = {};
+
+struct HighWaterWindow {
+    int64_t start_us;
+    int64_t cur_max;
+    int64_t prev_max;
+};
+// Protected by s_stack_usage_mutex.
+static HighWaterWindow s_high_water_windows[STACK_TYPE_LARGE + 1] = {};
+
+struct StackUsage {
+    int64_t count;
+    int64_t sum;
+    int64_t max;
+    StackType stacktype;
+};
+static butil::Mutex* s_stack_usage_mutex = NULL;
+// entry function -> usage
+static std::map<void*, StackUsage>* s_stack_usage = NULL;
+static pthread_once_t s_stack_usage_once = PTHREAD_ONCE_INIT;
+static void init_stack_usage() {
+    s_stack_usage_mutex = new butil::Mutex;
+    s_stack_usage = new std::map<void*, StackUsage>;
+}
+
+static __thread int tls_stack_sampling_countdown = 0;
+
+static const uint64_t STACK_CANARY = 0x5441434b43414e59ULL;
+
+inline uintptr_t page_floor(uintptr_t addr) {
+    const static uintptr_t PAGESIZE = getpagesize();
+    return addr & ~(PAGESIZE - 1);
+}
+
+bool begin_sampling_stack_usage(ContextualStack* s) {
+    if (--tls_stack_sampling_countdown > 0) {
+        return false;
+    }
+    tls_stack_sampling_countdown = FLAGS_stack_usage_sampling_interval;
+    // Stacks allocated by malloc are not page-aligned and may share pages
+    // with other memory, don't touch them.
+    if (s == NULL || s->storage.guardsize <= 0 || s->storage.bottom == NULL) {
+        return false;
+    }
+    const static uintptr_t PAGESIZE = getpagesize();
+    const uintptr_t top = (uintptr_t)s->storage.bottom - s->storage.stacksize;
+    // Keep the page of current frame and the one below for frames of
+    // madvise() itself.
+    const uintptr_t end = page_floor((uintptr_t)__builtin_frame_address(0)) -
+        PAGESIZE;
+    if (end > top) {
+        madvise((void*)top, end - top, MADV_DONTNEED);
+    }
+    return true;
+}
+
+void end_sampling_stack_usage(ContextualStack* s, void* (*fn)(void*)) {
+    const static uintptr_t PAGESIZE = getpagesize();
+    const uintptr_t top = (uintptr_t)s->storage.bottom - s->storage.stacksize;
+    const uintptr_t end = page_floor((uintptr_t)__builtin_frame_address(0));
+    // Find the lowest resident page.
+    uintptr_t lowest = end;
+    unsigned char vec[256];
+    for (uintptr_t p = top; p < end; p += PAGESIZE * sizeof(vec)) {
+        const size_t len = std::min(end - p, PAGESIZE * sizeof(vec));
+        if (mincore((void*)p, len, vec) != 0) {
+            return;
+        }
+        size_t i = 0;
+        for (; i < (len + PAGESIZE - 1) / PAGESIZE && !(vec[i] & 1); ++i) {}
+        if (i < (len + PAGESIZE - 1) / PAGESIZE) {
+            lowest = p + i * PAGESIZE;
+            break;
+        }
+    }
+    const int64_t used = (uintptr_t)s->storage.bottom - lowest;
+    const int64_t now_us = butil::monotonic_time_us();
+    const int64_t window_us = FLAGS_stack_high_water_window_s * 1000000L;
+
+    pthread_once(&s_stack_usage_once, init_stack_usage);
+    BAIDU_SCOPED_LOCK(*s_stack_usage_mutex);
+    HighWaterWindow& w = s_high_water_windows[s->stacktype];
+    if (now_us - w.start_us >= window_us) {
+        // Usages sampled before last window are forgotten.
+        w.prev_max = (now_us - w.start_us < 2 * window_us ? w.cur_max : 0);
+        w.cur_max = 0;
+        w.start_us = now_us;
+    }
+    w.cur_max = std::max(w.cur_max, used);
+    s_stack_high_water[s->stacktype].store(
+        std::max(w.cur_max, w.prev_max), butil::memory_order_relaxed);
+
+    StackUsage& usage = (*s_stack_usage)[(void*)fn];
+    ++usage.count;
+    usage.sum += used;
+    usage.max = std::max(usage.max, used);
+    usage.stacktype = s->stacktype;
+}
+
+void trim_stack(ContextualStack* s) {
+    StackStorage& st = s->storage;
+    if (st.guardsize <= 0 || st.bottom == NULL) {
+        return;
+    }
+    const int64_t high_water =
+        s_stack_high_water[s->stacktype].load(butil::memory_order_relaxed);
+    if (high_water <= 0) {  // not sampled yet.
+        return;
+    }
+    const static uintptr_t PAGESIZE = getpagesize();
+    const uintptr_t bottom = (uintptr_t)st.bottom;
+    // Keep one more page, and never release the frames saved in context
+    // which run again when the stack is reused. The canary is put at
+    // `keep_begin', which must be strictly below the saved frames: when
+    // the context is page-aligned, the page below it is kept as well.
+    uintptr_t keep_begin = page_floor(bottom - high_water) - PAGESIZE;
+    keep_begin = std::min(keep_begin, page_floor((uintptr_t)s->context - 1));
+    const uintptr_t top = bottom - st.stacksize;
+    if (keep_begin <= top) {
+        return;
+    }
+    // Pages beyond the canary are likely untouched if it's intact. This is
+    // best effort: a frame larger than a page may skip over the canary and
+    // touch pages beyond, which are then kept until the canary is
+    // overwritten or the high-water mark changes.
+    uint64_t* canary = (uint64_t*)keep_begin;
+    if (st.keep_size == (int)(bottom - keep_begin) && *canary == STACK_CANARY) {
+        return;
+    }
+    madvise((void*)top, keep_begin - top, MADV_DONTNEED);
+    *canary = STACK_CANARY;
+    st.keep_size = bottom - keep_begin;
+}
+
+static const char* stack_type_name(StackType type) {
+    switch (type) {
+    case STACK_TYPE_SMALL:
+        return "small";
+    case STACK_TYPE_NORMAL:
+        return "normal";
+    case STACK_TYPE_LARGE:
+        return "large";
+    default:
+        return "unknown";
+    }
+}
+
+static bool sort_by_max(const std::pair<void*, StackUsage>& a,
+                        const std::pair<void*, StackUsage>& b) {
+    return a.second.max > b.second.max;
+}
+
+void print_stack_usage(std::ostream& os) {
+    os << "high_water small=" << s_stack_high_water[STACK_TYPE_SMALL].load(
+           butil::memory_order_relaxed)
+       << " normal=" << s_stack_high_water[STACK_TYPE_NORMAL].load(
+           butil::memory_order_relaxed)
+       << " large=" << s_stack_high_water[STACK_TYPE_LARGE].load(
+           butil::memory_order_relaxed);
+    std::vector<std::pair<void*, StackUsage> > usages;
+    pthread_once(&s_stack_usage_once, init_stack_usage);
+    {
+        BAIDU_SCOPED_LOCK(*s_stack_usage_mutex);
+        usages.assign(s_stack_usage->begin(), s_stack_usage->end());
+    }
+    std::sort(usages.begin(), usages.end(), sort_by_max);
+    const size_t MAX_SHOWN = 32;
+    for (size_t i = 0; i < usages.size() && i < MAX_SHOWN; ++i) {
+        const StackUsage& u = usages[i].second;
+        os << '\n' << usages[i].first;
+        Dl_info info;
+        if (dladdr(usages[i].first, &info) && info.dli_sname != NULL &&
+            info.dli_saddr == usages[i].first) {
+            os << '(' << info.dli_sname << ')';
+        }
+        os << " stack=" << stack_type_name(u.stacktype)
+           << " count=" << u.count << " avg=" << u.sum / u.count
+           << " max=" << u.max;
+    }
+}
+
+static void print_stack_usage_var(std::ostream& os, void*) {
+    print_stack_usage(os);
+}
+static bvar::PassiveStatus<std::string> bvar_stack_usage(
+    "bthread_stack_usage", print_stack_usage_var, NULL);
+
 int* SmallStackClass::stack_size_flag = &FLAGS_stack_size_small;
 int* NormalStackClass::stack_size_flag = &FLAGS_stack_size_normal;
 int* LargeStackClass::stack_size_flag = &FLAGS_stack_size_large;
@@ -23,6 +23,7 @@
 #define BTHREAD_ALLOCATE_STACK_H
 
 #include <assert.h>
+#include <ostream>
 #include <gflags/gflags.h>          // DECLARE_int32
 #include "bthread/types.h"
 #include "bthread/context.h"        // bthread_fcontext_t
@@ -37,6 +38,8 @@ struct StackStorage {
     // http://www.boost.org/doc/libs/1_55_0/libs/context/doc/html/context/stack.html
     void* bottom;
     unsigned valgrind_stack_id;
+    // Bytes below `bottom' kept by last trim_stack(), 0 if not trimmed.
+    int keep_size;
 
     // Clears all members.
     void zeroize() {
@@ -44,6 +47,7 @@ struct StackStorage {
         guardsize = 0;
         bottom = NULL;
         valgrind_stack_id = 0;
+        keep_size = 0;
     }
 };
  
@@ -76,6 +80,21 @@ void return_stack(ContextualStack*);
 // (to save contexts before jumping)
 void jump_stack(ContextualStack* from, ContextualStack* to);
 
+// Called on stack `s' before running the entry function of a bthread.
+// Returns true if stack usage of this run should be sampled, in which case
+// pages below the callsite are released so that pages touched by the entry
+// function can be counted by end_sampling_stack_usage().
+bool begin_sampling_stack_usage(ContextualStack* s);
+// Called on stack `s' after the entry function `fn' returned.
+void end_sampling_stack_usage(ContextualStack* s, void* (*fn)(void*));
+
+// Release pages of the unused stack `s' beyond the sampled high-water mark
+// of stacks in the same type.
+void trim_stack(ContextualStack* s);
+
+// Print sampled stack usages of stack types and entry functions.
+void print_stack_usage(std::ostream& os);
+
 }  // namespace bthread
 
 #include "bthread/stack_inl.h"
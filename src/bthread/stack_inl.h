@@ -25,6 +25,8 @@
 DECLARE_int32(guard_page_size);
 DECLARE_int32(tc_stack_small);
 DECLARE_int32(tc_stack_normal);
+DECLARE_int32(stack_usage_sampling_interval);
+DECLARE_bool(stack_trim_cached);
 
 namespace bthread {
 
@@ -72,6 +74,9 @@ template <typename StackClass> struct StackFactory {
     }
     
     static void return_stack(ContextualStack* sc) {
+        if (FLAGS_stack_trim_cached) {
+            trim_stack(sc);
+        }
         butil::return_object(static_cast<Wrapper*>(sc));
     }
 };
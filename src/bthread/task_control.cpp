@@ -19,6 +19,8 @@
 
 // Date: Tue Jul 10 17:40:58 CST 2012
 
+#include <dirent.h>                        // opendir
+#include <sched.h>                         // sched_getaffinity
 #include "butil/scoped_lock.h"             // BAIDU_SCOPED_LOCK
 #include "butil/errno.h"                   // berror
 #include "butil/logging.h"
@@ -38,6 +40,10 @@ DEFINE_int32(task_group_runqueue_capacity, 4096,
              "capacity of runqueue in each TaskGroup");
 DEFINE_int32(task_group_yield_before_idle, 0,
              "TaskGroup yields so many times before idle");
+DEFINE_bool(task_group_numa_aware, false,
+            "Bind workers to NUMA nodes in round-robin and steal tasks from "
+            "workers on the same node first. Read at initialization of "
+            "bthread only");
 
 namespace bthread {
 
@@ -55,6 +61,133 @@ void run_worker_startfn() {
     }
 }
 
+int parse_cpu_list(const char* str, std::vector<int>* cpus) {
+    cpus->clear();
+    const char* p = str;
+    while (*p != '\0' && *p != '\n') {
+        char* endptr = NULL;
+        const long first = strtol(p, &endptr, 10);
+        if (endptr == p || first < 0) {
+            return -1;
+        }
+        long last = first;
+        p = endptr;
+        if (*p == '-') {
+            ++p;
+            last = strtol(p, &endptr, 10);
+            if (endptr == p || last < first) {
+                return -1;
+            }
+            p = endptr;
+        }
+        for (long i = first; i <= last; ++i) {
+            cpus->push_back((int)i);
+        }
+        if (*p == ',') {
+            ++p;
+        } else if (*p != '\0' && *p != '\n') {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void TaskControl::init_numa_nodes() {
+    _node_cpus.clear();
+#if defined(OS_LINUX)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        PLOG(WARNING) << "Fail to sched_getaffinity";
+        return;
+    }
+    const char* const node_dir = "/sys/devices/system/node";
+    DIR* dir = opendir(node_dir);
+    if (dir == NULL) {
+        PLOG(WARNING) << "Fail to open " << node_dir;
+        return;
+    }
+    std::vector<std::vector<int> > nodes;
+    while (struct dirent* ent = readdir(dir)) {
+        int node = -1;
+        if (sscanf(ent->d_name, "node%d", &node) != 1 || node < 0) {
+            continue;
+        }
+        char path[256];
+        snprintf(path, sizeof(path), "%s/%s/cpulist", node_dir, ent->d_name);
+        FILE* fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+        char buf[1024];
+        std::vector<int> cpus;
+        if (fgets(buf, sizeof(buf), fp) != NULL &&
+            parse_cpu_list(buf, &cpus) == 0) {
+            std::vector<int> usable;
+            for (size_t i = 0; i < cpus.size(); ++i) {
+                if (cpus[i] < CPU_SETSIZE && CPU_ISSET(cpus[i], &allowed)) {
+                    usable.push_back(cpus[i]);
+                }
+            }
+            if (!usable.empty()) {
+                if ((size_t)node >= nodes.size()) {
+                    nodes.resize(node + 1);
+                }
+                nodes[node].swap(usable);
+            }
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+    // Compact away nodes without usable cpus (memory-only or excluded).
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (!nodes[i].empty()) {
+            _node_cpus.push_back(nodes[i]);
+        }
+    }
+#endif
+    if (_node_cpus.size() <= 1) {
+        LOG(INFO) << "Found " << _node_cpus.size()
+                  << " NUMA node, workers are not bound";
+        _node_cpus.clear();
+        return;
+    }
+    _node_groups = new NodeGroups[_node_cpus.size()];
+    for (size_t i = 0; i < _node_cpus.size(); ++i) {
+        _node_groups[i].ngroup.store(0, butil::memory_order_relaxed);
+        _node_groups[i].groups = (TaskGroup**)calloc(
+            BTHREAD_MAX_CONCURRENCY, sizeof(TaskGroup*));
+        CHECK(_node_groups[i].groups) << "Fail to create array of groups";
+    }
+    LOG(INFO) << "Partition workers into " << _node_cpus.size()
+              << " NUMA nodes";
+}
+
+int TaskControl::bind_worker_to_numa_node() {
+    if (_node_cpus.empty()) {
+        return -1;
+    }
+    const int node = _next_worker_node.fetch_add(
+        1, butil::memory_order_relaxed) % _node_cpus.size();
+#if defined(OS_LINUX)
+    // Memory is allocated on the node of first touch by default, binding
+    // before creating TaskGroup makes the runqueue, stacks and TaskMetas
+    // allocated by this worker node-local.
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    const std::vector<int>& cpus = _node_cpus[node];
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        CPU_SET(cpus[i], &cs);
+    }
+    const int rc = pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+    if (rc != 0) {
+        LOG(WARNING) << "Fail to bind worker to NUMA node " << node
+                     << ", " << berror(rc);
+    }
+#endif
+    return node;
+}
+
 void* TaskControl::worker_thread(void* arg) {
     run_worker_startfn();    
 #ifdef BAIDU_INTERNAL
@@ -62,7 +195,8 @@ void* TaskControl::worker_thread(void* arg) {
 #endif
     
     TaskControl* c = static_cast<TaskControl*>(arg);
-    TaskGroup* g = c->create_group();
+    const int numa_node = c->bind_worker_to_numa_node();
+    TaskGroup* g = c->create_group(numa_node);
     TaskStatistics stat;
     if (NULL == g) {
         LOG(ERROR) << "Fail to create TaskGroup in pthread=" << pthread_self();
@@ -85,12 +219,13 @@ void* TaskControl::worker_thread(void* arg) {
     return NULL;
 }
 
-TaskGroup* TaskControl::create_group() {
+TaskGroup* TaskControl::create_group(int numa_node) {
     TaskGroup* g = new (std::nothrow) TaskGroup(this);
     if (NULL == g) {
         LOG(FATAL) << "Fail to new TaskGroup";
         return NULL;
     }
+    g->_numa_node = numa_node;
     if (g->init(FLAGS_task_group_runqueue_capacity) != 0) {
         LOG(ERROR) << "Fail to init TaskGroup";
         delete g;
@@ -124,6 +259,9 @@ TaskControl::TaskControl()
     // NOTE: all fileds must be initialized before the vars.
     : _ngroup(0)
     , _groups((TaskGroup**)calloc(BTHREAD_MAX_CONCURRENCY, sizeof(TaskGroup*)))
+    , _node_groups(NULL)
+    , _next_worker_node(0)
+    , _has_high_priority(false)
     , _stop(false)
     , _concurrency(0)
     , _nworkers("bthread_worker_count")
@@ -159,6 +297,10 @@ int TaskControl::init(int concurrency) {
         LOG(ERROR) << "Fail to get global_timer_thread";
         return -1;
     }
+
+    if (FLAGS_task_group_numa_aware) {
+        init_numa_nodes();
+    }
     
     _workers.resize(_concurrency);   
     for (int i = 0; i < _concurrency; ++i) {
@@ -258,6 +400,13 @@ TaskControl::~TaskControl() {
 
     free(_groups);
     _groups = NULL;
+    if (_node_groups) {
+        for (size_t i = 0; i < _node_cpus.size(); ++i) {
+            free(_node_groups[i].groups);
+        }
+        delete [] _node_groups;
+        _node_groups = NULL;
+    }
 }
 
 int TaskControl::_add_group(TaskGroup* g) {
@@ -273,6 +422,14 @@ int TaskControl::_add_group(TaskGroup* g) {
         _groups[ngroup] = g;
         _ngroup.store(ngroup + 1, butil::memory_order_release);
     }
+    if (g->_numa_node >= 0) {
+        NodeGroups& ng = _node_groups[g->_numa_node];
+        const size_t nlocal = ng.ngroup.load(butil::memory_order_relaxed);
+        if (nlocal < (size_t)BTHREAD_MAX_CONCURRENCY) {
+            ng.groups[nlocal] = g;
+            ng.ngroup.store(nlocal + 1, butil::memory_order_release);
+        }
+    }
     mu.unlock();
     // See the comments in _destroy_group
     // TODO: Not needed anymore since non-worker pthread cannot have TaskGroup
@@ -317,6 +474,18 @@ int TaskControl::_destroy_group(TaskGroup* g) {
                 break;
             }
         }
+        if (g->_numa_node >= 0) {
+            // Same as above.
+            NodeGroups& ng = _node_groups[g->_numa_node];
+            const size_t nlocal = ng.ngroup.load(butil::memory_order_relaxed);
+            for (size_t i = 0; i < nlocal; ++i) {
+                if (ng.groups[i] == g) {
+                    ng.groups[i] = ng.groups[nlocal - 1];
+                    ng.ngroup.store(nlocal - 1, butil::memory_order_release);
+                    break;
+                }
+            }
+        }
     }
 
     // Can't delete g immediately because for performance consideration,
@@ -332,21 +501,23 @@ int TaskControl::_destroy_group(TaskGroup* g) {
     return 0;
 }
 
-bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
-    // 1: Acquiring fence is paired with releasing fence in _add_group to
-    // avoid accessing uninitialized slot of _groups.
-    const size_t ngroup = _ngroup.load(butil::memory_order_acquire/*1*/);
-    if (0 == ngroup) {
-        return false;
-    }
-
+bool TaskControl::steal_task_from(TaskGroup** groups, size_t ngroup,
+                                  bthread_t* tid, size_t* seed,
+                                  size_t offset, bool high_priority) {
     // NOTE: Don't return inside `for' iteration since we need to update |seed|
     bool stolen = false;
     size_t s = *seed;
     for (size_t i = 0; i < ngroup; ++i, s += offset) {
-        TaskGroup* g = _groups[s % ngroup];
+        TaskGroup* g = groups[s % ngroup];
         // g is possibly NULL because of concurrent _destroy_group
         if (g) {
+            if (high_priority) {
+                if (g->_high_rq.steal(tid) || g->_high_remote_rq.pop(tid)) {
+                    stolen = true;
+                    break;
+                }
+                continue;
+            }
             if (g->_rq.steal(tid)) {
                 stolen = true;
                 break;
@@ -361,6 +532,39 @@ bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
     return stolen;
 }
 
+bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset,
+                             int numa_node) {
+    if (_has_high_priority.load(butil::memory_order_relaxed) &&
+        steal_task_of_priority(tid, seed, offset, numa_node, true)) {
+        return true;
+    }
+    return steal_task_of_priority(tid, seed, offset, numa_node, false);
+}
+
+bool TaskControl::steal_task_of_priority(bthread_t* tid, size_t* seed,
+                                         size_t offset, int numa_node,
+                                         bool high_priority) {
+    // Steal within the node first, stealing from other nodes accesses
+    // remote TaskMetas and stacks.
+    if (numa_node >= 0) {
+        const NodeGroups& ng = _node_groups[numa_node];
+        const size_t nlocal = ng.ngroup.load(butil::memory_order_acquire);
+        if (nlocal != 0 &&
+            steal_task_from(ng.groups, nlocal, tid, seed, offset,
+                            high_priority)) {
+            return true;
+        }
+    }
+    // 1: Acquiring fence is paired with releasing fence in _add_group to
+    // avoid accessing uninitialized slot of _groups.
+    const size_t ngroup = _ngroup.load(butil::memory_order_acquire/*1*/);
+    if (0 == ngroup) {
+        return false;
+    }
+    return steal_task_from(_groups, ngroup, tid, seed, offset,
+                           high_priority);
+}
+
 void TaskControl::signal_task(int num_task) {
     if (num_task <= 0) {
         return;
@@ -401,7 +605,8 @@ void TaskControl::print_rq_sizes(std::ostream& os) {
         // ngroup > _ngroup: nums[_ngroup ... ngroup-1] = 0
         // ngroup < _ngroup: just ignore _groups[_ngroup ... ngroup-1]
         for (size_t i = 0; i < ngroup; ++i) {
-            nums[i] = (_groups[i] ? _groups[i]->_rq.volatile_size() : 0);
+            nums[i] = (_groups[i] ? (_groups[i]->_rq.volatile_size() +
+                                     _groups[i]->_high_rq.volatile_size()) : 0);
         }
     }
     for (size_t i = 0; i < ngroup; ++i) {
@@ -26,6 +26,7 @@
 #include <iostream>                             // std::ostream
 #endif
 #include <stddef.h>                             // size_t
+#include <vector>
 #include "butil/atomicops.h"                     // butil::atomic
 #include "bvar/bvar.h"                          // bvar::PassiveStatus
 #include "bthread/task_meta.h"                  // TaskMeta
@@ -48,11 +49,23 @@ public:
     // Must be called before using. `nconcurrency' is # of worker pthreads.
     int init(int nconcurrency);
     
-    // Create a TaskGroup in this control.
-    TaskGroup* create_group();
-
-    // Steal a task from a "random" group.
-    bool steal_task(bthread_t* tid, size_t* seed, size_t offset);
+    // Create a TaskGroup in this control. `numa_node' is the NUMA node that
+    // the calling worker is bound to, -1 if it's not bound.
+    TaskGroup* create_group(int numa_node);
+
+    // Steal a task from a "random" group. Groups on `numa_node' are tried
+    // before others if it's not -1. High-priority tasks are tried before
+    // normal ones.
+    bool steal_task(bthread_t* tid, size_t* seed, size_t offset,
+                    int numa_node);
+
+    // Called when a high-priority task is queued. Workers don't look for
+    // high-priority tasks in other groups before the first call.
+    void mark_high_priority_queued() {
+        if (!_has_high_priority.load(butil::memory_order_relaxed)) {
+            _has_high_priority.store(true, butil::memory_order_relaxed);
+        }
+    }
 
     // Tell other groups that `n' tasks was just added to caller's runqueue
     void signal_task(int num_task);
@@ -78,7 +91,33 @@ public:
     // If this method is called after init(), it never returns NULL.
     TaskGroup* choose_one_group();
 
+    // # of NUMA nodes that workers are partitioned into, 0 if workers are
+    // not NUMA-aware.
+    int numa_node_count() const { return (int)_node_cpus.size(); }
+
 private:
+    // Groups of workers bound to a NUMA node.
+    struct NodeGroups {
+        butil::atomic<size_t> ngroup;
+        TaskGroup** groups;
+    };
+
+    // Read NUMA nodes with cpus usable by this process into _node_cpus.
+    void init_numa_nodes();
+    // Bind calling worker to cpus of next NUMA node in round-robin.
+    // Returns the node, -1 if workers are not NUMA-aware.
+    int bind_worker_to_numa_node();
+
+    // Steal a task from one of `groups' in the order decided by `*seed' and
+    // `offset'. Only high-priority queues are checked if `high_priority' is
+    // true, only normal ones otherwise.
+    static bool steal_task_from(TaskGroup** groups, size_t ngroup,
+                                bthread_t* tid, size_t* seed, size_t offset,
+                                bool high_priority);
+
+    bool steal_task_of_priority(bthread_t* tid, size_t* seed, size_t offset,
+                                int numa_node, bool high_priority);
+
     // Add/Remove a TaskGroup.
     // Returns 0 on success, -1 otherwise.
     int _add_group(TaskGroup*);
@@ -95,6 +134,15 @@ private:
     TaskGroup** _groups;
     butil::Mutex _modify_group_mutex;
 
+    // Indexed by NUMA node, empty when NUMA-aware is off or there's only
+    // one node.
+    std::vector<std::vector<int> > _node_cpus;
+    NodeGroups* _node_groups;
+    butil::atomic<size_t> _next_worker_node;
+
+    // True if any high-priority task was ever queued.
+    butil::atomic<bool> _has_high_priority;
+
     bool _stop;
     butil::atomic<int> _concurrency;
     std::vector<pthread_t> _workers;
@@ -123,6 +171,10 @@ inline bvar::LatencyRecorder& TaskControl::exposed_pending_time() {
     return *pt;
 }
 
+// Parse cpu list in format of /sys/devices/system/node/node*/cpulist,
+// e.g. "0-3,8,10-11". Returns 0 on success, -1 otherwise.
+int parse_cpu_list(const char* str, std::vector<int>* cpus);
+
 }  // namespace bthread
 
 #endif  // BTHREAD_TASK_CONTROL_H
@@ -188,10 +188,12 @@ TaskGroup::TaskGroup(TaskControl* c)
     , _last_context_remained(NULL)
     , _last_context_remained_arg(NULL)
     , _pl(NULL)
+    , _numa_node(-1)
     , _main_stack(NULL)
     , _main_tid(0)
     , _remote_num_nosignal(0)
     , _remote_nsignaled(0)
+    , _nhigh_popped(0)
 {
     _steal_seed = butil::fast_rand();
     _steal_offset = OFFSET_TABLE[_steal_seed % ARRAY_SIZE(OFFSET_TABLE)];
@@ -218,6 +220,14 @@ int TaskGroup::init(size_t runqueue_capacity) {
         LOG(FATAL) << "Fail to init _remote_rq";
         return -1;
     }
+    if (_high_rq.init(runqueue_capacity) != 0) {
+        LOG(FATAL) << "Fail to init _high_rq";
+        return -1;
+    }
+    if (_high_remote_rq.init(runqueue_capacity / 2) != 0) {
+        LOG(FATAL) << "Fail to init _high_remote_rq";
+        return -1;
+    }
     ContextualStack* stk = get_stack(STACK_TYPE_MAIN, NULL);
     if (NULL == stk) {
         LOG(FATAL) << "Fail to get main stack container";
@@ -291,11 +301,16 @@ void TaskGroup::task_runner(intptr_t skip_remained) {
         // not caught explicitly. This is consistent with other threading
         // libraries.
         void* thread_return;
+        const bool sampling_stack = (FLAGS_stack_usage_sampling_interval > 0 &&
+                                     begin_sampling_stack_usage(m->stack));
         try {
             thread_return = m->fn(m->arg);
         } catch (ExitException& e) {
             thread_return = e.value();
         }
+        if (sampling_stack) {
+            end_sampling_stack_usage(m->stack, m->fn);
+        }
 
         // Group is probably changed
         g = tls_task_group;
@@ -508,15 +523,7 @@ void TaskGroup::ending_sched(TaskGroup** pg) {
     TaskGroup* g = *pg;
     bthread_t next_tid = 0;
     // Find next task to run, if none, switch to idle thread of the group.
-#ifndef BTHREAD_FAIR_WSQ
-    // When BTHREAD_FAIR_WSQ is defined, profiling shows that cpu cost of
-    // WSQ::steal() in example/multi_threaded_echo_c++ changes from 1.9%
-    // to 2.9%
-    const bool popped = g->_rq.pop(&next_tid);
-#else
-    const bool popped = g->_rq.steal(&next_tid);
-#endif
-    if (!popped && !g->steal_task(&next_tid)) {
+    if (!g->pop_rq(&next_tid) && !g->steal_task(&next_tid)) {
         // Jump to main task if there's no task to run.
         next_tid = g->_main_tid;
     }
@@ -549,12 +556,7 @@ void TaskGroup::sched(TaskGroup** pg) {
     TaskGroup* g = *pg;
     bthread_t next_tid = 0;
     // Find next task to run, if none, switch to idle thread of the group.
-#ifndef BTHREAD_FAIR_WSQ
-    const bool popped = g->_rq.pop(&next_tid);
-#else
-    const bool popped = g->_rq.steal(&next_tid);
-#endif
-    if (!popped && !g->steal_task(&next_tid)) {
+    if (!g->pop_rq(&next_tid) && !g->steal_task(&next_tid)) {
         // Jump to main task if there's no task to run.
         next_tid = g->_main_tid;
     }
@@ -665,6 +667,9 @@ void TaskGroup::flush_nosignal_tasks() {
 }
 
 void TaskGroup::ready_to_run_remote(bthread_t tid, bool nosignal) {
+    if (is_high_priority(tid)) {
+        return ready_to_run_remote_high_priority(tid, nosignal);
+    }
     _remote_rq._mutex.lock();
     while (!_remote_rq.push_locked(tid)) {
         flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
@@ -685,6 +690,30 @@ void TaskGroup::ready_to_run_remote(bthread_t tid, bool nosignal) {
     }
 }
 
+void TaskGroup::ready_to_run_remote_high_priority(bthread_t tid,
+                                                  bool nosignal) {
+    _control->mark_high_priority_queued();
+    while (!_high_remote_rq.push(tid)) {
+        flush_nosignal_tasks_remote();
+        LOG_EVERY_SECOND(ERROR) << "_high_remote_rq is full, capacity="
+                                << _high_remote_rq.capacity();
+        ::usleep(1000);
+    }
+    // Share the nosignal counter with _remote_rq so that the signal is
+    // delivered by the next flush_nosignal_tasks_remote() or signaled task.
+    _remote_rq._mutex.lock();
+    if (nosignal) {
+        ++_remote_num_nosignal;
+        _remote_rq._mutex.unlock();
+    } else {
+        const int additional_signal = _remote_num_nosignal;
+        _remote_num_nosignal = 0;
+        _remote_nsignaled += 1 + additional_signal;
+        _remote_rq._mutex.unlock();
+        _control->signal_task(1 + additional_signal);
+    }
+}
+
 void TaskGroup::flush_nosignal_tasks_remote_locked(butil::Mutex& locked_mutex) {
     const int val = _remote_num_nosignal;
     if (!val) {
@@ -178,8 +178,9 @@ public:
     // Get the meta associate with the task.
     static TaskMeta* address_meta(bthread_t tid);
 
-    // Push a task into _rq, if _rq is full, retry after some time. This
-    // process make go on indefinitely.
+    // Push a task into _rq (or _high_rq if the task is high-priority), if
+    // the queue is full, retry after some time. This process make go on
+    // indefinitely.
     void push_rq(bthread_t tid);
 
 private:
@@ -211,14 +212,23 @@ friend class TaskControl;
     // loop calling this function should end.
     bool wait_task(bthread_t* tid);
 
+    // Pop a task from _high_rq or _rq.
+    bool pop_rq(bthread_t* tid);
+
+    // True if the task has BTHREAD_HIGH_PRIORITY.
+    static bool is_high_priority(bthread_t tid);
+
+    void ready_to_run_remote_high_priority(bthread_t tid, bool nosignal);
+
     bool steal_task(bthread_t* tid) {
-        if (_remote_rq.pop(tid)) {
+        if (_high_remote_rq.pop(tid) || _remote_rq.pop(tid)) {
             return true;
         }
 #ifndef BTHREAD_DONT_SAVE_PARKING_STATE
         _last_pl_state = _pl->get_state();
 #endif
-        return _control->steal_task(tid, &_steal_seed, _steal_offset);
+        return _control->steal_task(tid, &_steal_seed, _steal_offset,
+                                    _numa_node);
     }
 
 #ifndef NDEBUG
@@ -245,12 +255,19 @@ friend class TaskControl;
 #endif
     size_t _steal_seed;
     size_t _steal_offset;
+    // NUMA node of the worker, -1 if the worker is not bound to a node.
+    int _numa_node;
     ContextualStack* _main_stack;
     bthread_t _main_tid;
     WorkStealingQueue<bthread_t> _rq;
     RemoteTaskQueue _remote_rq;
     int _remote_num_nosignal;
     int _remote_nsignaled;
+    // Queues of high-priority tasks, popped before _rq and _remote_rq.
+    WorkStealingQueue<bthread_t> _high_rq;
+    RemoteTaskQueue _high_remote_rq;
+    // Number of high-priority tasks popped from _high_rq in a row.
+    int _nhigh_popped;
 };
 
 }  // namespace bthread
@@ -18,7 +18,9 @@
 // bthread - A M:N threading library to make applications more concurrent.
 
 
+#include <string.h>                        // memset
 #include <queue>                           // heap functions
+#include <gflags/gflags.h>
 #include "butil/scoped_lock.h"
 #include "butil/logging.h"
 #include "butil/third_party/murmurhash3/murmurhash3.h"   // fmix64
@@ -28,6 +30,11 @@
 #include "bthread/timer_thread.h"
 #include "bthread/log.h"
 
+DEFINE_bool(timer_thread_timing_wheel, false,
+            "Keep tasks of the global TimerThread in a hierarchical timing "
+            "wheel rather than the heap. Read at creation of the TimerThread "
+            "only");
+
 namespace bthread {
 
 // Defined in task_control.cpp
@@ -36,7 +43,8 @@ void run_worker_startfn();
 const TimerThread::TaskId TimerThread::INVALID_TASK_ID = 0;
 
 TimerThreadOptions::TimerThreadOptions()
-    : num_buckets(13) {
+    : num_buckets(13)
+    , use_timing_wheel(false) {
 }
 
 // A task contains the necessary information for running fn(arg).
@@ -116,6 +124,144 @@ inline bool task_greater(const TimerThread::Task* a, const TimerThread::Task* b)
     return a->run_time > b->run_time;
 }
 
+// Hierarchical timing wheel of NUM_LEVELS levels, each level has 64 slots
+// and a slot of level L spans 64^L ticks. A task is put into the lowest
+// level in which its tick shares the higher digits with the current tick,
+// and is moved down (cascaded) when the current tick enters its slot, so
+// each task is moved at most NUM_LEVELS times. Occupied slots are marked
+// in bitmaps so that the next tick to process is found without walking
+// through empty slots.
+// Only accessed by the timer thread, no synchronization is needed.
+class TimingWheel {
+public:
+    typedef TimerThread::Task Task;
+
+    static const int64_t TICK_US = 1000;
+    static const int LEVEL_BITS = 6;
+    static const int NUM_SLOTS = (1 << LEVEL_BITS);
+    // 64^6 ticks of 1ms are more than 2 years.
+    static const int NUM_LEVELS = 6;
+
+    explicit TimingWheel(int64_t now_us) : _current_tick(now_us / TICK_US) {
+        memset(_slots, 0, sizeof(_slots));
+        memset(_bitmaps, 0, sizeof(_bitmaps));
+    }
+
+    // Put `task' into the wheel.
+    // Returns false if the task is due in current tick or too far from now,
+    // and should be put into the heap instead.
+    bool add(Task* task) {
+        const int64_t tick = task->run_time / TICK_US;
+        if (tick <= _current_tick) {
+            return false;
+        }
+        for (int level = 0; level < NUM_LEVELS; ++level) {
+            const int shift = LEVEL_BITS * (level + 1);
+            if ((tick >> shift) == (_current_tick >> shift)) {
+                const int slot = (tick >> (shift - LEVEL_BITS)) & (NUM_SLOTS - 1);
+                task->next = _slots[level][slot];
+                _slots[level][slot] = task;
+                _bitmaps[level] |= (1ULL << slot);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Advance the wheel to `now_us' and call on_due(task) for each task
+    // whose tick has come. Unscheduled tasks are deleted on the way.
+    template <typename OnDue>
+    void advance(int64_t now_us, OnDue& on_due) {
+        const int64_t target = now_us / TICK_US;
+        while (_current_tick < target) {
+            // Ticks before next_tick() touch no occupied slots, skip them.
+            const int64_t tick = next_tick();
+            if (tick > target) {
+                _current_tick = target;
+                break;
+            }
+            _current_tick = tick;
+            for (int level = NUM_LEVELS - 1; level > 0; --level) {
+                if (tick & ((1LL << (LEVEL_BITS * level)) - 1)) {
+                    continue;
+                }
+                Task* p = take_slot(level, (tick >> (LEVEL_BITS * level)) &
+                                    (NUM_SLOTS - 1));
+                while (p) {
+                    Task* next_task = p->next;
+                    if (!p->try_delete() && !add(p)) {
+                        on_due(p);
+                    }
+                    p = next_task;
+                }
+            }
+            Task* p = take_slot(0, tick & (NUM_SLOTS - 1));
+            while (p) {
+                Task* next_task = p->next;
+                if (!p->try_delete()) {
+                    on_due(p);
+                }
+                p = next_task;
+            }
+        }
+    }
+
+    // The realtime that advance() should be called at, max of int64_t
+    // if the wheel is empty.
+    int64_t next_run_time() const {
+        const int64_t tick = next_tick();
+        if (tick == std::numeric_limits<int64_t>::max()) {
+            return tick;
+        }
+        return tick * TICK_US;
+    }
+
+private:
+    // The nearest tick at which a slot should be cascaded or expired.
+    int64_t next_tick() const {
+        int64_t result = std::numeric_limits<int64_t>::max();
+        for (int level = 0; level < NUM_LEVELS; ++level) {
+            if (_bitmaps[level] == 0) {
+                continue;
+            }
+            const int shift = LEVEL_BITS * level;
+            const int cur_slot = (_current_tick >> shift) & (NUM_SLOTS - 1);
+            // Occupied slots are always after the current one.
+            const uint64_t mask = _bitmaps[level] & ~((2ULL << cur_slot) - 1);
+            if (mask == 0) {
+                continue;
+            }
+            const int64_t tick = ((_current_tick >> shift) +
+                                  (__builtin_ctzll(mask) - cur_slot)) << shift;
+            if (tick < result) {
+                result = tick;
+            }
+        }
+        return result;
+    }
+
+    Task* take_slot(int level, int slot) {
+        Task* head = _slots[level][slot];
+        _slots[level][slot] = NULL;
+        _bitmaps[level] &= ~(1ULL << slot);
+        return head;
+    }
+
+    int64_t _current_tick;
+    Task* _slots[NUM_LEVELS][NUM_SLOTS];
+    uint64_t _bitmaps[NUM_LEVELS];
+};
+
+// Push tasks expired from the TimingWheel into the heap.
+struct PushToHeap {
+    explicit PushToHeap(std::vector<TimerThread::Task*>* tasks) : _tasks(tasks) {}
+    void operator()(TimerThread::Task* task) {
+        _tasks->push_back(task);
+        std::push_heap(_tasks->begin(), _tasks->end(), task_greater);
+    }
+    std::vector<TimerThread::Task*>* _tasks;
+};
+
 void* TimerThread::run_this(void* arg) {
     static_cast<TimerThread*>(arg)->run();
     return NULL;
@@ -322,6 +468,9 @@ void TimerThread::run() {
     // min heap of tasks (ordered by run_time)
     std::vector<Task*> tasks;
     tasks.reserve(4096);
+    // tasks far from running, only used when use_timing_wheel is true.
+    TimingWheel wheel(last_sleep_time);
+    PushToHeap push_to_heap(&tasks);
 
     // vars
     size_t nscheduled = 0;
@@ -357,12 +506,16 @@ void TimerThread::run() {
                 Task* next_task = p->next;
 
                 if (!p->try_delete()) { // remove the task if it's unscheduled
-                    tasks.push_back(p);
-                    std::push_heap(tasks.begin(), tasks.end(), task_greater);
+                    if (!_options.use_timing_wheel || !wheel.add(p)) {
+                        push_to_heap(p);
+                    }
                 }
                 p = next_task;
             }
         }
+        if (_options.use_timing_wheel) {
+            wheel.advance(butil::gettimeofday_us(), push_to_heap);
+        }
 
         bool pull_again = false;
         while (!tasks.empty()) {
@@ -404,6 +557,9 @@ void TimerThread::run() {
         if (!tasks.empty()) {
             next_run_time = tasks[0]->run_time;
         }
+        if (_options.use_timing_wheel) {
+            next_run_time = std::min(next_run_time, wheel.next_run_time());
+        }
         // Similarly with the situation before running tasks, we check
         // _nearest_run_time to prevent us from waiting on a non-earliest
         // task. We also use the _nsignal to make sure that if new task 
@@ -462,6 +618,7 @@ static void init_global_timer_thread() {
     }
     TimerThreadOptions options;
     options.bvar_prefix = "bthread_timer";
+    options.use_timing_wheel = FLAGS_timer_thread_timing_wheel;
     const int rc = g_timer_thread->start(&options);
     if (rc != 0) {
         LOG(FATAL) << "Fail to start timer_thread, " << berror(rc);
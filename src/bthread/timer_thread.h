@@ -43,6 +43,14 @@ struct TimerThreadOptions {
     // Default: ""
     std::string bvar_prefix;
 
+    // Keep tasks far from running in a hierarchical timing wheel with 1ms
+    // ticks instead of the heap, which makes scheduling O(1) and purges
+    // unscheduled tasks (e.g. timeouts of RPC which already responded)
+    // before they ever reach the heap. Tasks are moved into the heap when
+    // their tick comes, so they still run at microsecond precision.
+    // Default: false
+    bool use_timing_wheel;
+
     // Constructed with default options.
     TimerThreadOptions();
 };
@@ -46,6 +46,11 @@ static const bthread_attrflags_t BTHREAD_LOG_START_AND_FINISH = 8;
 static const bthread_attrflags_t BTHREAD_LOG_CONTEXT_SWITCH = 16;
 static const bthread_attrflags_t BTHREAD_NOSIGNAL = 32;
 static const bthread_attrflags_t BTHREAD_NEVER_QUIT = 64;
+// bthreads with this flag are put into separate run queues which are
+// checked before the normal ones by all workers, so that they're not
+// delayed by bursts of normal bthreads. Normal bthreads still get a
+// chance to run periodically.
+static const bthread_attrflags_t BTHREAD_HIGH_PRIORITY = 128;
 
 // Key of thread-local data, created by bthread_key_create.
 typedef struct {
@@ -174,11 +179,23 @@ typedef struct {
 } bthread_condattr_t;
 
 typedef struct {
+    // Readers and the writer sleep on these butexes respectively.
+    unsigned* reader_butex;
+    unsigned* writer_butex;
+    // Serializes writers.
+    bthread_mutex_t write_queue_mutex;
+    // Numbers of active and waiting readers and flags of the writer.
+    uint64_t state;
 } bthread_rwlock_t;
 
 typedef struct {
 } bthread_rwlockattr_t;
 
+// The only reader/writer preference of bthread_rwlock_t, same value as
+// PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP of glibc which is not
+// available on other platforms.
+#define BTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP 2
+
 typedef struct {
     unsigned int count;
 } bthread_barrier_t;
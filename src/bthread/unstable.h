@@ -39,6 +39,12 @@ __BEGIN_DECLS
 // Schedule tasks created by BTHREAD_NOSIGNAL
 extern void bthread_flush();
 
+// Set BTHREAD_HIGH_PRIORITY of the calling bthread if `high' is non-zero,
+// clear it otherwise. The change takes effect the next time the bthread is
+// queued, e.g. after being woken up from butex or yielding.
+// Returns previous setting(0 or 1), -1 if the caller is not a bthread.
+extern int bthread_set_high_priority(int high);
+
 // Mark the calling bthread as "about to quit". When the bthread is scheduled,
 // worker pthreads are not notified.
 extern int bthread_about_to_quit();
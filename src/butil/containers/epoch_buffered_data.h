@@ -0,0 +1,460 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BUTIL_EPOCH_BUFFERED_DATA_H
+#define BUTIL_EPOCH_BUFFERED_DATA_H
+
+#include <stdint.h>
+#include <vector>                                       // std::vector
+#include <pthread.h>
+#include "butil/scoped_lock.h"
+#include "butil/logging.h"
+#include "butil/macros.h"
+#include "butil/errno.h"
+#include "butil/atomicops.h"
+#include "butil/compiler_specific.h"                    // BAIDU_CACHELINE_ALIGNMENT
+#include "butil/containers/doubly_buffered_data.h"      // Void
+
+namespace butil {
+
+// Same interface as DoublyBufferedData, but Modify() never waits for
+// readers, which makes it suitable for data being modified frequently
+// (e.g. server lists of large clusters) or read by a lot of threads.
+//
+// Read(): publish the global epoch in a thread-local record and read the
+// current instance. No lock is involved.
+//
+// Modify(): apply fn to a copy of the current instance, publish the copy and
+// advance the global epoch. The replaced instance is retired with the epoch
+// in which it was current. Retired instances are reclaimed in batches: once
+// every thread-local record is either idle or newer than the epoch of an
+// instance, no reader can be reading the instance. Reclamation scans the
+// records without locking them, a Modify() costs one copy of T plus
+// O(threads/RECLAIM_BATCH) amortized, and never blocks on slow readers.
+//
+// Differences from DoublyBufferedData:
+//  - T must be copy-constructible and copy-assignable.
+//  - fn is called once. Modify() calls it with a copy of the current
+//    instance, ModifyWithForeground() calls it with a recycled instance of
+//    unspecified content, so fn must build background from foreground.
+//  - Read() can be nested in the same thread.
+//  - Up to RECLAIM_BATCH old instances may be kept alive after Modify().
+// As with DoublyBufferedData, don't suspend the bthread holding a ScopedPtr.
+
+template <typename T, typename TLS = Void>
+class EpochBufferedData {
+    class Record;
+public:
+    // Number of retired instances to accumulate before scanning records.
+    static const size_t RECLAIM_BATCH = 4;
+
+    class ScopedPtr {
+    friend class EpochBufferedData;
+    public:
+        ScopedPtr() : _data(NULL), _r(NULL) {}
+        ~ScopedPtr() {
+            if (_r) {
+                _r->EndRead();
+            }
+        }
+        const T* get() const { return _data; }
+        const T& operator*() const { return *_data; }
+        const T* operator->() const { return _data; }
+        TLS& tls() { return _r->user_tls(); }
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(ScopedPtr);
+        const T* _data;
+        Record* _r;
+    };
+
+    EpochBufferedData();
+    ~EpochBufferedData();
+
+    // Put current instance into ptr. The instance will not be changed or
+    // destroyed until ptr is destructed.
+    // This function is not blocked by Read() and Modify() in other threads.
+    // Returns 0 on success, -1 otherwise.
+    int Read(ScopedPtr* ptr);
+
+    // Call fn(T&, ...) with a copy of current instance and publish the copy
+    // if fn returns non-zero. Modify() from different threads are exclusive
+    // from each other.
+    template <typename Fn> size_t Modify(Fn& fn);
+    template <typename Fn, typename Arg1> size_t Modify(Fn& fn, const Arg1&);
+    template <typename Fn, typename Arg1, typename Arg2>
+    size_t Modify(Fn& fn, const Arg1&, const Arg2&);
+
+    // Call fn(T& background, const T& foreground, ...) and publish background
+    // if fn returns non-zero. Content of background is unspecified.
+    template <typename Fn> size_t ModifyWithForeground(Fn& fn);
+    template <typename Fn, typename Arg1>
+    size_t ModifyWithForeground(Fn& fn, const Arg1&);
+    template <typename Fn, typename Arg1, typename Arg2>
+    size_t ModifyWithForeground(Fn& fn, const Arg1&, const Arg2&);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(EpochBufferedData);
+
+    template <typename Fn>
+    struct WithFG0 {
+        WithFG0(Fn& fn) : _fn(fn) {}
+        size_t operator()(T& bg, const T& fg) { return _fn(bg, fg); }
+    private:
+        Fn& _fn;
+    };
+
+    template <typename Fn, typename Arg1>
+    struct WithFG1 {
+        WithFG1(Fn& fn, const Arg1& arg1) : _fn(fn), _arg1(arg1) {}
+        size_t operator()(T& bg, const T& fg) { return _fn(bg, fg, _arg1); }
+    private:
+        Fn& _fn;
+        const Arg1& _arg1;
+    };
+
+    template <typename Fn, typename Arg1, typename Arg2>
+    struct WithFG2 {
+        WithFG2(Fn& fn, const Arg1& arg1, const Arg2& arg2)
+            : _fn(fn), _arg1(arg1), _arg2(arg2) {}
+        size_t operator()(T& bg, const T& fg)
+        { return _fn(bg, fg, _arg1, _arg2); }
+    private:
+        Fn& _fn;
+        const Arg1& _arg1;
+        const Arg2& _arg2;
+    };
+
+    // Copy foreground into background and ignore foreground.
+    template <typename Fn>
+    struct OnCopy0 {
+        OnCopy0(Fn& fn) : _fn(fn) {}
+        size_t operator()(T& bg, const T& fg) { bg = fg; return _fn(bg); }
+    private:
+        Fn& _fn;
+    };
+
+    template <typename Fn, typename Arg1>
+    struct OnCopy1 {
+        OnCopy1(Fn& fn, const Arg1& arg1) : _fn(fn), _arg1(arg1) {}
+        size_t operator()(T& bg, const T& fg)
+        { bg = fg; return _fn(bg, _arg1); }
+    private:
+        Fn& _fn;
+        const Arg1& _arg1;
+    };
+
+    template <typename Fn, typename Arg1, typename Arg2>
+    struct OnCopy2 {
+        OnCopy2(Fn& fn, const Arg1& arg1, const Arg2& arg2)
+            : _fn(fn), _arg1(arg1), _arg2(arg2) {}
+        size_t operator()(T& bg, const T& fg)
+        { bg = fg; return _fn(bg, _arg1, _arg2); }
+    private:
+        Fn& _fn;
+        const Arg1& _arg1;
+        const Arg2& _arg2;
+    };
+
+    struct Retired {
+        T* data;
+        // Epoch in which `data' was the current instance.
+        uint64_t epoch;
+    };
+
+    // fn(T& bg, const T& fg) is called with the lock of _modify_mutex.
+    template <typename Fn> size_t Publish(Fn& fn);
+    Record* AcquireRecord();
+    void ReclaimRetired();
+    static void ReleaseRecord(void* arg);
+
+    // Current instance.
+    butil::atomic<T*> _data;
+
+    // Advanced by each Modify(), never 0.
+    butil::atomic<uint64_t> _epoch;
+
+    // Key to access thread-local records.
+    bool _created_key;
+    pthread_key_t _record_key;
+
+    // Records of all threads ever read, linked by Record::_next. Records are
+    // only freed in destructor and reused by new threads, so that they can
+    // be scanned without locking.
+    butil::atomic<Record*> _records;
+
+    // Following fields are protected by _modify_mutex.
+    std::vector<Retired> _retired;
+    // Reclaimed instance for next Modify() to avoid allocation.
+    T* _spare;
+
+    // Sequence modifications.
+    pthread_mutex_t _modify_mutex;
+};
+
+template <typename T, typename TLS>
+const size_t EpochBufferedData<T, TLS>::RECLAIM_BATCH;
+
+template <typename T, typename TLS>
+class BAIDU_CACHELINE_ALIGNMENT EpochBufferedData<T, TLS>::Record
+    : public DoublyBufferedDataWrapperBase<T, TLS> {
+friend class EpochBufferedData;
+public:
+    Record() : _epoch(0), _in_use(true), _depth(0), _next(NULL) {}
+
+    // Called by the owning thread only.
+    inline void EndRead() {
+        if (--_depth == 0) {
+            // Pairs with the acquire load in ReclaimRetired() so that all
+            // accesses to the instance happen before its destruction.
+            _epoch.store(0, butil::memory_order_release);
+        }
+    }
+
+    void Reset() {
+        _depth = 0;
+        _epoch.store(0, butil::memory_order_relaxed);
+        ResetUserTLS(this);
+    }
+
+private:
+    template <typename U>
+    static void ResetUserTLS(DoublyBufferedDataWrapperBase<T, U>* r)
+    { r->user_tls() = U(); }
+    static void ResetUserTLS(DoublyBufferedDataWrapperBase<T, Void>*) {}
+
+    // Global epoch when the outermost Read() began, 0 when not reading.
+    butil::atomic<uint64_t> _epoch;
+    butil::atomic<bool> _in_use;
+    int _depth;
+    Record* _next;
+};
+
+template <typename T, typename TLS>
+EpochBufferedData<T, TLS>::EpochBufferedData()
+    : _data(new T())
+    , _epoch(1)
+    , _created_key(false)
+    , _record_key(0)
+    , _records(NULL)
+    , _spare(NULL) {
+    _retired.reserve(RECLAIM_BATCH + 1);
+    pthread_mutex_init(&_modify_mutex, NULL);
+    const int rc = pthread_key_create(&_record_key, ReleaseRecord);
+    if (rc != 0) {
+        LOG(FATAL) << "Fail to pthread_key_create: " << berror(rc);
+    } else {
+        _created_key = true;
+    }
+}
+
+template <typename T, typename TLS>
+EpochBufferedData<T, TLS>::~EpochBufferedData() {
+    // User is responsible for synchronizations between Read()/Modify() and
+    // this function.
+    if (_created_key) {
+        pthread_key_delete(_record_key);
+    }
+    Record* r = _records.load(butil::memory_order_relaxed);
+    while (r) {
+        Record* next = r->_next;
+        delete r;
+        r = next;
+    }
+    for (size_t i = 0; i < _retired.size(); ++i) {
+        delete _retired[i].data;
+    }
+    _retired.clear();
+    delete _spare;
+    delete _data.load(butil::memory_order_relaxed);
+    pthread_mutex_destroy(&_modify_mutex);
+}
+
+// Called when thread quits.
+template <typename T, typename TLS>
+void EpochBufferedData<T, TLS>::ReleaseRecord(void* arg) {
+    Record* r = static_cast<Record*>(arg);
+    r->_epoch.store(0, butil::memory_order_release);
+    r->_in_use.store(false, butil::memory_order_release);
+}
+
+// Called when thread reads for the first time.
+template <typename T, typename TLS>
+typename EpochBufferedData<T, TLS>::Record*
+EpochBufferedData<T, TLS>::AcquireRecord() {
+    Record* r = NULL;
+    for (Record* p = _records.load(butil::memory_order_acquire);
+         p != NULL; p = p->_next) {
+        bool expected = false;
+        if (!p->_in_use.load(butil::memory_order_relaxed) &&
+            p->_in_use.compare_exchange_strong(
+                expected, true, butil::memory_order_acquire)) {
+            p->Reset();
+            r = p;
+            break;
+        }
+    }
+    if (r == NULL) {
+        r = new (std::nothrow) Record;
+        if (r == NULL) {
+            return NULL;
+        }
+        Record* head = _records.load(butil::memory_order_relaxed);
+        do {
+            r->_next = head;
+        } while (!_records.compare_exchange_weak(
+                     head, r, butil::memory_order_release,
+                     butil::memory_order_relaxed));
+    }
+    const int rc = pthread_setspecific(_record_key, r);
+    if (rc != 0) {
+        ReleaseRecord(r);
+        return NULL;
+    }
+    return r;
+}
+
+template <typename T, typename TLS>
+int EpochBufferedData<T, TLS>::Read(
+    typename EpochBufferedData<T, TLS>::ScopedPtr* ptr) {
+    if (BAIDU_UNLIKELY(!_created_key)) {
+        return -1;
+    }
+    Record* r = static_cast<Record*>(pthread_getspecific(_record_key));
+    if (BAIDU_UNLIKELY(r == NULL)) {
+        r = AcquireRecord();
+        if (r == NULL) {
+            return -1;
+        }
+    }
+    if (r->_depth++ == 0) {
+        // The acquire load makes sure that the instance published before
+        // the epoch is visible if the epoch is newer than the one in which
+        // the instance was retired.
+        r->_epoch.store(_epoch.load(butil::memory_order_acquire),
+                        butil::memory_order_relaxed);
+        // Either ReclaimRetired() sees the epoch stored above, or the load
+        // below sees the instance published before the reclamation.
+        butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    }
+    ptr->_data = _data.load(butil::memory_order_acquire);
+    ptr->_r = r;
+    return 0;
+}
+
+template <typename T, typename TLS>
+void EpochBufferedData<T, TLS>::ReclaimRetired() {
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    uint64_t min_epoch = UINT64_MAX;
+    for (Record* r = _records.load(butil::memory_order_acquire);
+         r != NULL; r = r->_next) {
+        const uint64_t e = r->_epoch.load(butil::memory_order_acquire);
+        if (e != 0 && e < min_epoch) {
+            min_epoch = e;
+        }
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < _retired.size(); ++i) {
+        // Readers began in or before the epoch of the instance may still
+        // be reading it.
+        if (_retired[i].epoch >= min_epoch) {
+            _retired[n++] = _retired[i];
+        } else if (_spare == NULL) {
+            _spare = _retired[i].data;
+        } else {
+            delete _retired[i].data;
+        }
+    }
+    _retired.resize(n);
+}
+
+template <typename T, typename TLS>
+template <typename Fn>
+size_t EpochBufferedData<T, TLS>::Publish(Fn& fn) {
+    BAIDU_SCOPED_LOCK(_modify_mutex);
+    T* fg = _data.load(butil::memory_order_relaxed);
+    T* bg = _spare;
+    if (bg != NULL) {
+        _spare = NULL;
+    } else {
+        bg = new T();
+    }
+    const size_t ret = fn(*bg, (const T&)*fg);
+    if (!ret) {
+        _spare = bg;
+        return 0;
+    }
+    // The release order matches with the acquire order in Read() to make
+    // readers see all changes made in fn.
+    _data.store(bg, butil::memory_order_release);
+    Retired r = { fg, _epoch.fetch_add(1, butil::memory_order_release) };
+    _retired.push_back(r);
+    if (_retired.size() >= RECLAIM_BATCH) {
+        ReclaimRetired();
+    }
+    return ret;
+}
+
+template <typename T, typename TLS>
+template <typename Fn>
+size_t EpochBufferedData<T, TLS>::Modify(Fn& fn) {
+    OnCopy0<Fn> c(fn);
+    return Publish(c);
+}
+
+template <typename T, typename TLS>
+template <typename Fn, typename Arg1>
+size_t EpochBufferedData<T, TLS>::Modify(Fn& fn, const Arg1& arg1) {
+    OnCopy1<Fn, Arg1> c(fn, arg1);
+    return Publish(c);
+}
+
+template <typename T, typename TLS>
+template <typename Fn, typename Arg1, typename Arg2>
+size_t EpochBufferedData<T, TLS>::Modify(
+    Fn& fn, const Arg1& arg1, const Arg2& arg2) {
+    OnCopy2<Fn, Arg1, Arg2> c(fn, arg1, arg2);
+    return Publish(c);
+}
+
+template <typename T, typename TLS>
+template <typename Fn>
+size_t EpochBufferedData<T, TLS>::ModifyWithForeground(Fn& fn) {
+    WithFG0<Fn> c(fn);
+    return Publish(c);
+}
+
+template <typename T, typename TLS>
+template <typename Fn, typename Arg1>
+size_t EpochBufferedData<T, TLS>::ModifyWithForeground(
+    Fn& fn, const Arg1& arg1) {
+    WithFG1<Fn, Arg1> c(fn, arg1);
+    return Publish(c);
+}
+
+template <typename T, typename TLS>
+template <typename Fn, typename Arg1, typename Arg2>
+size_t EpochBufferedData<T, TLS>::ModifyWithForeground(
+    Fn& fn, const Arg1& arg1, const Arg2& arg2) {
+    WithFG2<Fn, Arg1, Arg2> c(fn, arg1, arg2);
+    return Publish(c);
+}
+
+}  // namespace butil
+
+#endif  // BUTIL_EPOCH_BUFFERED_DATA_H
@@ -0,0 +1,321 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <errno.h>
+#include <sys/mman.h>                              // mmap
+#include <pthread.h>
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"  // fmix64
+#include "butil/huge_page_allocator.h"
+
+namespace butil {
+
+const size_t HugePageAllocator::ARENA_SIZE;
+const size_t HugePageAllocator::MIN_BLOCK_SIZE;
+const size_t HugePageAllocator::MAX_BLOCK_SIZE;
+
+HugePageAllocator::Options::Options()
+    : max_memory(1024UL * 1024 * 1024)
+    , use_hugetlb(true)
+    , lock_memory(false)
+    , on_new_arena(NULL) {
+}
+
+HugePageAllocator::HugePageAllocator(const Options& options)
+    : _options(options)
+    , _narena(0)
+    , _max_arena(options.max_memory / ARENA_SIZE)
+    , _arena_table(NULL)
+    , _arena_table_mask(0) {
+    // Keep load factor of the table below 0.5 so that probing is short.
+    size_t cap = 16;
+    while (cap < _max_arena * 2) {
+        cap *= 2;
+    }
+    _arena_table = new butil::atomic<uintptr_t>[cap];
+    for (size_t i = 0; i < cap; ++i) {
+        _arena_table[i].store(0, butil::memory_order_relaxed);
+    }
+    _arena_table_mask = cap - 1;
+}
+
+HugePageAllocator::~HugePageAllocator() {
+    for (size_t i = 0; i <= _arena_table_mask; ++i) {
+        const uintptr_t entry = _arena_table[i].load(butil::memory_order_relaxed);
+        if (entry) {
+            munmap((void*)(entry & ~(ARENA_SIZE - 1)), ARENA_SIZE);
+        }
+    }
+    delete [] _arena_table;
+    _arena_table = NULL;
+}
+
+int HugePageAllocator::class_index_of(size_t size) {
+    if (size > MAX_BLOCK_SIZE) {
+        return -1;
+    }
+    int index = 0;
+    for (size_t block_size = MIN_BLOCK_SIZE; block_size < size;
+         block_size <<= 1) {
+        ++index;
+    }
+    return index;
+}
+
+size_t HugePageAllocator::block_size_of(size_t size) {
+    const int index = class_index_of(size);
+    return index < 0 ? 0 : (MIN_BLOCK_SIZE << index);
+}
+
+int HugePageAllocator::find_arena(const void* mem) const {
+    const uintptr_t base = (uintptr_t)mem & ~(uintptr_t)(ARENA_SIZE - 1);
+    for (size_t i = butil::fmix64(base) & _arena_table_mask; ;
+         i = (i + 1) & _arena_table_mask) {
+        const uintptr_t entry =
+            _arena_table[i].load(butil::memory_order_acquire);
+        if (entry == 0) {
+            return -1;
+        }
+        if ((entry & ~(uintptr_t)(ARENA_SIZE - 1)) == base) {
+            return (int)(entry & (ARENA_SIZE - 1));
+        }
+    }
+}
+
+void* HugePageAllocator::map_arena() {
+#ifdef MAP_HUGETLB
+    if (_options.use_hugetlb) {
+        // Huge pages are naturally aligned.
+        void* mem = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            return mem;
+        }
+    }
+#endif
+    // Map twice the size and trim to get an aligned arena.
+    char* mem = (char*)mmap(NULL, ARENA_SIZE * 2, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == (char*)MAP_FAILED) {
+        PLOG(ERROR) << "Fail to mmap arena";
+        return NULL;
+    }
+    char* aligned = (char*)(((uintptr_t)mem + ARENA_SIZE - 1) &
+                            ~(uintptr_t)(ARENA_SIZE - 1));
+    if (aligned != mem) {
+        munmap(mem, aligned - mem);
+    }
+    munmap(aligned + ARENA_SIZE, mem + ARENA_SIZE * 2 - aligned - ARENA_SIZE);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+HugePageAllocator::FreeBlock* HugePageAllocator::new_arena(int index) {
+    BAIDU_SCOPED_LOCK(_arena_mutex);
+    if (_narena.load(butil::memory_order_relaxed) >= _max_arena) {
+        return NULL;
+    }
+    char* mem = (char*)map_arena();
+    if (mem == NULL) {
+        return NULL;
+    }
+    if (_options.lock_memory && mlock(mem, ARENA_SIZE) != 0) {
+        PLOG(WARNING) << "Fail to mlock arena";
+    }
+    const uintptr_t entry = (uintptr_t)mem | index;
+    for (size_t i = butil::fmix64((uintptr_t)mem) & _arena_table_mask; ;
+         i = (i + 1) & _arena_table_mask) {
+        if (_arena_table[i].load(butil::memory_order_relaxed) == 0) {
+            _arena_table[i].store(entry, butil::memory_order_release);
+            break;
+        }
+    }
+    _narena.fetch_add(1, butil::memory_order_relaxed);
+    if (_options.on_new_arena) {
+        _options.on_new_arena(mem, ARENA_SIZE);
+    }
+    const size_t block_size = MIN_BLOCK_SIZE << index;
+    FreeBlock* head = NULL;
+    for (size_t off = ARENA_SIZE; off >= block_size; off -= block_size) {
+        FreeBlock* b = (FreeBlock*)(mem + off - block_size);
+        b->next = head;
+        head = b;
+    }
+    return head;
+}
+
+void* HugePageAllocator::Allocate(size_t size) {
+    const int index = class_index_of(size);
+    if (index < 0) {
+        return NULL;
+    }
+    SizeClass& sc = _classes[index];
+    {
+        BAIDU_SCOPED_LOCK(sc.mutex);
+        FreeBlock* b = sc.free_list;
+        if (b) {
+            sc.free_list = b->next;
+            --sc.nfree;
+            sc.nallocated.fetch_add(1, butil::memory_order_relaxed);
+            return b;
+        }
+    }
+    // Map the arena outside the lock of the class.
+    FreeBlock* head = new_arena(index);
+    if (head == NULL) {
+        sc.nexhausted.fetch_add(1, butil::memory_order_relaxed);
+        return NULL;
+    }
+    FreeBlock* b = head;
+    head = head->next;
+    size_t n = 0;
+    FreeBlock* tail = NULL;
+    for (FreeBlock* p = head; p; p = p->next) {
+        tail = p;
+        ++n;
+    }
+    BAIDU_SCOPED_LOCK(sc.mutex);
+    ++sc.narena;
+    if (tail) {
+        tail->next = sc.free_list;
+        sc.free_list = head;
+        sc.nfree += n;
+    }
+    sc.nallocated.fetch_add(1, butil::memory_order_relaxed);
+    return b;
+}
+
+void HugePageAllocator::Deallocate(void* mem) {
+    const int index = find_arena(mem);
+    if (index < 0) {
+        LOG(FATAL) << "mem=" << mem << " was not allocated by this allocator";
+        return;
+    }
+    SizeClass& sc = _classes[index];
+    FreeBlock* b = (FreeBlock*)mem;
+    BAIDU_SCOPED_LOCK(sc.mutex);
+    b->next = sc.free_list;
+    sc.free_list = b;
+    ++sc.nfree;
+    sc.nallocated.fetch_sub(1, butil::memory_order_relaxed);
+}
+
+void HugePageAllocator::GetStats(std::vector<SizeClassStats>* stats) const {
+    stats->resize(NUM_CLASSES);
+    for (int i = 0; i < NUM_CLASSES; ++i) {
+        const SizeClass& sc = _classes[i];
+        SizeClassStats& st = (*stats)[i];
+        st.block_size = MIN_BLOCK_SIZE << i;
+        {
+            BAIDU_SCOPED_LOCK(sc.mutex);
+            st.arena_count = sc.narena;
+            st.free = sc.nfree;
+        }
+        st.allocated = sc.nallocated.load(butil::memory_order_relaxed);
+        st.exhausted = sc.nexhausted.load(butil::memory_order_relaxed);
+    }
+}
+
+void HugePageAllocator::Describe(std::ostream& os) const {
+    std::vector<SizeClassStats> stats;
+    GetStats(&stats);
+    os << "mapped=" << mapped_memory() << '/' << _max_arena * ARENA_SIZE;
+    for (size_t i = 0; i < stats.size(); ++i) {
+        const SizeClassStats& st = stats[i];
+        if (st.arena_count == 0 && st.exhausted == 0) {
+            continue;
+        }
+        os << "\nblock_size=" << st.block_size
+           << " arena=" << st.arena_count
+           << " allocated=" << st.allocated
+           << " free=" << st.free
+           << " exhausted=" << st.exhausted;
+    }
+}
+
+namespace iobuf {
+
+// Defined in iobuf.cpp
+extern void* (*blockmem_allocate)(size_t);
+extern void (*blockmem_deallocate)(void*);
+
+static HugePageAllocator* g_huge_page_allocator = NULL;
+static void* (*g_fallback_allocate)(size_t) = NULL;
+static void (*g_fallback_deallocate)(void*) = NULL;
+static pthread_mutex_t g_huge_page_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void* huge_page_blockmem_allocate(size_t size) {
+    void* mem = g_huge_page_allocator->Allocate(size);
+    if (mem) {
+        return mem;
+    }
+    return g_fallback_allocate(size);
+}
+
+static void huge_page_blockmem_deallocate(void* mem) {
+    if (g_huge_page_allocator->Owns(mem)) {
+        return g_huge_page_allocator->Deallocate(mem);
+    }
+    // Allocated before replacing or fallen back.
+    return g_fallback_deallocate(mem);
+}
+
+int use_huge_page_allocator(const HugePageAllocator::Options& options) {
+    BAIDU_SCOPED_LOCK(g_huge_page_mutex);
+    if (g_huge_page_allocator) {
+        return -1;
+    }
+    g_huge_page_allocator = new HugePageAllocator(options);
+    g_fallback_allocate = blockmem_allocate;
+    g_fallback_deallocate = blockmem_deallocate;
+    // Set deallocate first since the allocator is never replaced back.
+    blockmem_deallocate = huge_page_blockmem_deallocate;
+    blockmem_allocate = huge_page_blockmem_allocate;
+    return 0;
+}
+
+HugePageAllocator* huge_page_allocator() {
+    return g_huge_page_allocator;
+}
+
+// Called by fit_block_size() in iobuf.cpp. False after
+// reset_blockmem_allocate_and_deallocate() even if the allocator was set.
+bool is_huge_page_blockmem_allocate_used() {
+    return blockmem_allocate == huge_page_blockmem_allocate;
+}
+
+// Called by reset_blockmem_allocate_and_deallocate() in iobuf.cpp. Blocks
+// in arenas can't be passed to ::free, keep deallocating them with the
+// allocator and others with ::free.
+// Returns false if the allocator is not used.
+bool reset_huge_page_blockmem_deallocate() {
+    BAIDU_SCOPED_LOCK(g_huge_page_mutex);
+    if (g_huge_page_allocator == NULL) {
+        return false;
+    }
+    g_fallback_allocate = ::malloc;
+    g_fallback_deallocate = ::free;
+    blockmem_deallocate = huge_page_blockmem_deallocate;
+    return true;
+}
+
+}  // namespace iobuf
+}  // namespace butil
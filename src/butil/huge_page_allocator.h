@@ -0,0 +1,165 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BUTIL_HUGE_PAGE_ALLOCATOR_H
+#define BUTIL_HUGE_PAGE_ALLOCATOR_H
+
+#include <stddef.h>
+#include <ostream>
+#include <vector>
+#include "butil/macros.h"
+#include "butil/atomicops.h"
+#include "butil/synchronization/lock.h"
+
+namespace butil {
+
+// Allocate memory blocks of power-of-2 sizes (size classes) from 2MB
+// arenas backed by huge pages, which reduces TLB misses and malloc overhead
+// of programs moving lots of data through IOBuf. Each arena is carved into
+// blocks of one size class. Arenas are never returned to the kernel, freed
+// blocks are cached in per-class free lists.
+// This class is thread-safe.
+class HugePageAllocator {
+public:
+    static const size_t ARENA_SIZE = 2 * 1024 * 1024;
+    static const size_t MIN_BLOCK_SIZE = 4096;
+    static const size_t MAX_BLOCK_SIZE = 1024 * 1024;
+
+    struct Options {
+        Options();
+
+        // Max bytes of all arenas. Allocate() returns NULL when more
+        // arenas are needed.
+        // Default: 1GB
+        size_t max_memory;
+
+        // Map arenas with MAP_HUGETLB (pages reserved by vm.nr_hugepages)
+        // first, fallback to transparent huge pages (madvise) if it fails.
+        // Default: true
+        bool use_hugetlb;
+
+        // mlock() arenas so that they're never swapped out and addresses
+        // are stable for registration with devices.
+        // Default: false
+        bool lock_memory;
+
+        // Called after a new arena is mapped, e.g. to register the memory
+        // for RDMA or io_uring fixed buffers.
+        // Default: NULL
+        void (*on_new_arena)(void* base, size_t size);
+    };
+
+    struct SizeClassStats {
+        size_t block_size;
+        // Number of arenas carved into blocks of this size.
+        size_t arena_count;
+        // Number of blocks being used.
+        size_t allocated;
+        // Number of freed blocks cached for reuse.
+        size_t free;
+        // Number of Allocate() failed due to max_memory.
+        size_t exhausted;
+    };
+
+    explicit HugePageAllocator(const Options& options);
+    // All blocks must have been deallocated.
+    ~HugePageAllocator();
+
+    // Allocate a block of at least `size' bytes.
+    // Returns NULL if `size' is larger than MAX_BLOCK_SIZE or no more arena
+    // can be mapped.
+    void* Allocate(size_t size);
+
+    // Return a block from Allocate().
+    void Deallocate(void* mem);
+
+    // True if `mem' points to memory of arenas of this allocator.
+    bool Owns(const void* mem) const { return find_arena(mem) >= 0; }
+
+    // Size of blocks that Allocate(size) returns, 0 if `size' is too large.
+    static size_t block_size_of(size_t size);
+
+    void GetStats(std::vector<SizeClassStats>* stats) const;
+
+    // Print stats in human-readable form.
+    void Describe(std::ostream& os) const;
+
+    // Bytes of all arenas mapped.
+    size_t mapped_memory() const
+    { return _narena.load(butil::memory_order_relaxed) * ARENA_SIZE; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(HugePageAllocator);
+
+    static const int NUM_CLASSES = 9;  // 4KB ... 1MB
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct SizeClass {
+        SizeClass()
+            : free_list(NULL), narena(0), nfree(0)
+            , nallocated(0), nexhausted(0) {}
+        mutable Mutex mutex;
+        FreeBlock* free_list;
+        size_t narena;
+        size_t nfree;
+        butil::atomic<size_t> nallocated;
+        butil::atomic<size_t> nexhausted;
+    };
+
+    static int class_index_of(size_t size);
+
+    // Map a new arena and carve it into blocks of class `index'.
+    // Returns the blocks linked together, NULL on failure.
+    FreeBlock* new_arena(int index);
+
+    // Index of the size class that `mem' belongs to, -1 if `mem' is not in
+    // any arena.
+    int find_arena(const void* mem) const;
+
+    void* map_arena();
+
+    Options _options;
+    SizeClass _classes[NUM_CLASSES];
+    butil::atomic<size_t> _narena;
+    size_t _max_arena;
+    Mutex _arena_mutex;
+    // Open-addressing hash table from base address of arenas to
+    // (base | class_index). Entries are never removed, lookups are lock-free.
+    butil::atomic<uintptr_t>* _arena_table;
+    size_t _arena_table_mask;
+};
+
+namespace iobuf {
+
+// Let IOBuf allocate blocks from a global HugePageAllocator, blocks that the
+// allocator can't serve are allocated by the allocator being replaced.
+// Should be called before heavy usages of IOBuf, blocks allocated before
+// are still freed correctly.
+// Returns 0 on success, -1 if it has been called.
+int use_huge_page_allocator(const HugePageAllocator::Options& options);
+
+// The allocator set by use_huge_page_allocator(), NULL if not set.
+HugePageAllocator* huge_page_allocator();
+
+}  // namespace iobuf
+}  // namespace butil
+
+#endif  // BUTIL_HUGE_PAGE_ALLOCATOR_H
@@ -35,6 +35,7 @@
 #include "butil/macros.h"                   // BAIDU_CASSERT
 #include "butil/logging.h"                  // CHECK, LOG
 #include "butil/fd_guard.h"                 // butil::fd_guard
+#include "butil/huge_page_allocator.h"     // HugePageAllocator
 #include "butil/iobuf.h"
 
 namespace butil {
@@ -163,10 +164,18 @@ inline void* cp(void *__restrict dest, const void *__restrict src, size_t n) {
 void* (*blockmem_allocate)(size_t) = ::malloc;
 void  (*blockmem_deallocate)(void*) = ::free;
 
-// Use default function pointers
+// Defined in huge_page_allocator.cpp
+extern bool reset_huge_page_blockmem_deallocate();
+extern bool is_huge_page_blockmem_allocate_used();
+
+// Use default function pointers. Blocks in arenas of the huge page allocator
+// may still be referenced, they're returned to the allocator instead of
+// ::free.
 void reset_blockmem_allocate_and_deallocate() {
     blockmem_allocate = ::malloc;
-    blockmem_deallocate = ::free;
+    if (!reset_huge_page_blockmem_deallocate()) {
+        blockmem_deallocate = ::free;
+    }
 }
 
 butil::static_atomic<size_t> g_nblock = BUTIL_STATIC_ATOMIC_INIT(0);
@@ -310,6 +319,19 @@ inline IOBuf::Block* create_block() {
     return create_block(IOBuf::DEFAULT_BLOCK_SIZE);
 }
 
+// Round user-specified `block_size' up to the size class of the huge page
+// allocator if blocks are allocated from it, otherwise rest of the class is
+// wasted.
+inline size_t fit_block_size(size_t block_size) {
+    if (is_huge_page_blockmem_allocate_used()) {
+        const size_t size = HugePageAllocator::block_size_of(block_size);
+        if (size != 0) {
+            return size;
+        }
+    }
+    return block_size;
+}
+
 // === Share TLS blocks between appending operations ===
 // Max number of blocks in each TLS. This is a soft limit namely
 // release_tls_block_chain() may exceed this limit sometimes.
@@ -1925,7 +1947,8 @@ bool IOBufAsZeroCopyOutputStream::Next(void** data, int* size) {
     if (_cur_block == NULL || _cur_block->full()) {
         _release_block();
         if (_block_size > 0) {
-            _cur_block = iobuf::create_block(_block_size);
+            _cur_block = iobuf::create_block(
+                iobuf::fit_block_size(_block_size));
         } else {
             _cur_block = iobuf::acquire_tls_block();
         }
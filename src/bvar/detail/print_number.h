@@ -0,0 +1,121 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef  BVAR_DETAIL_PRINT_NUMBER_H
+#define  BVAR_DETAIL_PRINT_NUMBER_H
+
+#include <stdio.h>                      // snprintf
+#include <string.h>                     // memcpy
+#include "butil/type_traits.h"          // butil::is_integral
+
+namespace bvar {
+namespace detail {
+
+// True if print_number() works for T. std::ostream prints chars as
+// characters, which are not numbers.
+template <typename T>
+struct is_printable_number {
+    static const bool value =
+        (butil::is_integral<T>::value &&
+         !butil::is_same<T, char>::value &&
+         !butil::is_same<T, signed char>::value &&
+         !butil::is_same<T, unsigned char>::value &&
+         !butil::is_same<T, wchar_t>::value) ||
+        butil::is_floating_point<T>::value;
+};
+
+inline int print_unsigned_number(char* buf, size_t size,
+                                 unsigned long long value, bool negative) {
+    char tmp[24];
+    char* p = tmp + sizeof(tmp);
+    do {
+        *--p = '0' + (char)(value % 10);
+        value /= 10;
+    } while (value);
+    if (negative) {
+        *--p = '-';
+    }
+    const size_t len = tmp + sizeof(tmp) - p;
+    if (len > size) {
+        return -1;
+    }
+    memcpy(buf, p, len);
+    return (int)len;
+}
+
+template <typename T>
+inline int print_integral_number(char* buf, size_t size, T value,
+                                 butil::true_type /*is_signed*/) {
+    if (value < 0) {
+        // Negate in unsigned domain to handle min() correctly.
+        return print_unsigned_number(
+            buf, size, 0ULL - (unsigned long long)value, true);
+    }
+    return print_unsigned_number(buf, size, (unsigned long long)value, false);
+}
+
+template <typename T>
+inline int print_integral_number(char* buf, size_t size, T value,
+                                 butil::false_type /*is_signed*/) {
+    return print_unsigned_number(buf, size, (unsigned long long)value, false);
+}
+
+template <typename T>
+inline int print_number(char* buf, size_t size, const T& value,
+                        butil::true_type /*is_integral*/) {
+    return print_integral_number(
+        buf, size, value,
+        butil::integral_constant<bool, ((T)-1 < (T)0)>());
+}
+
+template <typename T>
+inline int print_floating_number(char* buf, size_t size, const T& value,
+                                 butil::true_type /*is_floating_point*/) {
+    // Same as the default format of std::ostream.
+    const int len = snprintf(buf, size, "%g", (double)value);
+    return (len >= 0 && (size_t)len < size) ? len : -1;
+}
+
+template <typename T>
+inline int print_floating_number(char*, size_t, const T&,
+                                 butil::false_type /*is_floating_point*/) {
+    return -1;
+}
+
+template <typename T>
+inline int print_number(char* buf, size_t size, const T& value,
+                        butil::false_type /*is_integral*/) {
+    return print_floating_number(buf, size, value,
+                                 butil::is_floating_point<T>());
+}
+
+// Print `value' into `buf' in the same form as std::ostream does by default,
+// used by Variable::describe_to_buffer() of numeric variables.
+// Returns length of the output, -1 if `value' is not a number or `buf' is
+// not large enough.
+template <typename T>
+inline int print_number(char* buf, size_t size, const T& value) {
+    if (!is_printable_number<T>::value) {
+        return -1;
+    }
+    return print_number(buf, size, value, butil::is_integral<T>());
+}
+
+}  // namespace detail
+}  // namespace bvar
+
+#endif  // BVAR_DETAIL_PRINT_NUMBER_H
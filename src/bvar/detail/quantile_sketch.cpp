@@ -0,0 +1,101 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "bvar/detail/quantile_sketch.h"
+#include "butil/logging.h"
+
+namespace bvar {
+namespace detail {
+
+void append_sketch_varint(std::string* out, uint64_t value) {
+    char buf[10];
+    size_t n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (char)value;
+    out->append(buf, n);
+}
+
+bool parse_sketch_varint(butil::StringPiece* data, uint64_t* value) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < data->size() && i < 10; ++i) {
+        const uint8_t b = (uint8_t)(*data)[i];
+        result |= (uint64_t)(b & 0x7F) << (7 * i);
+        if (!(b & 0x80)) {
+            data->remove_prefix(i + 1);
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct AddToSketch {
+    void operator()(ThreadLocalQuantileSketch& sketch, uint32_t latency) const {
+        sketch.add(latency);
+    }
+};
+
+SketchPercentile::SketchPercentile() : _combiner(NULL), _sampler(NULL) {
+    _combiner = new combiner_type;
+}
+
+SketchPercentile::~SketchPercentile() {
+    // Have to destroy sampler first to avoid the race between destruction and
+    // sampler
+    if (_sampler != NULL) {
+        _sampler->destroy();
+        _sampler = NULL;
+    }
+    delete _combiner;
+}
+
+SketchPercentile::value_type SketchPercentile::reset() {
+    return _combiner->reset_all_agents();
+}
+
+SketchPercentile::value_type SketchPercentile::get_value() const {
+    return _combiner->combine_agents();
+}
+
+SketchPercentile& SketchPercentile::operator<<(int64_t latency) {
+    agent_type* agent = _combiner->get_or_create_tls_agent();
+    if (BAIDU_UNLIKELY(!agent)) {
+        LOG(FATAL) << "Fail to create agent";
+        return *this;
+    }
+    if (latency < 0) {
+        if (!_debug_name.empty()) {
+            LOG(WARNING) << "Input=" << latency << " to `" << _debug_name
+                       << "' is negative, drop";
+        } else {
+            LOG(WARNING) << "Input=" << latency << " to SketchPercentile("
+                       << (void*)this << ") is negative, drop";
+        }
+        return *this;
+    }
+    if (latency > std::numeric_limits<uint32_t>::max()) {
+        latency = std::numeric_limits<uint32_t>::max();
+    }
+    agent->element.modify(AddToSketch(), (uint32_t)latency);
+    return *this;
+}
+
+}  // namespace detail
+}  // namespace bvar
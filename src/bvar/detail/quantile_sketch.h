@@ -0,0 +1,386 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef  BVAR_DETAIL_QUANTILE_SKETCH_H
+#define  BVAR_DETAIL_QUANTILE_SKETCH_H
+
+#include <string.h>                     // memset memcpy
+#include <stdint.h>                     // uint32_t
+#include <math.h>                       // ceil
+#include <limits>                       // std::numeric_limits
+#include <ostream>                      // std::ostream
+#include <string>                       // std::string
+#include "butil/macros.h"               // DISALLOW_COPY_AND_ASSIGN
+#include "butil/strings/string_piece.h" // butil::StringPiece
+#include "bvar/window.h"                // Window
+#include "bvar/detail/combiner.h"       // AgentCombiner
+#include "bvar/detail/sampler.h"        // ReducerSampler
+
+namespace bvar {
+namespace detail {
+
+// Histogram of latencies with bounded relative error, which is the idea of
+// DDSketch: values are counted in buckets whose widths grow with values.
+// Buckets are log-linear (as in HdrHistogram) rather than logarithmic so
+// that addressing a bucket takes a few bit operations:
+//   - values in [0, 64) have their own buckets.
+//   - every [2^e, 2^(e+1)) with e >= 6 is split into 64 equal buckets.
+// A bucket is reported as its middle point, so any quantile differs from
+// the exact one by at most 1/128 (~0.8%), no matter how many values are
+// added or how sketches are merged. Unlike PercentileSamples, merging
+// sketches is deterministic and lossless: counts of same buckets are summed,
+// thus sketches from threads, seconds or even processes (see serialize())
+// can be combined in any order with the same result.
+//
+// Counts of every [2^e, 2^(e+1)) are stored in a page allocated on first
+// use, so the memory is bounded by NUM_PAGES * SUB_BUCKETS * sizeof(Count)
+// and is generally much less since latencies seldom span all pages.
+// Values larger than uint32 max are counted as uint32 max.
+template <typename Count>
+class QuantileSketch {
+template <typename> friend class QuantileSketch;
+public:
+    static const int SUB_BUCKET_BITS = 6;
+    static const uint32_t SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+    // Page 0 holds [0, 64), page p (p > 0) holds [2^(p+5), 2^(p+6)).
+    static const uint32_t NUM_PAGES = 33 - SUB_BUCKET_BITS;
+    static const uint32_t NUM_BUCKETS = NUM_PAGES * SUB_BUCKETS;
+
+    QuantileSketch() : _count(0) {
+        memset(_pages, 0, sizeof(_pages));
+    }
+
+    ~QuantileSketch() {
+        for (uint32_t i = 0; i < NUM_PAGES; ++i) {
+            delete [] _pages[i];
+        }
+    }
+
+    QuantileSketch(const QuantileSketch& rhs) : _count(0) {
+        memset(_pages, 0, sizeof(_pages));
+        *this = rhs;
+    }
+
+    // Notice that we keep allocated pages to avoid future allocations.
+    QuantileSketch& operator=(const QuantileSketch& rhs) {
+        if (this == &rhs) {
+            return *this;
+        }
+        _count = rhs._count;
+        for (uint32_t i = 0; i < NUM_PAGES; ++i) {
+            if (rhs._pages[i] != NULL) {
+                memcpy(get_page_at(i), rhs._pages[i],
+                       sizeof(Count) * SUB_BUCKETS);
+            } else if (_pages[i] != NULL) {
+                memset(_pages[i], 0, sizeof(Count) * SUB_BUCKETS);
+            }
+        }
+        return *this;
+    }
+
+    // Count `value' once.
+    void add(uint32_t value) {
+        const uint32_t index = bucket_index(value);
+        ++get_page_at(index >> SUB_BUCKET_BITS)[index & (SUB_BUCKETS - 1)];
+        ++_count;
+    }
+
+    // Count `n' times of values in bucket `index'.
+    void add_to_bucket(uint32_t index, uint64_t n) {
+        if (index < NUM_BUCKETS && n != 0) {
+            get_page_at(index >> SUB_BUCKET_BITS)[index & (SUB_BUCKETS - 1)] += n;
+            _count += n;
+        }
+    }
+
+    // Add counts of another sketch.
+    template <typename Count2>
+    void merge(const QuantileSketch<Count2>& rhs) {
+        if (rhs._count == 0) {
+            return;
+        }
+        for (uint32_t i = 0; i < NUM_PAGES; ++i) {
+            const Count2* src = rhs._pages[i];
+            if (src == NULL) {
+                continue;
+            }
+            Count* dst = get_page_at(i);
+            for (uint32_t j = 0; j < SUB_BUCKETS; ++j) {
+                dst[j] += src[j];
+            }
+        }
+        _count += rhs._count;
+    }
+
+    // Remove all counts, allocated pages are kept.
+    void clear() {
+        if (_count == 0) {
+            return;
+        }
+        for (uint32_t i = 0; i < NUM_PAGES; ++i) {
+            if (_pages[i] != NULL) {
+                memset(_pages[i], 0, sizeof(Count) * SUB_BUCKETS);
+            }
+        }
+        _count = 0;
+    }
+
+    // Number of values ever added.
+    uint64_t count() const { return _count; }
+
+    bool empty() const { return _count == 0; }
+
+    // Get the `ratio'-ile value. E.g. 0.99 means 99%-ile value.
+    uint32_t get_number(double ratio) const {
+        uint64_t n = (uint64_t)ceil(ratio * _count);
+        if (n > _count) {
+            n = _count;
+        } else if (n == 0) {
+            return 0;
+        }
+        for (uint32_t i = 0; i < NUM_PAGES; ++i) {
+            const Count* page = _pages[i];
+            if (page == NULL) {
+                continue;
+            }
+            for (uint32_t j = 0; j < SUB_BUCKETS; ++j) {
+                if (n <= page[j]) {
+                    return bucket_value((i << SUB_BUCKET_BITS) + j);
+                }
+                n -= page[j];
+            }
+        }
+        return std::numeric_limits<uint32_t>::max();
+    }
+
+    // Number of values counted in bucket `index'.
+    uint64_t bucket_count(uint32_t index) const {
+        if (index >= NUM_BUCKETS) {
+            return 0;
+        }
+        const Count* page = _pages[index >> SUB_BUCKET_BITS];
+        return page ? page[index & (SUB_BUCKETS - 1)] : 0;
+    }
+
+    // Call `fn(bucket_index, count)' for each non-empty bucket in ascending
+    // order of values.
+    template <typename Fn>
+    void for_each_bucket(Fn& fn) const {
+        for (uint32_t i = 0; i < NUM_PAGES; ++i) {
+            const Count* page = _pages[i];
+            if (page == NULL) {
+                continue;
+            }
+            for (uint32_t j = 0; j < SUB_BUCKETS; ++j) {
+                if (page[j]) {
+                    fn((i << SUB_BUCKET_BITS) + j, (uint64_t)page[j]);
+                }
+            }
+        }
+    }
+
+    // Index of the bucket counting `value'.
+    static uint32_t bucket_index(uint32_t value) {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        // e >= SUB_BUCKET_BITS
+        const int e = 31 - __builtin_clz(value);
+        const int shift = e - SUB_BUCKET_BITS;
+        return ((uint32_t)(shift + 1) << SUB_BUCKET_BITS) +
+            ((value >> shift) - SUB_BUCKETS);
+    }
+
+    // Smallest value counted in bucket `index'.
+    static uint32_t bucket_lower_bound(uint32_t index) {
+        const uint32_t page = index >> SUB_BUCKET_BITS;
+        if (page == 0) {
+            return index;
+        }
+        const uint32_t shift = page - 1;
+        return (SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << shift;
+    }
+
+    // Largest value counted in bucket `index'.
+    static uint32_t bucket_upper_bound(uint32_t index) {
+        const uint32_t page = index >> SUB_BUCKET_BITS;
+        if (page == 0) {
+            return index;
+        }
+        return bucket_lower_bound(index) + ((1u << (page - 1)) - 1);
+    }
+
+    // Value representing bucket `index', which is the middle of the bucket.
+    static uint32_t bucket_value(uint32_t index) {
+        const uint32_t lower = bucket_lower_bound(index);
+        return lower + (bucket_upper_bound(index) - lower + 1) / 2;
+    }
+
+    // Append counts into `out' in a compact binary form which can be parsed
+    // by parse(). Buckets are written as varint-encoded pairs of distance
+    // to the previous non-empty bucket and the count.
+    void serialize(std::string* out) const;
+
+    // Add counts serialized by serialize() into this sketch, which is how
+    // sketches from different processes are merged.
+    // Returns true on success, false if `data' is malformed.
+    bool parse(const butil::StringPiece& data);
+
+    // For debugging.
+    void describe(std::ostream& os) const {
+        os << "{count=" << _count;
+        for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+            const Count* page = _pages[i >> SUB_BUCKET_BITS];
+            if (page && page[i & (SUB_BUCKETS - 1)]) {
+                os << ' ' << bucket_lower_bound(i) << '-'
+                   << bucket_upper_bound(i) << ':'
+                   << page[i & (SUB_BUCKETS - 1)];
+            }
+        }
+        os << '}';
+    }
+
+private:
+    Count* get_page_at(uint32_t page) {
+        if (_pages[page] == NULL) {
+            _pages[page] = new Count[SUB_BUCKETS]();
+        }
+        return _pages[page];
+    }
+
+    uint64_t _count;
+    Count* _pages[NUM_PAGES];
+};
+
+template <typename Count> const int QuantileSketch<Count>::SUB_BUCKET_BITS;
+template <typename Count> const uint32_t QuantileSketch<Count>::SUB_BUCKETS;
+template <typename Count> const uint32_t QuantileSketch<Count>::NUM_PAGES;
+template <typename Count> const uint32_t QuantileSketch<Count>::NUM_BUCKETS;
+
+void append_sketch_varint(std::string* out, uint64_t value);
+bool parse_sketch_varint(butil::StringPiece* data, uint64_t* value);
+
+template <typename Count>
+void QuantileSketch<Count>::serialize(std::string* out) const {
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < NUM_PAGES; ++i) {
+        const Count* page = _pages[i];
+        if (page == NULL) {
+            continue;
+        }
+        for (uint32_t j = 0; j < SUB_BUCKETS; ++j) {
+            if (page[j]) {
+                const uint32_t index = (i << SUB_BUCKET_BITS) + j;
+                append_sketch_varint(out, index - last);
+                append_sketch_varint(out, page[j]);
+                last = index;
+            }
+        }
+    }
+}
+
+template <typename Count>
+bool QuantileSketch<Count>::parse(const butil::StringPiece& data) {
+    butil::StringPiece left = data;
+    uint64_t index = 0;
+    while (!left.empty()) {
+        uint64_t delta = 0;
+        uint64_t n = 0;
+        if (!parse_sketch_varint(&left, &delta) ||
+            !parse_sketch_varint(&left, &n)) {
+            return false;
+        }
+        index += delta;
+        if (index >= NUM_BUCKETS) {
+            return false;
+        }
+        add_to_bucket(index, n);
+    }
+    return true;
+}
+
+template <typename Count>
+std::ostream& operator<<(std::ostream& os, const QuantileSketch<Count>& s) {
+    s.describe(os);
+    return os;
+}
+
+typedef QuantileSketch<uint32_t> ThreadLocalQuantileSketch;
+typedef QuantileSketch<uint32_t> GlobalQuantileSketch;
+// Combined from sketches of a window, which may overflow uint32.
+typedef QuantileSketch<uint64_t> CombinedQuantileSketch;
+
+// Same as Percentile except that latencies are counted in QuantileSketch.
+// NOTE: DON'T use it directly, use LatencyRecorder instead.
+class SketchPercentile {
+public:
+    struct AddSketch {
+        template <typename C1, typename C2>
+        void operator()(QuantileSketch<C1>& s1,
+                        const QuantileSketch<C2>& s2) const {
+            s1.merge(s2);
+        }
+    };
+
+    typedef GlobalQuantileSketch                            value_type;
+    typedef ReducerSampler<SketchPercentile,
+                           GlobalQuantileSketch,
+                           AddSketch, VoidOp>               sampler_type;
+    typedef AgentCombiner <GlobalQuantileSketch,
+                           ThreadLocalQuantileSketch,
+                           AddSketch>                       combiner_type;
+    typedef combiner_type::Agent                            agent_type;
+    SketchPercentile();
+    ~SketchPercentile();
+
+    AddSketch op() const { return AddSketch(); }
+    VoidOp inv_op() const { return VoidOp(); }
+
+    // The sampler for windows over percentile.
+    sampler_type* get_sampler() {
+        if (NULL == _sampler) {
+            _sampler = new sampler_type(this);
+            _sampler->schedule();
+        }
+        return _sampler;
+    }
+
+    value_type reset();
+
+    value_type get_value() const;
+
+    SketchPercentile& operator<<(int64_t latency);
+
+    bool valid() const { return _combiner != NULL && _combiner->valid(); }
+
+    // This name is useful for warning negative latencies in operator<<
+    void set_debug_name(const butil::StringPiece& name) {
+        _debug_name.assign(name.data(), name.size());
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SketchPercentile);
+
+    combiner_type*          _combiner;
+    sampler_type*           _sampler;
+    std::string _debug_name;
+};
+
+}  // namespace detail
+}  // namespace bvar
+
+#endif  //BVAR_DETAIL_QUANTILE_SKETCH_H
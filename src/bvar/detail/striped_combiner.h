@@ -0,0 +1,199 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef  BVAR_DETAIL_STRIPED_COMBINER_H
+#define  BVAR_DETAIL_STRIPED_COMBINER_H
+
+#include <stdlib.h>                      // malloc, free
+#include <unistd.h>                      // sysconf
+#include <new>                           // placement new
+#include "butil/atomicops.h"             // butil::atomic
+#include "butil/compiler_specific.h"     // BAIDU_CACHELINE_SIZE
+#include "butil/macros.h"                // DISALLOW_COPY_AND_ASSIGN
+#include "butil/thread_local.h"          // BAIDU_THREAD_LOCAL
+#include "butil/type_traits.h"           // butil::is_integral
+
+namespace bvar {
+namespace detail {
+
+// Applies `Op' to an atomic cell. The generic version is a CAS loop, which
+// is correct for any Op. Specialize it for ops that map to a single atomic
+// instruction (see AddTo in bvar/reducer.h).
+template <typename T, typename Op>
+struct StripeModifier {
+    static void modify(butil::atomic<T>* cell, const Op& op, T value) {
+        T old_value = cell->load(butil::memory_order_relaxed);
+        T new_value = old_value;
+        op(new_value, value);
+        // Skip the write when Op does not change the cell, which is the
+        // common case for Maxer/Miner and keeps the cacheline shared.
+        while (new_value != old_value &&
+               !cell->compare_exchange_weak(old_value, new_value,
+                                            butil::memory_order_relaxed)) {
+            new_value = old_value;
+            op(new_value, value);
+        }
+    }
+};
+
+class StripeIndex {
+public:
+    // Max number of stripes of a StripedCombiner.
+    static const size_t MAX_STRIPES = 64;
+
+    // Number of stripes used by all StripedCombiner, which is the number
+    // of online cpus rounded up to power of 2 and capped by MAX_STRIPES.
+    static size_t nstripes() {
+        static const size_t n = compute_nstripes();
+        return n;
+    }
+
+    // Stripe of calling thread, assigned round-robin on first call so that
+    // threads are spread evenly over stripes.
+    static size_t current() {
+        // 0 means unassigned, otherwise stripe + 1.
+        static BAIDU_THREAD_LOCAL size_t tls_index = 0;
+        if (__builtin_expect(tls_index == 0, 0)) {
+            static butil::static_atomic<size_t> s_next = BUTIL_STATIC_ATOMIC_INIT(0);
+            tls_index = s_next.fetch_add(1, butil::memory_order_relaxed)
+                % MAX_STRIPES + 1;
+        }
+        return (tls_index - 1) & (nstripes() - 1);
+    }
+
+private:
+    static size_t compute_nstripes() {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t n = 1;
+        while (n < MAX_STRIPES && (long)n < ncpu) {
+            n <<= 1;
+        }
+        return n;
+    }
+};
+
+// A combiner keeping values in a fixed number of cacheline-aligned atomic
+// cells instead of one agent per thread. Writers pick the cell of their
+// stripe and modify it with a single relaxed atomic op, readers combine
+// the fixed set of cells, so neither needs a lock nor depends on the number
+// of threads. The cost is that threads sharing a stripe contend on the same
+// cacheline, which is why it's only used for integral values whose ops are
+// one instruction (see StripedAdder/StripedMaxer/StripedMiner).
+//
+// Interface is a subset of AgentCombiner that Reducer depends on.
+template <typename T, typename Op>
+class StripedCombiner {
+public:
+    typedef T result_type;
+    typedef T value_type;
+    typedef Op op_type;
+
+    class Element {
+    public:
+        void modify(const Op& op, T value) {
+            StripeModifier<T, Op>::modify(&_value, op, value);
+        }
+        T load() const { return _value.load(butil::memory_order_relaxed); }
+        T exchange(T value) {
+            return _value.exchange(value, butil::memory_order_relaxed);
+        }
+        void store(T value) { _value.store(value, butil::memory_order_relaxed); }
+    private:
+        butil::atomic<T> _value;
+    };
+
+    struct BAIDU_CACHELINE_ALIGNMENT Agent {
+        Element element;
+    };
+
+    BAIDU_CASSERT(butil::is_integral<T>::value,
+                  StripedCombiner_only_supports_integral_types);
+
+    StripedCombiner(T result_identity = T(),
+                    T element_identity = T(),
+                    const Op& op = Op())
+        : _nstripes(StripeIndex::nstripes())
+        , _mem(NULL)
+        , _agents(NULL)
+        , _element_identity(element_identity)
+        , _op(op) {
+        (void)result_identity;
+        _mem = malloc(sizeof(Agent) * _nstripes + BAIDU_CACHELINE_SIZE);
+        if (_mem != NULL) {
+            // malloc() does not guarantee alignment of cacheline.
+            const uintptr_t p = ((uintptr_t)_mem + BAIDU_CACHELINE_SIZE - 1)
+                & ~(uintptr_t)(BAIDU_CACHELINE_SIZE - 1);
+            _agents = reinterpret_cast<Agent*>(p);
+            for (size_t i = 0; i < _nstripes; ++i) {
+                new (&_agents[i]) Agent;
+                _agents[i].element.store(element_identity);
+            }
+        }
+    }
+
+    ~StripedCombiner() {
+        free(_mem);
+        _mem = NULL;
+        _agents = NULL;
+    }
+
+    // Combine cells without locking. Modifications done concurrently may
+    // or may not be counted.
+    T combine_agents() const {
+        T ret = _element_identity;
+        for (size_t i = 0; i < _nstripes; ++i) {
+            _op(ret, _agents[i].element.load());
+        }
+        return ret;
+    }
+
+    // Reset all cells to the identity and return the combined value before.
+    // Every modification is counted either in returned value or after reset.
+    T reset_all_agents() {
+        T ret = _element_identity;
+        for (size_t i = 0; i < _nstripes; ++i) {
+            _op(ret, _agents[i].element.exchange(_element_identity));
+        }
+        return ret;
+    }
+
+    // Never returns NULL once valid().
+    Agent* get_or_create_tls_agent() {
+        if (__builtin_expect(_agents == NULL, 0)) {
+            return NULL;
+        }
+        return &_agents[StripeIndex::current()];
+    }
+
+    const Op& op() const { return _op; }
+
+    bool valid() const { return _agents != NULL; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(StripedCombiner);
+
+    const size_t _nstripes;
+    void* _mem;
+    Agent* _agents;
+    const T _element_identity;
+    const Op _op;
+};
+
+}  // namespace detail
+}  // namespace bvar
+
+#endif  // BVAR_DETAIL_STRIPED_COMBINER_H
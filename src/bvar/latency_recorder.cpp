@@ -19,6 +19,7 @@
 
 #include <gflags/gflags.h>
 #include "butil/unique_ptr.h"
+#include "butil/base64.h"
 #include "bvar/latency_recorder.h"
 
 namespace bvar {
@@ -39,11 +40,17 @@ const bool ALLOW_UNUSED dummy_bvar_latency_p2 = ::GFLAGS_NS::RegisterFlagValidat
 const bool ALLOW_UNUSED dummy_bvar_latency_p3 = ::GFLAGS_NS::RegisterFlagValidator(
     &FLAGS_bvar_latency_p3, valid_percentile);
 
+DEFINE_bool(bvar_latency_use_sketch, false, "Count latencies of LatencyRecorder"
+            " created afterwards in histograms with bounded relative error"
+            " instead of sampling them, which gives accurate tail percentiles"
+            " and exposes <prefix>_latency_sketch that can be merged across"
+            " processes");
+
 namespace detail {
 
 typedef PercentileSamples<1022> CombinedPercentileSamples;
 
-CDF::CDF(PercentileWindow* w) : _w(w) {}
+CDF::CDF(LatencyRecorderBase* owner) : _owner(owner) {}
 
 CDF::~CDF() {
     hide();
@@ -55,35 +62,36 @@ void CDF::describe(std::ostream& os, bool) const {
 
 int CDF::describe_series(
     std::ostream& os, const SeriesOptions& options) const {
-    if (_w == NULL) {
+    if (_owner == NULL) {
         return 1;
     }
     if (options.test_only) {
         return 0;
     }
-    std::unique_ptr<CombinedPercentileSamples> cb(new CombinedPercentileSamples);
-    std::vector<GlobalPercentileSamples> buckets;
-    _w->get_samples(&buckets);
-    for (size_t i = 0; i < buckets.size(); ++i) {
-        cb->combine_of(buckets.begin(), buckets.end());
-    }
-    std::pair<int, int> values[20];
+    double ratios[20];
+    int64_t latencies[arraysize(ratios)];
+    int labels[arraysize(ratios)];
     size_t n = 0;
     for (int i = 1; i < 10; ++i) {
-        values[n++] = std::make_pair(i*10, cb->get_number(i * 0.1));
+        labels[n] = i * 10;
+        ratios[n++] = i * 0.1;
     }
     for (int i = 91; i < 100; ++i) {
-        values[n++] = std::make_pair(i, cb->get_number(i * 0.01));
+        labels[n] = i;
+        ratios[n++] = i * 0.01;
     }
-    values[n++] = std::make_pair(100, cb->get_number(0.999));
-    values[n++] = std::make_pair(101, cb->get_number(0.9999));
-    CHECK_EQ(n, arraysize(values));
+    labels[n] = 100;
+    ratios[n++] = 0.999;
+    labels[n] = 101;
+    ratios[n++] = 0.9999;
+    CHECK_EQ(n, arraysize(ratios));
+    _owner->get_latency_percentiles(ratios, latencies, n);
     os << "{\"label\":\"cdf\",\"data\":[";
     for (size_t i = 0; i < n; ++i) {
         if (i) {
             os << ',';
         }
-        os << '[' << values[i].first << ',' << values[i].second << ']';
+        os << '[' << labels[i] << ',' << (int)latencies[i] << ']';
     }
     os << "]}";
     return 0;
@@ -132,41 +140,116 @@ static int64_t get_p3(void* arg) {
 }
 
 static Vector<int64_t, 4> get_latencies(void *arg) {
-    std::unique_ptr<CombinedPercentileSamples> cb(
-        combine((PercentileWindow*)arg));
     // NOTE: We don't show 99.99% since it's often significantly larger than
     // other values and make other curves on the plotted graph small and
     // hard to read.
+    const double ratios[4] = {
+        FLAGS_bvar_latency_p1 / 100.0,
+        FLAGS_bvar_latency_p2 / 100.0,
+        FLAGS_bvar_latency_p3 / 100.0,
+        0.999
+    };
+    int64_t latencies[4];
+    static_cast<LatencyRecorderBase*>(arg)->get_latency_percentiles(
+        ratios, latencies, 4);
     Vector<int64_t, 4> result;
-    result[0] = cb->get_number(FLAGS_bvar_latency_p1 / 100.0);
-    result[1] = cb->get_number(FLAGS_bvar_latency_p2 / 100.0);
-    result[2] = cb->get_number(FLAGS_bvar_latency_p3 / 100.0);
-    result[3] = cb->get_number(0.999);
+    for (size_t i = 0; i < 4; ++i) {
+        result[i] = latencies[i];
+    }
     return result;
 }
 
+static void print_latency_sketch(std::ostream& os, void* arg) {
+    CombinedQuantileSketch sketch;
+    if (!static_cast<LatencyRecorderBase*>(arg)->get_latency_sketch(&sketch)) {
+        return;
+    }
+    std::string data;
+    sketch.serialize(&data);
+    std::string encoded;
+    butil::Base64Encode(data, &encoded);
+    os << encoded;
+}
+
 LatencyRecorderBase::LatencyRecorderBase(time_t window_size)
     : _max_latency(0)
+    , _latency_percentile(NULL)
     , _latency_window(&_latency, window_size)
     , _max_latency_window(&_max_latency, window_size)
     , _count(get_recorder_count, &_latency)
     , _qps(get_window_recorder_qps, &_latency_window)
-    , _latency_percentile_window(&_latency_percentile, window_size)
+    , _latency_percentile_window(NULL)
     , _latency_p1(get_p1, this)
     , _latency_p2(get_p2, this)
     , _latency_p3(get_p3, this)
     , _latency_999(get_percetile<999, 1000>, this)
     , _latency_9999(get_percetile<9999, 10000>, this)
-    , _latency_cdf(&_latency_percentile_window)
-    , _latency_percentiles(get_latencies, &_latency_percentile_window)
-{}
+    , _latency_cdf(this)
+    , _latency_percentiles(get_latencies, this)
+    , _latency_sketch(NULL)
+    , _latency_sketch_window(NULL)
+    , _latency_sketch_status(print_latency_sketch, this) {
+    // Only one of Percentile and SketchPercentile is created, both of them
+    // are sampled every second by their windows.
+    if (FLAGS_bvar_latency_use_sketch) {
+        _latency_sketch = new SketchPercentile;
+        _latency_sketch_window =
+            new SketchPercentileWindow(_latency_sketch, window_size);
+    } else {
+        _latency_percentile = new Percentile;
+        _latency_percentile_window =
+            new PercentileWindow(_latency_percentile, window_size);
+    }
+}
+
+LatencyRecorderBase::~LatencyRecorderBase() {
+    _latency_sketch_status.hide();
+    // The window references sampler of the sketch.
+    delete _latency_sketch_window;
+    _latency_sketch_window = NULL;
+    delete _latency_sketch;
+    _latency_sketch = NULL;
+    delete _latency_percentile_window;
+    _latency_percentile_window = NULL;
+    delete _latency_percentile;
+    _latency_percentile = NULL;
+}
+
+bool LatencyRecorderBase::get_latency_sketch(
+    CombinedQuantileSketch* sketch) const {
+    if (_latency_sketch_window == NULL) {
+        return false;
+    }
+    std::vector<GlobalQuantileSketch> buckets;
+    _latency_sketch_window->get_samples(&buckets);
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        sketch->merge(buckets[i]);
+    }
+    return true;
+}
+
+void LatencyRecorderBase::get_latency_percentiles(
+    const double* ratios, int64_t* latencies, size_t n) const {
+    if (use_sketch()) {
+        CombinedQuantileSketch sketch;
+        get_latency_sketch(&sketch);
+        for (size_t i = 0; i < n; ++i) {
+            latencies[i] = sketch.get_number(ratios[i]);
+        }
+        return;
+    }
+    std::unique_ptr<CombinedPercentileSamples> cb(
+        combine(_latency_percentile_window));
+    for (size_t i = 0; i < n; ++i) {
+        latencies[i] = cb->get_number(ratios[i]);
+    }
+}
 
 }  // namespace detail
 
 Vector<int64_t, 4> LatencyRecorder::latency_percentiles() const {
     // const_cast here is just to adapt parameter type and safe.
-    return detail::get_latencies(
-        const_cast<detail::PercentileWindow*>(&_latency_percentile_window));
+    return detail::get_latencies(const_cast<LatencyRecorder*>(this));
 }
 
 int64_t LatencyRecorder::qps(time_t window_size) const {
@@ -205,7 +288,11 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
 
     // set debug names for printing helpful error log.
     _latency.set_debug_name(prefix);
-    _latency_percentile.set_debug_name(prefix);
+    if (_latency_sketch) {
+        _latency_sketch->set_debug_name(prefix);
+    } else {
+        _latency_percentile->set_debug_name(prefix);
+    }
 
     if (_latency_window.expose_as(prefix, "latency") != 0) {
         return -1;
@@ -248,13 +335,18 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
              (int)FLAGS_bvar_latency_p1, (int)FLAGS_bvar_latency_p2,
              (int)FLAGS_bvar_latency_p3);
     CHECK_EQ(0, _latency_percentiles.set_vector_names(namebuf));
+    if (_latency_sketch &&
+        _latency_sketch_status.expose_as(prefix, "latency_sketch",
+                                         DISPLAY_ON_PLAIN_TEXT) != 0) {
+        return -1;
+    }
     return 0;
 }
 
 int64_t LatencyRecorder::latency_percentile(double ratio) const {
-    std::unique_ptr<detail::CombinedPercentileSamples> cb(
-        combine((detail::PercentileWindow*)&_latency_percentile_window));
-    return cb->get_number(ratio);
+    int64_t latency = 0;
+    get_latency_percentiles(&ratio, &latency, 1);
+    return latency;
 }
 
 void LatencyRecorder::hide() {
@@ -269,12 +361,17 @@ void LatencyRecorder::hide() {
     _latency_9999.hide();
     _latency_cdf.hide();
     _latency_percentiles.hide();
+    _latency_sketch_status.hide();
 }
 
 LatencyRecorder& LatencyRecorder::operator<<(int64_t latency) {
     _latency << latency;
     _max_latency << latency;
-    _latency_percentile << latency;
+    if (_latency_sketch) {
+        *_latency_sketch << latency;
+    } else {
+        *_latency_percentile << latency;
+    }
     return *this;
 }
 
@@ -24,6 +24,7 @@
 #include "bvar/reducer.h"
 #include "bvar/passive_status.h"
 #include "bvar/detail/percentile.h"
+#include "bvar/detail/quantile_sketch.h"
 
 namespace bvar {
 namespace detail {
@@ -32,34 +33,52 @@ class Percentile;
 typedef Window<IntRecorder, SERIES_IN_SECOND> RecorderWindow;
 typedef Window<Maxer<int64_t>, SERIES_IN_SECOND> MaxWindow;
 typedef Window<Percentile, SERIES_IN_SECOND> PercentileWindow;
+typedef Window<SketchPercentile, SERIES_IN_SECOND> SketchPercentileWindow;
+
+class LatencyRecorderBase;
 
 // NOTE: Always use int64_t in the interfaces no matter what the impl. is.
 
 class CDF : public Variable {
 public:
-    explicit CDF(PercentileWindow* w);
+    explicit CDF(LatencyRecorderBase* owner);
     ~CDF();
     void describe(std::ostream& os, bool quote_string) const override;
     int describe_series(std::ostream& os, const SeriesOptions& options) const override;
 private:
-    PercentileWindow* _w; 
+    LatencyRecorderBase* _owner;
 };
 
 // For mimic constructor inheritance.
 class LatencyRecorderBase {
 public:
     explicit LatencyRecorderBase(time_t window_size);
+    ~LatencyRecorderBase();
     time_t window_size() const { return _latency_window.window_size(); }
+
+    // Put |ratios[i]|-ile latencies in recent window_size-to-ctor seconds
+    // into |latencies[i]|, combining the window only once.
+    void get_latency_percentiles(const double* ratios, int64_t* latencies,
+                                 size_t n) const;
+
+    // True if latencies are counted in QuantileSketch, which is decided by
+    // -bvar_latency_use_sketch at construction.
+    bool use_sketch() const { return _latency_sketch != NULL; }
+
+    // Combine sketches in recent window_size-to-ctor seconds into `sketch'.
+    // Returns false if use_sketch() is false.
+    bool get_latency_sketch(CombinedQuantileSketch* sketch) const;
 protected:
     IntRecorder _latency;
     Maxer<int64_t> _max_latency;
-    Percentile _latency_percentile;
+    // NULL if use_sketch() is true.
+    Percentile* _latency_percentile;
 
     RecorderWindow _latency_window;
     MaxWindow _max_latency_window;
     PassiveStatus<int64_t> _count;
     PassiveStatus<int64_t> _qps;
-    PercentileWindow _latency_percentile_window;
+    PercentileWindow* _latency_percentile_window;
     PassiveStatus<int64_t> _latency_p1;
     PassiveStatus<int64_t> _latency_p2;
     PassiveStatus<int64_t> _latency_p3;
@@ -67,6 +86,11 @@ protected:
     PassiveStatus<int64_t> _latency_9999; // 99.99%
     CDF _latency_cdf;
     PassiveStatus<Vector<int64_t, 4> > _latency_percentiles;
+    // Following are NULL unless use_sketch() is true.
+    SketchPercentile* _latency_sketch;
+    SketchPercentileWindow* _latency_sketch_window;
+    // Base64 of the serialized sketch, for merging across processes.
+    PassiveStatus<std::string> _latency_sketch_status;
 };
 } // namespace detail
 
@@ -107,6 +131,8 @@ public:
     //                                    // foo_bar_write_max_latency
     //                                    // foo_bar_write_count
     //                                    // foo_bar_write_qps
+    //                                    // foo_bar_write_latency_sketch
+    //                                    //   (-bvar_latency_use_sketch only)
     //   rec.expose("foo_bar", "read");   // foo_bar_read_latency
     //                                    // foo_bar_read_max_latency
     //                                    // foo_bar_read_count
@@ -155,6 +181,8 @@ public:
     { return _max_latency_window.name(); }
     const std::string& count_name() const { return _count.name(); }
     const std::string& qps_name() const { return _qps.name(); }
+    const std::string& latency_sketch_name() const
+    { return _latency_sketch_status.name(); }
 };
 
 std::ostream& operator<<(std::ostream& os, const LatencyRecorder&);
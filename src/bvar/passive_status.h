@@ -126,6 +126,14 @@ public:
         os << get_value();
     }
 
+    int describe_to_buffer(char* buf, size_t size,
+                           bool /*quote_string*/) const override {
+        if (!detail::is_printable_number<Tp>::value) {
+            return -1;
+        }
+        return detail::print_number(buf, size, get_value());
+    }
+
 #ifdef BAIDU_INTERNAL
     void get_value(boost::any* value) const override {
         if (_getfn) {
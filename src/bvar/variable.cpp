@@ -18,6 +18,7 @@
 // Date: 2014/09/22 19:04:47
 
 #include <pthread.h>
+#include <algorithm>                            // std::sort
 #include <set>                                  // std::set
 #include <fstream>                              // std::ifstream
 #include <sstream>                              // std::ostringstream
@@ -29,6 +30,8 @@
 #include "butil/errno.h"                         // berror
 #include "butil/time.h"                          // milliseconds_from_now
 #include "butil/file_util.h"                     // butil::FilePath
+#include "butil/iobuf.h"                         // butil::IOBuf
+#include "butil/third_party/murmurhash3/murmurhash3.h"
 #include "bvar/gflag.h"
 #include "bvar/variable.h"
 
@@ -458,77 +461,290 @@ DumpOptions::DumpOptions()
     , display_filter(DISPLAY_ON_PLAIN_TEXT)
 {}
 
-int Variable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
-    if (NULL == dumper) {
-        LOG(ERROR) << "Parameter[dumper] is NULL";
-        return -1;
+// Names and descriptions of exposed variables collected in one pass over
+// the maps. Each variable is stored as "name : description\r\n" in one
+// buffer, which is reused between dumps, so that collecting does not
+// allocate memory for each variable and the records can be appended into
+// IOBuf directly after being sorted.
+class ExposedSnapshot {
+public:
+    struct Item {
+        size_t offset;
+        uint32_t name_size;
+        uint32_t desc_size;
+    };
+
+    ExposedSnapshot() : _os(&_streambuf) {}
+
+    void clear() {
+        _buf.clear();
+        _items.clear();
     }
-    DumpOptions opt;
-    if (poptions) {
-        opt = *poptions;
+
+    size_t size() const { return _items.size(); }
+
+    void truncate(size_t n) {
+        if (n < _items.size()) {
+            _buf.resize(_items[n].offset);
+            _items.resize(n);
+        }
     }
-    CharArrayStreamBuf streambuf;
-    std::ostream os(&streambuf);
-    int count = 0;
+
+    void append(const std::string& name, const Variable* var,
+                bool quote_string) {
+        Item item;
+        item.offset = _buf.size();
+        item.name_size = name.size();
+        _buf.append(name);
+        _buf.append(" : ", 3);
+        const size_t desc_offset = _buf.size();
+        char numbuf[64];
+        const int rc = var->describe_to_buffer(
+            numbuf, sizeof(numbuf), quote_string);
+        if (rc >= 0) {
+            _buf.append(numbuf, rc);
+        } else {
+            _streambuf.reset();
+            var->describe(_os, quote_string);
+            const butil::StringPiece desc = _streambuf.data();
+            _buf.append(desc.data(), desc.size());
+        }
+        item.desc_size = _buf.size() - desc_offset;
+        _buf.append("\r\n", 2);
+        _items.push_back(item);
+    }
+
+    void sort() {
+        std::sort(_items.begin(), _items.end(), NameLess(_buf.data()));
+    }
+
+    butil::StringPiece name(size_t i) const {
+        return butil::StringPiece(_buf.data() + _items[i].offset,
+                                  _items[i].name_size);
+    }
+    butil::StringPiece description(size_t i) const {
+        return butil::StringPiece(
+            _buf.data() + _items[i].offset + _items[i].name_size + 3,
+            _items[i].desc_size);
+    }
+    // "name : description\r\n"
+    butil::StringPiece record(size_t i) const {
+        return butil::StringPiece(
+            _buf.data() + _items[i].offset,
+            _items[i].name_size + 3 + _items[i].desc_size + 2);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ExposedSnapshot);
+
+    struct NameLess {
+        explicit NameLess(const char* base) : _base(base) {}
+        bool operator()(const Item& a, const Item& b) const {
+            return butil::StringPiece(_base + a.offset, a.name_size) <
+                butil::StringPiece(_base + b.offset, b.name_size);
+        }
+        const char* _base;
+    };
+
+    std::string _buf;
+    std::vector<Item> _items;
+    CharArrayStreamBuf _streambuf;
+    std::ostream _os;
+};
+
+// Put descriptions of variables selected by `opt' into `snapshot', sorted
+// by names.
+static void collect_exposed(const DumpOptions& opt, ExposedSnapshot* snapshot) {
+    snapshot->clear();
     WildcardMatcher black_matcher(opt.black_wildcards,
                                   opt.question_mark,
                                   false);
     WildcardMatcher white_matcher(opt.white_wildcards,
                                   opt.question_mark,
                                   true);
-
-    std::ostringstream dumpped_info;
-    const bool log_dummped = FLAGS_bvar_log_dumpped;
-
     if (white_matcher.wildcards().empty() &&
         !white_matcher.exact_names().empty()) {
+        // std::set is sorted already.
         for (std::set<std::string>::const_iterator
                  it = white_matcher.exact_names().begin();
              it != white_matcher.exact_names().end(); ++it) {
             const std::string& name = *it;
-            if (!black_matcher.match(name)) {
-                if (bvar::Variable::describe_exposed(
-                        name, os, opt.quote_string, opt.display_filter) != 0) {
-                    continue;
-                }
-                if (log_dummped) {
-                    dumpped_info << '\n' << name << ": " << streambuf.data();
-                }
-                if (!dumper->dump(name, streambuf.data())) {
-                    return -1;
-                }
-                streambuf.reset();
-                ++count;
+            if (black_matcher.match(name)) {
+                continue;
+            }
+            VarMapWithLock& m = get_var_map(name);
+            BAIDU_SCOPED_LOCK(m.mutex);
+            VarEntry* p = m.seek(name);
+            if (p != NULL && (p->display_filter & opt.display_filter)) {
+                snapshot->append(name, p->var, opt.quote_string);
             }
         }
-    } else {
-        // Have to iterate all variables.
-        std::vector<std::string> varnames;
-        bvar::Variable::list_exposed(&varnames, opt.display_filter);
-        // Sort the names to make them more readable.
-        std::sort(varnames.begin(), varnames.end());
-        for (std::vector<std::string>::const_iterator
-                 it = varnames.begin(); it != varnames.end(); ++it) {
-            const std::string& name = *it;
-            if (white_matcher.match(name) && !black_matcher.match(name)) {
-                if (bvar::Variable::describe_exposed(
-                        name, os, opt.quote_string, opt.display_filter) != 0) {
-                    continue;
-                }
-                if (log_dummped) {
-                    dumpped_info << '\n' << name << ": " << streambuf.data();
+        return;
+    }
+    // Describe variables while iterating the maps rather than listing the
+    // names first and finding them again one by one. A variable must be
+    // described with the lock held to keep it from being destroyed, and
+    // describe() may run user callbacks (PassiveStatus), so yield after
+    // each description to not block expose() and hide() for long.
+    VarMapWithLock* var_maps = get_var_maps();
+    for (size_t i = 0; i < SUB_MAP_COUNT; ++i) {
+        VarMapWithLock& m = var_maps[i];
+        const size_t begin_size = snapshot->size();
+        std::unique_lock<pthread_mutex_t> mu(m.mutex);
+        size_t n = 0;
+        bool described = false;
+        for (VarMap::const_iterator it = m.begin(); it != m.end(); ++it) {
+            if (described || ++n >= 256/*max iterated one pass*/) {
+                VarMap::PositionHint hint;
+                m.save_iterator(it, &hint);
+                n = 0;
+                described = false;
+                mu.unlock();  // yield
+                mu.lock();
+                it = m.restore_iterator(hint);
+                if (it == m.begin()) { // resized
+                    snapshot->truncate(begin_size);
                 }
-                if (!dumper->dump(name, streambuf.data())) {
-                    return -1;
+                if (it == m.end()) {
+                    break;
                 }
-                streambuf.reset();
-                ++count;
             }
+            const std::string& name = it->first;
+            if ((it->second.display_filter & opt.display_filter) &&
+                white_matcher.match(name) && !black_matcher.match(name)) {
+                snapshot->append(name, it->second.var, opt.quote_string);
+                described = true;
+            }
+        }
+    }
+    // Sort the names to make them more readable.
+    snapshot->sort();
+}
+
+int Variable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
+    if (NULL == dumper) {
+        LOG(ERROR) << "Parameter[dumper] is NULL";
+        return -1;
+    }
+    DumpOptions opt;
+    if (poptions) {
+        opt = *poptions;
+    }
+    ExposedSnapshot snapshot;
+    collect_exposed(opt, &snapshot);
+
+    std::ostringstream dumpped_info;
+    const bool log_dummped = FLAGS_bvar_log_dumpped;
+    std::string name;
+    for (size_t i = 0; i < snapshot.size(); ++i) {
+        snapshot.name(i).CopyToString(&name);
+        const butil::StringPiece desc = snapshot.description(i);
+        if (log_dummped) {
+            dumpped_info << '\n' << name << ": " << desc;
+        }
+        if (!dumper->dump(name, desc)) {
+            return -1;
         }
     }
     if (log_dummped) {
         LOG(INFO) << "Dumpped variables:" << dumpped_info.str();
     }
+    return snapshot.size();
+}
+
+struct DumpState::Impl {
+    struct Dumpped {
+        uint64_t desc_hash;
+        uint64_t version;
+    };
+    typedef butil::FlatMap<std::string, Dumpped> DumppedMap;
+
+    Impl() : version(0) {
+        CHECK_EQ(0, dumpped.init(1024, 80));
+    }
+
+    ExposedSnapshot snapshot;
+    DumppedMap dumpped;
+    uint64_t version;
+    std::string name;
+};
+
+DumpState::DumpState() : _impl(new Impl) {}
+
+DumpState::~DumpState() {
+    delete _impl;
+    _impl = NULL;
+}
+
+void DumpState::reset() {
+    _impl->dumpped.clear();
+}
+
+size_t DumpState::size() const {
+    return _impl->dumpped.size();
+}
+
+inline uint64_t hash_description(const butil::StringPiece& desc) {
+    uint64_t h[2];
+    butil::MurmurHash3_x64_128(desc.data(), desc.size(), 0, h);
+    return h[0];
+}
+
+int Variable::dump_exposed(butil::IOBuf* out, const DumpOptions* poptions,
+                           DumpState* state) {
+    if (NULL == out) {
+        LOG(ERROR) << "Parameter[out] is NULL";
+        return -1;
+    }
+    DumpOptions opt;
+    if (poptions) {
+        opt = *poptions;
+    }
+    ExposedSnapshot local_snapshot;
+    ExposedSnapshot* snapshot =
+        (state ? &state->_impl->snapshot : &local_snapshot);
+    collect_exposed(opt, snapshot);
+
+    butil::IOBufAppender appender;
+    int count = 0;
+    if (state == NULL) {
+        for (size_t i = 0; i < snapshot->size(); ++i) {
+            appender.append(snapshot->record(i));
+        }
+        count = snapshot->size();
+    } else {
+        DumpState::Impl* impl = state->_impl;
+        const uint64_t version = ++impl->version;
+        for (size_t i = 0; i < snapshot->size(); ++i) {
+            snapshot->name(i).CopyToString(&impl->name);
+            const uint64_t h = hash_description(snapshot->description(i));
+            DumpState::Impl::Dumpped* d = impl->dumpped.seek(impl->name);
+            if (d == NULL) {
+                d = &impl->dumpped[impl->name];
+            } else if (d->desc_hash == h) {
+                d->version = version;
+                continue;
+            }
+            d->desc_hash = h;
+            d->version = version;
+            appender.append(snapshot->record(i));
+            ++count;
+        }
+        if (impl->dumpped.size() > snapshot->size()) {
+            // Some variables were hidden since last dump.
+            std::vector<std::string> removed;
+            for (DumpState::Impl::DumppedMap::const_iterator
+                     it = impl->dumpped.begin(); it != impl->dumpped.end(); ++it) {
+                if (it->second.version != version) {
+                    removed.push_back(it->first);
+                }
+            }
+            for (size_t i = 0; i < removed.size(); ++i) {
+                impl->dumpped.erase(removed[i]);
+            }
+        }
+    }
+    appender.move_to(*out);
     return count;
 }
 
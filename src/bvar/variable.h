@@ -35,6 +35,10 @@ class any;
 }
 #endif
 
+namespace butil {
+class IOBuf;
+}
+
 namespace bvar {
 
 DECLARE_bool(save_series);
@@ -77,6 +81,28 @@ struct DumpOptions {
     std::string black_wildcards;
 };
 
+// Remember what was dumped by Variable::dump_exposed(butil::IOBuf*, ...) so
+// that next call with the same state only appends variables whose
+// descriptions changed. Not thread-safe.
+class DumpState {
+friend class Variable;
+public:
+    DumpState();
+    ~DumpState();
+
+    // Forget dumped variables, next dump appends all of them.
+    void reset();
+
+    // Number of variables remembered.
+    size_t size() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DumpState);
+
+    struct Impl;
+    Impl* _impl;
+};
+
 struct SeriesOptions {
     SeriesOptions() : fixed_length(true), test_only(false) {}
     
@@ -107,6 +133,15 @@ public:
     // string form of describe().
     std::string get_description() const;
 
+    // Print the variable into `buf' of `size' bytes without std::ostream,
+    // which is much cheaper for numeric values. The output must be same
+    // with describe(). Returns length of the output, -1 when the variable
+    // does not support this or `buf' is not large enough, in which case
+    // dump_exposed() falls back to describe().
+    virtual int describe_to_buffer(char* /*buf*/, size_t /*size*/,
+                                   bool /*quote_string*/) const
+    { return -1; }
+
 #ifdef BAIDU_INTERNAL
     // Get value.
     // If subclass does not override this method, the value is the description
@@ -205,6 +240,15 @@ public:
     // Return number of dumped variables, -1 on error.
     static int dump_exposed(Dumper* dumper, const DumpOptions* options);
 
+    // Append variables selected by `options' into `out' in the form of
+    // "name : description\r\n", sorted by names. If `state' is not NULL,
+    // only variables whose descriptions changed since the previous call with
+    // the same `state' are appended.
+    // Use default options when `options' is NULL.
+    // Return number of appended variables, -1 on error.
+    static int dump_exposed(butil::IOBuf* out, const DumpOptions* options,
+                            DumpState* state = NULL);
+
 protected:
     virtual int expose_impl(const butil::StringPiece& prefix,
                             const butil::StringPiece& name,
@@ -26,6 +26,7 @@
 #include "butil/logging.h"                         // LOG
 #include "bvar/detail/sampler.h"
 #include "bvar/detail/series.h"
+#include "bvar/detail/print_number.h"
 #include "bvar/variable.h"
 
 namespace bvar {
@@ -117,6 +118,14 @@ public:
             os << get_value();
         }
     }
+
+    int describe_to_buffer(char* buf, size_t size,
+                           bool /*quote_string*/) const override {
+        if (!detail::is_printable_number<value_type>::value) {
+            return -1;
+        }
+        return detail::print_number(buf, size, get_value());
+    }
     
 #ifdef BAIDU_INTERNAL
     void get_value(boost::any* value) const override { *value = get_value(); }
@@ -0,0 +1,107 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <algorithm>
+#include <google/protobuf/descriptor.h>
+#include "encode_decode.h"
+#include "protobuf_map.h"
+#include "field_table.h"
+
+namespace json2pb {
+
+namespace {
+struct EntryNameLess {
+    explicit EntryNameLess(const std::vector<FieldTable::Entry>* entries)
+        : _entries(entries) {}
+    bool operator()(int lhs, int rhs) const {
+        return (*_entries)[lhs].name < (*_entries)[rhs].name;
+    }
+    bool operator()(int lhs, const butil::StringPiece& rhs) const {
+        return (*_entries)[lhs].name < rhs;
+    }
+    const std::vector<FieldTable::Entry>* _entries;
+};
+} // namespace
+
+FieldTable::FieldTable(const google::protobuf::Message& prototype) {
+    const google::protobuf::Reflection* reflection = prototype.GetReflection();
+    const google::protobuf::Descriptor* descriptor = prototype.GetDescriptor();
+    std::vector<const google::protobuf::FieldDescriptor*> fields;
+    fields.reserve(descriptor->field_count());
+    for (int i = 0; i < descriptor->extension_range_count(); ++i) {
+        const google::protobuf::Descriptor::ExtensionRange*
+            ext_range = descriptor->extension_range(i);
+        for (int tag_number = ext_range->start;
+             tag_number < ext_range->end; ++tag_number) {
+            const google::protobuf::FieldDescriptor* field =
+                reflection->FindKnownExtensionByNumber(tag_number);
+            if (field) {
+                fields.push_back(field);
+            }
+        }
+    }
+    for (int i = 0; i < descriptor->field_count(); ++i) {
+        fields.push_back(descriptor->field(i));
+    }
+
+    _entries.resize(fields.size());
+    _sorted.resize(fields.size());
+    std::string decoded;
+    for (size_t i = 0; i < fields.size(); ++i) {
+        const google::protobuf::FieldDescriptor* field = fields[i];
+        Entry& e = _entries[i];
+        e.field = field;
+        if (decode_name(field->name(), decoded)) {
+            _decoded_names.push_back(decoded);
+            e.name = _decoded_names.back();
+        } else {
+            e.name = field->name();
+        }
+        e.is_map = IsProtobufMap(field);
+        if (field->is_required()) {
+            _required.push_back(i);
+        }
+        _sorted[i] = i;
+    }
+    std::sort(_sorted.begin(), _sorted.end(), EntryNameLess(&_entries));
+}
+
+int FieldTable::Find(const butil::StringPiece& name) const {
+    std::vector<int>::const_iterator it = std::lower_bound(
+        _sorted.begin(), _sorted.end(), name, EntryNameLess(&_entries));
+    if (it != _sorted.end() && _entries[*it].name == name) {
+        return *it;
+    }
+    return -1;
+}
+
+FieldTableCache::~FieldTableCache() {
+    for (std::map<const google::protobuf::Descriptor*, FieldTable*>::iterator
+             it = _tables.begin(); it != _tables.end(); ++it) {
+        delete it->second;
+    }
+}
+
+const FieldTable& FieldTableCache::Get(const google::protobuf::Message& message) {
+    FieldTable*& table = _tables[message.GetDescriptor()];
+    if (table == NULL) {
+        table = new FieldTable(message);
+    }
+    return *table;
+}
+
+} // namespace json2pb
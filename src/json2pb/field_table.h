@@ -0,0 +1,86 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BRPC_JSON2PB_FIELD_TABLE_H
+#define BRPC_JSON2PB_FIELD_TABLE_H
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <google/protobuf/message.h>
+#include "butil/macros.h"
+#include "butil/strings/string_piece.h"
+
+namespace json2pb {
+
+// Fields of a message type (including known extensions) along with their
+// names in json, which are decoded once per type rather than once per
+// converted message.
+class FieldTable {
+public:
+    struct Entry {
+        const google::protobuf::FieldDescriptor* field;
+        // Referencing a std::string, thus always null-terminated.
+        butil::StringPiece name;
+        bool is_map;
+    };
+
+    // Known extensions are found via reflection of `prototype'.
+    explicit FieldTable(const google::protobuf::Message& prototype);
+
+    // Known extensions followed by fields in declaration order, which is the
+    // order that fields are written into json.
+    const std::vector<Entry>& entries() const { return _entries; }
+
+    // Indexes of entries of required fields, in declaration order.
+    const std::vector<int>& required() const { return _required; }
+
+    // Returns index of the entry whose json name is `name', -1 otherwise.
+    int Find(const butil::StringPiece& name) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FieldTable);
+
+    std::vector<Entry> _entries;
+    // Indexes of _entries sorted by name.
+    std::vector<int> _sorted;
+    std::vector<int> _required;
+    // Names that differ from the field names after decoding. A deque is used
+    // so that appending does not invalidate names referenced by _entries.
+    std::deque<std::string> _decoded_names;
+};
+
+// FieldTables of message types met during one conversion. The tables are not
+// shared between conversions: descriptors from dynamic pools may be destroyed
+// and extensions may be registered at any time.
+class FieldTableCache {
+public:
+    FieldTableCache() {}
+    ~FieldTableCache();
+
+    const FieldTable& Get(const google::protobuf::Message& message);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FieldTableCache);
+
+    std::map<const google::protobuf::Descriptor*, FieldTable*> _tables;
+};
+
+} // namespace json2pb
+
+#endif // BRPC_JSON2PB_FIELD_TABLE_H
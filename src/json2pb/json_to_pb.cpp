@@ -27,7 +27,7 @@
 #include "butil/strings/string_number_conversions.h"
 #include "json_to_pb.h"
 #include "zero_copy_stream_reader.h"       // ZeroCopyStreamReader
-#include "encode_decode.h"
+#include "field_table.h"                   // FieldTableCache
 #include "butil/base64.h"
 #include "butil/string_printf.h"
 #include "protobuf_map.h"
@@ -264,7 +264,8 @@ inline bool convert_uint64_type(const BUTIL_RAPIDJSON_NAMESPACE::Value& item,
 
 bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
                              google::protobuf::Message* message,
-                             const Json2PbOptions& options, std::string* err);
+                             const Json2PbOptions& options, std::string* err,
+                             FieldTableCache* tables);
 
 //Json value to protobuf convert rules for type:
 //Json value type                 Protobuf type                convert rules
@@ -290,41 +291,25 @@ bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
         })
 
 
-static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
-                                  const google::protobuf::FieldDescriptor* field,
-                                  google::protobuf::Message* message,
-                                  const Json2PbOptions& options,
-                                  std::string* err) {
-    if (value.IsNull()) {
-        if (field->is_required()) {
-            J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
-            return false;
-        }
-        return true;
-    }
-        
-    if (field->is_repeated()) {
-        if (!value.IsArray()) {
-            J2PERROR(err, "Invalid value for repeated field: %s",
-                     field->full_name().c_str());
-            return false;
-        }
-    } 
-
+// Convert `item' to the value of a non-repeated `field', or add it to a
+// repeated `field' when `repeated' is true.
+static bool JsonValueToProtoItem(const BUTIL_RAPIDJSON_NAMESPACE::Value& item,
+                                 const google::protobuf::FieldDescriptor* field,
+                                 bool repeated,
+                                 google::protobuf::Message* message,
+                                 const Json2PbOptions& options,
+                                 std::string* err,
+                                 FieldTableCache* tables) {
     const google::protobuf::Reflection* reflection = message->GetReflection();
     switch (field->cpp_type()) {
 #define CASE_FIELD_TYPE(cpptype, method, jsontype)                      \
-        case google::protobuf::FieldDescriptor::CPPTYPE_##cpptype: {                      \
-            if (field->is_repeated()) {                                 \
-                const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();          \
-                for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) { \
-                    const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];       \
-                    if (TYPE_MATCH == J2PCHECKTYPE(item, cpptype, jsontype)) { \
-                        reflection->Add##method(message, field, item.Get##jsontype()); \
-                    }                                                   \
+        case google::protobuf::FieldDescriptor::CPPTYPE_##cpptype: {    \
+            if (TYPE_MATCH == J2PCHECKTYPE(item, cpptype, jsontype)) {  \
+                if (repeated) {                                         \
+                    reflection->Add##method(message, field, item.Get##jsontype()); \
+                } else {                                                \
+                    reflection->Set##method(message, field, item.Get##jsontype()); \
                 }                                                       \
-            } else if (TYPE_MATCH == J2PCHECKTYPE(value, cpptype, jsontype)) { \
-                reflection->Set##method(message, field, value.Get##jsontype()); \
             }                                                           \
             break;                                                      \
         }                                                               \
@@ -335,92 +320,20 @@ static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
 #undef CASE_FIELD_TYPE
 
     case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size;
-                 ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value& item = value[index];
-                if (!convert_int64_type(item, true, message, field, reflection,
-                                        err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_int64_type(value, false, message, field, reflection,
-                                       err)) {
-            return false;
-        }
-        break;
+        return convert_int64_type(item, repeated, message, field, reflection, err);
 
     case google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size;
-                 ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value& item = value[index];
-                if (!convert_uint64_type(item, true, message, field, reflection,
-                                         err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_uint64_type(value, false, message, field, reflection,
-                                       err)) {
-            return false;
-        }
-        break;
+        return convert_uint64_type(item, repeated, message, field, reflection, err);
 
     case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_float_type(item, true, message, field,
-                                        reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_float_type(value, false, message, field,
-                                       reflection, err)) {
-            return false;
-        }
-        break;
+        return convert_float_type(item, repeated, message, field, reflection, err);
 
     case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: 
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_double_type(item, true, message, field,
-                                         reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_double_type(value, false, message, field,
-                                        reflection, err)) {
-            return false;
-        }
-        break;
+        return convert_double_type(item, repeated, message, field, reflection, err);
         
     case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (TYPE_MATCH == J2PCHECKTYPE(item, string, String)) { 
-                    std::string str(item.GetString(), item.GetStringLength());
-                    if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES &&
-                        options.base64_to_bytes) {
-                        std::string str_decoded;
-                        if (!butil::Base64Decode(str, &str_decoded)) {
-                            J2PERROR(err, "Fail to decode base64 string=%s", str.c_str());
-                            return false;
-                        }
-                        str = str_decoded;
-                    }
-                    reflection->AddString(message, field, str);
-                }  
-            }
-        } else if (TYPE_MATCH == J2PCHECKTYPE(value, string, String)) {
-            std::string str(value.GetString(), value.GetStringLength());
+        if (TYPE_MATCH == J2PCHECKTYPE(item, string, String)) { 
+            std::string str(item.GetString(), item.GetStringLength());
             if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES &&
                 options.base64_to_bytes) {
                 std::string str_decoded;
@@ -428,45 +341,62 @@ static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
                     J2PERROR(err, "Fail to decode base64 string=%s", str.c_str());
                     return false;
                 }
-                str = str_decoded;
+                str.swap(str_decoded);
+            }
+            if (repeated) {
+                reflection->AddString(message, field, str);
+            } else {
+                reflection->SetString(message, field, str);
             }
-            reflection->SetString(message, field, str);
         }
         break;
 
     case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_enum_type(item, true, message, field,
-                                       reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_enum_type(value, false, message, field,
-                                      reflection, err)) {
-            return false;
+        return convert_enum_type(item, repeated, message, field, reflection, err);
+        
+    case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
+        if (!repeated) {
+            return JsonValueToProtoMessage(
+                item, reflection->MutableMessage(message, field), options, err, tables);
+        }
+        if (TYPE_MATCH == J2PCHECKTYPE(item, message, Object)) { 
+            return JsonValueToProtoMessage(
+                item, reflection->AddMessage(message, field), options, err, tables);
         }
         break;
+    }
+    return true;
+}
+
+static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
+                                  const google::protobuf::FieldDescriptor* field,
+                                  google::protobuf::Message* message,
+                                  const Json2PbOptions& options,
+                                  std::string* err,
+                                  FieldTableCache* tables) {
+    if (value.IsNull()) {
+        if (field->is_required()) {
+            J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
+            return false;
+        }
+        return true;
+    }
         
-    case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value& item = value[index];
-                if (TYPE_MATCH == J2PCHECKTYPE(item, message, Object)) { 
-                    if (!JsonValueToProtoMessage(
-                            item, reflection->AddMessage(message, field), options, err)) {
-                        return false;
-                    }
-                } 
-            }
-        } else if (!JsonValueToProtoMessage(
-            value, reflection->MutableMessage(message, field), options, err)) {
+    if (!field->is_repeated()) {
+        return JsonValueToProtoItem(value, field, false, message, options, err,
+                                    tables);
+    }
+    if (!value.IsArray()) {
+        J2PERROR(err, "Invalid value for repeated field: %s",
+                 field->full_name().c_str());
+        return false;
+    }
+    const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
+    for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
+        if (!JsonValueToProtoItem(value[index], field, true, message,
+                                  options, err, tables)) {
             return false;
         }
-        break;
     }
     return true;
 }
@@ -475,7 +405,8 @@ bool JsonMapToProtoMap(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
                        const google::protobuf::FieldDescriptor* map_desc,
                        google::protobuf::Message* message,
                        const Json2PbOptions& options,
-                       std::string* err) {
+                       std::string* err,
+                       FieldTableCache* tables) {
     if (!value.IsObject()) {
         J2PERROR(err, "Non-object value for map field: %s",
                  map_desc->full_name().c_str());
@@ -495,7 +426,8 @@ bool JsonMapToProtoMap(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
         entry_reflection->SetString(
             entry, key_desc, std::string(it->name.GetString(),
                                          it->name.GetStringLength()));
-        if (!JsonValueToProtoField(it->value, value_desc, entry, options, err)) {
+        if (!JsonValueToProtoField(it->value, value_desc, entry, options, err,
+                                   tables)) {
             return false;
         }
     }
@@ -505,45 +437,24 @@ bool JsonMapToProtoMap(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
 bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
                              google::protobuf::Message* message,
                              const Json2PbOptions& options,
-                             std::string* err) {
+                             std::string* err,
+                             FieldTableCache* tables) {
     const google::protobuf::Descriptor* descriptor = message->GetDescriptor();
     if (!json_value.IsObject()) {
         J2PERROR(err, "`json_value' is not a json object. %s", descriptor->name().c_str());
         return false;
     }
 
-    const google::protobuf::Reflection* reflection = message->GetReflection();
-    
-    std::vector<const google::protobuf::FieldDescriptor*> fields;
-    fields.reserve(64);
-    for (int i = 0; i < descriptor->extension_range_count(); ++i) {
-        const google::protobuf::Descriptor::ExtensionRange*
-            ext_range = descriptor->extension_range(i);
-        for (int tag_number = ext_range->start; tag_number < ext_range->end;
-             ++tag_number) {
-            const google::protobuf::FieldDescriptor* field =
-                reflection->FindKnownExtensionByNumber(tag_number);
-            if (field) {
-                fields.push_back(field);
-            }
-        }
-    }
-    for (int i = 0; i < descriptor->field_count(); ++i) {
-        fields.push_back(descriptor->field(i));
-    }
-
-    std::string field_name_str_temp; 
+    const std::vector<FieldTable::Entry>& entries = tables->Get(*message).entries();
     const BUTIL_RAPIDJSON_NAMESPACE::Value* value_ptr = NULL;
-    for (size_t i = 0; i < fields.size(); ++i) {
-        const google::protobuf::FieldDescriptor* field = fields[i];
-        
-        const std::string& orig_name = field->name();
-        bool res = decode_name(orig_name, field_name_str_temp); 
-        const std::string& field_name_str = (res ? field_name_str_temp : orig_name);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const google::protobuf::FieldDescriptor* field = entries[i].field;
+        // Names in FieldTable are always null-terminated.
+        const char* field_name_str = entries[i].name.data();
 
 #ifndef RAPIDJSON_VERSION_0_1
         BUTIL_RAPIDJSON_NAMESPACE::Value::ConstMemberIterator member =
-                json_value.FindMember(field_name_str.data());
+                json_value.FindMember(field_name_str);
         if (member == json_value.MemberEnd()) {
             if (field->is_required()) {
                 J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
@@ -554,7 +465,7 @@ bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
         value_ptr = &(member->value);
 #else 
         const BUTIL_RAPIDJSON_NAMESPACE::Value::Member* member =
-                json_value.FindMember(field_name_str.data());
+                json_value.FindMember(field_name_str);
         if (member == NULL) {
             if (field->is_required()) {
                 J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
@@ -565,17 +476,299 @@ bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
         value_ptr = &(member->value);
 #endif
 
-        if (IsProtobufMap(field) && value_ptr->IsObject()) {
+        if (entries[i].is_map && value_ptr->IsObject()) {
             // Try to parse json like {"key":value, ...} into protobuf map
-            if (!JsonMapToProtoMap(*value_ptr, field, message, options, err)) {
+            if (!JsonMapToProtoMap(*value_ptr, field, message, options, err,
+                                   tables)) {
+                return false;
+            }
+        } else {
+            if (!JsonValueToProtoField(*value_ptr, field, message, options, err,
+                                       tables)) {
                 return false;
             }
+        }
+    }
+    return true;
+}
+
+// Convert json to protobuf by handling events of BUTIL_RAPIDJSON_NAMESPACE::Reader
+// directly rather than parsing the json into a Document first, which holds
+// nodes of all values and doubles the memory for converting large json.
+// Values are converted by the same rules as
+// JsonValueToProtoMessage: scalars are wrapped into Values on stack and
+// containers are represented by empty Values of the same types, with
+// nested values skipped. Differences are that errors are reported in the
+// order that values appear in json, and missing required fields are
+// reported when their objects end.
+class JsonToProtoConverter {
+public:
+    JsonToProtoConverter(google::protobuf::Message* message,
+                         const Json2PbOptions& options, std::string* err)
+        : _root(message), _options(options), _err(err)
+        , _depth(0), _failed(false) {}
+
+    // True if the parsing was terminated by failure of conversion.
+    bool failed() const { return _failed; }
+
+    // Handler of BUTIL_RAPIDJSON_NAMESPACE::Reader
+    bool Null() {
+        const BUTIL_RAPIDJSON_NAMESPACE::Value v;
+        return OnValue(v);
+    }
+    bool Bool(bool b) {
+        const BUTIL_RAPIDJSON_NAMESPACE::Value v(b);
+        return OnValue(v);
+    }
+    bool AddInt(int i) {
+        const BUTIL_RAPIDJSON_NAMESPACE::Value v(i);
+        return OnValue(v);
+    }
+    bool AddUint(unsigned u) {
+        const BUTIL_RAPIDJSON_NAMESPACE::Value v(u);
+        return OnValue(v);
+    }
+    bool AddInt64(int64_t i) {
+        const BUTIL_RAPIDJSON_NAMESPACE::Value v(i);
+        return OnValue(v);
+    }
+    bool AddUint64(uint64_t u) {
+        const BUTIL_RAPIDJSON_NAMESPACE::Value v(u);
+        return OnValue(v);
+    }
+    bool Double(double d) {
+        const BUTIL_RAPIDJSON_NAMESPACE::Value v(d);
+        return OnValue(v);
+    }
+    bool String(const char* str, BUTIL_RAPIDJSON_NAMESPACE::SizeType length,
+                bool /*copy*/) {
+        // `str' is valid until this function returns, referencing is enough.
+        const BUTIL_RAPIDJSON_NAMESPACE::Value v(str, length);
+        return OnValue(v);
+    }
+    bool StartObject();
+    bool Key(const char* str, BUTIL_RAPIDJSON_NAMESPACE::SizeType length,
+             bool copy);
+    bool EndObject(BUTIL_RAPIDJSON_NAMESPACE::SizeType);
+    bool StartArray();
+    bool EndArray(BUTIL_RAPIDJSON_NAMESPACE::SizeType);
+
+private:
+    enum FrameType {
+        FRAME_MESSAGE,   // an object converted to a message
+        FRAME_MAP,       // an object converted to a protobuf map
+        FRAME_REPEATED,  // an array converted to a repeated field
+        FRAME_SKIP,      // a value not converted
+    };
+    struct Frame {
+        FrameType type;
+        // MESSAGE/MAP: the message and field that the next value goes to,
+        // field is NULL if the value should be skipped.
+        // REPEATED: the message and the repeated field.
+        google::protobuf::Message* message;
+        const google::protobuf::FieldDescriptor* field;
+        // MESSAGE: fields of the message and whether they've appeared.
+        const FieldTable* table;
+        std::vector<bool> seen;
+        // MAP: the message and the map field that entries are added to.
+        google::protobuf::Message* map_owner;
+        const google::protobuf::FieldDescriptor* map_field;
+        // SKIP: nesting depth inside the skipped value.
+        int nskip;
+    };
+
+    // Frames are reused to avoid allocations for each object or array.
+    Frame& PushFrame(FrameType type) {
+        if (_depth == _frames.size()) {
+            _frames.push_back(Frame());
+        }
+        Frame& f = _frames[_depth++];
+        f.type = type;
+        f.message = NULL;
+        f.field = NULL;
+        f.table = NULL;
+        f.map_owner = NULL;
+        f.map_field = NULL;
+        f.nskip = 1;
+        return f;
+    }
+    void PushMessageFrame(google::protobuf::Message* message) {
+        const FieldTable& table = _tables.Get(*message);
+        Frame& f = PushFrame(FRAME_MESSAGE);
+        f.message = message;
+        f.table = &table;
+        f.seen.assign(table.entries().size(), false);
+    }
+    // Skip the container just started if `ok' is true.
+    bool SkipContainer(bool ok) {
+        if (!ok) {
+            _failed = true;
+            return false;
+        }
+        PushFrame(FRAME_SKIP);
+        return true;
+    }
+    bool RootIsNotObject() {
+        J2PERROR(_err, "`json_value' is not a json object. %s",
+                 _root->GetDescriptor()->name().c_str());
+        _failed = true;
+        return false;
+    }
+    bool OnValue(const BUTIL_RAPIDJSON_NAMESPACE::Value& value);
+
+    google::protobuf::Message* _root;
+    const Json2PbOptions& _options;
+    std::string* _err;
+    std::vector<Frame> _frames;
+    size_t _depth;
+    bool _failed;
+    FieldTableCache _tables;
+};
+
+bool JsonToProtoConverter::OnValue(const BUTIL_RAPIDJSON_NAMESPACE::Value& value) {
+    if (_depth == 0) {
+        return RootIsNotObject();
+    }
+    const Frame& f = _frames[_depth - 1];
+    bool ok = true;
+    if (f.type == FRAME_REPEATED) {
+        ok = JsonValueToProtoItem(value, f.field, true, f.message,
+                                  _options, _err, &_tables);
+    } else if (f.type != FRAME_SKIP && f.field != NULL) {
+        ok = JsonValueToProtoField(value, f.field, f.message,
+                                   _options, _err, &_tables);
+    }
+    if (!ok) {
+        _failed = true;
+    }
+    return ok;
+}
+
+bool JsonToProtoConverter::StartObject() {
+    if (_depth == 0) {
+        PushMessageFrame(_root);
+        return true;
+    }
+    Frame& f = _frames[_depth - 1];
+    if (f.type == FRAME_SKIP) {
+        ++f.nskip;
+        return true;
+    }
+    google::protobuf::Message* message = f.message;
+    const google::protobuf::FieldDescriptor* field = f.field;
+    const google::protobuf::Reflection* reflection = message->GetReflection();
+    const BUTIL_RAPIDJSON_NAMESPACE::Value object(BUTIL_RAPIDJSON_NAMESPACE::kObjectType);
+    if (f.type == FRAME_REPEATED) {
+        if (field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
+            PushMessageFrame(reflection->AddMessage(message, field));
+            return true;
+        }
+        return SkipContainer(JsonValueToProtoItem(
+                                 object, field, true, message, _options, _err,
+                                 &_tables));
+    }
+    if (field == NULL) {
+        PushFrame(FRAME_SKIP);
+        return true;
+    }
+    if (IsProtobufMap(field)) {
+        // Try to parse json like {"key":value, ...} into protobuf map
+        Frame& map_frame = PushFrame(FRAME_MAP);
+        map_frame.map_owner = message;
+        map_frame.map_field = field;
+        return true;
+    }
+    if (!field->is_repeated() &&
+        field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
+        PushMessageFrame(reflection->MutableMessage(message, field));
+        return true;
+    }
+    return SkipContainer(JsonValueToProtoField(
+                             object, field, message, _options, _err, &_tables));
+}
+
+bool JsonToProtoConverter::Key(const char* str,
+                               BUTIL_RAPIDJSON_NAMESPACE::SizeType length,
+                               bool /*copy*/) {
+    Frame& f = _frames[_depth - 1];
+    if (f.type == FRAME_MESSAGE) {
+        const int index = f.table->Find(butil::StringPiece(str, length));
+        // Values of unknown keys are skipped. Only the first one of
+        // duplicated keys is converted, the same as Document::FindMember.
+        if (index < 0 || f.seen[index]) {
+            f.field = NULL;
         } else {
-            if (!JsonValueToProtoField(*value_ptr, field, message, options, err)) {
+            f.seen[index] = true;
+            f.field = f.table->entries()[index].field;
+        }
+    } else if (f.type == FRAME_MAP) {
+        const google::protobuf::Descriptor* entry_desc = f.map_field->message_type();
+        f.message = f.map_owner->GetReflection()->AddMessage(
+            f.map_owner, f.map_field);
+        f.message->GetReflection()->SetString(
+            f.message, entry_desc->field(KEY_INDEX), std::string(str, length));
+        f.field = entry_desc->field(VALUE_INDEX);
+    }
+    return true;
+}
+
+bool JsonToProtoConverter::EndObject(BUTIL_RAPIDJSON_NAMESPACE::SizeType) {
+    Frame& f = _frames[_depth - 1];
+    if (f.type == FRAME_SKIP && --f.nskip > 0) {
+        return true;
+    }
+    if (f.type == FRAME_MESSAGE) {
+        const std::vector<int>& required = f.table->required();
+        for (size_t i = 0; i < required.size(); ++i) {
+            if (!f.seen[required[i]]) {
+                J2PERROR(_err, "Missing required field: %s",
+                         f.table->entries()[required[i]].field->full_name().c_str());
+                _failed = true;
                 return false;
             }
         }
     }
+    --_depth;
+    return true;
+}
+
+bool JsonToProtoConverter::StartArray() {
+    if (_depth == 0) {
+        return RootIsNotObject();
+    }
+    Frame& f = _frames[_depth - 1];
+    if (f.type == FRAME_SKIP) {
+        ++f.nskip;
+        return true;
+    }
+    google::protobuf::Message* message = f.message;
+    const google::protobuf::FieldDescriptor* field = f.field;
+    const BUTIL_RAPIDJSON_NAMESPACE::Value array(BUTIL_RAPIDJSON_NAMESPACE::kArrayType);
+    if (f.type == FRAME_REPEATED) {
+        return SkipContainer(JsonValueToProtoItem(
+                                 array, field, true, message, _options, _err,
+                                 &_tables));
+    }
+    if (field == NULL) {
+        PushFrame(FRAME_SKIP);
+        return true;
+    }
+    if (field->is_repeated()) {
+        Frame& repeated_frame = PushFrame(FRAME_REPEATED);
+        repeated_frame.message = message;
+        repeated_frame.field = field;
+        return true;
+    }
+    return SkipContainer(JsonValueToProtoField(
+                             array, field, message, _options, _err, &_tables));
+}
+
+bool JsonToProtoConverter::EndArray(BUTIL_RAPIDJSON_NAMESPACE::SizeType) {
+    Frame& f = _frames[_depth - 1];
+    if (f.type == FRAME_SKIP && --f.nskip > 0) {
+        return true;
+    }
+    --_depth;
     return true;
 }
 
@@ -599,7 +792,8 @@ inline bool JsonToProtoMessageInline(const std::string& json_string,
         J2PERROR(error, "Invalid json format");
         return false;
     }
-    return json2pb::JsonValueToProtoMessage(d, message, options, error);
+    FieldTableCache tables;
+    return json2pb::JsonValueToProtoMessage(d, message, options, error, &tables);
 }
 
 bool JsonToProtoMessage(const std::string& json_string,
@@ -616,12 +810,18 @@ bool JsonToProtoMessage(google::protobuf::io::ZeroCopyInputStream* stream,
     if (error) {
         error->clear();
     }
-    BUTIL_RAPIDJSON_NAMESPACE::Document d;
-    if (!json2pb::ZeroCopyStreamToJson(&d, stream)) {
+    ZeroCopyStreamReader stream_reader(stream);
+    JsonToProtoConverter converter(message, options, error);
+    BUTIL_RAPIDJSON_NAMESPACE::Reader reader;
+    reader.Parse<0>(stream_reader, converter);
+    if (converter.failed()) {
+        return false;
+    }
+    if (reader.HasParseError()) {
         J2PERROR(error, "Invalid json format");
         return false;
     }
-    return json2pb::JsonValueToProtoMessage(d, message, options, error);
+    return true;
 }
 
 bool JsonToProtoMessage(const std::string& json_string, 
@@ -643,15 +843,7 @@ bool JsonToProtoMessage(std::string json_string,
 bool JsonToProtoMessage(google::protobuf::io::ZeroCopyInputStream *stream,
                         google::protobuf::Message* message,
                         std::string* error) {
-    if (error) {
-        error->clear();
-    }
-    BUTIL_RAPIDJSON_NAMESPACE::Document d;
-    if (!json2pb::ZeroCopyStreamToJson(&d, stream)) {
-        J2PERROR(error, "Invalid json format");
-        return false;
-    }
-    return json2pb::JsonValueToProtoMessage(d, message, Json2PbOptions(), error);
+    return JsonToProtoMessage(stream, message, Json2PbOptions(), error);
 }
 } //namespace json2pb
 
@@ -42,7 +42,11 @@ bool JsonToProtoMessage(const std::string& json,
                         const Json2PbOptions& options,
                         std::string* error = NULL);
 
-// send output to ZeroCopyOutputStream instead of std::string.
+// read json from ZeroCopyInputStream instead of std::string. The json is
+// converted while being parsed without building an intermediate document,
+// thus the memory does not grow with size of the json. Differences from the
+// std::string version: errors are reported in the order that values appear in json, and
+// `message' may be partially filled when the json turns out to be invalid.
 bool JsonToProtoMessage(google::protobuf::io::ZeroCopyInputStream *json,
                         google::protobuf::Message* message,
                         const Json2PbOptions& options,
@@ -23,8 +23,9 @@
 #include <time.h>
 #include <google/protobuf/descriptor.h>
 #include "butil/base64.h"
+#include "butil/iobuf.h"
 #include "zero_copy_stream_writer.h"
-#include "encode_decode.h"
+#include "field_table.h"
 #include "protobuf_map.h"
 #include "rapidjson.h"
 #include "pb_to_json.h"
@@ -60,44 +61,26 @@ private:
 
     std::string _error;
     Pb2JsonOptions _option;
+    FieldTableCache _field_tables;
 };
 
 template <typename Handler>
 bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handler& handler) {
     handler.StartObject();
     const google::protobuf::Reflection* reflection = message.GetReflection();
-    const google::protobuf::Descriptor* descriptor = message.GetDescriptor();
-    
-    int ext_range_count = descriptor->extension_range_count();
-    int field_count = descriptor->field_count();
-    std::vector<const google::protobuf::FieldDescriptor*> fields;
-    fields.reserve(64);
-    for (int i = 0; i < ext_range_count; ++i) {
-        const google::protobuf::Descriptor::ExtensionRange*
-            ext_range = descriptor->extension_range(i);
-        for (int tag_number = ext_range->start;
-             tag_number < ext_range->end; ++tag_number) {
-            const google::protobuf::FieldDescriptor* field =
-                    reflection->FindKnownExtensionByNumber(tag_number);
-            if (field) {
-                fields.push_back(field);
-            }
-        }
-    }
-    std::vector<const google::protobuf::FieldDescriptor*> map_fields;
-    for (int i = 0; i < field_count; ++i) {
-        const google::protobuf::FieldDescriptor* field = descriptor->field(i);
-        if (_option.enable_protobuf_map && json2pb::IsProtobufMap(field)) {
-            map_fields.push_back(field);
-        } else {
-            fields.push_back(field);
-        }
-    }
+    const std::vector<FieldTable::Entry>& entries =
+        _field_tables.Get(message).entries();
 
     // Fill in non-map fields
-    std::string field_name_str;
-    for (size_t i = 0; i < fields.size(); ++i) {
-        const google::protobuf::FieldDescriptor* field = fields[i];
+    bool has_map_fields = false;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const google::protobuf::FieldDescriptor* field = entries[i].field;
+        // Extensions are never converted as maps.
+        if (_option.enable_protobuf_map && entries[i].is_map &&
+            !field->is_extension()) {
+            has_map_fields = true;
+            continue;
+        }
         if (!field->is_repeated() && !reflection->HasField(message, field)) {
             // Field that has not been set
             if (field->is_required()) {
@@ -115,9 +98,7 @@ bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handle
             continue;
         }
 
-        const std::string& orig_name = field->name();
-        bool decoded = decode_name(orig_name, field_name_str); 
-        const std::string& name = decoded ? field_name_str : orig_name;
+        const butil::StringPiece& name = entries[i].name;
         handler.Key(name.data(), name.size(), false);
         if (!_PbFieldToJson(message, field, handler)) {
             return false;
@@ -125,8 +106,11 @@ bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handle
     }
 
     // Fill in map fields
-    for (size_t i = 0; i < map_fields.size(); ++i) {
-        const google::protobuf::FieldDescriptor* map_desc = map_fields[i];
+    for (size_t i = 0; has_map_fields && i < entries.size(); ++i) {
+        if (!entries[i].is_map || entries[i].field->is_extension()) {
+            continue;
+        }
+        const google::protobuf::FieldDescriptor* map_desc = entries[i].field;
         const google::protobuf::FieldDescriptor* key_desc =
                 map_desc->message_type()->field(json2pb::KEY_INDEX);
         const google::protobuf::FieldDescriptor* value_desc =
@@ -134,9 +118,7 @@ bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handle
 
         // Write a json object corresponding to hold protobuf map
         // such as {"key": value, ...}
-        const std::string& orig_name = map_desc->name();
-        bool decoded = decode_name(orig_name, field_name_str);
-        const std::string& name = decoded ? field_name_str : orig_name;
+        const butil::StringPiece& name = entries[i].name;
         handler.Key(name.data(), name.size(), false);
         handler.StartObject();
         std::string entry_name;
@@ -144,9 +126,9 @@ bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handle
             const google::protobuf::Message& entry =
                     reflection->GetRepeatedMessage(message, map_desc, j);
             const google::protobuf::Reflection* entry_reflection = entry.GetReflection();
-            entry_name = entry_reflection->GetStringReference(
+            const std::string& key = entry_reflection->GetStringReference(
                 entry, key_desc, &entry_name);
-            handler.Key(entry_name.data(), entry_name.size(), false);
+            handler.Key(key.data(), key.size(), false);
 
             // Fill in entries into this json object
             if (!_PbFieldToJson(entry, value_desc, handler)) {
@@ -197,13 +179,15 @@ bool PbToJsonConverter::_PbFieldToJson(
 #undef CASE_FIELD_TYPE
 
     case google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
-        std::string value;
+        // Strings are referenced rather than copied unless the message
+        // stores them elsewhere, e.g. in a Cord.
+        std::string scratch;
         if (field->is_repeated()) {
             int field_size = reflection->FieldSize(message, field);
             handler.StartArray();
             for (int index = 0; index < field_size; ++index) {
-                value = reflection->GetRepeatedStringReference(
-                    message, field, index, &value);
+                const std::string& value = reflection->GetRepeatedStringReference(
+                    message, field, index, &scratch);
                 if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES
                     && _option.bytes_to_base64) {
                     std::string value_decoded;
@@ -216,7 +200,8 @@ bool PbToJsonConverter::_PbFieldToJson(
             handler.EndArray(field_size);
             
         } else {
-            value = reflection->GetStringReference(message, field, &value);
+            const std::string& value =
+                reflection->GetStringReference(message, field, &scratch);
             if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES
                 && _option.bytes_to_base64) {
                 std::string value_decoded;
@@ -333,4 +318,48 @@ bool ProtoMessageToJson(const google::protobuf::Message& message,
                         std::string* error) {
     return ProtoMessageToJson(message, stream, Pb2JsonOptions(), error);
 }
+
+// Output stream of rapidjson writing into blocks of IOBuf directly, which
+// is cheaper than ZeroCopyStreamWriter checking the buffer for each char.
+class IOBufAppenderWriter {
+public:
+    typedef char Ch;
+    explicit IOBufAppenderWriter(butil::IOBufAppender* appender)
+        : _appender(appender) {}
+
+    void Put(char c) { _appender->push_back(c); }
+    void PutN(char c, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            _appender->push_back(c);
+        }
+    }
+    void Puts(const char* str, size_t length) { _appender->append(str, length); }
+    void Flush() {}
+
+    char Peek() { return 0; }
+    char Take() { return 0; }
+    size_t Tell() { return 0; }
+    char *PutBegin() { return NULL; }
+    size_t PutEnd(char *) { return 0; }
+private:
+    butil::IOBufAppender* _appender;
+};
+
+bool ProtoMessageToJson(const google::protobuf::Message& message,
+                        butil::IOBuf* json,
+                        const Pb2JsonOptions& options,
+                        std::string* error) {
+    butil::IOBufAppender appender;
+    IOBufAppenderWriter writer(&appender);
+    if (!json2pb::ProtoMessageToJsonStream(message, options, writer, error)) {
+        return false;
+    }
+    json->append(appender.buf().movable());
+    return true;
+}
+
+bool ProtoMessageToJson(const google::protobuf::Message& message,
+                        butil::IOBuf* json, std::string* error) {
+    return ProtoMessageToJson(message, json, Pb2JsonOptions(), error);
+}
 } // namespace json2pb
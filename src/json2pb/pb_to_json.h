@@ -23,6 +23,7 @@
 #include <string>
 #include <google/protobuf/message.h>
 #include <google/protobuf/io/zero_copy_stream.h> // ZeroCopyOutputStream
+#include "butil/iobuf.h"                         // IOBuf
 
 namespace json2pb {
 
@@ -78,6 +79,12 @@ bool ProtoMessageToJson(const google::protobuf::Message& message,
                         google::protobuf::io::ZeroCopyOutputStream *json,
                         const Pb2JsonOptions& options,
                         std::string* error = NULL);
+// append output to IOBuf, which writes into its blocks directly and is the
+// fastest way to generate large json. Nothing is appended on failure.
+bool ProtoMessageToJson(const google::protobuf::Message& message,
+                        butil::IOBuf* json,
+                        const Pb2JsonOptions& options,
+                        std::string* error = NULL);
 
 // Using default Pb2JsonOptions.
 bool ProtoMessageToJson(const google::protobuf::Message& message,
@@ -86,6 +93,9 @@ bool ProtoMessageToJson(const google::protobuf::Message& message,
 bool ProtoMessageToJson(const google::protobuf::Message& message,
                         google::protobuf::io::ZeroCopyOutputStream* json,
                         std::string* error = NULL);
+bool ProtoMessageToJson(const google::protobuf::Message& message,
+                        butil::IOBuf* json,
+                        std::string* error = NULL);
 } // namespace json2pb
 
 #endif // BRPC_JSON2PB_PB_TO_JSON_H
@@ -46,6 +46,7 @@
 namespace brpc {
 DECLARE_int32(idle_timeout_second);
 DECLARE_int32(max_connection_pool_size);
+DECLARE_double(backup_request_max_ratio);
 class Server;
 class MethodStatus;
 namespace policy {
@@ -541,6 +542,49 @@ protected:
         }
     };
 
+    // Sub calls to odd channels sleep for a while or fail.
+    class SlowOrFailOnOdd : public SetCode {
+    public:
+        explicit SlowOrFailOnOdd(bool fail) : _fail(fail) {}
+        brpc::SubCall Map(
+            int channel_index,
+            const google::protobuf::MethodDescriptor* method,
+            const google::protobuf::Message* req_base,
+            google::protobuf::Message* response) {
+            brpc::SubCall sc =
+                SetCode::Map(channel_index, method, req_base, response);
+            if (channel_index % 2) {
+                test::EchoRequest* req =
+                    const_cast<test::EchoRequest*>(
+                        static_cast<const test::EchoRequest*>(sc.request));
+                if (_fail) {
+                    req->set_server_fail(brpc::EINTERNAL);
+                } else {
+                    req->set_sleep_us(300000); // 300ms
+                }
+            }
+            return sc;
+        }
+    private:
+        bool _fail;
+    };
+
+    // Merge with MergeFrom() and record when merges happen.
+    class RecordMergeTime : public brpc::ResponseMerger {
+    public:
+        explicit RecordMergeTime(Result result) : _result(result) {}
+        Result Merge(google::protobuf::Message* response,
+                     const google::protobuf::Message* sub_response) {
+            // No lock since ParallelChannel calls Merge() one by one.
+            merge_times.push_back(butil::gettimeofday_us());
+            response->MergeFrom(*sub_response);
+            return _result;
+        }
+        std::vector<int64_t> merge_times;
+    private:
+        Result _result;
+    };
+
     void TestSuccessParallel(bool single_server, bool async, bool short_connection) {
         std::cout << " *** single=" << single_server
                   << " async=" << async
@@ -731,6 +775,119 @@ protected:
         StopAndJoin();
     }
 
+    void TestSuccessLimitParallel(bool single_server, bool async,
+                                  bool short_connection) {
+        std::cout << " *** single=" << single_server
+                  << " async=" << async
+                  << " short=" << short_connection << std::endl;
+
+        ASSERT_EQ(0, StartAccept(_ep));
+        const size_t NCHANS = 8;
+        brpc::Channel subchans[NCHANS];
+        brpc::ParallelChannel channel;
+        brpc::ParallelChannelOptions opt;
+        opt.success_limit = NCHANS / 2;
+        ASSERT_EQ(0, channel.Init(&opt));
+        for (size_t i = 0; i < NCHANS; ++i) {
+            SetUpChannel(&subchans[i], single_server, short_connection);
+            ASSERT_EQ(0, channel.AddChannel(
+                          &subchans[i], brpc::DOESNT_OWN_CHANNEL,
+                          new SlowOrFailOnOdd(false), NULL));
+        }
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(__FUNCTION__);
+        const int64_t start_time = butil::gettimeofday_us();
+        CallMethod(&channel, &cntl, &req, &res, async);
+
+        // Ended without waiting for the slow sub calls, which are canceled.
+        EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        EXPECT_LT(butil::gettimeofday_us(), start_time + 200000L/*200ms*/);
+        EXPECT_EQ(NCHANS, (size_t)cntl.sub_count());
+        for (int i = 0; i < cntl.sub_count(); ++i) {
+            if (i % 2) {
+                EXPECT_EQ(ECANCELED, cntl.sub(i)->ErrorCode()) << "i=" << i;
+            } else {
+                EXPECT_FALSE(cntl.sub(i)->Failed()) << "i=" << i;
+            }
+        }
+        ASSERT_EQ(NCHANS / 2, (size_t)res.code_list_size());
+        for (int i = 0; i < res.code_list_size(); ++i) {
+            EXPECT_EQ(1, res.code_list(i) % 2);
+        }
+
+        // Half of sub calls fail, success_limit=5 can't be reached and the
+        // call fails as soon as 4 sub calls fail.
+        brpc::ParallelChannel channel2;
+        opt.success_limit = NCHANS / 2 + 1;
+        ASSERT_EQ(0, channel2.Init(&opt));
+        for (size_t i = 0; i < NCHANS; ++i) {
+            ASSERT_EQ(0, channel2.AddChannel(
+                          &subchans[i], brpc::DOESNT_OWN_CHANNEL,
+                          new SlowOrFailOnOdd(true), NULL));
+        }
+        cntl.Reset();
+        res.Clear();
+        CallMethod(&channel2, &cntl, &req, &res, async);
+        EXPECT_EQ(brpc::EINTERNAL, cntl.ErrorCode()) << cntl.ErrorText();
+        StopAndJoin();
+    }
+
+    void TestMergeIncrementallyParallel(bool single_server, bool async,
+                                        bool short_connection) {
+        std::cout << " *** single=" << single_server
+                  << " async=" << async
+                  << " short=" << short_connection << std::endl;
+
+        ASSERT_EQ(0, StartAccept(_ep));
+        const size_t NCHANS = 8;
+        brpc::Channel subchans[NCHANS];
+        brpc::ParallelChannel channel;
+        brpc::ParallelChannelOptions opt;
+        opt.merge_incrementally = true;
+        ASSERT_EQ(0, channel.Init(&opt));
+        RecordMergeTime* merger =
+            new RecordMergeTime(brpc::ResponseMerger::MERGED);
+        for (size_t i = 0; i < NCHANS; ++i) {
+            SetUpChannel(&subchans[i], single_server, short_connection);
+            ASSERT_EQ(0, channel.AddChannel(
+                          &subchans[i], brpc::DOESNT_OWN_CHANNEL,
+                          new SlowOrFailOnOdd(false), merger));
+        }
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(__FUNCTION__);
+        const int64_t start_time = butil::gettimeofday_us();
+        CallMethod(&channel, &cntl, &req, &res, async);
+        EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        EXPECT_EQ(NCHANS, (size_t)res.code_list_size());
+        // Responses of fast sub calls were merged before slow ones came back.
+        ASSERT_EQ(NCHANS, merger->merge_times.size());
+        for (size_t i = 0; i < NCHANS / 2; ++i) {
+            EXPECT_LT(merger->merge_times[i], start_time + 200000L/*200ms*/);
+        }
+        EXPECT_GE(merger->merge_times.back(), start_time + 300000L/*300ms*/);
+
+        // FAIL_ALL ends the call without waiting for slow sub calls.
+        brpc::ParallelChannel channel2;
+        ASSERT_EQ(0, channel2.Init(&opt));
+        for (size_t i = 0; i < NCHANS; ++i) {
+            ASSERT_EQ(0, channel2.AddChannel(
+                          &subchans[i], brpc::DOESNT_OWN_CHANNEL,
+                          new SlowOrFailOnOdd(false),
+                          new RecordMergeTime(brpc::ResponseMerger::FAIL_ALL)));
+        }
+        cntl.Reset();
+        res.Clear();
+        const int64_t start_time2 = butil::gettimeofday_us();
+        CallMethod(&channel2, &cntl, &req, &res, async);
+        EXPECT_EQ(brpc::ERESPONSE, cntl.ErrorCode()) << cntl.ErrorText();
+        EXPECT_LT(butil::gettimeofday_us(), start_time2 + 200000L/*200ms*/);
+        StopAndJoin();
+    }
+
     void TestSuccessParallel2(bool single_server, bool async, bool short_connection) {
         std::cout << " *** single=" << single_server
                   << " async=" << async
@@ -1308,6 +1465,83 @@ protected:
         StopAndJoin();
     }
     
+    void TestBackupRequest(
+        bool single_server, bool async, bool short_connection) {
+        std::cout << " *** single=" << single_server
+                  << " async=" << async
+                  << " short=" << short_connection << std::endl;
+        ASSERT_EQ(0, StartAccept(_ep));
+        brpc::ChannelOptions opt;
+        if (short_connection) {
+            opt.connection_type = brpc::CONNECTION_TYPE_SHORT;
+        }
+        opt.timeout_ms = 200;
+        opt.max_retry = 3;
+        opt.backup_request_ms = 10;
+        opt.max_backup_requests = 3;
+        brpc::Channel channel;
+        if (single_server) {
+            ASSERT_EQ(0, channel.Init(_ep, &opt));
+        } else {
+            ASSERT_EQ(0, channel.Init(_naming_url.c_str(), "rR", &opt));
+        }
+
+        // Send another backup request every backup_request_ms until
+        // max_backup_requests is reached.
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(__FUNCTION__);
+        req.set_sleep_us(70000); // 70ms
+        butil::Timer tm;
+        tm.start();
+        CallMethod(&channel, &cntl, &req, &res, async);
+        tm.stop();
+        EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        EXPECT_TRUE(cntl.has_backup_request());
+        EXPECT_EQ(3, cntl.retried_count());
+        EXPECT_LT(labs(tm.m_elapsed() - 70), 15);
+        bthread_usleep(100000);  // wait for the sleep tasks to finish
+
+        // No budget for backup requests.
+        brpc::FLAGS_backup_request_max_ratio = 0.001;
+        cntl.Reset();
+        tm.start();
+        CallMethod(&channel, &cntl, &req, &res, async);
+        tm.stop();
+        brpc::FLAGS_backup_request_max_ratio = 0;
+        EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        EXPECT_FALSE(cntl.has_backup_request());
+        EXPECT_EQ(0, cntl.retried_count());
+        EXPECT_LT(labs(tm.m_elapsed() - 70), 15);
+
+        // Backup request is sent after the recent latency percentile of the
+        // server, which is much smaller than backup_request_ms.
+        opt.backup_request_ms = 150;
+        opt.backup_request_percentile = 0.9;
+        opt.max_backup_requests = 1;
+        brpc::Channel channel2;
+        if (single_server) {
+            ASSERT_EQ(0, channel2.Init(_ep, &opt));
+        } else {
+            ASSERT_EQ(0, channel2.Init(_naming_url.c_str(), "rR", &opt));
+        }
+        req.set_sleep_us(0);
+        for (int i = 0; i < 20; ++i) {
+            cntl.Reset();
+            CallMethod(&channel2, &cntl, &req, &res, async);
+            ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        }
+        cntl.Reset();
+        req.set_sleep_us(70000); // 70ms
+        CallMethod(&channel2, &cntl, &req, &res, async);
+        EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        EXPECT_TRUE(cntl.has_backup_request());
+        EXPECT_EQ(1, cntl.retried_count());
+        bthread_usleep(100000);  // wait for the sleep tasks to finish
+        StopAndJoin();
+    }
+
     void TestCloseFD(bool single_server, bool async, bool short_connection) {
         std::cout << " *** single=" << single_server
                   << " async=" << async
@@ -2206,6 +2440,26 @@ TEST_F(ChannelTest, success_parallel2) {
     }
 }
 
+TEST_F(ChannelTest, success_limit_parallel) {
+    for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
+        for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
+            for (int k = 0; k <=1; ++k) { // Flag ShortConnection
+                TestSuccessLimitParallel(i, j, k);
+            }
+        }
+    }
+}
+
+TEST_F(ChannelTest, merge_incrementally_parallel) {
+    for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
+        for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
+            for (int k = 0; k <=1; ++k) { // Flag ShortConnection
+                TestMergeIncrementallyParallel(i, j, k);
+            }
+        }
+    }
+}
+
 TEST_F(ChannelTest, cancel_before_callmethod) {
     for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
         for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
@@ -2356,6 +2610,16 @@ TEST_F(ChannelTest, timeout_selective) {
     }
 }
 
+TEST_F(ChannelTest, backup_request) {
+    for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
+        for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
+            for (int k = 0; k <=1; ++k) { // Flag ShortConnection
+                TestBackupRequest(i, j, k);
+            }
+        }
+    }
+}
+
 TEST_F(ChannelTest, close_fd) {
     for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
         for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
@@ -22,13 +22,32 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <poll.h>
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include "butil/gperftools_profiler.h"
 #include "butil/time.h"
 #include "butil/macros.h"
 #include "butil/fd_utility.h"
 #include "brpc/event_dispatcher.h"
 #include "brpc/details/has_epollrdhup.h"
+#include "brpc/details/io_uring.h"
+#ifdef BRPC_HAS_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+namespace brpc {
+DECLARE_bool(event_dispatcher_use_io_uring);
+}
+
+// Run with -event_dispatcher_use_io_uring to test the io_uring poller.
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    LOG(INFO) << "event_dispatcher_use_io_uring="
+              << brpc::FLAGS_event_dispatcher_use_io_uring;
+    return RUN_ALL_TESTS();
+}
 
 class EventDispatcherTest : public ::testing::Test{
 protected:
@@ -52,6 +71,47 @@ TEST_F(EventDispatcherTest, versioned_ref) {
     ASSERT_EQ(brpc::MakeVRef(1, 1), versioned_ref);
 }
 
+#ifdef BRPC_HAS_IO_URING
+static void OnPollCompletion(const io_uring_cqe* cqe, void* arg) {
+    std::vector<std::pair<uint64_t, int> >* results =
+        (std::vector<std::pair<uint64_t, int> >*)arg;
+    results->push_back(std::make_pair((uint64_t)cqe->user_data, cqe->res));
+}
+
+TEST_F(EventDispatcherTest, io_uring_poll) {
+    brpc::IOUring ring;
+    if (ring.Init(8) != 0) {
+        PLOG(WARNING) << "io_uring is not supported, skip";
+        return;
+    }
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    io_uring_sqe* sqe = ring.GetSqe();
+    ASSERT_TRUE(sqe);
+    brpc::IOUring::PrepPollAdd(sqe, fds[0], POLLIN, false, 1);
+    sqe = ring.GetSqe();
+    ASSERT_TRUE(sqe);
+    brpc::IOUring::PrepNop(sqe, 2);
+    ASSERT_EQ(2u, ring.Publish());
+    ASSERT_EQ(2, ring.Submit(2));
+    ASSERT_EQ(0u, ring.Publish());
+
+    std::vector<std::pair<uint64_t, int> > results;
+    ASSERT_EQ(0, ring.SubmitAndWait(0));
+    ASSERT_EQ(1, ring.ForEachCqe(OnPollCompletion, &results));
+    ASSERT_EQ(2u, results[0].first);
+
+    ASSERT_EQ(1, write(fds[1], "x", 1));
+    results.clear();
+    ASSERT_EQ(0, ring.SubmitAndWait(0));
+    ASSERT_EQ(1, ring.ForEachCqe(OnPollCompletion, &results));
+    ASSERT_EQ(1u, results[0].first);
+    ASSERT_TRUE(results[0].second & POLLIN);
+    close(fds[0]);
+    close(fds[1]);
+}
+#endif
+
 std::vector<int> err_fd;
 pthread_mutex_t err_fd_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -22,6 +22,8 @@
 #include <gtest/gtest.h>
 #include "brpc/details/hpack.h"
 #include "butil/logging.h"
+#include "butil/time.h"
+#include "brpc/details/hpack-static-table.h"
 
 class HPackTest : public testing::Test {
 };
@@ -548,3 +550,111 @@ TEST_F(HPackTest, responses_with_huffman) {
     }
     ASSERT_TRUE(buf.buf().empty());
 }
+
+TEST_F(HPackTest, static_table_lookup) {
+    brpc::HPacker p1;
+    ASSERT_EQ(0, p1.Init(4096));
+    brpc::HPacker p2;
+    ASSERT_EQ(0, p2.Init(4096));
+    brpc::HPackOptions options;
+    options.index_policy = brpc::HPACK_NOT_INDEX_HEADER;
+    for (size_t i = 0; i < ARRAY_SIZE(brpc::s_static_headers); ++i) {
+        const int index = i + 1;
+        brpc::HPacker::Header h(brpc::s_static_headers[i].name,
+                                brpc::s_static_headers[i].value);
+        butil::IOBufAppender buf;
+        p1.Encode(&buf, h, options);
+        if (!h.value.empty()) {
+            // Indexed Header Field
+            ASSERT_EQ(1u, buf.buf().size()) << h.name << ": " << h.value;
+            ASSERT_EQ(0x80 | index, *(const uint8_t*)buf.buf().fetch1());
+        }
+        // Names are matched case-insensitively and values are not.
+        std::string name = h.name;
+        for (size_t j = 0; j < name.size(); ++j) {
+            name[j] = ::toupper(name[j]);
+        }
+        brpc::HPacker::Header h2(name, "Not-In-Table");
+        p1.Encode(&buf, h2, options);
+        brpc::HPacker::Header h3;
+        if (!h.value.empty()) {
+            ASSERT_GT(p2.Decode(&buf.buf(), &h3), 0);
+            ASSERT_EQ(h.name, h3.name);
+            ASSERT_EQ(h.value, h3.value);
+        } else {
+            buf.buf().clear();
+            p1.Encode(&buf, h2, options);
+        }
+        // Literal Header Field without Indexing -- Indexed Name
+        const size_t name_bytes = (index < 15 ? 1 : 2);
+        ASSERT_EQ(name_bytes + 1 + h2.value.size(), buf.buf().size()) << h.name;
+        ASSERT_GT(p2.Decode(&buf.buf(), &h3), 0);
+        ASSERT_EQ(h.name, h3.name);
+        ASSERT_EQ(h2.value, h3.value);
+        ASSERT_TRUE(buf.buf().empty());
+    }
+}
+
+TEST_F(HPackTest, encode_and_decode_performance) {
+    // Headers of a typical gRPC request.
+    ConstHeader headers[] = {
+        {":method", "POST"},
+        {":scheme", "http"},
+        {":path", "/grpc.testing.BenchmarkService/UnaryCall"},
+        {":authority", "127.0.0.1:8010"},
+        {"content-type", "application/grpc"},
+        {"te", "trailers"},
+        {"grpc-timeout", "1000m"},
+        {"grpc-accept-encoding", "identity,deflate,gzip"},
+        {"user-agent", "grpc-c++/1.26.0 grpc-c/9.0.0 (linux; chttp2)"},
+    };
+    const size_t N = 100000;
+    for (int huffman = 0; huffman < 2; ++huffman) {
+        for (int policy = brpc::HPACK_INDEX_HEADER;
+             policy <= brpc::HPACK_NEVER_INDEX_HEADER; ++policy) {
+            brpc::HPacker p1;
+            ASSERT_EQ(0, p1.Init(4096));
+            brpc::HPacker p2;
+            ASSERT_EQ(0, p2.Init(4096));
+            std::vector<brpc::HPacker::Header> hs;
+            for (size_t i = 0; i < ARRAY_SIZE(headers); ++i) {
+                hs.push_back(brpc::HPacker::Header(
+                                 headers[i].name, headers[i].value));
+            }
+            brpc::HPackOptions options;
+            options.index_policy = (brpc::HeaderIndexPolicy)policy;
+            options.encode_name = huffman;
+            options.encode_value = huffman;
+            butil::IOBufAppender appender;
+            butil::Timer tm;
+            tm.start();
+            for (size_t i = 0; i < N; ++i) {
+                for (size_t j = 0; j < hs.size(); ++j) {
+                    p1.Encode(&appender, hs[j], options);
+                }
+            }
+            tm.stop();
+            butil::IOBuf buf;
+            appender.move_to(buf);
+            const size_t encoded_size = buf.size();
+            const int64_t encode_ns = tm.n_elapsed();
+
+            butil::IOBufBytesIterator it(buf);
+            brpc::HPacker::Header h;
+            tm.start();
+            for (size_t i = 0; i < N; ++i) {
+                for (size_t j = 0; j < hs.size(); ++j) {
+                    ASSERT_GT(p2.Decode(it, &h), 0);
+                }
+            }
+            tm.stop();
+            ASSERT_EQ(hs.back().name, h.name);
+            ASSERT_EQ(hs.back().value, h.value);
+            LOG(INFO) << "huffman=" << huffman << " policy=" << policy
+                      << " bytes/request=" << encoded_size / N
+                      << " encode=" << encode_ns / (N * hs.size())
+                      << "ns decode=" << tm.n_elapsed() / (N * hs.size())
+                      << "ns per header";
+        }
+    }
+}
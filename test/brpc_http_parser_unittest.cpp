@@ -17,6 +17,9 @@
 
 #include <gtest/gtest.h>
 #include <iostream>
+#include <algorithm>
+#include <string>
+#include <vector>
 
 #include "butil/time.h"
 #include "butil/logging.h"
@@ -110,6 +113,134 @@ TEST_F(HttpParserTest, http_example) {
     LOG(INFO) << http_parser_execute(&parser, &settings, http_request, strlen(http_request));
 }
 
+struct ParsedRequest {
+    std::string url;
+    std::vector<std::pair<std::string, std::string> > headers;
+    std::string body;
+    bool completed;
+    ParsedRequest() : completed(false) {}
+};
+
+static int collect_url(http_parser* p, const char* at, const size_t length) {
+    static_cast<ParsedRequest*>(p->data)->url.append(at, length);
+    return 0;
+}
+
+static int collect_header_field(http_parser* p, const char* at,
+                                const size_t length) {
+    ParsedRequest* r = static_cast<ParsedRequest*>(p->data);
+    // Fields may be split into several calls.
+    if (r->headers.empty() || !r->headers.back().second.empty()) {
+        r->headers.push_back(std::make_pair(std::string(), std::string()));
+    }
+    r->headers.back().first.append(at, length);
+    return 0;
+}
+
+static int collect_header_value(http_parser* p, const char* at,
+                                const size_t length) {
+    static_cast<ParsedRequest*>(p->data)->headers.back().second.append(at, length);
+    return 0;
+}
+
+static int collect_body(http_parser* p, const char* at, const size_t length) {
+    static_cast<ParsedRequest*>(p->data)->body.append(at, length);
+    return 0;
+}
+
+static int mark_completed(http_parser* p) {
+    static_cast<ParsedRequest*>(p->data)->completed = true;
+    return 0;
+}
+
+// Feed `request' to the parser in pieces of `piece_size' bytes.
+static int parse_in_pieces(const std::string& request, size_t piece_size,
+                           ParsedRequest* r) {
+    http_parser parser;
+    http_parser_init(&parser, brpc::HTTP_REQUEST);
+    parser.data = r;
+    http_parser_settings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.on_url = collect_url;
+    settings.on_header_field = collect_header_field;
+    settings.on_header_value = collect_header_value;
+    settings.on_body = collect_body;
+    settings.on_message_complete = mark_completed;
+    for (size_t i = 0; i < request.size(); i += piece_size) {
+        const size_t n = std::min(piece_size, request.size() - i);
+        if (http_parser_execute(&parser, &settings, request.data() + i, n) != n) {
+            return parser.http_errno;
+        }
+    }
+    return 0;
+}
+
+TEST_F(HttpParserTest, parse_long_tokens_in_pieces) {
+    const std::string long_path(300, 'p');
+    const std::string long_value = "Mozilla/5.0 (X11; Linux x86_64) "
+        "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/86.0.4240.75 "
+        "Safari/537.36";
+    const std::string request =
+        "POST /" + long_path + "?key=" + long_path + " HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: " + long_value + "\r\n"
+        "X-Custom-Header-With-A-Very-Long-Name: \tv\r\n"
+        "Content-Length: 5\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n"
+        "hello";
+    const size_t piece_sizes[] = { request.size(), 1, 7, 16, 17, 64 };
+    for (size_t i = 0; i < ARRAY_SIZE(piece_sizes); ++i) {
+        ParsedRequest r;
+        ASSERT_EQ(0, parse_in_pieces(request, piece_sizes[i], &r))
+            << "piece_size=" << piece_sizes[i];
+        ASSERT_TRUE(r.completed);
+        ASSERT_EQ("/" + long_path + "?key=" + long_path, r.url);
+        ASSERT_EQ(5u, r.headers.size());
+        ASSERT_EQ("User-Agent", r.headers[1].first);
+        ASSERT_EQ(long_value, r.headers[1].second);
+        ASSERT_EQ("X-Custom-Header-With-A-Very-Long-Name", r.headers[2].first);
+        ASSERT_EQ("v", r.headers[2].second);
+        ASSERT_EQ("hello", r.body);
+    }
+
+    // Skipped bytes are still counted in the size of headers.
+    const std::string huge_request =
+        "GET / HTTP/1.1\r\nCookie: " +
+        std::string(BRPC_HTTP_MAX_HEADER_SIZE, 'c') + "\r\n\r\n";
+    ParsedRequest r;
+    ASSERT_EQ(brpc::HPE_HEADER_OVERFLOW, parse_in_pieces(huge_request, 4096, &r));
+
+    // Invalid characters in header names are still rejected.
+    ParsedRequest r2;
+    ASSERT_EQ(brpc::HPE_INVALID_HEADER_TOKEN, parse_in_pieces(
+        "GET / HTTP/1.1\r\nX-Bad(Name): v\r\n\r\n", 64, &r2));
+}
+
+TEST_F(HttpParserTest, parse_perf) {
+    const std::string request =
+        "GET /api/v1/users/12345/profile?fields=name,email,avatar HTTP/1.1\r\n"
+        "Host: api.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36\r\n"
+        "Accept: application/json, text/plain, */*\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: en-US,en;q=0.9\r\n"
+        "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+    const size_t loops = 200000;
+    butil::Timer timer;
+    timer.start();
+    for (size_t i = 0; i < loops; ++i) {
+        ParsedRequest r;
+        ASSERT_EQ(0, parse_in_pieces(request, request.size(), &r));
+    }
+    timer.stop();
+    std::cout << "It takes " << timer.n_elapsed() / loops
+              << "ns to parse a request of " << request.size() << " bytes"
+              << std::endl;
+}
+
 TEST_F(HttpParserTest, append_filename) {
     std::string dir;
 
@@ -23,6 +23,7 @@
 #include <sys/socket.h>
 #include <netdb.h>                   //
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include "butil/gperftools_profiler.h"
 #include "butil/time.h"
 #include "butil/macros.h"
@@ -36,8 +37,16 @@ void EmptyProcessHuluRequest(brpc::InputMessageBase* msg_base) {
     brpc::DestroyingPtr<brpc::InputMessageBase> a(msg_base);
 }
 
+int g_reject_count = 0;
+
+brpc::ParseResult RejectAll(butil::IOBuf*, brpc::Socket*, bool, const void*) {
+    ++g_reject_count;
+    return brpc::MakeParseError(brpc::PARSE_ERROR_TRY_OTHERS);
+}
+
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
     brpc::Protocol dummy_protocol = 
                              { brpc::policy::ParseHuluMessage,
                                brpc::SerializeRequestDefault, 
@@ -46,6 +55,10 @@ int main(int argc, char* argv[]) {
                                NULL, NULL, NULL,
                                brpc::CONNECTION_TYPE_ALL, "dummy_hulu" };
     EXPECT_EQ(0,  RegisterProtocol((brpc::ProtocolType)30, dummy_protocol));
+    brpc::Protocol reject_protocol = dummy_protocol;
+    reject_protocol.parse = RejectAll;
+    reject_protocol.name = "reject_all";
+    EXPECT_EQ(0,  RegisterProtocol((brpc::ProtocolType)29, reject_protocol));
     return RUN_ALL_TESTS();
 }
 
@@ -146,6 +159,68 @@ void* client_thread(void* arg) {
     return NULL;
 }
 
+TEST_F(MessengerTest, once_read_size) {
+    brpc::SocketOptions options;
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr m;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &m));
+
+    ASSERT_EQ(4096u, brpc::InputMessenger::GetOnceReadSize(m.get(), false));
+    // Reads filling the buffer double size of the next read.
+    ASSERT_TRUE(brpc::InputMessenger::UpdateOnceReadSize(m.get(), 4096, 4096));
+    ASSERT_EQ(8192u, brpc::InputMessenger::GetOnceReadSize(m.get(), true));
+    ASSERT_TRUE(brpc::InputMessenger::UpdateOnceReadSize(m.get(), 8192, 8192));
+    ASSERT_EQ(16384u, brpc::InputMessenger::GetOnceReadSize(m.get(), true));
+    for (int i = 0; i < 10; ++i) {
+        const size_t once_read =
+            brpc::InputMessenger::GetOnceReadSize(m.get(), true);
+        brpc::InputMessenger::UpdateOnceReadSize(m.get(), once_read, once_read);
+    }
+    ASSERT_EQ(524288u, brpc::InputMessenger::GetOnceReadSize(m.get(), true));
+
+    // Shrink to a short read, still bounded by average message size.
+    ASSERT_FALSE(brpc::InputMessenger::UpdateOnceReadSize(m.get(), 524288, 100));
+    ASSERT_EQ(4096u, brpc::InputMessenger::GetOnceReadSize(m.get(), false));
+    m->_avg_msg_size = 1000;
+    ASSERT_EQ(16000u, brpc::InputMessenger::GetOnceReadSize(m.get(), false));
+    m->SetFailed();
+}
+
+TEST_F(MessengerTest, sniff_protocol_by_prefix) {
+    brpc::InputMessenger messenger;
+    const brpc::InputMessageHandler handlers[] = {
+        { RejectAll, EmptyProcessHuluRequest, NULL, NULL, "reject_all" },
+        { brpc::policy::ParseHuluMessage,
+          EmptyProcessHuluRequest, NULL, NULL, "dummy_hulu" }
+    };
+    ASSERT_EQ(0, messenger.AddHandler(handlers[0]));
+    ASSERT_EQ(0, messenger.AddHandler(handlers[1]));
+
+    char buf[MESSAGE_SIZE];
+    memcpy(buf, "HULU", 4);
+    *(uint32_t*)(buf + 4) = MESSAGE_SIZE - 12;
+    *(uint32_t*)(buf + 8) = 4;
+    g_reject_count = 0;
+    for (int i = 0; i < 3; ++i) {
+        brpc::SocketOptions options;
+        options.user = &messenger;  // as accepted by a server
+        brpc::SocketId id;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+        brpc::SocketUniquePtr m;
+        ASSERT_EQ(0, brpc::Socket::Address(id, &m));
+        m->_read_buf.append(buf, sizeof(buf));
+        size_t index = (size_t)-1;
+        brpc::ParseResult pr = messenger.CutInputMessage(m.get(), &index, false);
+        ASSERT_TRUE(pr.is_ok());
+        ASSERT_EQ(30u, index);
+        pr.message()->Destroy();
+        m->SetFailed();
+    }
+    // Only the first connection tried all handlers in order.
+    ASSERT_EQ(1, g_reject_count);
+}
+
 TEST_F(MessengerTest, dispatch_tasks) {
     client_stop = false;
     
@@ -22,12 +22,14 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <map>
+#include <set>
 #include <gtest/gtest.h>
 #include "bthread/bthread.h"
 #include "butil/gperftools_profiler.h"
 #include "butil/time.h"
 #include "butil/fast_rand.h"
 #include "butil/containers/doubly_buffered_data.h"
+#include "butil/containers/epoch_buffered_data.h"
 #include "brpc/describable.h"
 #include "brpc/socket.h"
 #include "butil/strings/string_number_conversions.h"
@@ -125,6 +127,144 @@ TEST_F(LoadBalancerTest, doubly_buffered_data) {
     }
 }
 
+butil::atomic<int> nalive_versioned(0);
+struct Versioned {
+    Versioned() : a(0), b(0), alive(true) { nalive_versioned.fetch_add(1); }
+    Versioned(const Versioned& rhs) : a(rhs.a), b(rhs.b), alive(true)
+    { nalive_versioned.fetch_add(1); }
+    ~Versioned() {
+        alive = false;
+        nalive_versioned.fetch_sub(1);
+    }
+    Versioned& operator=(const Versioned& rhs) {
+        a = rhs.a;
+        b = rhs.b;
+        return *this;
+    }
+    int64_t a;
+    int64_t b;
+    volatile bool alive;
+};
+
+bool IncVersioned(Versioned& v) {
+    ++v.a;
+    ++v.b;
+    return true;
+}
+
+size_t SetFromFG(Versioned& bg, const Versioned& fg, int64_t n) {
+    bg.a = fg.a + n;
+    bg.b = fg.b + n;
+    return 1;
+}
+
+struct EpochReaderArgs {
+    butil::EpochBufferedData<Versioned, TLS>* d;
+    butil::atomic<bool> stop;
+    butil::atomic<int64_t> nread;
+    butil::atomic<int64_t> nerror;
+};
+
+void* read_epoch_buffered_data(void* arg) {
+    EpochReaderArgs* args = (EpochReaderArgs*)arg;
+    int64_t last = 0;
+    int64_t nread = 0;
+    while (!args->stop.load(butil::memory_order_relaxed)) {
+        butil::EpochBufferedData<Versioned, TLS>::ScopedPtr ptr;
+        if (args->d->Read(&ptr) != 0) {
+            args->nerror.fetch_add(1);
+            break;
+        }
+        butil::EpochBufferedData<Versioned, TLS>::ScopedPtr nested;
+        args->d->Read(&nested);
+        const int64_t a = ptr->a;
+        if (a != ptr->b || a < last || !ptr->alive ||
+            nested->a < a || !nested->alive) {
+            args->nerror.fetch_add(1);
+        }
+        last = a;
+        ++nread;
+    }
+    args->nread.fetch_add(nread);
+    return NULL;
+}
+
+TEST_F(LoadBalancerTest, epoch_buffered_data) {
+    const size_t old_TLS_ctor = TLS_ctor;
+    const size_t old_TLS_dtor = TLS_dtor;
+    {
+        butil::EpochBufferedData<Foo, TLS> d2;
+        butil::EpochBufferedData<Foo, TLS>::ScopedPtr ptr;
+        d2.Read(&ptr);
+        ASSERT_EQ(old_TLS_ctor + 1, TLS_ctor);
+    }
+    ASSERT_EQ(old_TLS_ctor + 1, TLS_ctor);
+    ASSERT_EQ(old_TLS_dtor + 1, TLS_dtor);
+
+    butil::EpochBufferedData<Foo> d;
+    {
+        butil::EpochBufferedData<Foo>::ScopedPtr ptr;
+        ASSERT_EQ(0, d.Read(&ptr));
+        ASSERT_EQ(0, ptr->x);
+        // Modify() does not wait for the reader.
+        ASSERT_EQ(1u, d.Modify(AddN, 10));
+        ASSERT_EQ(0, ptr->x);
+        butil::EpochBufferedData<Foo>::ScopedPtr ptr2;
+        ASSERT_EQ(0, d.Read(&ptr2));
+        ASSERT_EQ(10, ptr2->x);
+    }
+    {
+        butil::EpochBufferedData<Foo>::ScopedPtr ptr;
+        ASSERT_EQ(0, d.Read(&ptr));
+        ASSERT_EQ(10, ptr->x);
+    }
+
+    const int old_nalive = nalive_versioned.load();
+    {
+        butil::EpochBufferedData<Versioned, TLS> dv;
+        EpochReaderArgs args;
+        args.d = &dv;
+        args.stop.store(false);
+        args.nread.store(0);
+        args.nerror.store(0);
+        pthread_t th[8];
+        for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+            ASSERT_EQ(0, pthread_create(&th[i], NULL,
+                                        read_epoch_buffered_data, &args));
+        }
+        butil::Timer tm;
+        tm.start();
+        const int N = 100000;
+        for (int i = 0; i < N; ++i) {
+            if (i % 2) {
+                ASSERT_EQ(1u, dv.Modify(IncVersioned));
+            } else {
+                ASSERT_EQ(1u, dv.ModifyWithForeground(SetFromFG, (int64_t)1));
+            }
+        }
+        tm.stop();
+        args.stop.store(true);
+        for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+            pthread_join(th[i], NULL);
+        }
+        LOG(INFO) << "Modify takes " << tm.n_elapsed() / N << "ns, nread="
+                  << args.nread.load();
+        ASSERT_EQ(0, args.nerror.load());
+        // Without readers, old instances are reclaimed in next batch.
+        const size_t batch =
+            butil::EpochBufferedData<Versioned, TLS>::RECLAIM_BATCH;
+        for (size_t i = 0; i < batch; ++i) {
+            ASSERT_EQ(1u, dv.Modify(IncVersioned));
+        }
+        ASSERT_LE(nalive_versioned.load() - old_nalive, (int)batch + 1);
+        butil::EpochBufferedData<Versioned, TLS>::ScopedPtr ptr;
+        ASSERT_EQ(0, dv.Read(&ptr));
+        ASSERT_EQ(N + (int)batch, ptr->a);
+        ASSERT_EQ(N + (int)batch, ptr->b);
+    }
+    ASSERT_EQ(old_nalive, nalive_versioned.load());
+}
+
 typedef brpc::policy::LocalityAwareLoadBalancer LALB;
 
 static void ValidateWeightTree(
@@ -217,6 +357,76 @@ TEST_F(LoadBalancerTest, la_sanity) {
     }
 }
 
+TEST_F(LoadBalancerTest, la_sharded) {
+    LALB proto;
+    ASSERT_TRUE(proto.New("shards=0") == NULL);
+    ASSERT_TRUE(proto.New("shards=9") == NULL);
+    ASSERT_TRUE(proto.New("shard=4") == NULL);
+    LALB* lalb = proto.New("shards=4");
+    ASSERT_TRUE(lalb != NULL);
+    ASSERT_EQ(4u, lalb->_shards.size());
+    // The instance itself is the first shard.
+    ASSERT_EQ(lalb, lalb->_shards[0]);
+
+    const size_t N = 64;
+    std::vector<brpc::ServerId> ids;
+    for (size_t i = 0; i < N; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "192.168.2.%d:8080", (int)i);
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+    ASSERT_EQ(N / 2, lalb->AddServersInBatch(
+        std::vector<brpc::ServerId>(ids.begin(), ids.begin() + N / 2)));
+    for (size_t i = N / 2; i < N; ++i) {
+        ASSERT_TRUE(lalb->AddServer(ids[i]));
+    }
+    size_t total_count = 0;
+    for (size_t i = 0; i < lalb->_shards.size(); ++i) {
+        const size_t n = lalb->_shards[i]->_left_weights.size();
+        ValidateLALB(*lalb->_shards[i], n);
+        total_count += n;
+    }
+    ASSERT_EQ(N, total_count);
+
+    // Every server is reachable and feedbacks go to the owning shard.
+    std::set<brpc::SocketId> selected;
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, true, false, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    for (size_t i = 0; i < N * 100; ++i) {
+        in.begin_time_us = butil::gettimeofday_us();
+        ASSERT_EQ(0, lalb->SelectServer(in, &out));
+        selected.insert(ptr->id());
+        brpc::LoadBalancer::CallInfo info =
+            { in.begin_time_us, ptr->id(), 0, NULL };
+        lalb->Feedback(info);
+    }
+    ASSERT_EQ(N, selected.size());
+    for (size_t i = 0; i < lalb->_shards.size(); ++i) {
+        ValidateLALB(*lalb->_shards[i], lalb->_shards[i]->_left_weights.size());
+    }
+
+    ASSERT_EQ(N / 2, lalb->RemoveServersInBatch(
+        std::vector<brpc::ServerId>(ids.begin(), ids.begin() + N / 2)));
+    for (size_t i = N / 2; i < N; ++i) {
+        ASSERT_TRUE(lalb->RemoveServer(ids[i]));
+    }
+    for (size_t i = 0; i < lalb->_shards.size(); ++i) {
+        ValidateLALB(*lalb->_shards[i], 0);
+    }
+    ASSERT_EQ(ENODATA, lalb->SelectServer(in, &out));
+    lalb->Destroy();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
 typedef std::map<brpc::SocketId, int> CountMap;
 volatile bool global_stop = false;
 
@@ -617,6 +827,96 @@ TEST_F(LoadBalancerTest, consistent_hashing) {
     }
 }
 
+TEST_F(LoadBalancerTest, consistent_hashing_maglev_and_bounded_load) {
+    brpc::policy::ConsistentHashingLoadBalancer proto(
+        brpc::policy::CONS_HASH_LB_MURMUR3);
+    ASSERT_TRUE(proto.New("maglev_table_size=65536") == NULL);
+    ASSERT_TRUE(proto.New("load_factor=0.5") == NULL);
+
+    const size_t N = 5;
+    std::vector<brpc::ServerId> ids;
+    for (size_t i = 0; i < N; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "10.92.115.%d:8833", (int)i + 1);
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, true, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+
+    // Maglev table spreads keys evenly and most keys stay on their servers
+    // after removing one server.
+    brpc::LoadBalancer* maglev = proto.New("maglev_table_size=65537");
+    ASSERT_TRUE(maglev != NULL);
+    ASSERT_EQ(N, maglev->AddServersInBatch(ids));
+    const size_t SELECT_TIMES = 100000;
+    std::vector<brpc::SocketId> before(SELECT_TIMES);
+    std::map<brpc::SocketId, size_t> times;
+    for (size_t i = 0; i < SELECT_TIMES; ++i) {
+        in.request_code = brpc::policy::MurmurHash32(&i, sizeof(i));
+        ASSERT_EQ(0, maglev->SelectServer(in, &out));
+        before[i] = ptr->id();
+        ++times[ptr->id()];
+    }
+    ASSERT_EQ(N, times.size());
+    for (std::map<brpc::SocketId, size_t>::iterator
+             it = times.begin(); it != times.end(); ++it) {
+        ASSERT_GT(it->second, SELECT_TIMES / N * 9 / 10);
+        ASSERT_LT(it->second, SELECT_TIMES / N * 11 / 10);
+    }
+    ASSERT_TRUE(maglev->RemoveServer(ids[0]));
+    size_t moved = 0;
+    for (size_t i = 0; i < SELECT_TIMES; ++i) {
+        in.request_code = brpc::policy::MurmurHash32(&i, sizeof(i));
+        ASSERT_EQ(0, maglev->SelectServer(in, &out));
+        ASSERT_NE(ids[0].id, ptr->id());
+        if (before[i] != ids[0].id && before[i] != ptr->id()) {
+            ++moved;
+        }
+    }
+    ASSERT_LT(moved, SELECT_TIMES / 20);
+    maglev->Destroy();
+
+    // With bounded loads, a hot key spills to other servers when its server
+    // has too many in-flight requests.
+    const double load_factor = 1.25;
+    brpc::LoadBalancer* bounded = proto.New("load_factor=1.25");
+    ASSERT_TRUE(bounded != NULL);
+    ASSERT_EQ(N, bounded->AddServersInBatch(ids));
+    std::vector<brpc::SocketId> selected;
+    std::map<brpc::SocketId, int64_t> inflight;
+    in.request_code = 12345;
+    for (size_t i = 0; i < 100; ++i) {
+        out.need_feedback = false;
+        ASSERT_EQ(0, bounded->SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        selected.push_back(ptr->id());
+        const int64_t bound = (int64_t)ceil(load_factor * (i + 1) / N);
+        ASSERT_LE(++inflight[ptr->id()], bound) << "i=" << i;
+    }
+    ASSERT_GT(inflight.size(), 1u);
+    for (size_t i = 0; i < selected.size(); ++i) {
+        brpc::LoadBalancer::CallInfo info = { 0, selected[i], 0, NULL };
+        bounded->Feedback(info);
+    }
+    // All requests are finished, the key goes to its own server again.
+    out.need_feedback = false;
+    ASSERT_EQ(0, bounded->SelectServer(in, &out));
+    ASSERT_EQ(selected[0], ptr->id());
+    bounded->Destroy();
+
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
 TEST_F(LoadBalancerTest, weighted_round_robin) {
     const char* servers[] = { 
             "10.92.115.19:8831", 
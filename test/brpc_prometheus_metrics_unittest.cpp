@@ -21,9 +21,15 @@
 #include "brpc/server.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
+#include "brpc/builtin/prometheus_metrics_service.h"
 #include "butil/strings/string_piece.h"
+#include "bvar/latency_recorder.h"
 #include "echo.pb.h"
 
+namespace bvar {
+DECLARE_bool(bvar_latency_use_sketch);
+}
+
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -142,3 +148,44 @@ TEST(PrometheusMetrics, sanity) {
     ASSERT_EQ(0, server.Stop(0));
     ASSERT_EQ(0, server.Join());
 }
+
+TEST(PrometheusMetrics, latency_sketch) {
+    bvar::FLAGS_bvar_latency_use_sketch = true;
+    bvar::LatencyRecorder rec("prometheus_sketch", 3);
+    bvar::FLAGS_bvar_latency_use_sketch = false;
+    usleep(1100000);
+    for (int i = 1; i <= 100; ++i) {
+        rec << i * 1000;
+    }
+    usleep(2100000);
+
+    butil::IOBuf buf;
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+    const std::string res = buf.to_string();
+    ASSERT_NE(std::string::npos, res.find(
+        "# TYPE prometheus_sketch_latency_histogram_bucket gauge\n"));
+    // All bounds are output even if the buckets are empty.
+    ASSERT_NE(std::string::npos, res.find(
+        "prometheus_sketch_latency_histogram_bucket{le=\"1\"} 0\n"));
+    ASSERT_NE(std::string::npos, res.find(
+        "prometheus_sketch_latency_histogram_bucket{le=\"1023\"} 1\n"));
+    ASSERT_NE(std::string::npos, res.find(
+        "prometheus_sketch_latency_histogram_bucket{le=\"1535\"} 1\n"));
+    ASSERT_NE(std::string::npos, res.find(
+        "prometheus_sketch_latency_histogram_bucket{le=\"2047\"} 2\n"));
+    ASSERT_NE(std::string::npos, res.find(
+        "prometheus_sketch_latency_histogram_bucket{le=\"4294967295\"} 100\n"));
+    size_t nbucket = 0;
+    for (size_t pos = res.find("prometheus_sketch_latency_histogram_bucket{");
+         pos != std::string::npos;
+         pos = res.find("prometheus_sketch_latency_histogram_bucket{", pos + 1)) {
+        ++nbucket;
+    }
+    ASSERT_EQ(64u, nbucket);
+    ASSERT_NE(std::string::npos, res.find(
+        "prometheus_sketch_latency_histogram_bucket{le=\"+Inf\"} 100\n"));
+    ASSERT_NE(std::string::npos, res.find(
+        "prometheus_sketch_latency_histogram_count 100\n"));
+    // The sketch itself is not a number.
+    ASSERT_EQ(std::string::npos, res.find("prometheus_sketch_latency_sketch"));
+}
@@ -1471,4 +1471,177 @@ TEST_F(ProtobufJsonTest, string_to_int64) {
     ASSERT_EQ(person.data(), 1234567);
 }
 
+void DoNothing(void*) {}
+
+// Convert `json' from std::string which builds a document first and from
+// ZeroCopyInputStream which converts while parsing, the results should be
+// the same. The json is split into tiny blocks so that tokens cross blocks.
+template <typename T>
+void CheckStreamingConversion(const std::string& json, bool expect_ok) {
+    T m1;
+    std::string err1;
+    ASSERT_EQ(expect_ok, json2pb::JsonToProtoMessage(json, &m1, &err1)) << err1;
+
+    butil::IOBuf buf;
+    for (size_t i = 0; i < json.size(); i += 3) {
+        buf.append_user_data(const_cast<char*>(json.data() + i),
+                             std::min(json.size() - i, (size_t)3), DoNothing);
+    }
+    butil::IOBufAsZeroCopyInputStream stream(buf);
+    T m2;
+    std::string err2;
+    ASSERT_EQ(expect_ok, json2pb::JsonToProtoMessage(&stream, &m2, &err2)) << err2;
+    ASSERT_EQ(err1, err2) << json;
+    if (expect_ok) {
+        ASSERT_EQ(m1.ShortDebugString(), m2.ShortDebugString());
+    }
+}
+
+TEST_F(ProtobufJsonTest, json_to_pb_streaming_case) {
+    CheckStreamingConversion<JsonContextBody>(
+        "{\"content\":[{\"distance\":1,\"unknown_member\":{\"a\":[1,{\"b\":[]}]},"
+        "\"ext\":{\"age\":1666666666, \"databyte\":\"d2VsY29tZQ==\", \"enumtype\":1},"
+        "\"uid\":\"someone\"},{\"distance\":10,\"unknown_member\":[20,[{}]],"
+        "\"ext\":{\"age\":1666666660, \"databyte\":\"d2VsY29tZTA=\", \"enumtype\":2},"
+        "\"uid\":\"someone0\"}], \"judge\":false, \"spur\":\"-Infinity\","
+        " \"data\":[1,2,3,4,5,6,7,8,9,10], \"info\":null, \"type\":[\"123\"]}", true);
+    // Only the first one of duplicated keys is converted.
+    CheckStreamingConversion<JsonContextBody>(
+        "{\"judge\":true, \"spur\":1.5, \"judge\":false, \"data\":[1], \"data\":[2]}",
+        true);
+    CheckStreamingConversion<JsonContextBody>(
+        "{\"judge\":false, \"spur\":2, \"data\":[\"1\",\"2\"]}", false);
+    CheckStreamingConversion<JsonContextBody>(
+        "{\"judge\":false, \"spur\":2, \"info\":2}", false);
+    CheckStreamingConversion<JsonContextBody>(
+        "{\"judge\":false, \"spur\":2, \"info\":{\"a\":1}}", false);
+    CheckStreamingConversion<JsonContextBody>(
+        "{\"judge\":false, \"spur\":2, \"data\":[[1]]}", false);
+    CheckStreamingConversion<JsonContextBody>(
+        "{\"judge\":{}, \"spur\":2}", false);
+    CheckStreamingConversion<JsonContextBody>(
+        "{\"judge\":null, \"spur\":2}", false);
+    CheckStreamingConversion<JsonContextBody>("{\"spur\":2}", false);
+    CheckStreamingConversion<JsonContextBody>(
+        "{\"judge\":false, \"spur\":\"NaNa\"}", false);
+    CheckStreamingConversion<JsonContextBody>(
+        "{\"content\":[{\"distance\":1,\"ext\":{\"age\":1, \"enumtype\":1}}],"
+        " \"judge\":false, \"spur\":2}", false);
+    CheckStreamingConversion<JsonContextBody>(
+        "{\"content\":[1], \"judge\":false, \"spur\":2}", false);
+    CheckStreamingConversion<JsonContextBody>("[1,2]", false);
+    CheckStreamingConversion<JsonContextBody>("\"judge\"", false);
+    CheckStreamingConversion<JsonContextBody>("{\"judge\":false,", false);
+
+    const std::string map_json =
+        "{\"addr\":\"baidu.com\","
+        "\"numbers\":{\"tel\":123456,\"cell\":654321},"
+        "\"contacts\":{\"email\":\"frank@baidu.com\","
+        "               \"office\":\"Shanghai\"},"
+        "\"friends\":{\"John\":[{\"school\":\"SJTU\",\"year\":2007}]}}";
+    CheckStreamingConversion<AddressNoMap>(map_json, true);
+    CheckStreamingConversion<AddressIntMap>(map_json, true);
+    CheckStreamingConversion<AddressStringMap>(map_json, true);
+    CheckStreamingConversion<AddressComplex>(map_json, true);
+    CheckStreamingConversion<AddressIntMap>(
+        "{\"addr\":\"baidu.com\","
+        "\"numbers\":[{\"key\":\"tel\",\"value\":123456},"
+        "             {\"key\":\"cell\",\"value\":654321}]}", true);
+    CheckStreamingConversion<AddressIntMap>(
+        "{\"addr\":\"baidu.com\", \"numbers\":{\"tel\":\"123456\"}}", false);
+
+    CheckStreamingConversion<Person>(
+        "{\"name\":\"hello\",\"id\":9,\"datadouble\":2.2,\"datafloat\":1.0,"
+        "\"hobby\":\"coding\"}", true);
+}
+
+TEST_F(ProtobufJsonTest, streaming_perf_case) {
+    AddressBook address_book;
+    for (int i = 0; i < 1000; ++i) {
+        Person* person = address_book.add_person();
+        person->set_id(i);
+        person->set_name("baidu");
+        person->set_email("welcome@baidu.com");
+        Person::PhoneNumber* phone_number = person->add_phone();
+        phone_number->set_number("number123");
+        phone_number->set_type(Person::HOME);
+        person->set_data(-240000000);
+        person->set_data32(6);
+        person->set_data64(-1820000000);
+        person->set_datadouble(123.456);
+        person->set_datafloat(8.6123);
+        person->set_datau32(60);
+        person->set_datau64(960);
+        person->set_databool(0);
+        person->set_databyte("welcome to china");
+    }
+    std::string json;
+    ASSERT_TRUE(json2pb::ProtoMessageToJson(address_book, &json, NULL));
+    butil::IOBuf json_buf;
+    json_buf.append(json);
+
+    printf("----------test streaming performance------------\n\n");
+    butil::Timer timer;
+    int64_t json_to_pb_doc = 0;
+    int64_t json_to_pb_stream = 0;
+    int64_t pb_to_json_string = 0;
+    int64_t pb_to_json_iobuf = 0;
+    const int times = 100;
+    for (int i = 0; i < times; ++i) {
+        AddressBook data1;
+        timer.start();
+        ASSERT_TRUE(json2pb::JsonToProtoMessage(json, &data1, NULL));
+        timer.stop();
+        json_to_pb_doc += timer.u_elapsed();
+
+        AddressBook data2;
+        butil::IOBufAsZeroCopyInputStream stream(json_buf);
+        timer.start();
+        ASSERT_TRUE(json2pb::JsonToProtoMessage(&stream, &data2, NULL));
+        timer.stop();
+        json_to_pb_stream += timer.u_elapsed();
+
+        std::string out;
+        timer.start();
+        ASSERT_TRUE(json2pb::ProtoMessageToJson(data2, &out, NULL));
+        timer.stop();
+        pb_to_json_string += timer.u_elapsed();
+
+        butil::IOBuf out_buf;
+        timer.start();
+        ASSERT_TRUE(json2pb::ProtoMessageToJson(data2, &out_buf, NULL));
+        timer.stop();
+        pb_to_json_iobuf += timer.u_elapsed();
+        ASSERT_EQ(out, out_buf.to_string());
+    }
+    printf("json(%zu bytes) to pb: document=%" PRId64 "us stream=%" PRId64 "us\n",
+           json.size(), json_to_pb_doc / times, json_to_pb_stream / times);
+    printf("pb to json: string=%" PRId64 "us iobuf=%" PRId64 "us\n",
+           pb_to_json_string / times, pb_to_json_iobuf / times);
+}
+
+TEST_F(ProtobufJsonTest, pb_to_json_iobuf_case) {
+    Person person;
+    person.set_name("hello");
+    person.set_id(9);
+    person.set_datadouble(2.2);
+    person.set_datafloat(1);
+    person.SetExtension(addressbook::hobby, std::string(10000, 'x'));
+    std::string expected;
+    ASSERT_TRUE(json2pb::ProtoMessageToJson(person, &expected));
+
+    butil::IOBuf iobuf;
+    iobuf.append("prefix");
+    std::string error;
+    ASSERT_TRUE(json2pb::ProtoMessageToJson(person, &iobuf, &error)) << error;
+    ASSERT_EQ("prefix" + expected, iobuf.to_string());
+
+    // Nothing is appended on failure.
+    Person invalid;
+    iobuf.clear();
+    ASSERT_FALSE(json2pb::ProtoMessageToJson(invalid, &iobuf, &error));
+    ASSERT_EQ("Missing required field: addressbook.Person.name", error);
+    ASSERT_TRUE(iobuf.empty());
+}
+
 }
@@ -28,6 +28,7 @@
 #include "butil/macros.h"
 #include "butil/fd_guard.h"
 #include "butil/files/scoped_file.h"
+#include "bthread/unstable.h"
 #include "brpc/socket.h"
 #include "brpc/builtin/version_service.h"
 #include "brpc/builtin/health_service.h"
@@ -1401,4 +1402,71 @@ TEST_F(ServerTest, max_concurrency) {
     stub.Echo(&cntl4, &req, NULL, NULL);
     ASSERT_FALSE(cntl4.Failed()) << cntl4.ErrorText();
 }
+
+class PriorityCheckingEchoService : public test::EchoService {
+public:
+    PriorityCheckingEchoService() : high_priority(-1) {}
+    virtual void Echo(google::protobuf::RpcController*,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        high_priority = bthread_set_high_priority(1);
+        bthread_set_high_priority(high_priority);
+        response->set_message(request->message());
+    }
+    virtual void ComboEcho(google::protobuf::RpcController*,
+                           const test::ComboRequest*,
+                           test::ComboResponse*,
+                           google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        high_priority = bthread_set_high_priority(1);
+        bthread_set_high_priority(high_priority);
+    }
+    int high_priority;
+};
+
+TEST_F(ServerTest, method_high_priority) {
+    const int port = 9200;
+    brpc::Server server;
+    PriorityCheckingEchoService service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(-1, server.SetMethodHighPriority("test.EchoService.NotExist"));
+    ASSERT_EQ(0, server.SetMethodHighPriority("test.EchoService.Echo"));
+    ASSERT_EQ(0, server.Start(port, NULL));
+    ASSERT_EQ(-1, server.SetMethodHighPriority("test.EchoService.Echo", false));
+
+    brpc::Channel http_channel;
+    brpc::ChannelOptions chan_options;
+    chan_options.protocol = "http";
+    ASSERT_EQ(0, http_channel.Init("0.0.0.0", port, &chan_options));
+    brpc::Channel normal_channel;
+    ASSERT_EQ(0, normal_channel.Init("0.0.0.0", port, NULL));
+    test::EchoService_Stub stub(&normal_channel);
+
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message("hello");
+    brpc::Controller cntl;
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(1, service.high_priority);
+
+    service.high_priority = -1;
+    cntl.Reset();
+    cntl.http_request().uri() = "/EchoService/Echo";
+    cntl.http_request().set_method(brpc::HTTP_METHOD_POST);
+    cntl.request_attachment().append("{\"message\":\"hello\"}");
+    http_channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(1, service.high_priority);
+
+    // Other methods are not affected.
+    test::ComboRequest combo_req;
+    test::ComboResponse combo_res;
+    cntl.Reset();
+    stub.ComboEcho(&cntl, &combo_req, &combo_res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(0, service.high_priority);
+}
 } //namespace
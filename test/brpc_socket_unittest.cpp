@@ -28,6 +28,7 @@
 #include "butil/time.h"
 #include "butil/macros.h"
 #include "butil/fd_utility.h"
+#include "butil/fd_guard.h"
 #include "bthread/unstable.h"
 #include "bthread/task_control.h"
 #include "brpc/socket.h"
@@ -40,6 +41,8 @@
 #include "brpc/server.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
+#include "brpc/details/zero_copy.h"
+#include "brpc/details/recent_latency.h"
 #include "health_check.pb.h"
 #if defined(OS_MACOSX)
 #include <sys/event.h>
@@ -53,6 +56,8 @@ extern TaskControl* g_task_control;
 
 namespace brpc {
 DECLARE_int32(health_check_interval);
+DECLARE_int32(socket_cork_us);
+DECLARE_int32(socket_cork_bytes);
 }
 
 void EchoProcessHuluRequest(brpc::InputMessageBase* msg_base);
@@ -1014,3 +1019,339 @@ TEST_F(SocketTest, multi_threaded_write_perf) {
     ASSERT_EQ((brpc::Socket*)NULL, global_sock);
     close(fds[0]);
 }
+
+TEST_F(SocketTest, zerocopy_write) {
+    if (!brpc::ZeroCopyWriter::IsSupported()) {
+        return;
+    }
+    butil::fd_guard listening_fd(tcp_listen(butil::EndPoint(butil::IP_ANY, 0)));
+    ASSERT_GT(listening_fd, 0);
+    butil::EndPoint point;
+    ASSERT_EQ(0, butil::get_local_side(listening_fd, &point));
+    butil::fd_guard client_fd(butil::tcp_connect(point, NULL));
+    ASSERT_GT(client_fd, 0);
+    butil::fd_guard server_fd(accept(listening_fd, NULL, NULL));
+    ASSERT_GT(server_fd, 0);
+    butil::make_non_blocking(client_fd);
+
+    const size_t N = 1024 * 1024;
+    std::string expected;
+    for (size_t i = 0; i < N; ++i) {
+        expected.push_back('a' + i % 26);
+    }
+    butil::IOBuf src;
+    src.append(expected);
+    brpc::ZeroCopyWriter writer;
+    std::string received;
+    const int64_t start_time = butil::gettimeofday_us();
+    while (received.size() < N) {
+        ASSERT_LT(butil::gettimeofday_us(), start_time + 5000000L);
+        if (!src.empty()) {
+            butil::IOBuf* pieces[] = { &src };
+            const ssize_t nw = writer.Write(client_fd, pieces, 1);
+            if (nw < 0 && errno == EOPNOTSUPP) {
+                LOG(WARNING) << "MSG_ZEROCOPY is not supported, skip";
+                return;
+            }
+            ASSERT_TRUE(nw > 0 || errno == EAGAIN || errno == ENOBUFS) << berror();
+        }
+        char buf[65536];
+        const ssize_t nr = read(server_fd, buf, sizeof(buf));
+        ASSERT_GT(nr, 0);
+        received.append(buf, nr);
+        writer.ReapCompletions(client_fd);
+    }
+    ASSERT_TRUE(src.empty());
+    ASSERT_EQ(expected, received);
+    while (writer.pending_count() != 0) {
+        ASSERT_LT(butil::gettimeofday_us(), start_time + 5000000L);
+        writer.ReapCompletions(client_fd);
+        bthread_usleep(1000);
+    }
+}
+
+struct ReapArg {
+    brpc::ZeroCopyWriter* writer;
+    int fd;
+    butil::atomic<bool> stop;
+};
+
+static void* reap_zerocopy_completions(void* void_arg) {
+    ReapArg* arg = (ReapArg*)void_arg;
+    while (!arg->stop.load(butil::memory_order_relaxed)) {
+        if (arg->writer->pending_count() != 0) {
+            arg->writer->ReapCompletions(arg->fd);
+        }
+    }
+    return NULL;
+}
+
+// Returns false on failures or if MSG_ZEROCOPY is not supported (with
+// `*supported' set to false). Uses non-fatal assertions only so that the
+// caller can join the reaping thread before returning.
+static bool write_and_wait_completions(brpc::ZeroCopyWriter* writer,
+                                       int client_fd, int server_fd,
+                                       bool* supported) {
+    *supported = true;
+    // Completions of small writes come soon and race with Write(). None of
+    // them should be lost, otherwise the last write is never released.
+    const int64_t start_time = butil::gettimeofday_us();
+    const std::string data(4096, 'z');
+    size_t nwritten = 0;
+    size_t nreceived = 0;
+    for (int i = 0; i < 1000; ++i) {
+        butil::IOBuf src;
+        src.append(data);
+        butil::IOBuf* pieces[] = { &src };
+        while (!src.empty()) {
+            if (butil::gettimeofday_us() >= start_time + 5000000L) {
+                ADD_FAILURE() << "Timedout";
+                return false;
+            }
+            const ssize_t nw = writer->Write(client_fd, pieces, 1);
+            if (nw < 0 && errno == EOPNOTSUPP) {
+                *supported = false;
+                return false;
+            }
+            if (!(nw > 0 || errno == EAGAIN || errno == ENOBUFS)) {
+                ADD_FAILURE() << berror();
+                return false;
+            }
+            if (nw > 0) {
+                nwritten += nw;
+            }
+            if (nreceived == nwritten) {
+                // ENOBUFS, wait for completions.
+                usleep(100);
+                continue;
+            }
+            char buf[65536];
+            const ssize_t nr = read(server_fd, buf, sizeof(buf));
+            EXPECT_GT(nr, 0);
+            if (nr <= 0) {
+                return false;
+            }
+            nreceived += nr;
+        }
+    }
+    while (nreceived < nwritten) {
+        char buf[65536];
+        const ssize_t nr = read(server_fd, buf, sizeof(buf));
+        EXPECT_GT(nr, 0);
+        if (nr <= 0) {
+            return false;
+        }
+        nreceived += nr;
+    }
+    while (writer->pending_count() != 0) {
+        if (butil::gettimeofday_us() >= start_time + 5000000L) {
+            ADD_FAILURE() << "pending=" << writer->pending_count();
+            return false;
+        }
+        usleep(1000);
+    }
+    return true;
+}
+
+TEST_F(SocketTest, zerocopy_write_with_concurrent_reaping) {
+    if (!brpc::ZeroCopyWriter::IsSupported()) {
+        return;
+    }
+    butil::fd_guard listening_fd(tcp_listen(butil::EndPoint(butil::IP_ANY, 0)));
+    ASSERT_GT(listening_fd, 0);
+    butil::EndPoint point;
+    ASSERT_EQ(0, butil::get_local_side(listening_fd, &point));
+    butil::fd_guard client_fd(butil::tcp_connect(point, NULL));
+    ASSERT_GT(client_fd, 0);
+    butil::fd_guard server_fd(accept(listening_fd, NULL, NULL));
+    ASSERT_GT(server_fd, 0);
+    butil::make_non_blocking(client_fd);
+
+    brpc::ZeroCopyWriter writer;
+    ReapArg arg;
+    arg.writer = &writer;
+    arg.fd = client_fd;
+    arg.stop = false;
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, reap_zerocopy_completions, &arg));
+    bool supported = true;
+    const bool ok = write_and_wait_completions(
+        &writer, client_fd, server_fd, &supported);
+    arg.stop = true;
+    ASSERT_EQ(0, pthread_join(th, NULL));
+    if (!supported) {
+        LOG(WARNING) << "MSG_ZEROCOPY is not supported, skip";
+        return;
+    }
+    ASSERT_TRUE(ok);
+}
+
+static void* read_all(void* arg) {
+    const int fd = (int)(intptr_t)arg;
+    char buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+    return NULL;
+}
+
+TEST_F(SocketTest, zerocopy_close_with_pending_writes) {
+    if (!brpc::ZeroCopyWriter::IsSupported()) {
+        return;
+    }
+    butil::fd_guard listening_fd(tcp_listen(butil::EndPoint(butil::IP_ANY, 0)));
+    ASSERT_GT(listening_fd, 0);
+    butil::EndPoint point;
+    ASSERT_EQ(0, butil::get_local_side(listening_fd, &point));
+    const int client_fd = butil::tcp_connect(point, NULL);
+    ASSERT_GT(client_fd, 0);
+    butil::fd_guard server_fd(accept(listening_fd, NULL, NULL));
+    ASSERT_GT(server_fd, 0);
+    butil::make_non_blocking(client_fd);
+
+    brpc::ZeroCopyWriter writer;
+    // Nobody reads `server_fd', the writes stay in the send queue.
+    butil::IOBuf src;
+    src.append(std::string(65536, 'z'));
+    butil::IOBuf* pieces[] = { &src };
+    const ssize_t nw = writer.Write(client_fd, pieces, 1);
+    if (nw < 0 && errno == EOPNOTSUPP) {
+        LOG(WARNING) << "MSG_ZEROCOPY is not supported, skip";
+        close(client_fd);
+        return;
+    }
+    ASSERT_GT(nw, 0);
+    ASSERT_EQ(1u, writer.pending_count());
+    src.clear();
+    const size_t nblock = butil::IOBuf::block_count();
+    // Blocks of the pending write are kept after closing.
+    writer.Close(client_fd);
+    ASSERT_EQ(0u, writer.pending_count());
+    ASSERT_EQ(nblock, butil::IOBuf::block_count());
+
+    // Released after the peer reads all data and the writes complete.
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, read_all,
+                                (void*)(intptr_t)(int)server_fd));
+    const int64_t start_time = butil::gettimeofday_us();
+    while (butil::IOBuf::block_count() >= nblock) {
+        ASSERT_LT(butil::gettimeofday_us(), start_time + 5000000L);
+        usleep(1000);
+    }
+    shutdown(server_fd, SHUT_RDWR);
+    pthread_join(th, NULL);
+}
+
+static void ReadUntil(int fd, size_t len, std::string* out) {
+    while (out->size() < len) {
+        char buf[256];
+        const ssize_t nr = read(fd, buf, sizeof(buf));
+        ASSERT_GT(nr, 0);
+        out->append(buf, nr);
+    }
+}
+
+TEST_F(SocketTest, corked_write) {
+    const int saved_cork_us = brpc::FLAGS_socket_cork_us;
+    const int saved_cork_bytes = brpc::FLAGS_socket_cork_bytes;
+    brpc::FLAGS_socket_cork_us = 500000;
+    brpc::FLAGS_socket_cork_bytes = 64;
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    brpc::SocketOptions options;
+    options.fd = fds[1];
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+
+    // Small writes are delayed until a write asking for flush.
+    std::string expected;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < 5; ++i) {
+        butil::IOBuf src;
+        src.append(std::string(10, 'a' + i));
+        expected.append(src.to_string());
+        ASSERT_EQ(0, s->Write(&src));
+    }
+    char c;
+    ASSERT_EQ(-1, recv(fds[0], &c, 1, MSG_DONTWAIT));
+    ASSERT_EQ(EAGAIN, errno);
+    butil::IOBuf src;
+    src.append("flush");
+    expected.append("flush");
+    brpc::Socket::WriteOptions wopt;
+    wopt.flush_immediately = true;
+    ASSERT_EQ(0, s->Write(&src, &wopt));
+    std::string received;
+    ReadUntil(fds[0], expected.size(), &received);
+    tm.stop();
+    ASSERT_EQ(expected, received);
+    ASSERT_LT(tm.u_elapsed(), brpc::FLAGS_socket_cork_us);
+
+    // Or until enough bytes are queued.
+    expected.clear();
+    received.clear();
+    tm.start();
+    for (int i = 0; i < 2; ++i) {
+        src.append(std::string(40, 'x' + i));
+        expected.append(src.to_string());
+        ASSERT_EQ(0, s->Write(&src));
+    }
+    ReadUntil(fds[0], expected.size(), &received);
+    tm.stop();
+    ASSERT_EQ(expected, received);
+    ASSERT_LT(tm.u_elapsed(), brpc::FLAGS_socket_cork_us);
+
+    // Or for at most socket_cork_us.
+    // Wait for the KeepWrite thread to quit, otherwise data is written
+    // by it directly.
+    bthread_usleep(50000);
+    received.clear();
+    tm.start();
+    src.append("timeout");
+    ASSERT_EQ(0, s->Write(&src));
+    ReadUntil(fds[0], 7, &received);
+    tm.stop();
+    ASSERT_EQ("timeout", received);
+    ASSERT_GE(tm.u_elapsed(), brpc::FLAGS_socket_cork_us / 2);
+
+    ASSERT_EQ(0, s->SetFailed());
+    s.reset();
+    close(fds[0]);
+    brpc::FLAGS_socket_cork_us = saved_cork_us;
+    brpc::FLAGS_socket_cork_bytes = saved_cork_bytes;
+}
+
+TEST_F(SocketTest, recent_latency) {
+    for (uint32_t v = 0; v < 1000000; ++v) {
+        const int index = brpc::RecentLatency::BucketIndex(v);
+        ASSERT_LT(index, (int)brpc::RecentLatency::NUM_BUCKETS);
+        ASSERT_GE(brpc::RecentLatency::BucketUpperBound(index), v);
+        // Over-estimated by at most 1/8.
+        ASSERT_LE(brpc::RecentLatency::BucketUpperBound(index), v + v / 8);
+    }
+    ASSERT_EQ(0xFFFFFFFFL, brpc::RecentLatency::BucketUpperBound(
+                  brpc::RecentLatency::BucketIndex(0xFFFFFFFF)));
+
+    brpc::RecentLatency rl;
+    const int64_t now_us = butil::gettimeofday_us();
+    for (int i = 1; i < (int)brpc::RecentLatency::MIN_COUNT; ++i) {
+        rl.Add(i * 1000, now_us);
+    }
+    ASSERT_EQ(-1, rl.GetPercentile(0.9, now_us));
+    for (int i = brpc::RecentLatency::MIN_COUNT; i <= 100; ++i) {
+        rl.Add(i * 1000, now_us);
+    }
+    const int64_t p90 = rl.GetPercentile(0.9, now_us);
+    ASSERT_GE(p90, 90000);
+    ASSERT_LE(p90, 90000 + 90000 / 8);
+
+    // Older latencies decay.
+    const int64_t later_us = now_us + brpc::RecentLatency::DECAY_INTERVAL_US * 3;
+    for (int i = 0; i < 100; ++i) {
+        rl.Add(1000, later_us);
+    }
+    ASSERT_LE(rl.GetPercentile(0.5, later_us), 1000 + 1000 / 8);
+    ASSERT_EQ(-1, rl.GetPercentile(
+                  0.5, later_us + brpc::RecentLatency::DECAY_INTERVAL_US * 40));
+}
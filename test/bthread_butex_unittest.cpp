@@ -67,6 +67,52 @@ void* joiner(void* arg) {
     return NULL;
 }
 
+struct ShortWaitArg {
+    uint32_t* butex;
+    butil::atomic<int> nfinished;
+};
+
+void* wait_for_short_timeouts(void* void_arg) {
+    ShortWaitArg* arg = static_cast<ShortWaitArg*>(void_arg);
+    for (int i = 0; i < 2000; ++i) {
+        // Timers this short may fire before the waiter is queued.
+        const timespec abstime = butil::microseconds_from_now(5 + i % 20);
+        EXPECT_EQ(-1, bthread::butex_wait(arg->butex, 0, &abstime));
+        EXPECT_EQ(ETIMEDOUT, errno);
+    }
+    arg->nfinished.fetch_add(1);
+    return NULL;
+}
+
+TEST(ButexTest, timer_fires_before_queueing) {
+    ShortWaitArg arg;
+    arg.butex = bthread::butex_create_checked<uint32_t>();
+    ASSERT_TRUE(arg.butex);
+    *arg.butex = 0;
+    arg.nfinished.store(0);
+    const int NTHREAD = 8;
+    bthread_t th[NTHREAD];
+    for (int i = 0; i < NTHREAD; ++i) {
+        ASSERT_EQ(0, bthread_start_background(
+                      &th[i], NULL, wait_for_short_timeouts, &arg));
+    }
+    const int64_t deadline_us = butil::gettimeofday_us() + 10000000L;
+    while (arg.nfinished.load() != NTHREAD &&
+           butil::gettimeofday_us() < deadline_us) {
+        usleep(10000);
+    }
+    // Waiters missed by their timers never wake up by themselves.
+    EXPECT_EQ(NTHREAD, arg.nfinished.load());
+    while (arg.nfinished.load() != NTHREAD) {
+        bthread::butex_wake_all(arg.butex);
+        usleep(10000);
+    }
+    for (int i = 0; i < NTHREAD; ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    bthread::butex_destroy(arg.butex);
+}
+
 struct A {
     uint64_t a;
     char dummy[0];
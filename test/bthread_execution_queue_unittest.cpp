@@ -15,6 +15,8 @@
 // specific language governing permissions and limitations
 // under the License.
 
+#include <algorithm>
+#include <vector>
 #include <gtest/gtest.h>
 
 #include <bthread/execution_queue.h>
@@ -463,6 +465,215 @@ TEST_F(ExecutionQueueTest, inplace_and_order) {
     ASSERT_EQ(0, disorder_times);
 }
 
+void* push_batches_with_id(void* arg) {
+    bthread::ExecutionQueueId<LongIntTask> id = { (uint64_t)arg };
+    int thread_id = num_threads.fetch_add(1, butil::memory_order_relaxed);
+    std::vector<LongIntTask> tasks;
+    for (int i = 0; i < 100000; ) {
+        // Mix tasks stored in nodes and malloc-ed arrays.
+        const int n = std::min(100000 - i, (int)butil::fast_rand_less_than(32));
+        tasks.clear();
+        for (int j = 0; j < n; ++j, ++i) {
+            tasks.push_back(LongIntTask(((long)thread_id << 32) | i));
+        }
+        if (n == 1 && butil::fast_rand_less_than(2)) {
+            bthread::execution_queue_execute(id, tasks[0]);
+        } else {
+            bthread::execution_queue_execute_batch(id, tasks.data(), n);
+        }
+    }
+    return NULL;
+}
+
+int check_order_by_span(void* meta, bthread::TaskIterator<LongIntTask>& iter) {
+    while (iter) {
+        size_t n = 0;
+        LongIntTask* tasks = iter.take_span(&n);
+        EXPECT_GT(n, 0u);
+        for (size_t i = 0; i < n; ++i) {
+            long value = tasks[i].value;
+            int thread_id = value >> 32;
+            long task = value & 0xFFFFFFFFul;
+            if (task != next_task[thread_id]++) {
+                EXPECT_TRUE(false) << "task=" << task << " thread_id=" << thread_id;
+                ++*(long*)meta;
+            }
+        }
+    }
+    return 0;
+}
+
+TEST_F(ExecutionQueueTest, multi_threaded_batch_order) {
+    int (*execute_fns[])(void*, bthread::TaskIterator<LongIntTask>&) =
+        { check_order, check_order_by_span };
+    for (size_t k = 0; k < ARRAY_SIZE(execute_fns); ++k) {
+        memset(next_task, 0, sizeof(next_task));
+        num_threads.store(0);
+        long disorder_times = 0;
+        bthread::ExecutionQueueId<LongIntTask> queue_id = { 0 };
+        bthread::ExecutionQueueOptions options;
+        ASSERT_EQ(0, bthread::execution_queue_start(&queue_id, &options,
+                                                    execute_fns[k],
+                                                    &disorder_times));
+        pthread_t threads[12];
+        for (size_t i = 0; i < ARRAY_SIZE(threads); ++i) {
+            pthread_create(&threads[i], NULL, &push_batches_with_id,
+                           (void *)queue_id.value);
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(threads); ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        ASSERT_EQ(0, bthread::execution_queue_stop(queue_id));
+        ASSERT_EQ(0, bthread::execution_queue_join(queue_id));
+        ASSERT_EQ(0, disorder_times);
+        for (size_t i = 0; i < ARRAY_SIZE(threads); ++i) {
+            ASSERT_EQ(100000, next_task[i]);
+        }
+    }
+}
+
+TEST_F(ExecutionQueueTest, execute_batch) {
+    int64_t result = 0;
+    int64_t expected_result = 0;
+    bthread::ExecutionQueueId<LongIntTask> queue_id = { 0 };
+    bthread::ExecutionQueueOptions options;
+    ASSERT_EQ(0, bthread::execution_queue_start(&queue_id, &options,
+                                                add, &result));
+    // Larger than one node can hold.
+    std::vector<LongIntTask> tasks;
+    for (size_t i = 0; i < bthread::TaskNode::MAX_BATCH_SIZE + 100; ++i) {
+        tasks.push_back(LongIntTask(i));
+        expected_result += i;
+    }
+    ASSERT_EQ(0, bthread::execution_queue_execute_batch(
+                  queue_id, tasks.data(), tasks.size()));
+    ASSERT_EQ(0, bthread::execution_queue_execute_batch(
+                  queue_id, tasks.data(), 2, &bthread::TASK_OPTIONS_URGENT));
+    expected_result += 1;
+    ASSERT_EQ(0, bthread::execution_queue_execute_batch(
+                  queue_id, tasks.data(), 0));
+    ASSERT_EQ(0, bthread::execution_queue_stop(queue_id));
+    ASSERT_NE(0, bthread::execution_queue_execute_batch(
+                  queue_id, tasks.data(), 1));
+    ASSERT_EQ(0, bthread::execution_queue_join(queue_id));
+    ASSERT_EQ(expected_result, result);
+    ASSERT_TRUE(stopped);
+}
+
+struct PartialConsumer {
+    std::vector<long> values;
+    int ncalls;
+    PartialConsumer() : ncalls(0) {}
+};
+
+int consume_three_at_most(void* meta, bthread::TaskIterator<LongIntTask>& iter) {
+    if (iter.is_queue_stopped()) {
+        return 0;
+    }
+    PartialConsumer* pc = (PartialConsumer*)meta;
+    ++pc->ncalls;
+    for (int i = 0; iter; ++iter) {
+        pc->values.push_back(iter->value);
+        if (iter->event) { iter->event->signal(); }
+        if (++i == 3) {
+            // Return in the middle of the batch, the current task is
+            // consumed.
+            break;
+        }
+    }
+    return 0;
+}
+
+TEST_F(ExecutionQueueTest, return_in_the_middle_of_batch) {
+    const bthread::TaskOptions* task_options[] =
+        { NULL, &bthread::TASK_OPTIONS_URGENT };
+    for (size_t k = 0; k < ARRAY_SIZE(task_options); ++k) {
+        PartialConsumer pc;
+        bthread::ExecutionQueueId<LongIntTask> queue_id = { 0 };
+        bthread::ExecutionQueueOptions options;
+        ASSERT_EQ(0, bthread::execution_queue_start(&queue_id, &options,
+                                                    consume_three_at_most,
+                                                    &pc));
+        std::vector<LongIntTask> tasks;
+        for (long i = 0; i < 10; ++i) {
+            tasks.push_back(LongIntTask(i));
+        }
+        ASSERT_EQ(0, bthread::execution_queue_execute_batch(
+                      queue_id, tasks.data(), tasks.size(), task_options[k]));
+        // Executed after the batch by the same consumer.
+        bthread::CountdownEvent event;
+        ASSERT_EQ(0, bthread::execution_queue_execute(
+                      queue_id, LongIntTask(10, &event)));
+        event.wait();
+        {
+            bthread::ExecutionQueue<LongIntTask>::scoped_ptr_t ptr =
+                bthread::execution_queue_address(queue_id);
+            ASSERT_TRUE(ptr != NULL);
+            // The urgent batch is counted once though it's executed in
+            // several calls.
+            ASSERT_EQ(0, ptr->_high_priority_tasks.load());
+        }
+        ASSERT_EQ(0, bthread::execution_queue_stop(queue_id));
+        ASSERT_EQ(0, bthread::execution_queue_join(queue_id));
+        ASSERT_EQ(11u, pc.values.size());
+        for (size_t i = 0; i < pc.values.size(); ++i) {
+            ASSERT_EQ((long)i, pc.values[i]);
+        }
+        ASSERT_LE(4, pc.ncalls);
+    }
+}
+
+void* push_batches(void* arg) {
+    PushArg* pa = (PushArg*)arg;
+    int64_t sum = 0;
+    butil::Timer timer;
+    timer.start();
+    int num = 0;
+    LongIntTask tasks[16];
+    for (;;) {
+        for (size_t i = 0; i < ARRAY_SIZE(tasks); ++i) {
+            tasks[i].value = num + i;
+        }
+        if (bthread::execution_queue_execute_batch(
+                pa->id, tasks, ARRAY_SIZE(tasks)) != 0) {
+            break;
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(tasks); ++i) {
+            sum += num++;
+        }
+    }
+    timer.stop();
+    pa->expected_value.fetch_add(sum, butil::memory_order_relaxed);
+    pa->total_num.fetch_add(num);
+    pa->total_time.fetch_add(timer.n_elapsed());
+    return NULL;
+}
+
+TEST_F(ExecutionQueueTest, batch_performance) {
+    pthread_t threads[8];
+    bthread::ExecutionQueueId<LongIntTask> queue_id = { 0 };
+    bthread::ExecutionQueueOptions options;
+    int64_t result = 0;
+    ASSERT_EQ(0, bthread::execution_queue_start(&queue_id, &options,
+                                                add, &result));
+    PushArg pa;
+    pa.id = queue_id;
+    for (size_t i = 0; i < ARRAY_SIZE(threads); ++i) {
+        pthread_create(&threads[i], NULL, &push_batches, &pa);
+    }
+    usleep(500 * 1000);
+    ASSERT_EQ(0, bthread::execution_queue_stop(queue_id));
+    for (size_t i = 0; i < ARRAY_SIZE(threads); ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    ASSERT_EQ(0, bthread::execution_queue_join(queue_id));
+    ASSERT_EQ(pa.expected_value.load(), result);
+    LOG(INFO) << "In batches of 16, each task takes "
+              << pa.total_time.load() / pa.total_num.load()
+              << " ns total_num=" << pa.total_num
+              << " with " << ARRAY_SIZE(threads) << " threads";
+}
+
 TEST_F(ExecutionQueueTest, size_of_task_node) {
     LOG(INFO) << "sizeof(TaskNode)=" << sizeof(bthread::TaskNode);
 }
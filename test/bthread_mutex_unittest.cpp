@@ -15,7 +15,9 @@
 // specific language governing permissions and limitations
 // under the License.
 
+#include <unistd.h>
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include "butil/compat.h"
 #include "butil/time.h"
 #include "butil/macros.h"
@@ -27,6 +29,10 @@
 #include "bthread/mutex.h"
 #include "butil/gperftools_profiler.h"
 
+namespace bthread {
+DECLARE_int32(bthread_butex_max_spin);
+}
+
 namespace {
 inline unsigned* get_butex(bthread_mutex_t & m) {
     return m.butex;
@@ -229,6 +235,60 @@ TEST(MutexTest, performance) {
     PerfTest(&bth_mutex, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
 }
 
+struct SpinArgs {
+    bthread::Mutex* mutex;
+    int64_t* shared_counter;
+    int nloop;
+};
+
+void* add_shared_counter(void* void_arg) {
+    SpinArgs* args = (SpinArgs*)void_arg;
+    for (int i = 0; i < args->nloop; ++i) {
+        BAIDU_SCOPED_LOCK(*args->mutex);
+        ++*args->shared_counter;
+    }
+    return NULL;
+}
+
+TEST(MutexTest, spin_before_park) {
+    const int32_t saved_max_spin = bthread::FLAGS_bthread_butex_max_spin;
+    int* butex = bthread::butex_create_checked<int>();
+    *butex = 1;
+    bthread::FLAGS_bthread_butex_max_spin = 0;
+    ASSERT_FALSE(bthread::butex_spin_wait(butex, 2));
+    bthread::FLAGS_bthread_butex_max_spin = 1000;
+    // Value never changes.
+    ASSERT_FALSE(bthread::butex_spin_wait(butex, 1));
+    // Spinning is skipped on single-cpu machines.
+    ASSERT_EQ(sysconf(_SC_NPROCESSORS_ONLN) > 1,
+              bthread::butex_spin_wait(butex, 2));
+    bthread::butex_destroy(butex);
+
+    const int max_spins[] = { 0, 1000 };
+    for (size_t k = 0; k < ARRAY_SIZE(max_spins); ++k) {
+        bthread::FLAGS_bthread_butex_max_spin = max_spins[k];
+        bthread::Mutex m;
+        int64_t counter = 0;
+        const int N = 8;
+        SpinArgs args = { &m, &counter, 100000 };
+        bthread_t th[N];
+        butil::Timer tm;
+        tm.start();
+        for (int i = 0; i < N; ++i) {
+            ASSERT_EQ(0, bthread_start_background(
+                          &th[i], NULL, add_shared_counter, &args));
+        }
+        for (int i = 0; i < N; ++i) {
+            ASSERT_EQ(0, bthread_join(th[i], NULL));
+        }
+        tm.stop();
+        ASSERT_EQ(N * args.nloop, counter);
+        LOG(INFO) << "max_spin=" << max_spins[k] << " average_time="
+                  << tm.n_elapsed() / (double)counter << "ns";
+    }
+    bthread::FLAGS_bthread_butex_max_spin = saved_max_spin;
+}
+
 void* loop_until_stopped(void* arg) {
     bthread::Mutex *m = (bthread::Mutex*)arg;
     while (!g_stopped) {
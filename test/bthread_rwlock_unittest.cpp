@@ -19,9 +19,12 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <signal.h>
+#include <vector>
 #include <gtest/gtest.h>
 #include "butil/time.h"
 #include "butil/macros.h"
+#include "bthread/bthread.h"
+#include "bthread/rwlock.h"
 
 namespace {
 void* read_thread(void* arg) {
@@ -76,4 +79,303 @@ TEST(RWLockTest, rdlock_performance) {
     pthread_mutex_destroy(&lock1);
 #endif
 }
+
+void* bthread_read_thread(void* arg) {
+    const size_t N = 10000;
+    bthread_rwlock_t* lock = (bthread_rwlock_t*)arg;
+    const long t1 = butil::cpuwide_time_ns();
+    for (size_t i = 0; i < N; ++i) {
+        bthread_rwlock_rdlock(lock);
+        bthread_rwlock_unlock(lock);
+    }
+    const long t2 = butil::cpuwide_time_ns();
+    return new long((t2 - t1)/N);
+}
+
+TEST(RWLockTest, bthread_rdlock_performance) {
+    bthread_rwlock_t lock1;
+    ASSERT_EQ(0, bthread_rwlock_init(&lock1, NULL));
+    pthread_t rth[16];
+    for (size_t i = 0; i < ARRAY_SIZE(rth); ++i) {
+        ASSERT_EQ(0, pthread_create(&rth[i], NULL, bthread_read_thread, &lock1));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(rth); ++i) {
+        long* res = NULL;
+        pthread_join(rth[i], (void**)&res);
+        printf("read thread %lu = %ldns\n", i, *res);
+        delete res;
+    }
+    ASSERT_EQ(0, bthread_rwlock_destroy(&lock1));
+}
+
+TEST(RWLockTest, sanity) {
+    bthread_rwlock_t rw;
+    ASSERT_EQ(0, bthread_rwlock_init(&rw, NULL));
+    ASSERT_EQ(EPERM, bthread_rwlock_unlock(&rw));
+
+    ASSERT_EQ(0, bthread_rwlock_rdlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_tryrdlock(&rw));
+    ASSERT_EQ(EBUSY, bthread_rwlock_trywrlock(&rw));
+    timespec abstime = butil::milliseconds_from_now(10);
+    ASSERT_EQ(ETIMEDOUT, bthread_rwlock_timedwrlock(&rw, &abstime));
+    // The timedout writer should not block readers.
+    ASSERT_EQ(0, bthread_rwlock_tryrdlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+
+    ASSERT_EQ(0, bthread_rwlock_wrlock(&rw));
+    ASSERT_EQ(EBUSY, bthread_rwlock_tryrdlock(&rw));
+    ASSERT_EQ(EBUSY, bthread_rwlock_trywrlock(&rw));
+    abstime = butil::milliseconds_from_now(10);
+    ASSERT_EQ(ETIMEDOUT, bthread_rwlock_timedrdlock(&rw, &abstime));
+    abstime = butil::milliseconds_from_now(10);
+    ASSERT_EQ(ETIMEDOUT, bthread_rwlock_timedwrlock(&rw, &abstime));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+    ASSERT_EQ(EPERM, bthread_rwlock_unlock(&rw));
+
+    ASSERT_EQ(0, bthread_rwlock_trywrlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+    ASSERT_EQ(0U, rw.state);
+    ASSERT_EQ(0, bthread_rwlock_destroy(&rw));
+
+    bthread_rwlockattr_t attr;
+    ASSERT_EQ(0, bthread_rwlockattr_init(&attr));
+    int pref = -1;
+    ASSERT_EQ(0, bthread_rwlockattr_getkind_np(&attr, &pref));
+    ASSERT_EQ(BTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP, pref);
+    ASSERT_EQ(0, bthread_rwlockattr_setkind_np(&attr, pref));
+    ASSERT_EQ(ENOTSUP, bthread_rwlockattr_setkind_np(&attr, pref + 1));
+    ASSERT_EQ(0, bthread_rwlockattr_destroy(&attr));
+}
+
+struct OrderArg {
+    bthread_rwlock_t* rw;
+    bool write;
+    butil::atomic<int>* order;
+    int my_order;
+};
+
+static void* lock_and_record_order(void* void_arg) {
+    OrderArg* arg = (OrderArg*)void_arg;
+    if (arg->write) {
+        EXPECT_EQ(0, bthread_rwlock_wrlock(arg->rw));
+    } else {
+        EXPECT_EQ(0, bthread_rwlock_rdlock(arg->rw));
+    }
+    arg->my_order = arg->order->fetch_add(1);
+    bthread_usleep(10000);
+    EXPECT_EQ(0, bthread_rwlock_unlock(arg->rw));
+    return NULL;
+}
+
+static uint64_t state_of(bthread_rwlock_t* rw) {
+    return ((butil::atomic<uint64_t>*)&rw->state)->load();
+}
+
+TEST(RWLockTest, writer_preferred_and_readers_not_starved) {
+    bthread_rwlock_t rw;
+    ASSERT_EQ(0, bthread_rwlock_init(&rw, NULL));
+    butil::atomic<int> order(0);
+    ASSERT_EQ(0, bthread_rwlock_rdlock(&rw));
+
+    OrderArg w1 = { &rw, true, &order, -1 };
+    bthread_t th_w1;
+    ASSERT_EQ(0, bthread_start_urgent(&th_w1, NULL, lock_and_record_order, &w1));
+    while (!(state_of(&rw) >> 62)) {
+        bthread_usleep(1000);
+    }
+    // New readers wait for the waiting writer.
+    ASSERT_EQ(EBUSY, bthread_rwlock_tryrdlock(&rw));
+    OrderArg r1 = { &rw, false, &order, -1 };
+    bthread_t th_r1;
+    ASSERT_EQ(0, bthread_start_urgent(&th_r1, NULL, lock_and_record_order, &r1));
+    bthread_usleep(10000);
+    // Writer waiting after r1 should not get the lock before r1.
+    OrderArg w2 = { &rw, true, &order, -1 };
+    bthread_t th_w2;
+    ASSERT_EQ(0, bthread_start_urgent(&th_w2, NULL, lock_and_record_order, &w2));
+    bthread_usleep(10000);
+    ASSERT_EQ(0, order.load());
+
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+    bthread_join(th_w1, NULL);
+    bthread_join(th_r1, NULL);
+    bthread_join(th_w2, NULL);
+    ASSERT_EQ(0, w1.my_order);
+    ASSERT_EQ(1, r1.my_order);
+    ASSERT_EQ(2, w2.my_order);
+    // All counters are zero, the generation may be not.
+    ASSERT_EQ(0U, rw.state & ((1ULL << 46) - 1));
+    ASSERT_EQ(0, bthread_rwlock_destroy(&rw));
+}
+
+static uint64_t waiting_readers(const bthread_rwlock_t& rw) {
+    return (*(volatile uint64_t*)&rw.state >> 23) & ((1ULL << 23) - 1);
+}
+
+static bool writer_waiting(const bthread_rwlock_t& rw) {
+    return *(volatile uint64_t*)&rw.state & (1ULL << 62);
+}
+
+struct TimedArg {
+    bthread_rwlock_t* rw;
+    int64_t timeout_us;
+    int rc;
+};
+
+static void* timed_wrlock(void* void_arg) {
+    TimedArg* arg = (TimedArg*)void_arg;
+    const timespec abstime = butil::microseconds_from_now(arg->timeout_us);
+    arg->rc = bthread_rwlock_timedwrlock(arg->rw, &abstime);
+    if (arg->rc == 0) {
+        bthread_rwlock_unlock(arg->rw);
+    }
+    return NULL;
+}
+
+static void* timed_rdlock(void* void_arg) {
+    TimedArg* arg = (TimedArg*)void_arg;
+    const timespec abstime = butil::microseconds_from_now(arg->timeout_us);
+    arg->rc = bthread_rwlock_timedrdlock(arg->rw, &abstime);
+    if (arg->rc == 0) {
+        bthread_rwlock_unlock(arg->rw);
+    }
+    return NULL;
+}
+
+static butil::atomic<int> nspinning(0);
+static butil::atomic<bool> stop_spinning(false);
+
+static void* spin(void*) {
+    nspinning.fetch_add(1);
+    while (!stop_spinning.load()) {}
+    return NULL;
+}
+
+TEST(RWLockTest, reader_handed_over_twice_before_running) {
+    bthread_rwlock_t rw;
+    ASSERT_EQ(0, bthread_rwlock_init(&rw, NULL));
+    ASSERT_EQ(0, bthread_rwlock_rdlock(&rw));
+
+    // A bthread reader blocked by a writer in pthread.
+    TimedArg w1 = { &rw, 200000, -1 };
+    pthread_t w1_th;
+    ASSERT_EQ(0, pthread_create(&w1_th, NULL, timed_wrlock, &w1));
+    while (!writer_waiting(rw)) {
+        usleep(1000);
+    }
+    TimedArg r1 = { &rw, 2000000, -1 };
+    bthread_t r1_th;
+    ASSERT_EQ(0, bthread_start_background(&r1_th, NULL, timed_rdlock, &r1));
+    while (waiting_readers(rw) != 1) {
+        usleep(1000);
+    }
+    // Occupy all workers so that r1 can't run after it's handed the lock.
+    const int nworker = bthread_getconcurrency();
+    nspinning.store(0);
+    stop_spinning.store(false);
+    std::vector<bthread_t> spinners(nworker);
+    for (int i = 0; i < nworker; ++i) {
+        ASSERT_EQ(0, bthread_start_background(&spinners[i], NULL, spin, NULL));
+    }
+    while (nspinning.load() < nworker) {
+        usleep(1000);
+    }
+    // w1 times out and hands the lock over to r1.
+    ASSERT_EQ(0, pthread_join(w1_th, NULL));
+    ASSERT_EQ(ETIMEDOUT, w1.rc);
+    ASSERT_EQ(0u, waiting_readers(rw));
+
+    // Another writer times out and hands the lock over to another reader,
+    // r1 is still not run.
+    TimedArg w2 = { &rw, 100000, -1 };
+    pthread_t w2_th;
+    ASSERT_EQ(0, pthread_create(&w2_th, NULL, timed_wrlock, &w2));
+    while (!writer_waiting(rw)) {
+        usleep(1000);
+    }
+    TimedArg r2 = { &rw, 2000000, -1 };
+    pthread_t r2_th;
+    ASSERT_EQ(0, pthread_create(&r2_th, NULL, timed_rdlock, &r2));
+    ASSERT_EQ(0, pthread_join(w2_th, NULL));
+    ASSERT_EQ(ETIMEDOUT, w2.rc);
+    ASSERT_EQ(0, pthread_join(r2_th, NULL));
+    ASSERT_EQ(0, r2.rc);
+
+    // r1 must know that it holds the lock.
+    stop_spinning.store(true);
+    for (int i = 0; i < nworker; ++i) {
+        ASSERT_EQ(0, bthread_join(spinners[i], NULL));
+    }
+    ASSERT_EQ(0, bthread_join(r1_th, NULL));
+    ASSERT_EQ(0, r1.rc);
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+    // All counters are zero, the generation may be not.
+    ASSERT_EQ(0U, rw.state & ((1ULL << 46) - 1));
+    ASSERT_EQ(0, bthread_rwlock_destroy(&rw));
+}
+
+struct StressArg {
+    bthread::RWLock* rw;
+    int64_t* x;
+    int64_t* y;
+    butil::atomic<bool>* stop;
+    int64_t nwrite;
+    int64_t nread;
+};
+
+static void* rw_stress(void* void_arg) {
+    StressArg* arg = (StressArg*)void_arg;
+    int i = 0;
+    while (!arg->stop->load(butil::memory_order_relaxed)) {
+        if (++i % 10 == 0) {
+            std::unique_lock<bthread::RWLock> lck(*arg->rw);
+            ++*arg->x;
+            ++*arg->y;
+            ++arg->nwrite;
+        } else {
+            arg->rw->lock_shared();
+            EXPECT_EQ(*arg->x, *arg->y);
+            arg->rw->unlock_shared();
+            ++arg->nread;
+        }
+    }
+    return NULL;
+}
+
+TEST(RWLockTest, mix_thread_types) {
+    bthread::RWLock rw;
+    int64_t x = 0;
+    int64_t y = 0;
+    butil::atomic<bool> stop(false);
+    const int N = 16;
+    StressArg args[N * 2];
+    pthread_t pth[N];
+    bthread_t bth[N];
+    for (int i = 0; i < N * 2; ++i) {
+        StressArg a = { &rw, &x, &y, &stop, 0, 0 };
+        args[i] = a;
+    }
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, pthread_create(&pth[i], NULL, rw_stress, &args[i]));
+        ASSERT_EQ(0, bthread_start_background(&bth[i], NULL, rw_stress,
+                                              &args[N + i]));
+    }
+    usleep(500000);
+    stop.store(true);
+    int64_t nwrite = 0;
+    int64_t nread = 0;
+    for (int i = 0; i < N; ++i) {
+        pthread_join(pth[i], NULL);
+        bthread_join(bth[i], NULL);
+    }
+    for (int i = 0; i < N * 2; ++i) {
+        nwrite += args[i].nwrite;
+        nread += args[i].nread;
+    }
+    printf("nwrite=%" PRId64 " nread=%" PRId64 "\n", nwrite, nread);
+    ASSERT_EQ(nwrite, x);
+    ASSERT_EQ(nwrite, y);
+}
 } // namespace
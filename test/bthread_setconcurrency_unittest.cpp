@@ -191,4 +191,15 @@ TEST(BthreadTest, min_concurrency) {
     ASSERT_EQ(conn + add_conn, bthread::g_task_control->concurrency());
 }
 
+TEST(BthreadTest, parse_cpu_list) {
+    std::vector<int> cpus;
+    ASSERT_EQ(0, bthread::parse_cpu_list("0-3,8,10-11\n", &cpus));
+    const int expected[] = { 0, 1, 2, 3, 8, 10, 11 };
+    ASSERT_EQ(std::vector<int>(expected, expected + ARRAY_SIZE(expected)), cpus);
+    ASSERT_EQ(0, bthread::parse_cpu_list("\n", &cpus));
+    ASSERT_TRUE(cpus.empty());
+    ASSERT_EQ(-1, bthread::parse_cpu_list("3-1", &cpus));
+    ASSERT_EQ(-1, bthread::parse_cpu_list("0;1", &cpus));
+}
+
 } // namespace
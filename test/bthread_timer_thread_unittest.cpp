@@ -20,6 +20,7 @@
 #include "bthread/sys_futex.h"
 #include "bthread/timer_thread.h"
 #include "bthread/bthread.h"
+#include "butil/fast_rand.h"
 #include "butil/logging.h"
 
 namespace {
@@ -254,4 +255,164 @@ TEST(TimerThreadTest, schedule_and_unschedule_in_task) {
     keeper5.expect_first_run();
 }
 
+struct WheelTask {
+    int64_t expected_us;
+    int64_t run_us;
+    bool unscheduled;
+    bthread::TimerThread::TaskId task_id;
+};
+
+static void record_run_time(void* arg) {
+    WheelTask* t = (WheelTask*)arg;
+    t->run_us = butil::gettimeofday_us();
+}
+
+TEST(TimerThreadTest, timing_wheel) {
+    bthread::TimerThread timer_thread;
+    bthread::TimerThreadOptions options;
+    options.use_timing_wheel = true;
+    ASSERT_EQ(0, timer_thread.start(&options));
+
+    // Delays covering the first 2 levels of the wheel and the past. Level 0
+    // and 1 span 64ms and 4.096s, tasks reach level 2 only when their ticks
+    // cross a multiple of 4.096s, which happens in about a third of runs.
+    const size_t N = 10000;
+    std::vector<WheelTask> tasks(N);
+    for (size_t i = 0; i < N; ++i) {
+        WheelTask& t = tasks[i];
+        const int64_t delay_us = (i == 0 ? -1000000 :
+                                  (int64_t)butil::fast_rand_less_than(1500000));
+        t.expected_us = butil::gettimeofday_us() + delay_us;
+        t.run_us = 0;
+        t.unscheduled = false;
+        t.task_id = timer_thread.schedule(
+            record_run_time, &t, butil::microseconds_to_timespec(t.expected_us));
+        ASSERT_NE(bthread::TimerThread::INVALID_TASK_ID, t.task_id);
+    }
+    usleep(10000);
+    for (size_t i = 1; i < N; i += 3) {
+        tasks[i].unscheduled =
+            (timer_thread.unschedule(tasks[i].task_id) == 0);
+    }
+    // Too far from now to be in the wheel, should not run.
+    timespec future_time = { std::numeric_limits<int>::max(), 0 };
+    TimeKeeper keeper(future_time, "keeper");
+    keeper.schedule(&timer_thread);
+
+    usleep(2000000);
+    timer_thread.stop_and_join();
+    keeper.expect_not_run();
+    int64_t max_delay_us = 0;
+    for (size_t i = 0; i < N; ++i) {
+        const WheelTask& t = tasks[i];
+        if (t.unscheduled) {
+            ASSERT_EQ(0, t.run_us) << "i=" << i;
+            continue;
+        }
+        ASSERT_NE(0, t.run_us) << "i=" << i;
+        if (i != 0) {
+            ASSERT_GE(t.run_us, t.expected_us) << "i=" << i;
+            max_delay_us = std::max(max_delay_us, t.run_us - t.expected_us);
+        }
+    }
+    LOG(INFO) << "max_delay=" << max_delay_us << "us";
+    ASSERT_LT(max_delay_us, 50000);
+}
+
+struct PerfArgs {
+    bthread::TimerThread* timer_thread;
+    size_t ntimers;
+};
+
+static void do_nothing(void*) {}
+
+// Schedule timers like RPC timeouts: most of them are unscheduled soon.
+static void* schedule_and_unschedule(void* void_arg) {
+    PerfArgs* args = (PerfArgs*)void_arg;
+    std::vector<bthread::TimerThread::TaskId> ids;
+    ids.reserve(64);
+    for (size_t i = 0; i < args->ntimers; ++i) {
+        const int64_t delay_us = 1000 + butil::fast_rand_less_than(1000000);
+        ids.push_back(args->timer_thread->schedule(
+                          do_nothing, NULL,
+                          butil::microseconds_from_now(delay_us)));
+        if (ids.size() == 64) {
+            for (size_t j = 0; j < ids.size() - 1; ++j) {
+                args->timer_thread->unschedule(ids[j]);
+            }
+            ids.clear();
+        }
+    }
+    return NULL;
+}
+
+// CPU time consumed by thread `th'.
+static int64_t thread_cpu_time_us(pthread_t th) {
+    clockid_t cid;
+    timespec ts;
+    if (pthread_getcpuclockid(th, &cid) != 0 ||
+        clock_gettime(cid, &ts) != 0) {
+        return -1;
+    }
+    return butil::timespec_to_microseconds(ts);
+}
+
+TEST(TimerThreadTest, schedule_unschedule_perf) {
+    const size_t NTHREAD = 4;
+    const size_t NTIMER = 1000000;
+    const size_t NPROBE = 1000;
+    for (int use_timing_wheel = 0; use_timing_wheel < 2; ++use_timing_wheel) {
+        bthread::TimerThread timer_thread;
+        bthread::TimerThreadOptions options;
+        options.use_timing_wheel = use_timing_wheel;
+        ASSERT_EQ(0, timer_thread.start(&options));
+        const int64_t cpu_start_us = thread_cpu_time_us(timer_thread.thread_id());
+        ASSERT_GE(cpu_start_us, 0);
+        PerfArgs args = { &timer_thread, NTIMER / NTHREAD };
+        pthread_t th[NTHREAD];
+        butil::Timer tm;
+        tm.start();
+        for (size_t i = 0; i < NTHREAD; ++i) {
+            ASSERT_EQ(0, pthread_create(&th[i], NULL,
+                                        schedule_and_unschedule, &args));
+        }
+        // Measure how late timers fire while the timer thread is loaded, which
+        // is mostly decided by how many tasks are pulled from buckets at once.
+        std::vector<WheelTask> probes(NPROBE);
+        for (size_t i = 0; i < NPROBE; ++i) {
+            WheelTask& t = probes[i];
+            t.expected_us = butil::gettimeofday_us() + 1000 +
+                butil::fast_rand_less_than(100000);
+            t.run_us = 0;
+            t.task_id = timer_thread.schedule(
+                record_run_time, &t,
+                butil::microseconds_to_timespec(t.expected_us));
+            ASSERT_NE(bthread::TimerThread::INVALID_TASK_ID, t.task_id);
+            usleep(100);
+        }
+        for (size_t i = 0; i < NTHREAD; ++i) {
+            pthread_join(th[i], NULL);
+        }
+        tm.stop();
+        // Timers left by producers fire within 1 second.
+        usleep(1100000);
+        const int64_t cpu_us =
+            thread_cpu_time_us(timer_thread.thread_id()) - cpu_start_us;
+        timer_thread.stop_and_join();
+        int64_t sum_late_us = 0;
+        int64_t max_late_us = 0;
+        for (size_t i = 0; i < NPROBE; ++i) {
+            const WheelTask& t = probes[i];
+            ASSERT_NE(0, t.run_us) << "i=" << i;
+            sum_late_us += t.run_us - t.expected_us;
+            max_late_us = std::max(max_late_us, t.run_us - t.expected_us);
+        }
+        LOG(INFO) << (use_timing_wheel ? "timing_wheel" : "heap")
+                  << ": " << NTIMER * 1000000L / tm.u_elapsed()
+                  << " schedule/s, timer thread cpu=" << cpu_us / 1000
+                  << "ms, lateness avg=" << sum_late_us / (int64_t)NPROBE
+                  << "us max=" << max_late_us << "us";
+    }
+}
+
 } // end namespace
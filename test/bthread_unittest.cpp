@@ -16,6 +16,7 @@
 // under the License.
 
 #include <execinfo.h>
+#include <sys/mman.h>                      // mincore
 #include <gtest/gtest.h>
 #include "butil/time.h"
 #include "butil/macros.h"
@@ -25,6 +26,9 @@
 #include "bthread/bthread.h"
 #include "bthread/unstable.h"
 #include "bthread/task_meta.h"
+#include "bthread/processor.h"
+
+DECLARE_int32(stack_high_water_window_s);
 
 namespace {
 class BthreadTest : public ::testing::Test{
@@ -531,4 +535,229 @@ TEST_F(BthreadTest, yield_single_thread) {
     ASSERT_EQ(0, bthread_join(tid, NULL));
 }
 
+void* record_seq(void* arg) {
+    static butil::static_atomic<int> seq = BUTIL_STATIC_ATOMIC_INIT(0);
+    *(int*)arg = seq.fetch_add(1, butil::memory_order_relaxed);
+    return NULL;
+}
+
+void* set_high_priority(void*) {
+    EXPECT_EQ(0, bthread_set_high_priority(1));
+    EXPECT_EQ(1, bthread_set_high_priority(0));
+    return NULL;
+}
+
+struct HighPriorityArg {
+    butil::atomic<int> nspinning;
+    butil::atomic<bool> released;
+    static const size_t N = 16;
+    // seq[N] is of the high-priority task.
+    int seq[N + 1];
+};
+
+void* spin_until_released(void* arg) {
+    HighPriorityArg* a = (HighPriorityArg*)arg;
+    a->nspinning.fetch_add(1);
+    while (!a->released.load()) {
+        cpu_relax();
+    }
+    return NULL;
+}
+
+void* record_seq_and_release(void* arg) {
+    HighPriorityArg* a = (HighPriorityArg*)arg;
+    record_seq(&a->seq[HighPriorityArg::N]);
+    a->released.store(true);
+    return NULL;
+}
+
+void* queue_tasks_of_both_priorities(void* arg) {
+    HighPriorityArg* a = (HighPriorityArg*)arg;
+    bthread_t th;
+    // Other workers are spinning, the tasks are queued in the worker running
+    // this bthread and not run until this bthread quits.
+    for (size_t i = 0; i < HighPriorityArg::N; ++i) {
+        EXPECT_EQ(0, bthread_start_background(
+                      &th, NULL, record_seq, &a->seq[i]));
+    }
+    const bthread_attr_t high_attr = BTHREAD_ATTR_NORMAL | BTHREAD_HIGH_PRIORITY;
+    EXPECT_EQ(0, bthread_start_background(
+                  &th, &high_attr, record_seq_and_release, a));
+    return NULL;
+}
+
+TEST_F(BthreadTest, high_priority) {
+    ASSERT_EQ(-1, bthread_set_high_priority(1));
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, set_high_priority, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+
+    // Occupy all workers but one so that the order of running is
+    // deterministic. Spinners are released by the high-priority task.
+    HighPriorityArg arg;
+    arg.nspinning.store(0);
+    arg.released.store(false);
+    for (size_t i = 0; i <= HighPriorityArg::N; ++i) {
+        arg.seq[i] = -1;
+    }
+    const int nspinner = bthread_getconcurrency() - 1;
+    std::vector<bthread_t> spinners(nspinner);
+    for (int i = 0; i < nspinner; ++i) {
+        ASSERT_EQ(0, bthread_start_background(
+                      &spinners[i], NULL, spin_until_released, &arg));
+    }
+    while (arg.nspinning.load() != nspinner) {
+        usleep(1000);
+    }
+    ASSERT_EQ(0, bthread_start_background(
+                  &th, NULL, queue_tasks_of_both_priorities, &arg));
+    for (int i = 0; i < nspinner; ++i) {
+        ASSERT_EQ(0, bthread_join(spinners[i], NULL));
+    }
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    for (size_t i = 0; i <= HighPriorityArg::N; ++i) {
+        while (*(volatile int*)&arg.seq[i] < 0) {
+            usleep(1000);
+        }
+    }
+    // The high-priority task queued last runs first.
+    for (size_t i = 0; i < HighPriorityArg::N; ++i) {
+        ASSERT_LT(arg.seq[HighPriorityArg::N], arg.seq[i]);
+    }
+}
+
+void* use_deep_stack(void* arg) {
+    const size_t size = (size_t)arg;
+    char* buf = (char*)alloca(size);
+    memset(buf, 1, size);
+    // Prevent the buffer from being optimized out.
+    EXPECT_EQ(1, *(volatile char*)&buf[size / 2]);
+    return NULL;
+}
+
+static size_t count_resident(const bthread::StackStorage& st) {
+    const size_t pagesize = getpagesize();
+    std::vector<unsigned char> vec(st.stacksize / pagesize);
+    char* top = (char*)st.bottom - st.stacksize;
+    EXPECT_EQ(0, mincore(top, st.stacksize, &vec[0]));
+    size_t n = 0;
+    for (size_t i = 0; i < vec.size(); ++i) {
+        n += (vec[i] & 1);
+    }
+    return n * pagesize;
+}
+
+TEST_F(BthreadTest, stack_usage_sampling_and_trim) {
+    const int saved_interval = FLAGS_stack_usage_sampling_interval;
+    FLAGS_stack_usage_sampling_interval = 1;
+    const size_t DEPTH = 200 * 1024;
+    for (int i = 0; i < 10; ++i) {
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_background(
+                      &th, NULL, use_deep_stack, (void*)DEPTH));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+    }
+    FLAGS_stack_usage_sampling_interval = saved_interval;
+    std::ostringstream os;
+    bthread::print_stack_usage(os);
+    LOG(INFO) << os.str();
+    const std::string usage = os.str();
+    std::ostringstream fn_os;
+    fn_os << (void*)use_deep_stack;
+    const size_t pos = usage.find(fn_os.str());
+    ASSERT_NE(std::string::npos, pos) << usage;
+    const size_t max_pos = usage.find("max=", pos);
+    ASSERT_NE(std::string::npos, max_pos);
+    const long max_usage = strtol(usage.c_str() + max_pos + 4, NULL, 10);
+    ASSERT_GE(max_usage, (long)DEPTH);
+    ASSERT_LT(max_usage, (long)DEPTH + 64 * 1024);
+
+    // Pages of a stack beyond the high-water mark are released.
+    bthread::ContextualStack* s =
+        bthread::get_stack(bthread::STACK_TYPE_NORMAL, NULL);
+    ASSERT_TRUE(s != NULL);
+    const bthread::StackStorage& st = s->storage;
+    ASSERT_GT(st.stacksize, (int)DEPTH * 2);
+    memset((char*)st.bottom - st.stacksize, 0, st.stacksize - 64 * 1024);
+    ASSERT_GE(count_resident(st), (size_t)st.stacksize - 64 * 1024);
+    bthread::trim_stack(s);
+    ASSERT_GT(st.keep_size, 0);
+    ASSERT_LE(count_resident(st), (size_t)max_usage + 2 * getpagesize());
+    bthread::return_stack(s);
+}
+
+static long normal_stack_high_water() {
+    std::ostringstream os;
+    bthread::print_stack_usage(os);
+    const std::string usage = os.str();
+    const size_t pos = usage.find("normal=");
+    EXPECT_NE(std::string::npos, pos) << usage;
+    return strtol(usage.c_str() + pos + 7, NULL, 10);
+}
+
+TEST_F(BthreadTest, stack_high_water_decays) {
+    const int saved_interval = FLAGS_stack_usage_sampling_interval;
+    const int saved_window = FLAGS_stack_high_water_window_s;
+    FLAGS_stack_usage_sampling_interval = 1;
+    FLAGS_stack_high_water_window_s = 1;
+    const size_t DEPTH = 200 * 1024;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(
+                  &th, NULL, use_deep_stack, (void*)DEPTH));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_GE(normal_stack_high_water(), (long)DEPTH);
+    // The deep usage is forgotten after 2 windows.
+    usleep(2100000);
+    ASSERT_EQ(0, bthread_start_background(
+                  &th, NULL, use_deep_stack, (void*)(16 * 1024)));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_LT(normal_stack_high_water(), (long)DEPTH);
+    FLAGS_stack_usage_sampling_interval = saved_interval;
+    FLAGS_stack_high_water_window_s = saved_window;
+}
+
+static bthread_fcontext_t s_main_context = NULL;
+static bool s_trimmed_stack_resumed = false;
+
+static void resume_trimmed_stack(intptr_t) {
+    s_trimmed_stack_resumed = true;
+    bthread_fcontext_t ctx;
+    bthread_jump_fcontext(&ctx, s_main_context, 0);
+}
+
+TEST_F(BthreadTest, trim_stack_with_page_aligned_context) {
+    // Sample the high-water mark.
+    const int saved_interval = FLAGS_stack_usage_sampling_interval;
+    FLAGS_stack_usage_sampling_interval = 1;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(
+                  &th, NULL, use_deep_stack, (void*)(16 * 1024)));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    FLAGS_stack_usage_sampling_interval = saved_interval;
+
+    bthread::ContextualStack* s =
+        bthread::get_stack(bthread::STACK_TYPE_NORMAL, NULL);
+    ASSERT_TRUE(s != NULL);
+    const bthread::StackStorage& st = s->storage;
+    const uintptr_t pagesize = getpagesize();
+    char* const bottom = (char*)st.bottom;
+    char* const top = bottom - st.stacksize;
+    // Move a context to exactly a page boundary far below the high-water
+    // mark, so that the context decides where the stack is trimmed.
+    char* const frame = (char*)bthread_make_fcontext(
+        bottom, st.stacksize, resume_trimmed_stack);
+    char* const aligned = (char*)(((uintptr_t)bottom - st.stacksize / 2) &
+                                  ~(pagesize - 1));
+    ASSERT_GT(aligned, top);
+    memcpy(aligned, frame, bottom - frame);
+    const bthread_fcontext_t saved_context = s->context;
+    s->context = aligned;
+    bthread::trim_stack(s);
+    ASSERT_GT(st.keep_size, bottom - (char*)s->context);
+    // The saved frame is intact and resumable.
+    bthread_jump_fcontext(&s_main_context, s->context, 0);
+    ASSERT_TRUE(s_trimmed_stack_resumed);
+    s->context = saved_context;
+    bthread::return_stack(s);
+}
 } // namespace
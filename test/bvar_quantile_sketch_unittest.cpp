@@ -0,0 +1,203 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include <gflags/gflags.h>
+#include "butil/base64.h"
+#include "butil/logging.h"
+#include "butil/time.h"
+#include "bvar/detail/quantile_sketch.h"
+#include "bvar/latency_recorder.h"
+#include <gtest/gtest.h>
+
+namespace bvar {
+DECLARE_bool(bvar_latency_use_sketch);
+}
+
+namespace {
+
+typedef bvar::detail::QuantileSketch<uint32_t> Sketch;
+
+// Exact `ratio'-ile of sorted values, picked in the same way as sketches.
+uint32_t exact_number(const std::vector<uint32_t>& sorted, double ratio) {
+    size_t n = (size_t)ceil(ratio * sorted.size());
+    if (n == 0) {
+        return 0;
+    }
+    return sorted[std::min(n, sorted.size()) - 1];
+}
+
+TEST(QuantileSketchTest, buckets) {
+    uint32_t last_index = 0;
+    for (uint32_t v = 0; v < 1000000; ++v) {
+        const uint32_t index = Sketch::bucket_index(v);
+        ASSERT_GE(index, last_index);
+        ASSERT_LT(index, Sketch::NUM_BUCKETS);
+        ASSERT_LE(Sketch::bucket_lower_bound(index), v);
+        ASSERT_GE(Sketch::bucket_upper_bound(index), v);
+        last_index = index;
+    }
+    const uint32_t max_index = Sketch::bucket_index(0xFFFFFFFF);
+    ASSERT_EQ(Sketch::NUM_BUCKETS - 1, max_index);
+    ASSERT_EQ(0xFFFFFFFFu, Sketch::bucket_upper_bound(max_index));
+    // Adjacent buckets have no gap.
+    for (uint32_t i = 1; i < Sketch::NUM_BUCKETS; ++i) {
+        ASSERT_EQ(Sketch::bucket_upper_bound(i - 1) + 1,
+                  Sketch::bucket_lower_bound(i)) << "i=" << i;
+    }
+}
+
+TEST(QuantileSketchTest, relative_error) {
+    srand(1234);
+    std::vector<uint32_t> values;
+    Sketch s;
+    for (int i = 0; i < 1000000; ++i) {
+        // Long-tailed, spanning several orders of magnitude.
+        const uint32_t v = (uint32_t)(100 * exp((rand() % 10000) / 1000.0));
+        values.push_back(v);
+        s.add(v);
+    }
+    std::sort(values.begin(), values.end());
+    ASSERT_EQ(values.size(), s.count());
+    const double ratios[] = { 0.1, 0.5, 0.9, 0.99, 0.999, 0.9999, 1.0 };
+    for (size_t i = 0; i < arraysize(ratios); ++i) {
+        const double exact = exact_number(values, ratios[i]);
+        const double approx = s.get_number(ratios[i]);
+        EXPECT_LE(fabs(approx - exact), exact / 128 + 1)
+            << "ratio=" << ratios[i] << " exact=" << exact
+            << " approx=" << approx;
+    }
+}
+
+TEST(QuantileSketchTest, merge_is_deterministic) {
+    Sketch parts[4];
+    Sketch all;
+    for (uint32_t i = 0; i < 100000; ++i) {
+        const uint32_t v = i * 7919 % 1000003;
+        parts[i % 4].add(v);
+        all.add(v);
+    }
+    bvar::detail::CombinedQuantileSketch m1;
+    bvar::detail::CombinedQuantileSketch m2;
+    for (int i = 0; i < 4; ++i) {
+        m1.merge(parts[i]);
+        m2.merge(parts[3 - i]);
+    }
+    ASSERT_EQ(all.count(), m1.count());
+    for (uint32_t i = 0; i < Sketch::NUM_BUCKETS; ++i) {
+        ASSERT_EQ(all.bucket_count(i), m1.bucket_count(i));
+        ASSERT_EQ(all.bucket_count(i), m2.bucket_count(i));
+    }
+    for (int i = 1; i <= 100; ++i) {
+        ASSERT_EQ(all.get_number(i / 100.0), m1.get_number(i / 100.0));
+    }
+}
+
+TEST(QuantileSketchTest, serialize_and_parse) {
+    Sketch s;
+    for (uint32_t i = 0; i < 10000; ++i) {
+        s.add(i * i);
+    }
+    s.add(0xFFFFFFFF);
+    std::string data;
+    s.serialize(&data);
+    LOG(INFO) << "Serialized " << s.count() << " values into "
+              << data.size() << " bytes";
+
+    bvar::detail::CombinedQuantileSketch s2;
+    ASSERT_TRUE(s2.parse(data));
+    ASSERT_TRUE(s2.parse(data));
+    ASSERT_EQ(s.count() * 2, s2.count());
+    for (uint32_t i = 0; i < Sketch::NUM_BUCKETS; ++i) {
+        ASSERT_EQ(s.bucket_count(i) * 2, s2.bucket_count(i));
+    }
+
+    Sketch empty;
+    std::string empty_data;
+    empty.serialize(&empty_data);
+    ASSERT_TRUE(empty_data.empty());
+    ASSERT_TRUE(s2.parse(empty_data));
+
+    bvar::detail::CombinedQuantileSketch s3;
+    ASSERT_FALSE(s3.parse(data.substr(0, data.size() - 1)));
+    ASSERT_FALSE(s3.parse(std::string("\xff\xff\xff\x7f\x01", 5)));
+}
+
+TEST(QuantileSketchTest, latency_recorder) {
+    bvar::FLAGS_bvar_latency_use_sketch = true;
+    bvar::LatencyRecorder rec("quantile_sketch_test", 3);
+    bvar::FLAGS_bvar_latency_use_sketch = false;
+    ASSERT_TRUE(rec.use_sketch());
+    ASSERT_EQ("quantile_sketch_test_latency_sketch", rec.latency_sketch_name());
+
+    // Let samplers take the first samples.
+    usleep(1100000);
+    for (int i = 1; i <= 10000; ++i) {
+        rec << i;
+    }
+    rec << -1;  // dropped
+    // Percentiles are computed from samples before the latest one.
+    usleep(2100000);
+
+    const int64_t p99 = rec.latency_percentile(0.99);
+    const int64_t p9999 = rec.latency_percentile(0.9999);
+    EXPECT_LE(labs(p99 - 9900), 9900 / 128 + 1) << p99;
+    EXPECT_LE(labs(p9999 - 9999), 9999 / 128 + 1) << p9999;
+    bvar::Vector<int64_t, 4> ps = rec.latency_percentiles();
+    EXPECT_EQ(p99, ps[2]);
+
+    // The exposed sketch is lossless.
+    const std::string encoded =
+        bvar::Variable::describe_exposed(rec.latency_sketch_name());
+    ASSERT_FALSE(encoded.empty());
+    std::string data;
+    ASSERT_TRUE(butil::Base64Decode(encoded, &data));
+    bvar::detail::CombinedQuantileSketch s;
+    ASSERT_TRUE(s.parse(data));
+    ASSERT_EQ(10000u, s.count());
+    EXPECT_EQ(p9999, (int64_t)s.get_number(0.9999));
+
+    bvar::LatencyRecorder rec2;
+    ASSERT_FALSE(rec2.use_sketch());
+    ASSERT_TRUE(bvar::Variable::describe_exposed("_latency_sketch").empty());
+}
+
+TEST(QuantileSketchTest, perf) {
+    bvar::detail::SketchPercentile sp;
+    bvar::detail::Percentile p;
+    const int N = 1000000;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        sp << (i & 0xFFFF);
+    }
+    tm.stop();
+    const int64_t sketch_ns = tm.n_elapsed() / N;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        p << (i & 0xFFFF);
+    }
+    tm.stop();
+    LOG(INFO) << "SketchPercentile takes " << sketch_ns
+              << "ns, Percentile takes " << tm.n_elapsed() / N << "ns";
+    ASSERT_EQ((uint64_t)N, sp.reset().count());
+}
+
+}  // namespace
@@ -342,4 +342,104 @@ TEST_F(ReducerTest, simple_window) {
     const int64_t v = w.get_value();
     ASSERT_EQ(100, v) << "v=" << v;
 }
+
+TEST_F(ReducerTest, striped_reducers) {
+    bvar::StripedAdder<int64_t> adder;
+    ASSERT_TRUE(adder.valid());
+    adder << -9 << 1 << 0 << 3;
+    ASSERT_EQ(-5, adder.get_value());
+    ASSERT_EQ(-5, adder.reset());
+    ASSERT_EQ(0, adder.get_value());
+
+    bvar::StripedMaxer<int> maxer;
+    ASSERT_EQ(std::numeric_limits<int>::min(), maxer.get_value());
+    maxer << 10 << 20 << -30;
+    ASSERT_EQ(20, maxer.get_value());
+    ASSERT_EQ(20, maxer.reset());
+    ASSERT_EQ(std::numeric_limits<int>::min(), maxer.get_value());
+
+    bvar::StripedMiner<uint64_t> miner;
+    ASSERT_EQ(std::numeric_limits<uint64_t>::max(), miner.get_value());
+    miner << 10 << 20 << 5;
+    ASSERT_EQ(5ul, miner.get_value());
+}
+
+static void* striped_counter(void* arg) {
+    bvar::StripedAdder<uint64_t>* reducer = (bvar::StripedAdder<uint64_t>*)arg;
+    butil::Timer timer;
+    timer.start();
+    for (size_t i = 0; i < OPS_PER_THREAD; ++i) {
+        (*reducer) << 2;
+    }
+    timer.stop();
+    return (void*)(timer.n_elapsed());
+}
+
+static long start_perf_test_with_striped_adder(size_t num_thread) {
+    bvar::StripedAdder<uint64_t> reducer;
+    EXPECT_TRUE(reducer.valid());
+    pthread_t threads[num_thread];
+    for (size_t i = 0; i < num_thread; ++i) {
+        pthread_create(&threads[i], NULL, &striped_counter, (void*)&reducer);
+    }
+    long totol_time = 0;
+    for (size_t i = 0; i < num_thread; ++i) {
+        void* ret = NULL;
+        pthread_join(threads[i], &ret);
+        totol_time += (long)ret;
+    }
+    long avg_time = totol_time / (OPS_PER_THREAD * num_thread);
+    EXPECT_EQ(2ul * num_thread * OPS_PER_THREAD, reducer.get_value());
+    return avg_time;
+}
+
+TEST_F(ReducerTest, striped_perf) {
+    std::ostringstream oss;
+    for (size_t i = 1; i <= 24; i *= 2) {
+        oss << i << '\t' << start_perf_test_with_striped_adder(i) << '\n';
+    }
+    LOG(INFO) << "StripedAdder performance:\n" << oss.str();
+
+    // Reading cost does not grow with number of threads ever written.
+    bvar::Adder<uint64_t> adder;
+    bvar::StripedAdder<uint64_t> striped;
+    for (size_t i = 0; i < 64; ++i) {
+        pthread_t th;
+        pthread_create(&th, NULL, &thread_counter, &adder);
+        pthread_join(th, NULL);
+        pthread_create(&th, NULL, &striped_counter, &striped);
+        pthread_join(th, NULL);
+    }
+    // Threads are joined one by one, Adder merges agents of exited threads
+    // into its global value.
+    const size_t N = 100000;
+    butil::Timer timer;
+    timer.start();
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_EQ(2ul * 64 * OPS_PER_THREAD, adder.get_value());
+    }
+    timer.stop();
+    const long adder_read = timer.n_elapsed() / N;
+    timer.start();
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_EQ(2ul * 64 * OPS_PER_THREAD, striped.get_value());
+    }
+    timer.stop();
+    LOG(INFO) << "get_value: Adder=" << adder_read << "ns StripedAdder="
+              << timer.n_elapsed() / N << "ns";
+}
+
+TEST_F(ReducerTest, striped_window) {
+    bvar::StripedAdder<int64_t> a;
+    bvar::Window<bvar::StripedAdder<int64_t> > w(&a, 10);
+    bvar::PerSecond<bvar::StripedAdder<int64_t> > ps(&a, 10);
+    bvar::StripedMaxer<int64_t> m;
+    bvar::Window<bvar::StripedMaxer<int64_t> > wm(&m, 10);
+    a << 100;
+    m << 7 << 3;
+    sleep(3);
+    ASSERT_EQ(100, w.get_value());
+    ASSERT_LE(9, ps.get_value(10));
+    ASSERT_EQ(7, wm.get_value());
+}
 } // namespace
@@ -19,12 +19,16 @@
 
 #include <pthread.h>                                // pthread_*
 
+#include <algorithm>
 #include <cstddef>
+#include <limits>
 #include <memory>
 #include <iostream>
 #include <sstream>
 #include "butil/time.h"
 #include "butil/macros.h"
+#include "butil/iobuf.h"
+#include "butil/string_printf.h"
 
 #include "bvar/bvar.h"
 
@@ -311,6 +315,141 @@ TEST_F(VariableTest, dump) {
     ASSERT_EQ(0UL, d._list.size());
 }
 
+TEST_F(VariableTest, describe_to_buffer) {
+    bvar::Adder<int64_t> a1;
+    a1 << std::numeric_limits<int64_t>::min();
+    bvar::Adder<uint64_t> a2;
+    a2 << std::numeric_limits<uint64_t>::max();
+    bvar::Adder<int> a3;
+    a3 << -10 << 3;
+    bvar::Adder<double> a4;
+    a4 << 1.5 << 0.25;
+    bvar::Maxer<int> a5;
+    bvar::Status<int> a6(-42);
+    bvar::Adder<std::string> a7;
+    a7 << "hello";
+    bvar::Status<char> a8('x');
+    const bvar::Variable* vars[] = { &a1, &a2, &a3, &a4, &a5, &a6 };
+    char buf[64];
+    for (size_t i = 0; i < arraysize(vars); ++i) {
+        const int len = vars[i]->describe_to_buffer(buf, sizeof(buf), false);
+        ASSERT_LT(0, len);
+        ASSERT_EQ(vars[i]->get_description(), std::string(buf, len));
+    }
+    // Not numbers, fallback to describe().
+    ASSERT_EQ(-1, a7.describe_to_buffer(buf, sizeof(buf), true));
+    ASSERT_EQ(-1, a8.describe_to_buffer(buf, sizeof(buf), false));
+    // Buffer is not large enough.
+    ASSERT_EQ(-1, a1.describe_to_buffer(buf, 5, false));
+}
+
+TEST_F(VariableTest, dump_to_iobuf) {
+    bvar::Adder<int> v2("var2");
+    v2 << 2;
+    bvar::Status<std::string> v1("var1", "a");
+    bvar::Status<int> v3("foo.bar.Apple", "var3", 3);
+
+    butil::IOBuf buf;
+    ASSERT_EQ(3, bvar::Variable::dump_exposed(&buf, NULL));
+    ASSERT_EQ("foo_bar_apple_var3 : 3\r\nvar1 : \"a\"\r\nvar2 : 2\r\n",
+              buf.to_string());
+
+    bvar::DumpOptions opts;
+    opts.white_wildcards = "var2;var1";
+    opts.quote_string = false;
+    buf.clear();
+    ASSERT_EQ(2, bvar::Variable::dump_exposed(&buf, &opts));
+    ASSERT_EQ("var1 : a\r\nvar2 : 2\r\n", buf.to_string());
+
+    // Incremental dumping only appends changed variables.
+    bvar::DumpState state;
+    buf.clear();
+    ASSERT_EQ(3, bvar::Variable::dump_exposed(&buf, NULL, &state));
+    ASSERT_EQ(3UL, state.size());
+    buf.clear();
+    ASSERT_EQ(0, bvar::Variable::dump_exposed(&buf, NULL, &state));
+    ASSERT_TRUE(buf.empty());
+    v2 << 1;
+    ASSERT_EQ(1, bvar::Variable::dump_exposed(&buf, NULL, &state));
+    ASSERT_EQ("var2 : 3\r\n", buf.to_string());
+    {
+        bvar::Adder<int> v4("var4");
+        buf.clear();
+        ASSERT_EQ(1, bvar::Variable::dump_exposed(&buf, NULL, &state));
+        ASSERT_EQ("var4 : 0\r\n", buf.to_string());
+        ASSERT_EQ(4UL, state.size());
+    }
+    // Hidden variables are forgotten.
+    buf.clear();
+    ASSERT_EQ(0, bvar::Variable::dump_exposed(&buf, NULL, &state));
+    ASSERT_EQ(3UL, state.size());
+    state.reset();
+    ASSERT_EQ(3, bvar::Variable::dump_exposed(&buf, NULL, &state));
+}
+
+class CountingDumper : public bvar::Dumper {
+public:
+    CountingDumper() : nbytes(0) {}
+    bool dump(const std::string& name,
+              const butil::StringPiece& description) override {
+        nbytes += name.size() + description.size();
+        return true;
+    }
+    size_t nbytes;
+};
+
+TEST_F(VariableTest, dump_perf) {
+    const size_t N = 20000;
+    std::vector<bvar::Adder<int64_t>*> vars;
+    for (size_t i = 0; i < N; ++i) {
+        bvar::Adder<int64_t>* v = new bvar::Adder<int64_t>;
+        ASSERT_EQ(0, v->expose(butil::string_printf("dump_perf_%lu", i)));
+        *v << (int64_t)i;
+        vars.push_back(v);
+    }
+    butil::Timer timer;
+    // The way dump_exposed() worked before: list names and describe them
+    // one by one.
+    timer.start();
+    std::vector<std::string> names;
+    bvar::Variable::list_exposed(&names, bvar::DISPLAY_ON_PLAIN_TEXT);
+    std::sort(names.begin(), names.end());
+    std::ostringstream os;
+    for (size_t i = 0; i < names.size(); ++i) {
+        os.str("");
+        bvar::Variable::describe_exposed(names[i], os, true);
+    }
+    timer.stop();
+    const int64_t list_describe_us = timer.u_elapsed();
+
+    CountingDumper d;
+    timer.start();
+    ASSERT_EQ((int)N, bvar::Variable::dump_exposed(&d, NULL));
+    timer.stop();
+    const int64_t dumper_us = timer.u_elapsed();
+
+    butil::IOBuf buf;
+    timer.start();
+    ASSERT_EQ((int)N, bvar::Variable::dump_exposed(&buf, NULL));
+    timer.stop();
+    const int64_t iobuf_us = timer.u_elapsed();
+
+    bvar::DumpState state;
+    ASSERT_EQ((int)N, bvar::Variable::dump_exposed(&buf, NULL, &state));
+    *vars[0] << 1;
+    buf.clear();
+    timer.start();
+    ASSERT_EQ(1, bvar::Variable::dump_exposed(&buf, NULL, &state));
+    timer.stop();
+    LOG(INFO) << "Dump " << N << " variables: list+describe="
+              << list_describe_us << "us Dumper=" << dumper_us
+              << "us IOBuf=" << iobuf_us << "us incremental="
+              << timer.u_elapsed() << "us";
+    for (size_t i = 0; i < vars.size(); ++i) {
+        delete vars[i];
+    }
+}
+
 TEST_F(VariableTest, latency_recorder) {
     bvar::LatencyRecorder rec;
     rec << 1 << 2 << 3;
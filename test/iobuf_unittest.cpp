@@ -30,6 +30,7 @@
 #include <butil/fd_guard.h>
 #include <butil/errno.h>
 #include <butil/fast_rand.h>
+#include <butil/huge_page_allocator.h>
 #if BAZEL_TEST
 #include "test/iobuf.pb.h"
 #else
@@ -1706,4 +1707,104 @@ TEST_F(IOBufTest, acquire_tls_block) {
     ASSERT_NE(butil::iobuf::block_cap(b), butil::iobuf::block_size(b));
 }
 
+TEST_F(IOBufTest, huge_page_allocator) {
+    butil::HugePageAllocator::Options options;
+    options.max_memory = 2 * butil::HugePageAllocator::ARENA_SIZE;
+    butil::HugePageAllocator alloc(options);
+    ASSERT_EQ(4096u, butil::HugePageAllocator::block_size_of(1));
+    ASSERT_EQ(8192u, butil::HugePageAllocator::block_size_of(4097));
+    ASSERT_EQ(0u, butil::HugePageAllocator::block_size_of(
+                      butil::HugePageAllocator::MAX_BLOCK_SIZE + 1));
+    ASSERT_EQ(NULL, alloc.Allocate(butil::HugePageAllocator::MAX_BLOCK_SIZE + 1));
+
+    void* p1 = alloc.Allocate(8192);
+    ASSERT_TRUE(p1);
+    ASSERT_TRUE(alloc.Owns(p1));
+    int x = 0;
+    ASSERT_FALSE(alloc.Owns(&x));
+    memset(p1, 'a', 8192);
+    ASSERT_EQ(butil::HugePageAllocator::ARENA_SIZE, alloc.mapped_memory());
+    std::vector<butil::HugePageAllocator::SizeClassStats> stats;
+    alloc.GetStats(&stats);
+    ASSERT_EQ(8192u, stats[1].block_size);
+    ASSERT_EQ(1u, stats[1].arena_count);
+    ASSERT_EQ(1u, stats[1].allocated);
+    ASSERT_EQ(butil::HugePageAllocator::ARENA_SIZE / 8192 - 1, stats[1].free);
+
+    // Freed blocks are reused.
+    alloc.Deallocate(p1);
+    void* p2 = alloc.Allocate(8000);
+    ASSERT_EQ(p1, p2);
+    alloc.Deallocate(p2);
+
+    // Another size class takes another arena, then memory is exhausted.
+    void* p3 = alloc.Allocate(butil::HugePageAllocator::MAX_BLOCK_SIZE);
+    ASSERT_TRUE(p3);
+    void* p4 = alloc.Allocate(butil::HugePageAllocator::MAX_BLOCK_SIZE);
+    ASSERT_TRUE(p4);
+    ASSERT_EQ(NULL, alloc.Allocate(butil::HugePageAllocator::MAX_BLOCK_SIZE));
+    ASSERT_EQ(NULL, alloc.Allocate(4096));
+    alloc.GetStats(&stats);
+    ASSERT_EQ(2u, stats.back().allocated);
+    ASSERT_EQ(1u, stats.back().exhausted);
+    ASSERT_EQ(1u, stats[0].exhausted);
+    std::ostringstream os;
+    alloc.Describe(os);
+    LOG(INFO) << os.str();
+    alloc.Deallocate(p3);
+    alloc.Deallocate(p4);
+}
+
+void use_huge_page_allocator_and_exit() {
+    butil::HugePageAllocator::Options options;
+    options.max_memory = 2 * butil::HugePageAllocator::ARENA_SIZE;
+    ASSERT_EQ(0, butil::iobuf::use_huge_page_allocator(options));
+    ASSERT_EQ(-1, butil::iobuf::use_huge_page_allocator(options));
+    butil::HugePageAllocator* alloc = butil::iobuf::huge_page_allocator();
+    ASSERT_TRUE(alloc);
+
+    butil::IOBuf buf;
+    {
+        // The block fills the size class.
+        butil::IOBufAsZeroCopyOutputStream os(&buf, 5000);
+        void* data = NULL;
+        int size = 0;
+        ASSERT_TRUE(os.Next(&data, &size));
+        ASSERT_GT(size, 5000);
+        ASSERT_LT(size, 8192);
+        ASSERT_TRUE(alloc->Owns(data));
+        memset(data, 'a', size);
+        ASSERT_EQ((size_t)size, buf.size());
+    }
+    std::vector<butil::HugePageAllocator::SizeClassStats> stats;
+    alloc->GetStats(&stats);
+    ASSERT_EQ(1u, stats[1].allocated);
+
+    // Blocks allocated from arenas are still returned to the allocator.
+    butil::iobuf::reset_blockmem_allocate_and_deallocate();
+    buf.clear();
+    alloc->GetStats(&stats);
+    ASSERT_EQ(0u, stats[1].allocated);
+
+    // Block sizes are not rounded up after the reset.
+    {
+        butil::IOBufAsZeroCopyOutputStream os(&buf, 5000);
+        void* data = NULL;
+        int size = 0;
+        ASSERT_TRUE(os.Next(&data, &size));
+        ASSERT_LT(size, 5000);
+        ASSERT_FALSE(alloc->Owns(data));
+    }
+    buf.clear();
+    exit(::testing::Test::HasFailure() ? 1 : 0);
+}
+
+TEST_F(IOBufTest, use_huge_page_allocator) {
+    // The allocator is process-wide and never uninstalled, run in a new
+    // process so that other tests are not affected.
+    ::testing::FLAGS_gtest_death_test_style = "threadsafe";
+    EXPECT_EXIT(use_huge_page_allocator_and_exit(),
+                ::testing::ExitedWithCode(0), "");
+}
+
 } // namespace